@@ -0,0 +1,21 @@
+require 'zlib'
+
+small = Random.new(1).bytes(64)
+large = Random.new(2).bytes(1 << 20)
+crc32 = BitTwiddle::CRC.new(width: 32, poly: 0x04C11DB7, init: 0xFFFFFFFF,
+                            refin: true, xorout: 0xFFFFFFFF)
+
+Benchmark.ips do |b|
+  b.report "BitTwiddle.crc32c on 64 bytes" do
+    BitTwiddle.crc32c(small)
+  end
+  b.report "BitTwiddle.crc32c on 1MB" do
+    BitTwiddle.crc32c(large)
+  end
+  b.report "BitTwiddle::CRC#checksum (CRC-32) on 1MB" do
+    crc32.checksum(large)
+  end
+  b.report "Zlib.crc32 on 1MB" do
+    Zlib.crc32(large)
+  end
+end
@@ -0,0 +1,416 @@
+/* BitTwiddle::AtomicBitset: a fixed-size bitset which many threads (or
+ * Ractors) can update at once, without locks
+ *
+ * Every update is a single atomic read-modify-write on one 64-bit word (a
+ * 'lock or', 'lock and' or 'lock cmpxchg' on x86), so concurrent updates to
+ * different bits of the same word are never lost. The bitset is frozen as soon
+ * as it is created, since its contents are not Ruby state, and its type is
+ * marked as shareable when frozen, so Ractor.make_shareable accepts it. */
+
+#include "bit_twiddle.h"
+#include <ruby/thread.h>
+
+/* Bulk updates from a String release the GVL above this many elements */
+#define NOGVL_THRESHOLD 65536
+
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
+
+typedef struct {
+  uint64_t *words;
+  size_t    size;   /* in bits; 0 until initialized */
+  size_t    nwords;
+} atomic_bitset;
+
+static inline int
+bit_test_and_set(atomic_bitset *ab, size_t i)
+{
+  uint64_t bit = 1ULL << (i & 63);
+  return (__atomic_fetch_or(&ab->words[i >> 6], bit, __ATOMIC_ACQ_REL) & bit) != 0;
+}
+
+static inline int
+bit_test_and_clear(atomic_bitset *ab, size_t i)
+{
+  uint64_t bit = 1ULL << (i & 63);
+  return (__atomic_fetch_and(&ab->words[i >> 6], ~bit, __ATOMIC_ACQ_REL) & bit) != 0;
+}
+
+static void
+ab_free(void *ptr)
+{
+  atomic_bitset *ab = ptr;
+  xfree(ab->words);
+  xfree(ab);
+}
+
+static size_t
+ab_memsize(const void *ptr)
+{
+  const atomic_bitset *ab = ptr;
+  return sizeof(atomic_bitset) + ab->nwords * sizeof(uint64_t);
+}
+
+static const rb_data_type_t ab_type = {
+  "BitTwiddle::AtomicBitset",
+  { 0, ab_free, ab_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static VALUE
+ab_alloc(VALUE klass)
+{
+  atomic_bitset *ab;
+  return TypedData_Make_Struct(klass, atomic_bitset, &ab_type, ab);
+}
+
+static atomic_bitset*
+get_ab(VALUE self)
+{
+  atomic_bitset *ab;
+  TypedData_Get_Struct(self, atomic_bitset, &ab_type, ab);
+  if (ab->size == 0)
+    rb_raise(rb_eRuntimeError, "uninitialized AtomicBitset");
+  return ab;
+}
+
+static void
+ab_setup(atomic_bitset *ab, size_t size)
+{
+  xfree(ab->words); /* from an earlier call which raised an exception */
+  ab->nwords = (size + 63) / 64;
+  ab->words  = ruby_xcalloc(ab->nwords, sizeof(uint64_t));
+  ab->size   = size;
+}
+
+static size_t
+value_to_bit(const atomic_bitset *ab, VALUE index)
+{
+  long i = NUM2LONG(index);
+  if (i < 0 || (size_t)i >= ab->size)
+    rb_raise(rb_eIndexError, "bit %ld out of range for AtomicBitset of %"PRIuSIZE" bits", i, ab->size);
+  return (size_t)i;
+}
+
+static uint64_t*
+value_to_word(const atomic_bitset *ab, VALUE index, uint64_t mask)
+{
+  long i = NUM2LONG(index);
+  if (i < 0 || (size_t)i >= ab->nwords)
+    rb_raise(rb_eIndexError, "word %ld out of range for AtomicBitset of %"PRIuSIZE" words", i, ab->nwords);
+  if ((size_t)i == ab->nwords - 1 && (ab->size & 63) && (mask >> (ab->size & 63)))
+    rb_raise(rb_eArgError, "mask has bits past the end of the AtomicBitset");
+  return &ab->words[i];
+}
+
+/* Document-method: BitTwiddle::AtomicBitset#initialize
+ * Create a bitset of `size` bits, all clear. It is frozen, but can still be
+ * updated by the methods of this class.
+ *
+ * @param size [Integer] At least 1
+ */
+static VALUE
+ab_initialize(VALUE self, VALUE size)
+{
+  atomic_bitset *ab;
+  uint64_t n = bt_num_to_u64(size);
+
+  TypedData_Get_Struct(self, atomic_bitset, &ab_type, ab);
+  if (ab->size)
+    rb_raise(rb_eRuntimeError, "AtomicBitset is already initialized");
+  if (n < 1 || n > ((uint64_t)1 << 46))
+    rb_raise(rb_eArgError, "AtomicBitset size must be between 1 and 2^46 bits");
+  ab_setup(ab, (size_t)n);
+  return rb_obj_freeze(self);
+}
+
+/* Document-method: BitTwiddle::AtomicBitset#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+ab_initialize_copy(VALUE self, VALUE orig)
+{
+  atomic_bitset *dst, *src = get_ab(orig);
+  size_t i;
+
+  TypedData_Get_Struct(self, atomic_bitset, &ab_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->size)
+    rb_raise(rb_eRuntimeError, "AtomicBitset is already initialized");
+  ab_setup(dst, src->size);
+  for (i = 0; i < src->nwords; i++)
+    dst->words[i] = __atomic_load_n(&src->words[i], __ATOMIC_RELAXED);
+  return rb_obj_freeze(self);
+}
+
+/* Document-method: BitTwiddle::AtomicBitset#test_and_set
+ * Set bit `index`, and return whether it was already set. When several threads
+ * set the same bit at once, exactly one of them gets `false`.
+ *
+ * @example
+ *   visited = BitTwiddle::AtomicBitset.new(1_000_000)
+ *   visited.test_and_set(42) # => false
+ *   visited.test_and_set(42) # => true
+ *
+ * @param index [Integer]
+ * @return [Boolean]
+ */
+static VALUE
+ab_test_and_set(VALUE self, VALUE index)
+{
+  atomic_bitset *ab = get_ab(self);
+  return bit_test_and_set(ab, value_to_bit(ab, index)) ? Qtrue : Qfalse;
+}
+
+/* Document-method: BitTwiddle::AtomicBitset#test_and_clear
+ * Clear bit `index`, and return whether it was set.
+ *
+ * @param index [Integer]
+ * @return [Boolean]
+ */
+static VALUE
+ab_test_and_clear(VALUE self, VALUE index)
+{
+  atomic_bitset *ab = get_ab(self);
+  return bit_test_and_clear(ab, value_to_bit(ab, index)) ? Qtrue : Qfalse;
+}
+
+/* Document-method: BitTwiddle::AtomicBitset#[]
+ * @param index [Integer]
+ * @return [Boolean] Whether bit `index` is set
+ */
+static VALUE
+ab_aref(VALUE self, VALUE index)
+{
+  atomic_bitset *ab = get_ab(self);
+  size_t i = value_to_bit(ab, index);
+  return (__atomic_load_n(&ab->words[i >> 6], __ATOMIC_ACQUIRE) >> (i & 63)) & 1 ? Qtrue : Qfalse;
+}
+
+/* Document-method: BitTwiddle::AtomicBitset#word
+ * @param index [Integer] Word number; bit `i` is bit `i % 64` of word `i / 64`
+ * @return [Integer] The current value of a 64-bit word
+ */
+static VALUE
+ab_word(VALUE self, VALUE index)
+{
+  atomic_bitset *ab = get_ab(self);
+  return ULL2NUM(__atomic_load_n(value_to_word(ab, index, 0), __ATOMIC_ACQUIRE));
+}
+
+/* Document-method: BitTwiddle::AtomicBitset#fetch_or_word
+ * Set the bits of word `index` which are set in `mask`, and return the word's
+ * previous value.
+ *
+ * @param index [Integer] Word number
+ * @param mask [Integer] 64 bits
+ * @return [Integer]
+ */
+static VALUE
+ab_fetch_or_word(VALUE self, VALUE index, VALUE mask)
+{
+  atomic_bitset *ab = get_ab(self);
+  uint64_t m = bt_num_to_u64(mask);
+  return ULL2NUM(__atomic_fetch_or(value_to_word(ab, index, m), m, __ATOMIC_ACQ_REL));
+}
+
+/* Document-method: BitTwiddle::AtomicBitset#compare_and_swap_word
+ * If word `index` is `expected`, replace it with `desired` and return `true`;
+ * otherwise return `false`.
+ *
+ * @param index [Integer] Word number
+ * @param expected [Integer] 64 bits
+ * @param desired [Integer] 64 bits
+ * @return [Boolean]
+ */
+static VALUE
+ab_compare_and_swap_word(VALUE self, VALUE index, VALUE expected, VALUE desired)
+{
+  atomic_bitset *ab = get_ab(self);
+  uint64_t e = bt_num_to_u64(expected), d = bt_num_to_u64(desired);
+  return __atomic_compare_exchange_n(value_to_word(ab, index, d), &e, d, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ? Qtrue : Qfalse;
+}
+
+/* Document-method: BitTwiddle::AtomicBitset#count
+ * The number of bits set. If other threads are updating the bitset, this may
+ * not match its contents at any single moment.
+ *
+ * @return [Integer]
+ */
+static VALUE
+ab_count(VALUE self)
+{
+  atomic_bitset *ab = get_ab(self);
+  size_t i, count = 0;
+  for (i = 0; i < ab->nwords; i++)
+    count += __builtin_popcountll(__atomic_load_n(&ab->words[i], __ATOMIC_RELAXED));
+  return SIZET2NUM(count);
+}
+
+/* Document-method: BitTwiddle::AtomicBitset#size
+ * @return [Integer] The number of bits
+ */
+static VALUE
+ab_size(VALUE self)
+{
+  return SIZET2NUM(get_ab(self)->size);
+}
+
+/* Document-method: BitTwiddle::AtomicBitset#clear
+ * Clear every bit (one word at a time).
+ *
+ * @return [AtomicBitset] `self`
+ */
+static VALUE
+ab_clear(VALUE self)
+{
+  atomic_bitset *ab = get_ab(self);
+  size_t i;
+  for (i = 0; i < ab->nwords; i++)
+    __atomic_store_n(&ab->words[i], 0, __ATOMIC_RELEASE);
+  return self;
+}
+
+static inline uint64_t
+load_index(const uchar *p, size_t i, int width)
+{
+  if (width == 64) {
+    uint64_t v;
+    memcpy(&v, p + 8*i, 8);
+    return v;
+  } else {
+    uint32_t v;
+    memcpy(&v, p + 4*i, 4);
+    return v;
+  }
+}
+
+typedef struct {
+  atomic_bitset *ab;
+  const uchar   *in;
+  uchar         *out;
+  size_t         n, kept;
+  int            width;
+} set_job;
+
+static void*
+set_buffer(void *arg)
+{
+  set_job *job = arg;
+  size_t i;
+
+  job->kept = 0;
+  for (i = 0; i < job->n; i++) {
+    if (!bit_test_and_set(job->ab, load_index(job->in, i, job->width))) {
+      memcpy(job->out + job->kept * (job->width / 8), job->in + i * (job->width / 8), job->width / 8);
+      job->kept++;
+    }
+  }
+  return NULL;
+}
+
+/* Document-method: BitTwiddle::AtomicBitset#test_and_set_all
+ * Set each bit in `indexes`, and return the ones which were not already set,
+ * in the same form. (When several threads set the same bit at once, exactly
+ * one of them gets it back.)
+ *
+ * `indexes` can be an Array of Integers, or a String of unsigned 32 or 64-bit
+ * integers in native byte order. For a long String, the GVL is released while
+ * the bits are set, so other threads can run.
+ *
+ * @example
+ *   seen = BitTwiddle::AtomicBitset.new(100)
+ *   seen.test_and_set_all([3, 5, 3]) # => [3, 5]
+ *   seen.test_and_set_all([5, 7])    # => [7]
+ *
+ * @param indexes [Array<Integer>, String]
+ * @param width [Integer] Size of each integer in a String: 32 or 64 bits (default 64)
+ * @return [Array<Integer>, String]
+ */
+static VALUE
+ab_test_and_set_all(int argc, VALUE *argv, VALUE self)
+{
+  atomic_bitset *ab = get_ab(self);
+  VALUE indexes, width, result;
+  set_job job;
+  size_t i;
+
+  rb_scan_args(argc, argv, "11", &indexes, &width);
+
+  if (!RB_TYPE_P(indexes, T_STRING)) {
+    VALUE tmp;
+    size_t *bits;
+    long j, n;
+    /* a private copy, which #to_int methods can't change; as for a String,
+     * every index is checked before any bit is set */
+    indexes = rb_ary_dup(rb_Array(indexes));
+    n       = RARRAY_LEN(indexes);
+    bits    = ALLOCV_N(size_t, tmp, n + 1);
+    for (j = 0; j < n; j++)
+      bits[j] = value_to_bit(ab, RARRAY_AREF(indexes, j));
+    result = rb_ary_new();
+    for (j = 0; j < n; j++)
+      if (!bit_test_and_set(ab, bits[j]))
+        rb_ary_push(result, RARRAY_AREF(indexes, j));
+    ALLOCV_END(tmp);
+    return result;
+  }
+
+  job.ab    = ab;
+  job.width = NIL_P(width) ? 64 : NUM2INT(width);
+  if (job.width != 32 && job.width != 64)
+    rb_raise(rb_eArgError, "integer width must be 32 or 64 bits (not %d)", job.width);
+  if (RSTRING_LEN(indexes) % (job.width / 8))
+    rb_raise(rb_eArgError, "buffer length must be a multiple of %d bytes", job.width / 8);
+  /* a frozen copy (which shares the bytes, unless 'indexes' is modified), so
+   * other threads can use or change 'indexes' while the GVL is released */
+  indexes = rb_str_new_frozen(indexes);
+  job.n   = RSTRING_LEN(indexes) / (job.width / 8);
+  job.in  = (const uchar*)RSTRING_PTR(indexes);
+
+  /* check every index first, so that an error leaves the bitset unchanged */
+  for (i = 0; i < job.n; i++)
+    if (load_index(job.in, i, job.width) >= ab->size)
+      rb_raise(rb_eIndexError, "bit %llu out of range for AtomicBitset of %"PRIuSIZE" bits",
+               (unsigned long long)load_index(job.in, i, job.width), ab->size);
+  result  = rb_str_new(NULL, RSTRING_LEN(indexes));
+  job.out = (uchar*)RSTRING_PTR(result);
+
+  if (job.n >= NOGVL_THRESHOLD)
+    rb_thread_call_without_gvl(set_buffer, &job, NULL, NULL);
+  else
+    set_buffer(&job);
+  rb_str_set_len(result, job.kept * (job.width / 8));
+  RB_GC_GUARD(indexes);
+  return result;
+}
+
+void Init_bt_atomic_bitset(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::AtomicBitset
+   * A fixed-size set of bits which any number of threads, or Ractors, can test
+   * and update at once without a Mutex, such as a "visited" set shared between
+   * crawler workers. Every update is one lock-free atomic operation on a 64-bit
+   * word. An AtomicBitset is always frozen, so `Ractor.make_shareable` accepts
+   * it; its methods can still update it.
+   */
+  VALUE rb_cAtomicBitset = rb_define_class_under(rb_mBitTwiddle, "AtomicBitset", rb_cObject);
+
+  rb_define_alloc_func(rb_cAtomicBitset, ab_alloc);
+  rb_define_method(rb_cAtomicBitset, "initialize",            ab_initialize,            1);
+  rb_define_method(rb_cAtomicBitset, "initialize_copy",       ab_initialize_copy,       1);
+  rb_define_method(rb_cAtomicBitset, "test_and_set",          ab_test_and_set,          1);
+  rb_define_method(rb_cAtomicBitset, "test_and_clear",        ab_test_and_clear,        1);
+  rb_define_method(rb_cAtomicBitset, "test_and_set_all",      ab_test_and_set_all,     -1);
+  rb_define_method(rb_cAtomicBitset, "[]",                    ab_aref,                  1);
+  rb_define_method(rb_cAtomicBitset, "word",                  ab_word,                  1);
+  rb_define_method(rb_cAtomicBitset, "fetch_or_word",         ab_fetch_or_word,         2);
+  rb_define_method(rb_cAtomicBitset, "compare_and_swap_word", ab_compare_and_swap_word, 3);
+  rb_define_method(rb_cAtomicBitset, "count",                 ab_count,                 0);
+  rb_define_method(rb_cAtomicBitset, "size",                  ab_size,                  0);
+  rb_define_method(rb_cAtomicBitset, "clear",                 ab_clear,                 0);
+}
@@ -0,0 +1,486 @@
+/* BitTwiddle::BitSlicedIndex: range predicates over a column of integers
+ *
+ * The column is stored as one bitmap per bit position ("slice"), built 64 rows
+ * at a time by transposing 64x64 bit blocks. A comparison with a constant c
+ * walks the slices from the most significant down, keeping a bitmap of rows
+ * equal to c in the bits seen so far and a bitmap of rows already known to be
+ * less (O'Neil and Quass, 1997):
+ *
+ *   bit i of c is 1:  LT |= EQ & ~slice[i];  EQ &= slice[i]
+ *   bit i of c is 0:  EQ &= ~slice[i]
+ *
+ * Every other comparison follows from LT and EQ. The bitmaps are processed in
+ * blocks which fit in L1 cache, with the AVX2/SSE2 kernels of String#and! etc.
+ *
+ * Results are bitmaps in Strings, with row r in bit r % 8 of byte r / 8 (as
+ * read by `String#unpack1("b*")`), so they can be combined with String#and!,
+ * String#or! and String#andnot! and counted with String#popcount. */
+
+#include "bit_twiddle.h"
+
+#define BLOCK_WORDS 512 /* 4KB of each bitmap at a time */
+
+enum bsi_cmp { CMP_LT, CMP_LE, CMP_EQ, CMP_GT, CMP_GE };
+
+typedef struct {
+  uint64_t *slices; /* slice i is words [i * nwords, (i + 1) * nwords) */
+  size_t    n;      /* number of rows */
+  size_t    nwords;
+  int       bits;   /* number of slices; enough for the largest value */
+  int       width;  /* of the column it was built from; 0 until initialized */
+} bit_sliced_index;
+
+static inline uint64_t*
+slice(const bit_sliced_index *bsi, int i)
+{
+  return bsi->slices + (size_t)i * bsi->nwords;
+}
+
+/* All rows, for words [w, w + count) */
+static void
+fill_rows(const bit_sliced_index *bsi, uint64_t *out, size_t w, size_t count)
+{
+  memset(out, 0xFF, count * 8);
+  if (w + count == bsi->nwords && (bsi->n & 63))
+    out[count - 1] = (1ULL << (bsi->n & 63)) - 1;
+}
+
+/* Rows which compare with 'c' as 'op', for words [w, w + count) */
+static void
+compare_block(const bit_sliced_index *bsi, uint64_t c, enum bsi_cmp op, uint64_t *out, size_t w, size_t count)
+{
+  uint64_t eq[BLOCK_WORDS], lt[BLOCK_WORDS], tmp[BLOCK_WORDS];
+  size_t bytes = count * 8;
+  int i;
+
+  fill_rows(bsi, eq, w, count);
+  memset(lt, 0, bytes);
+  if (bsi->bits < 64 && (c >> bsi->bits)) {
+    /* c is bigger than any value in the column */
+    memcpy(lt, eq, bytes);
+    memset(eq, 0, bytes);
+  } else {
+    for (i = bsi->bits - 1; i >= 0; i--) {
+      const uchar *s = (const uchar*)(slice(bsi, i) + w);
+      if ((c >> i) & 1) {
+        memcpy(tmp, eq, bytes);
+        bt_bitop_buf((uchar*)tmp, s, bytes, BT_ANDNOT);
+        bt_bitop_buf((uchar*)lt, (const uchar*)tmp, bytes, BT_OR);
+        bt_bitop_buf((uchar*)eq, s, bytes, BT_AND);
+      } else {
+        bt_bitop_buf((uchar*)eq, s, bytes, BT_ANDNOT);
+      }
+    }
+  }
+
+  switch (op) {
+  case CMP_LT:
+    memcpy(out, lt, bytes);
+    break;
+  case CMP_EQ:
+    memcpy(out, eq, bytes);
+    break;
+  case CMP_LE:
+    memcpy(out, lt, bytes);
+    bt_bitop_buf((uchar*)out, (const uchar*)eq, bytes, BT_OR);
+    break;
+  case CMP_GE:
+    fill_rows(bsi, out, w, count);
+    bt_bitop_buf((uchar*)out, (const uchar*)lt, bytes, BT_ANDNOT);
+    break;
+  case CMP_GT:
+    fill_rows(bsi, out, w, count);
+    bt_bitop_buf((uchar*)out, (const uchar*)lt, bytes, BT_ANDNOT);
+    bt_bitop_buf((uchar*)out, (const uchar*)eq, bytes, BT_ANDNOT);
+    break;
+  }
+}
+
+/* Convert a bitmap of words to the String form */
+static VALUE
+words_to_bitmap(const bit_sliced_index *bsi, const uint64_t *words)
+{
+  VALUE  str = rb_str_new(NULL, bsi->nwords * 8);
+  uchar *p   = (uchar*)RSTRING_PTR(str);
+  size_t w;
+
+  for (w = 0; w < bsi->nwords; w++)
+    store_le64(p + 8*w, words[w]);
+  rb_str_set_len(str, (bsi->n + 7) / 8);
+  return str;
+}
+
+/* Convert a bitmap String (as returned by the comparison methods) to words */
+static void
+bitmap_to_words(const bit_sliced_index *bsi, VALUE str, uint64_t *words)
+{
+  size_t bytes = (bsi->n + 7) / 8;
+
+  StringValue(str);
+  if ((size_t)RSTRING_LEN(str) != bytes)
+    rb_raise(rb_eArgError, "filter must be %"PRIuSIZE" bytes, not %ld", bytes, RSTRING_LEN(str));
+  if (bsi->nwords) {
+    uchar last[8] = {0};
+    size_t w, full = bytes / 8;
+    for (w = 0; w < full; w++)
+      words[w] = load_le64((const uchar*)RSTRING_PTR(str) + 8*w);
+    if (full < bsi->nwords) {
+      memcpy(last, RSTRING_PTR(str) + 8*full, bytes - 8*full);
+      words[full] = load_le64(last);
+    }
+    if (bsi->n & 63)
+      words[bsi->nwords - 1] &= (1ULL << (bsi->n & 63)) - 1;
+  }
+}
+
+static void
+bsi_free(void *ptr)
+{
+  bit_sliced_index *bsi = ptr;
+  xfree(bsi->slices);
+  xfree(bsi);
+}
+
+static size_t
+bsi_memsize(const void *ptr)
+{
+  const bit_sliced_index *bsi = ptr;
+  return sizeof(bit_sliced_index) + (size_t)bsi->bits * bsi->nwords * 8;
+}
+
+static const rb_data_type_t bsi_type = {
+  "BitTwiddle::BitSlicedIndex",
+  { 0, bsi_free, bsi_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+bsi_alloc(VALUE klass)
+{
+  bit_sliced_index *bsi;
+  return TypedData_Make_Struct(klass, bit_sliced_index, &bsi_type, bsi);
+}
+
+static bit_sliced_index*
+get_bsi(VALUE self)
+{
+  bit_sliced_index *bsi;
+  TypedData_Get_Struct(self, bit_sliced_index, &bsi_type, bsi);
+  if (bsi->width == 0)
+    rb_raise(rb_eRuntimeError, "uninitialized BitSlicedIndex");
+  return bsi;
+}
+
+static inline uint64_t
+load_value(const uchar *p, size_t i, int width)
+{
+  if (width == 64) {
+    uint64_t v;
+    memcpy(&v, p + 8*i, 8);
+    return v;
+  } else {
+    uint32_t v;
+    memcpy(&v, p + 4*i, 4);
+    return v;
+  }
+}
+
+/* Document-method: BitTwiddle::BitSlicedIndex#initialize
+ * Index a column of unsigned integers. Only as many bit slices are kept as the
+ * largest value needs.
+ *
+ * @example
+ *   bsi = BitTwiddle::BitSlicedIndex.new([5, 1, 9, 5].pack("L*"))
+ *   bsi.eq(5).unpack1("b4")         # => "1001"
+ *   bsi.between(2, 9).unpack1("b4") # => "1011"
+ *   bsi.sum                         # => 20
+ *
+ * @param column [String] Unsigned integers in native byte order (as produced by
+ *   `Array#pack("L*")` or `Array#pack("Q*")`)
+ * @param width [Integer] Size of each integer: 32 or 64 bits (default 32)
+ */
+static VALUE
+bsi_initialize(int argc, VALUE *argv, VALUE self)
+{
+  bit_sliced_index *bsi;
+  VALUE column, width;
+  const uchar *p;
+  uint64_t m[64], all = 0;
+  size_t i, g;
+  int w, b;
+
+  rb_scan_args(argc, argv, "11", &column, &width);
+  TypedData_Get_Struct(self, bit_sliced_index, &bsi_type, bsi);
+  if (bsi->width)
+    rb_raise(rb_eRuntimeError, "BitSlicedIndex is already initialized");
+  StringValue(column);
+  w = NIL_P(width) ? 32 : NUM2INT(width);
+  if (w != 32 && w != 64)
+    rb_raise(rb_eArgError, "integer width must be 32 or 64 bits (not %d)", w);
+  if (RSTRING_LEN(column) % (w / 8))
+    rb_raise(rb_eArgError, "buffer length must be a multiple of %d bytes", w / 8);
+
+  p           = (const uchar*)RSTRING_PTR(column);
+  bsi->n      = RSTRING_LEN(column) / (w / 8);
+  bsi->nwords = (bsi->n + 63) / 64;
+  for (i = 0; i < bsi->n; i++)
+    all |= load_value(p, i, w);
+  bsi->bits   = all ? 64 - __builtin_clzll(all) : 0;
+  xfree(bsi->slices); /* from an earlier call which raised an exception */
+  bsi->slices = ALLOC_N(uint64_t, bsi->bits * bsi->nwords + 1);
+
+  /* row r of each block of 64 becomes bit r of word r / 64 in every slice */
+  for (g = 0; g < bsi->nwords; g++) {
+    size_t rows = (bsi->n - 64*g < 64) ? bsi->n - 64*g : 64;
+    for (i = 0; i < rows; i++)
+      m[i] = load_value(p, 64*g + i, w);
+    for (; i < 64; i++)
+      m[i] = 0;
+    bt_bit_transpose64(m);
+    for (b = 0; b < bsi->bits; b++)
+      slice(bsi, b)[g] = m[b];
+  }
+  bsi->width = w;
+  RB_GC_GUARD(column);
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitSlicedIndex#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+bsi_initialize_copy(VALUE self, VALUE orig)
+{
+  bit_sliced_index *dst, *src = get_bsi(orig);
+  size_t words = (size_t)src->bits * src->nwords + 1;
+
+  TypedData_Get_Struct(self, bit_sliced_index, &bsi_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->width)
+    rb_raise(rb_eRuntimeError, "BitSlicedIndex is already initialized");
+  REALLOC_N(dst->slices, uint64_t, words);
+  MEMCPY(dst->slices, src->slices, uint64_t, words);
+  dst->n      = src->n;
+  dst->nwords = src->nwords;
+  dst->bits   = src->bits;
+  dst->width  = src->width;
+  return self;
+}
+
+static VALUE
+bsi_compare(VALUE self, VALUE value, enum bsi_cmp op)
+{
+  bit_sliced_index *bsi = get_bsi(self);
+  uint64_t c = bt_num_to_u64(value), *out;
+  size_t w;
+  VALUE tmp, result;
+
+  out = ALLOCV_N(uint64_t, tmp, bsi->nwords + 1);
+  for (w = 0; w < bsi->nwords; w += BLOCK_WORDS)
+    compare_block(bsi, c, op, out + w, w, bsi->nwords - w < BLOCK_WORDS ? bsi->nwords - w : BLOCK_WORDS);
+  result = words_to_bitmap(bsi, out);
+  ALLOCV_END(tmp);
+  return result;
+}
+
+/* Document-method: BitTwiddle::BitSlicedIndex#lt
+ * @param value [Integer]
+ * @return [String] A bitmap of the rows less than `value`
+ */
+static VALUE
+bsi_lt(VALUE self, VALUE value)
+{
+  return bsi_compare(self, value, CMP_LT);
+}
+
+/* Document-method: BitTwiddle::BitSlicedIndex#le
+ * @param value [Integer]
+ * @return [String] A bitmap of the rows less than or equal to `value`
+ */
+static VALUE
+bsi_le(VALUE self, VALUE value)
+{
+  return bsi_compare(self, value, CMP_LE);
+}
+
+/* Document-method: BitTwiddle::BitSlicedIndex#eq
+ * @param value [Integer]
+ * @return [String] A bitmap of the rows equal to `value`
+ */
+static VALUE
+bsi_eq(VALUE self, VALUE value)
+{
+  return bsi_compare(self, value, CMP_EQ);
+}
+
+/* Document-method: BitTwiddle::BitSlicedIndex#gt
+ * @param value [Integer]
+ * @return [String] A bitmap of the rows greater than `value`
+ */
+static VALUE
+bsi_gt(VALUE self, VALUE value)
+{
+  return bsi_compare(self, value, CMP_GT);
+}
+
+/* Document-method: BitTwiddle::BitSlicedIndex#ge
+ * @param value [Integer]
+ * @return [String] A bitmap of the rows greater than or equal to `value`
+ */
+static VALUE
+bsi_ge(VALUE self, VALUE value)
+{
+  return bsi_compare(self, value, CMP_GE);
+}
+
+/* Document-method: BitTwiddle::BitSlicedIndex#between
+ * @param min [Integer]
+ * @param max [Integer]
+ * @return [String] A bitmap of the rows from `min` to `max`, inclusive
+ */
+static VALUE
+bsi_between(VALUE self, VALUE min, VALUE max)
+{
+  bit_sliced_index *bsi = get_bsi(self);
+  uint64_t lo = bt_num_to_u64(min), hi = bt_num_to_u64(max), *out, *upper;
+  size_t w;
+  VALUE tmp, result;
+
+  out   = ALLOCV_N(uint64_t, tmp, 2 * (bsi->nwords + 1));
+  upper = out + bsi->nwords + 1;
+  for (w = 0; w < bsi->nwords; w += BLOCK_WORDS) {
+    size_t count = bsi->nwords - w < BLOCK_WORDS ? bsi->nwords - w : BLOCK_WORDS;
+    if (lo > hi) {
+      memset(out + w, 0, count * 8);
+      continue;
+    }
+    compare_block(bsi, lo, CMP_GE, out + w, w, count);
+    compare_block(bsi, hi, CMP_LE, upper + w, w, count);
+    bt_bitop_buf((uchar*)(out + w), (const uchar*)(upper + w), count * 8, BT_AND);
+  }
+  result = words_to_bitmap(bsi, out);
+  ALLOCV_END(tmp);
+  return result;
+}
+
+/* Document-method: BitTwiddle::BitSlicedIndex#sum
+ * Add up the values in the rows selected by `filter` (or all rows). This is a
+ * popcount of each slice (ANDed with `filter`), weighted by its bit position;
+ * the rows are never reconstructed.
+ *
+ * @example
+ *   prices = BitTwiddle::BitSlicedIndex.new(price_column)
+ *   prices.sum(prices.ge(100)) # total of the prices of at least 100
+ *
+ * @param filter [String, nil] A bitmap as returned by `lt`, `between`, etc.
+ * @return [Integer]
+ */
+static VALUE
+bsi_sum(int argc, VALUE *argv, VALUE self)
+{
+  bit_sliced_index *bsi = get_bsi(self);
+  uint64_t lo = 0, hi = 0, *filter = NULL, block[BLOCK_WORDS];
+  VALUE arg, tmp = 0;
+  size_t w;
+  int i;
+
+  rb_scan_args(argc, argv, "01", &arg);
+  if (!NIL_P(arg)) {
+    filter = ALLOCV_N(uint64_t, tmp, bsi->nwords + 1);
+    bitmap_to_words(bsi, arg, filter);
+  }
+
+  for (i = 0; i < bsi->bits; i++) {
+    uint64_t count = 0, add_lo, add_hi;
+    if (filter) {
+      for (w = 0; w < bsi->nwords; w += BLOCK_WORDS) {
+        size_t bytes = (bsi->nwords - w < BLOCK_WORDS ? bsi->nwords - w : BLOCK_WORDS) * 8;
+        memcpy(block, slice(bsi, i) + w, bytes);
+        bt_bitop_buf((uchar*)block, (const uchar*)(filter + w), bytes, BT_AND);
+        count += bt_popcount_buf(block, bytes);
+      }
+    } else {
+      count = bt_popcount_buf(slice(bsi, i), bsi->nwords * 8);
+    }
+    /* add count << i to the 128-bit total */
+    add_lo = count << i;
+    add_hi = i ? count >> (64 - i) : 0;
+    lo += add_lo;
+    hi += add_hi + (lo < add_lo);
+  }
+
+  if (filter)
+    ALLOCV_END(tmp);
+  return bt_u128_to_num(lo, hi);
+}
+
+/* Document-method: BitTwiddle::BitSlicedIndex#[]
+ * Reconstruct the value in row `index` from its bits.
+ *
+ * @param index [Integer]
+ * @return [Integer]
+ */
+static VALUE
+bsi_aref(VALUE self, VALUE index)
+{
+  bit_sliced_index *bsi = get_bsi(self);
+  long r = NUM2LONG(index);
+  uint64_t v = 0;
+  int i;
+
+  if (r < 0)
+    r += (long)bsi->n;
+  if (r < 0 || (size_t)r >= bsi->n)
+    rb_raise(rb_eIndexError, "row %ld out of range for BitSlicedIndex of %"PRIuSIZE" rows", NUM2LONG(index), bsi->n);
+  for (i = 0; i < bsi->bits; i++)
+    v |= ((slice(bsi, i)[r >> 6] >> (r & 63)) & 1) << i;
+  return ULL2NUM(v);
+}
+
+/* Document-method: BitTwiddle::BitSlicedIndex#size
+ * @return [Integer] The number of rows
+ */
+static VALUE
+bsi_size(VALUE self)
+{
+  return SIZET2NUM(get_bsi(self)->n);
+}
+
+/* Document-method: BitTwiddle::BitSlicedIndex#bits
+ * @return [Integer] The number of bit slices (the bit length of the largest value)
+ */
+static VALUE
+bsi_bits(VALUE self)
+{
+  return INT2FIX(get_bsi(self)->bits);
+}
+
+void Init_bt_bit_sliced_index(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::BitSlicedIndex
+   * An immutable index over a column of unsigned integers, which finds the rows
+   * matching a comparison or range with a few bitmap operations per bit of the
+   * values, and sums the values of selected rows with popcounts. Results are
+   * bitmaps in Strings (row r is bit r % 8 of byte r / 8), which can be
+   * combined with `String#and!`, `#or!` and `#andnot!` and counted with
+   * `String#popcount`.
+   */
+  VALUE rb_cBitSlicedIndex = rb_define_class_under(rb_mBitTwiddle, "BitSlicedIndex", rb_cObject);
+
+  rb_define_alloc_func(rb_cBitSlicedIndex, bsi_alloc);
+  rb_define_method(rb_cBitSlicedIndex, "initialize",      bsi_initialize,     -1);
+  rb_define_method(rb_cBitSlicedIndex, "initialize_copy", bsi_initialize_copy, 1);
+  rb_define_method(rb_cBitSlicedIndex, "lt",              bsi_lt,              1);
+  rb_define_method(rb_cBitSlicedIndex, "le",              bsi_le,              1);
+  rb_define_method(rb_cBitSlicedIndex, "eq",              bsi_eq,              1);
+  rb_define_method(rb_cBitSlicedIndex, "gt",              bsi_gt,              1);
+  rb_define_method(rb_cBitSlicedIndex, "ge",              bsi_ge,              1);
+  rb_define_method(rb_cBitSlicedIndex, "between",         bsi_between,         2);
+  rb_define_method(rb_cBitSlicedIndex, "sum",             bsi_sum,            -1);
+  rb_define_method(rb_cBitSlicedIndex, "[]",              bsi_aref,            1);
+  rb_define_method(rb_cBitSlicedIndex, "size",            bsi_size,            0);
+  rb_define_method(rb_cBitSlicedIndex, "bits",            bsi_bits,            0);
+}
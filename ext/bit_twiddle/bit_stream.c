@@ -0,0 +1,876 @@
+/* BitTwiddle::BitWriter and BitTwiddle::BitReader: Ruby interfaces to the bit
+ * streams in bit_stream.h, for writing and parsing variable-length codes and
+ * packed binary formats */
+
+#include "bit_stream.h"
+
+#define ORDER_MSB 0
+#define ORDER_LSB 1
+
+/* The longest unary code (in bits) which BitWriter will write; anything longer
+ * is almost certainly a mistake, which would otherwise allocate a huge buffer */
+#define MAX_UNARY ((uint64_t)1 << 28)
+
+typedef struct {
+  bt_bitwriter w;
+  int          order; /* -1 until initialized */
+} bit_writer;
+
+typedef struct {
+  bt_bitreader r;
+  uchar       *data;  /* copy of the String, followed by BT_BITSTREAM_PAD zero bytes */
+  size_t       len;
+  int          order;
+} bit_reader;
+
+static int
+value_to_order(VALUE order)
+{
+  ID id;
+  if (NIL_P(order))
+    return ORDER_MSB;
+  id = SYM2ID(order);
+  if (id == rb_intern("msb"))
+    return ORDER_MSB;
+  if (id == rb_intern("lsb"))
+    return ORDER_LSB;
+  rb_raise(rb_eArgError, "bit order must be :msb or :lsb");
+}
+
+static VALUE
+order_to_sym(int order)
+{
+  return ID2SYM(rb_intern(order == ORDER_LSB ? "lsb" : "msb"));
+}
+
+static int
+value_to_nbits(VALUE nbits)
+{
+  int n = NUM2INT(nbits);
+  if (n < 0 || n > 64)
+    rb_raise(rb_eArgError, "number of bits must be between 0 and 64 (not %d)", n);
+  return n;
+}
+
+static uint64_t
+value_to_modulus(VALUE m)
+{
+  uint64_t modulus = bt_num_to_u64(m);
+  if (modulus == 0)
+    rb_raise(rb_eArgError, "Golomb modulus must be positive");
+  return modulus;
+}
+
+/* For a Golomb code with modulus m, the remainder is written in b or b-1 bits
+ * (truncated binary); remainders below 'cutoff' use the shorter form */
+static inline int
+golomb_bits(uint64_t m)
+{
+  return (m == 1) ? 0 : 64 - __builtin_clzll(m - 1);
+}
+
+static inline uint64_t
+golomb_cutoff(uint64_t m, int b)
+{
+  return ((b == 64) ? 0 : (1ULL << b)) - m;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void
+writer_free(void *ptr)
+{
+  bit_writer *bw = ptr;
+  if (bw->order >= 0)
+    bt_bw_free(&bw->w);
+  xfree(bw);
+}
+
+static size_t
+writer_memsize(const void *ptr)
+{
+  const bit_writer *bw = ptr;
+  return sizeof(bit_writer) + (bw->order >= 0 ? bw->w.capa : 0);
+}
+
+static const rb_data_type_t writer_type = {
+  "BitTwiddle::BitWriter",
+  { 0, writer_free, writer_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+writer_alloc(VALUE klass)
+{
+  bit_writer *bw;
+  VALUE obj = TypedData_Make_Struct(klass, bit_writer, &writer_type, bw);
+  bw->order = -1;
+  return obj;
+}
+
+static bit_writer*
+get_writer(VALUE self)
+{
+  bit_writer *bw;
+  TypedData_Get_Struct(self, bit_writer, &writer_type, bw);
+  if (bw->order < 0)
+    rb_raise(rb_eRuntimeError, "uninitialized BitWriter");
+  return bw;
+}
+
+/* Append the low n bits of v (0 <= n <= 64; higher bits of v must be 0) */
+static inline void
+writer_put(bit_writer *bw, uint64_t v, int n)
+{
+  if (n == 0)
+    return;
+  if (bw->order == ORDER_LSB)
+    bt_bw_put_lsb(&bw->w, v, n);
+  else
+    bt_bw_put(&bw->w, v, n);
+}
+
+static void
+writer_put_unary(bit_writer *bw, uint64_t q)
+{
+  if (q >= MAX_UNARY)
+    rb_raise(rb_eRangeError, "unary code of %llu bits is too long (the limit is %llu)",
+             (unsigned long long)q + 1, (unsigned long long)MAX_UNARY);
+  for (; q >= 64; q -= 64)
+    writer_put(bw, ~0ULL, 64);
+  /* q 1 bits, then a 0 */
+  if (bw->order == ORDER_LSB)
+    writer_put(bw, (1ULL << q) - 1, q + 1);
+  else
+    writer_put(bw, ((1ULL << q) - 1) << 1, q + 1);
+}
+
+static void
+writer_align(bit_writer *bw)
+{
+  writer_put(bw, 0, (8 - bt_bw_bits(&bw->w) % 8) % 8);
+}
+
+/* Document-method: BitTwiddle::BitWriter#initialize
+ * Create an empty bit stream.
+ *
+ * In `:msb` order, the first bit written goes into the high bit of the first
+ * byte, and multi-bit values are written starting with their most significant
+ * bit (as in most network protocols, JPEG and H.264). In `:lsb` order, the first
+ * bit written goes into the low bit of the first byte, and values are written
+ * starting with their least significant bit (as in Deflate).
+ *
+ * @param order [Symbol] `:msb` (default) or `:lsb`
+ */
+static VALUE
+writer_initialize(int argc, VALUE *argv, VALUE self)
+{
+  bit_writer *bw;
+  VALUE order;
+  int   o;
+
+  rb_scan_args(argc, argv, "01", &order);
+  TypedData_Get_Struct(self, bit_writer, &writer_type, bw);
+  if (bw->order >= 0)
+    rb_raise(rb_eRuntimeError, "BitWriter is already initialized");
+  o = value_to_order(order);
+  bt_bw_init(&bw->w);
+  bw->order = o;
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitWriter#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+writer_initialize_copy(VALUE self, VALUE orig)
+{
+  bit_writer *dst, *src = get_writer(orig);
+
+  TypedData_Get_Struct(self, bit_writer, &writer_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->order >= 0)
+    rb_raise(rb_eRuntimeError, "BitWriter is already initialized");
+  dst->w     = src->w;
+  dst->w.buf = ALLOC_N(uchar, src->w.capa);
+  memcpy(dst->w.buf, src->w.buf, src->w.capa);
+  dst->order = src->order;
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitWriter#order
+ * @return [Symbol] `:msb` or `:lsb`
+ */
+static VALUE
+writer_order(VALUE self)
+{
+  return order_to_sym(get_writer(self)->order);
+}
+
+/* Document-method: BitTwiddle::BitWriter#write
+ * Append `value` as an `nbits`-bit unsigned integer.
+ *
+ * If `value` is negative or needs more than `nbits` bits, raise `RangeError`.
+ *
+ * @example
+ *   w = BitTwiddle::BitWriter.new
+ *   w.write(5, 3).write(1, 5).to_s # => "\xA1"
+ *
+ * @param value [Integer]
+ * @param nbits [Integer] 0 to 64
+ * @return [BitWriter] `self`
+ */
+static VALUE
+writer_write(VALUE self, VALUE value, VALUE nbits)
+{
+  bit_writer *bw = get_writer(self);
+  int      n = value_to_nbits(nbits);
+  uint64_t v = bt_num_to_u64(value);
+
+  rb_check_frozen(self);
+  if (n < 64 && (v >> n))
+    rb_raise(rb_eRangeError, "value doesn't fit in %d bits", n);
+  writer_put(bw, v, n);
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitWriter#write_bit
+ * Append a single bit.
+ *
+ * @param bit [Integer, Boolean] `0`, `1`, `false` or `true`
+ * @return [BitWriter] `self`
+ */
+static VALUE
+writer_write_bit(VALUE self, VALUE bit)
+{
+  bit_writer *bw = get_writer(self);
+  int b;
+
+  rb_check_frozen(self);
+  if (bit == Qtrue || bit == Qfalse)
+    b = (bit == Qtrue);
+  else if ((b = NUM2INT(bit)) != 0 && b != 1)
+    rb_raise(rb_eArgError, "bit must be 0 or 1 (not %d)", b);
+  writer_put(bw, b, 1);
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitWriter#write_unary
+ * Append `n` in unary: `n` 1 bits followed by a 0 bit.
+ *
+ * Unary codes (including the quotients of Rice and Golomb codes) are limited
+ * to 2^28 bits; a longer one raises `RangeError`.
+ *
+ * @param n [Integer] A non-negative integer
+ * @return [BitWriter] `self`
+ */
+static VALUE
+writer_write_unary(VALUE self, VALUE n)
+{
+  bit_writer *bw = get_writer(self);
+  rb_check_frozen(self);
+  writer_put_unary(bw, bt_num_to_u64(n));
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitWriter#write_rice
+ * Append `value` as a Rice code with parameter `k`: `value >> k` in unary,
+ * then the low `k` bits of `value`. Small values take few bits; a good `k` is
+ * about `log2(mean value)`.
+ *
+ * @example
+ *   w = BitTwiddle::BitWriter.new
+ *   w.write_rice(9, 2) # 110 (2 in unary), then 01
+ *   w.pos              # => 5
+ *
+ * @param value [Integer] A non-negative integer
+ * @param k [Integer] 0 to 64
+ * @return [BitWriter] `self`
+ */
+static VALUE
+writer_write_rice(VALUE self, VALUE value, VALUE k)
+{
+  bit_writer *bw = get_writer(self);
+  int      bits = value_to_nbits(k);
+  uint64_t v    = bt_num_to_u64(value);
+
+  rb_check_frozen(self);
+  writer_put_unary(bw, (bits == 64) ? 0 : v >> bits);
+  writer_put(bw, bt_low_bits(v, bits), bits);
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitWriter#write_golomb
+ * Append `value` as a Golomb code with modulus `m`: `value / m` in unary, then
+ * `value % m` in truncated binary. When `m` is a power of 2, this is the same as
+ * a Rice code.
+ *
+ * @param value [Integer] A non-negative integer
+ * @param m [Integer] A positive integer
+ * @return [BitWriter] `self`
+ */
+static VALUE
+writer_write_golomb(VALUE self, VALUE value, VALUE m)
+{
+  bit_writer *bw = get_writer(self);
+  uint64_t v      = bt_num_to_u64(value);
+  uint64_t mod    = value_to_modulus(m);
+  uint64_t rem    = v % mod;
+  int      b      = golomb_bits(mod);
+  uint64_t cutoff = golomb_cutoff(mod, b);
+
+  rb_check_frozen(self);
+  writer_put_unary(bw, v / mod);
+  if (b == 0) {
+    /* m is 1; there is no remainder */
+  } else if (rem < cutoff) {
+    writer_put(bw, rem, b - 1);
+  } else {
+    /* the extra bit comes last in either bit order, so the code stays prefix-free */
+    writer_put(bw, (rem + cutoff) >> 1, b - 1);
+    writer_put(bw, (rem + cutoff) & 1, 1);
+  }
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitWriter#align
+ * Append 0 bits up to the next byte boundary.
+ *
+ * @return [BitWriter] `self`
+ */
+static VALUE
+writer_align_m(VALUE self)
+{
+  bit_writer *bw = get_writer(self);
+  rb_check_frozen(self);
+  writer_align(bw);
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitWriter#write_bytes
+ * Append 0 bits up to the next byte boundary, then append the bytes of `str`.
+ *
+ * @param str [String]
+ * @return [BitWriter] `self`
+ */
+static VALUE
+writer_write_bytes(VALUE self, VALUE str)
+{
+  bit_writer  *bw = get_writer(self);
+  const uchar *p;
+  size_t       len, i = 0;
+
+  rb_check_frozen(self);
+  StringValue(str);
+  p   = (const uchar*)RSTRING_PTR(str);
+  len = RSTRING_LEN(str);
+  writer_align(bw);
+
+  if (bw->order == ORDER_LSB) {
+    for (; i + 8 <= len; i += 8)
+      bt_bw_put_lsb(&bw->w, load_le64(p + i), 64);
+  } else {
+    for (; i + 8 <= len; i += 8)
+      bt_bw_put(&bw->w, load_be64(p + i), 64);
+  }
+  for (; i < len; i++)
+    writer_put(bw, p[i], 8);
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitWriter#pos
+ * @return [Integer] The number of bits written
+ */
+static VALUE
+writer_pos(VALUE self)
+{
+  return SIZET2NUM(bt_bw_bits(&get_writer(self)->w));
+}
+
+/* Document-method: BitTwiddle::BitWriter#bytesize
+ * @return [Integer] The number of bytes needed to hold the bits written
+ */
+static VALUE
+writer_bytesize(VALUE self)
+{
+  return SIZET2NUM((bt_bw_bits(&get_writer(self)->w) + 7) / 8);
+}
+
+/* Document-method: BitTwiddle::BitWriter#to_s
+ * Return the bits written as a binary String. If the number of bits is not a
+ * multiple of 8, the last byte is padded with 0 bits. More bits can still be
+ * written afterwards.
+ *
+ * @return [String]
+ */
+static VALUE
+writer_to_s(VALUE self)
+{
+  bit_writer *bw = get_writer(self);
+  size_t bytes = (bw->order == ORDER_LSB) ? bt_bw_sync_lsb(&bw->w) : bt_bw_sync(&bw->w);
+  return rb_str_new((const char*)bw->w.buf, bytes);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void
+reader_free(void *ptr)
+{
+  bit_reader *br = ptr;
+  xfree(br->data);
+  xfree(br);
+}
+
+static size_t
+reader_memsize(const void *ptr)
+{
+  const bit_reader *br = ptr;
+  return sizeof(bit_reader) + (br->data ? br->len + BT_BITSTREAM_PAD : 0);
+}
+
+static const rb_data_type_t reader_type = {
+  "BitTwiddle::BitReader",
+  { 0, reader_free, reader_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+reader_alloc(VALUE klass)
+{
+  bit_reader *br;
+  VALUE obj = TypedData_Make_Struct(klass, bit_reader, &reader_type, br);
+  br->order = -1;
+  return obj;
+}
+
+static bit_reader*
+get_reader(VALUE self)
+{
+  bit_reader *br;
+  TypedData_Get_Struct(self, bit_reader, &reader_type, br);
+  if (br->order < 0)
+    rb_raise(rb_eRuntimeError, "uninitialized BitReader");
+  return br;
+}
+
+static void
+reader_setup(bit_reader *br, const uchar *p, size_t len, int order)
+{
+  br->data = ALLOC_N(uchar, len + BT_BITSTREAM_PAD);
+  memcpy(br->data, p, len);
+  memset(br->data + len, 0, BT_BITSTREAM_PAD);
+  br->len   = len;
+  br->order = order;
+  bt_br_init(&br->r, br->data, len * 8);
+}
+
+static inline size_t
+reader_left(const bit_reader *br)
+{
+  return br->r.bits - br->r.pos;
+}
+
+static inline void
+reader_need(const bit_reader *br, size_t n)
+{
+  if (reader_left(br) < n)
+    rb_raise(rb_eEOFError, "not enough bits left (%"PRIuSIZE" needed, %"PRIuSIZE" left)", n, reader_left(br));
+}
+
+/* Read n bits (0 <= n <= 64), without checking for the end of the data */
+static inline uint64_t
+reader_get(bit_reader *br, int n)
+{
+  if (n == 0)
+    return 0;
+  return (br->order == ORDER_LSB) ? bt_br_get_lsb(&br->r, n) : bt_br_get(&br->r, n);
+}
+
+static uint64_t
+reader_get_unary(bit_reader *br)
+{
+  uint64_t count = 0;
+  size_t   start = br->r.pos;
+  for (;;) {
+    size_t   left = reader_left(br);
+    int      n    = (left < 64) ? (int)left : 64, ones;
+    uint64_t word, zeros;
+
+    if (n == 0) {
+      br->r.pos = start;
+      rb_raise(rb_eEOFError, "unary code runs past the end of the data");
+    }
+    word = reader_get(br, n);
+    /* the terminating 0 is the first 1 in 'zeros' (past the n bits read, there
+     * are always 1s, so 'ones' can't be more than n) */
+    if (br->order == ORDER_LSB) {
+      zeros = ~word;
+      ones  = zeros ? __builtin_ctzll(zeros) : 64;
+    } else {
+      zeros = ~(word << (64 - n));
+      ones  = zeros ? __builtin_clzll(zeros) : 64;
+    }
+    if (ones < n) {
+      /* give back the bits after the terminating 0 */
+      br->r.pos -= n - ones - 1;
+      return count + ones;
+    }
+    count += n;
+  }
+}
+
+static void
+reader_align(bit_reader *br)
+{
+  size_t pos = (br->r.pos + 7) & ~(size_t)7;
+  br->r.pos  = (pos < br->r.bits) ? pos : br->r.bits;
+}
+
+/* Document-method: BitTwiddle::BitReader#initialize
+ * Create a reader for the bits in `str`, which can be read in the same bit order
+ * as they were written by `BitWriter` (see `BitWriter#initialize`). The String
+ * is copied, so changing it later does not affect the reader.
+ *
+ * @param str [String]
+ * @param order [Symbol] `:msb` (default) or `:lsb`
+ */
+static VALUE
+reader_initialize(int argc, VALUE *argv, VALUE self)
+{
+  bit_reader *br;
+  VALUE str, order;
+  int   o;
+
+  rb_scan_args(argc, argv, "11", &str, &order);
+  TypedData_Get_Struct(self, bit_reader, &reader_type, br);
+  if (br->order >= 0)
+    rb_raise(rb_eRuntimeError, "BitReader is already initialized");
+  StringValue(str);
+  o = value_to_order(order);
+  reader_setup(br, (const uchar*)RSTRING_PTR(str), RSTRING_LEN(str), o);
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitReader#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+reader_initialize_copy(VALUE self, VALUE orig)
+{
+  bit_reader *dst, *src = get_reader(orig);
+
+  TypedData_Get_Struct(self, bit_reader, &reader_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->order >= 0)
+    rb_raise(rb_eRuntimeError, "BitReader is already initialized");
+  reader_setup(dst, src->data, src->len, src->order);
+  dst->r.pos = src->r.pos;
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitReader#order
+ * @return [Symbol] `:msb` or `:lsb`
+ */
+static VALUE
+reader_order(VALUE self)
+{
+  return order_to_sym(get_reader(self)->order);
+}
+
+/* Document-method: BitTwiddle::BitReader#read
+ * Read an `nbits`-bit unsigned integer.
+ *
+ * If there are fewer than `nbits` bits left, raise `EOFError`.
+ *
+ * @example
+ *   r = BitTwiddle::BitReader.new("\xA1")
+ *   r.read(3) # => 5
+ *   r.read(5) # => 1
+ *
+ * @param nbits [Integer] 0 to 64
+ * @return [Integer]
+ */
+static VALUE
+reader_read(VALUE self, VALUE nbits)
+{
+  bit_reader *br = get_reader(self);
+  int n = value_to_nbits(nbits);
+  reader_need(br, n);
+  return ULL2NUM(reader_get(br, n));
+}
+
+/* Document-method: BitTwiddle::BitReader#peek
+ * Return the next `nbits` bits like `#read`, but without consuming them. Past
+ * the end of the data, 0 bits are returned, so this can be used to look up
+ * variable-length codes in a table even at the end of the data.
+ *
+ * @param nbits [Integer] 0 to 64
+ * @return [Integer]
+ */
+static VALUE
+reader_peek(VALUE self, VALUE nbits)
+{
+  bit_reader *br = get_reader(self);
+  int      n = value_to_nbits(nbits);
+  size_t   pos = br->r.pos;
+  uint64_t v = reader_get(br, n);
+  br->r.pos = pos;
+  return ULL2NUM(v);
+}
+
+/* Document-method: BitTwiddle::BitReader#skip
+ * Skip over `nbits` bits.
+ *
+ * If there are fewer than `nbits` bits left, raise `EOFError`.
+ *
+ * @param nbits [Integer] A non-negative integer
+ * @return [BitReader] `self`
+ */
+static VALUE
+reader_skip(VALUE self, VALUE nbits)
+{
+  bit_reader *br = get_reader(self);
+  long n = NUM2LONG(nbits);
+  if (n < 0)
+    rb_raise(rb_eArgError, "can't skip a negative number of bits");
+  reader_need(br, n);
+  br->r.pos += n;
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitReader#read_bit
+ * Read a single bit.
+ *
+ * If there are no bits left, raise `EOFError`.
+ *
+ * @return [Integer] 0 or 1
+ */
+static VALUE
+reader_read_bit(VALUE self)
+{
+  bit_reader *br = get_reader(self);
+  reader_need(br, 1);
+  return INT2FIX(br->order == ORDER_LSB ? bt_br_bit_lsb(&br->r) : bt_br_bit(&br->r));
+}
+
+/* Document-method: BitTwiddle::BitReader#read_unary
+ * Read a number written by `BitWriter#write_unary`: count 1 bits up to the
+ * next 0 bit.
+ *
+ * If there is no 0 bit before the end of the data, raise `EOFError`.
+ *
+ * @return [Integer]
+ */
+static VALUE
+reader_read_unary(VALUE self)
+{
+  return ULL2NUM(reader_get_unary(get_reader(self)));
+}
+
+/* Document-method: BitTwiddle::BitReader#read_rice
+ * Read a number written by `BitWriter#write_rice` with the same `k`.
+ *
+ * If the code runs past the end of the data, raise `EOFError`, and if the
+ * decoded number does not fit in 64 bits, raise `RangeError`.
+ *
+ * @param k [Integer] 0 to 64
+ * @return [Integer]
+ */
+static VALUE
+reader_read_rice(VALUE self, VALUE k)
+{
+  bit_reader *br = get_reader(self);
+  int      bits = value_to_nbits(k);
+  uint64_t q    = reader_get_unary(br);
+
+  /* q << bits must fit in 64 bits; with k = 0 it always does (and q >> 64 is
+   * undefined) */
+  if (bits == 64 ? q != 0 : (bits > 0 && (q >> (64 - bits)) != 0))
+    rb_raise(rb_eRangeError, "Rice code does not fit in 64 bits");
+  reader_need(br, bits);
+  return ULL2NUM(((bits == 64) ? 0 : q << bits) | reader_get(br, bits));
+}
+
+/* Document-method: BitTwiddle::BitReader#read_golomb
+ * Read a number written by `BitWriter#write_golomb` with the same `m`.
+ *
+ * If the code runs past the end of the data, raise `EOFError`, and if the
+ * decoded number does not fit in 64 bits, raise `RangeError`.
+ *
+ * @param m [Integer] A positive integer
+ * @return [Integer]
+ */
+static VALUE
+reader_read_golomb(VALUE self, VALUE m)
+{
+  bit_reader *br = get_reader(self);
+  uint64_t mod    = value_to_modulus(m);
+  int      b      = golomb_bits(mod);
+  uint64_t cutoff = golomb_cutoff(mod, b);
+  uint64_t q      = reader_get_unary(br), rem = 0, result;
+
+  if (b > 0) {
+    reader_need(br, b - 1);
+    rem = reader_get(br, b - 1);
+    if (rem >= cutoff) {
+      reader_need(br, 1);
+      rem = ((rem << 1) | reader_get(br, 1)) - cutoff;
+    }
+  }
+  if (q > (UINT64_MAX - rem) / mod)
+    rb_raise(rb_eRangeError, "Golomb code does not fit in 64 bits");
+  result = q * mod + rem;
+  return ULL2NUM(result);
+}
+
+/* Document-method: BitTwiddle::BitReader#align
+ * Skip to the next byte boundary (or the end of the data).
+ *
+ * @return [BitReader] `self`
+ */
+static VALUE
+reader_align_m(VALUE self)
+{
+  reader_align(get_reader(self));
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitReader#read_bytes
+ * Skip to the next byte boundary, then read `n` whole bytes.
+ *
+ * If there are fewer than `n` bytes left, raise `EOFError`.
+ *
+ * @param n [Integer]
+ * @return [String]
+ */
+static VALUE
+reader_read_bytes(VALUE self, VALUE n)
+{
+  bit_reader *br = get_reader(self);
+  long  len = NUM2LONG(n);
+  VALUE result;
+
+  if (len < 0)
+    rb_raise(rb_eArgError, "can't read a negative number of bytes");
+  reader_align(br);
+  if ((size_t)len > reader_left(br) / 8)
+    rb_raise(rb_eEOFError, "not enough bytes left (%ld needed, %"PRIuSIZE" left)", len, reader_left(br) / 8);
+  result = rb_str_new((const char*)br->data + br->r.pos / 8, len);
+  br->r.pos += len * 8;
+  return result;
+}
+
+/* Document-method: BitTwiddle::BitReader#pos
+ * @return [Integer] The bit offset of the next bit to be read
+ */
+static VALUE
+reader_pos(VALUE self)
+{
+  return SIZET2NUM(get_reader(self)->r.pos);
+}
+
+/* Document-method: BitTwiddle::BitReader#pos=
+ * Move to the given bit offset.
+ *
+ * If `pos` is negative or past the end of the data, raise `ArgumentError`.
+ *
+ * @param pos [Integer]
+ */
+static VALUE
+reader_set_pos(VALUE self, VALUE pos)
+{
+  bit_reader *br = get_reader(self);
+  long p = NUM2LONG(pos);
+  if (p < 0 || (size_t)p > br->r.bits)
+    rb_raise(rb_eArgError, "bit position %ld is out of range", p);
+  br->r.pos = p;
+  return pos;
+}
+
+/* Document-method: BitTwiddle::BitReader#bit_size
+ * @return [Integer] The total number of bits in the data
+ */
+static VALUE
+reader_bit_size(VALUE self)
+{
+  return SIZET2NUM(get_reader(self)->r.bits);
+}
+
+/* Document-method: BitTwiddle::BitReader#bits_left
+ * @return [Integer] The number of bits after the current position
+ */
+static VALUE
+reader_bits_left(VALUE self)
+{
+  return SIZET2NUM(reader_left(get_reader(self)));
+}
+
+/* Document-method: BitTwiddle::BitReader#eof?
+ * @return [Boolean] Whether all the bits have been read
+ */
+static VALUE
+reader_eof_p(VALUE self)
+{
+  return reader_left(get_reader(self)) ? Qfalse : Qtrue;
+}
+
+void Init_bt_bit_stream(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  VALUE rb_cBitWriter, rb_cBitReader;
+
+  /* Document-class: BitTwiddle::BitWriter
+   * Builds a String bit by bit, for variable-length codes (unary, Rice and
+   * Golomb codes, or your own Huffman codes) and packed binary formats. Bits are
+   * buffered 64 at a time, so each write is only a few instructions.
+   *
+   * @example
+   *   w = BitTwiddle::BitWriter.new
+   *   w.write(1, 1).write(300, 12).write_rice(17, 3)
+   *   r = BitTwiddle::BitReader.new(w.to_s)
+   *   [r.read(1), r.read(12), r.read_rice(3)] # => [1, 300, 17]
+   */
+  rb_cBitWriter = rb_define_class_under(rb_mBitTwiddle, "BitWriter", rb_cObject);
+  rb_define_alloc_func(rb_cBitWriter, writer_alloc);
+  rb_define_method(rb_cBitWriter, "initialize",      writer_initialize,      -1);
+  rb_define_method(rb_cBitWriter, "initialize_copy", writer_initialize_copy,  1);
+  rb_define_method(rb_cBitWriter, "order",           writer_order,            0);
+  rb_define_method(rb_cBitWriter, "write",           writer_write,            2);
+  rb_define_method(rb_cBitWriter, "write_bit",       writer_write_bit,        1);
+  rb_define_method(rb_cBitWriter, "write_unary",     writer_write_unary,      1);
+  rb_define_method(rb_cBitWriter, "write_rice",      writer_write_rice,       2);
+  rb_define_method(rb_cBitWriter, "write_golomb",    writer_write_golomb,     2);
+  rb_define_method(rb_cBitWriter, "write_bytes",     writer_write_bytes,      1);
+  rb_define_method(rb_cBitWriter, "align",           writer_align_m,          0);
+  rb_define_method(rb_cBitWriter, "pos",             writer_pos,              0);
+  rb_define_method(rb_cBitWriter, "bytesize",        writer_bytesize,         0);
+  rb_define_method(rb_cBitWriter, "to_s",            writer_to_s,             0);
+
+  /* Document-class: BitTwiddle::BitReader
+   * Reads bits from a String, in the same bit orders and with the same codes as
+   * `BitWriter`. The data is read 64 bits at a time from any bit offset.
+   */
+  rb_cBitReader = rb_define_class_under(rb_mBitTwiddle, "BitReader", rb_cObject);
+  rb_define_alloc_func(rb_cBitReader, reader_alloc);
+  rb_define_method(rb_cBitReader, "initialize",      reader_initialize,      -1);
+  rb_define_method(rb_cBitReader, "initialize_copy", reader_initialize_copy,  1);
+  rb_define_method(rb_cBitReader, "order",           reader_order,            0);
+  rb_define_method(rb_cBitReader, "read",            reader_read,             1);
+  rb_define_method(rb_cBitReader, "peek",            reader_peek,             1);
+  rb_define_method(rb_cBitReader, "skip",            reader_skip,             1);
+  rb_define_method(rb_cBitReader, "read_bit",        reader_read_bit,         0);
+  rb_define_method(rb_cBitReader, "read_unary",      reader_read_unary,       0);
+  rb_define_method(rb_cBitReader, "read_rice",       reader_read_rice,        1);
+  rb_define_method(rb_cBitReader, "read_golomb",     reader_read_golomb,      1);
+  rb_define_method(rb_cBitReader, "read_bytes",      reader_read_bytes,       1);
+  rb_define_method(rb_cBitReader, "align",           reader_align_m,          0);
+  rb_define_method(rb_cBitReader, "pos",             reader_pos,              0);
+  rb_define_method(rb_cBitReader, "pos=",            reader_set_pos,          1);
+  rb_define_method(rb_cBitReader, "bit_size",        reader_bit_size,         0);
+  rb_define_method(rb_cBitReader, "bits_left",       reader_bits_left,        0);
+  rb_define_method(rb_cBitReader, "eof?",            reader_eof_p,            0);
+}
@@ -0,0 +1,189 @@
+/* Bit-level writer and reader used by the stream codecs
+ *
+ * Bits are normally written MSB-first: the first bit written is the high bit of
+ * the first byte. The _lsb variants use the other order, where the first bit
+ * written is the low bit of the first byte (as in Deflate); a stream must be
+ * written and read with the same order. The writer gathers bits in a 64-bit accumulator and stores whole words;
+ * the reader loads 64 bits at a time from any bit offset. The writer always keeps
+ * BT_BITSTREAM_PAD zero bytes after the data, so a reader over the writer's
+ * buffer never needs bounds checks within a single read. */
+
+#ifndef BIT_STREAM_H
+#define BIT_STREAM_H
+
+#include "bit_twiddle.h"
+
+#define BT_BITSTREAM_PAD 16
+
+typedef struct {
+  uchar   *buf;
+  size_t   len;   /* bytes of whole words stored in buf */
+  size_t   capa;  /* bytes allocated for buf, including padding */
+  uint64_t acc;   /* pending bits, in the low 'nacc' bits */
+  int      nacc;
+} bt_bitwriter;
+
+typedef struct {
+  const uchar *buf;
+  size_t       pos;   /* bit offset of the next bit to read */
+  size_t       bits;  /* number of valid bits in buf */
+} bt_bitreader;
+
+static inline uint64_t bt_low_bits(uint64_t v, int n)
+{
+  return (n >= 64) ? v : v & ((1ULL << n) - 1);
+}
+
+static inline void bt_bw_init(bt_bitwriter *w)
+{
+  w->capa = 64 + 8 + BT_BITSTREAM_PAD;
+  w->buf  = ZALLOC_N(uchar, w->capa);
+  w->len  = 0;
+  w->acc  = 0;
+  w->nacc = 0;
+}
+
+static inline void bt_bw_free(bt_bitwriter *w)
+{
+  xfree(w->buf);
+  w->buf = NULL;
+}
+
+static inline void bt_bw_reserve(bt_bitwriter *w)
+{
+  /* room for one more word, the pending bits stored by bt_bw_sync, and padding */
+  if (w->len + 16 + BT_BITSTREAM_PAD > w->capa) {
+    size_t capa = w->capa * 2;
+    REALLOC_N(w->buf, uchar, capa);
+    memset(w->buf + w->capa, 0, capa - w->capa);
+    w->capa = capa;
+  }
+}
+
+static inline void bt_bw_flush_word(bt_bitwriter *w, uint64_t word)
+{
+  bt_bw_reserve(w);
+#ifndef WORDS_BIGENDIAN
+  word = __builtin_bswap64(word);
+#endif
+  memcpy(w->buf + w->len, &word, 8);
+  w->len += 8;
+}
+
+/* Append the low n bits of v (1 <= n <= 64; higher bits of v must be 0) */
+static inline void bt_bw_put(bt_bitwriter *w, uint64_t v, int n)
+{
+  int space = 64 - w->nacc;
+  if (n < space) {
+    w->acc   = (w->acc << n) | v;
+    w->nacc += n;
+  } else {
+    /* fill the accumulator, store it, and keep the bits which didn't fit */
+    uint64_t word = (space == 64) ? v : (w->acc << space) | (v >> (n - space));
+    bt_bw_flush_word(w, word);
+    w->nacc = n - space;
+    w->acc  = bt_low_bits(v, w->nacc);
+  }
+}
+
+/* Append the low n bits of v (1 <= n <= 64; higher bits of v must be 0), LSB-first */
+static inline void bt_bw_put_lsb(bt_bitwriter *w, uint64_t v, int n)
+{
+  int space = 64 - w->nacc;
+  if (n < space) {
+    w->acc  |= v << w->nacc;
+    w->nacc += n;
+  } else {
+    uint64_t word = (space == 64) ? v : w->acc | (v << w->nacc);
+    bt_bw_reserve(w);
+    store_le64(w->buf + w->len, word);
+    w->len += 8;
+    w->nacc = n - space;
+    w->acc  = w->nacc ? v >> space : 0;
+  }
+}
+
+/* Total number of bits written */
+static inline size_t bt_bw_bits(const bt_bitwriter *w)
+{
+  return w->len * 8 + w->nacc;
+}
+
+/* Store the pending bits after the whole words (followed by BT_BITSTREAM_PAD
+ * zero bytes), without changing the writer's state; more bits can still be
+ * appended afterwards. Return the number of bytes which hold data */
+static inline size_t bt_bw_sync(bt_bitwriter *w)
+{
+  uint64_t word = w->nacc ? w->acc << (64 - w->nacc) : 0;
+#ifndef WORDS_BIGENDIAN
+  word = __builtin_bswap64(word);
+#endif
+  memcpy(w->buf + w->len, &word, 8);
+  memset(w->buf + w->len + 8, 0, BT_BITSTREAM_PAD);
+  return w->len + (w->nacc + 7) / 8;
+}
+
+/* Like bt_bw_sync, for a writer used with bt_bw_put_lsb */
+static inline size_t bt_bw_sync_lsb(bt_bitwriter *w)
+{
+  store_le64(w->buf + w->len, w->acc);
+  memset(w->buf + w->len + 8, 0, BT_BITSTREAM_PAD);
+  return w->len + (w->nacc + 7) / 8;
+}
+
+/* 'buf' must be followed by BT_BITSTREAM_PAD readable bytes */
+static inline void bt_br_init(bt_bitreader *r, const uchar *buf, size_t bits)
+{
+  r->buf  = buf;
+  r->pos  = 0;
+  r->bits = bits;
+}
+
+/* Read n bits (1 <= n <= 64) */
+static inline uint64_t bt_br_get(bt_bitreader *r, int n)
+{
+  int      off  = r->pos % 8;
+  uint64_t word = load_be64(r->buf + r->pos / 8) << off;
+  if (n + off > 64)
+    word |= (uint64_t)r->buf[r->pos / 8 + 8] >> (8 - off);
+  r->pos += n;
+  return word >> (64 - n);
+}
+
+static inline int bt_br_bit(bt_bitreader *r)
+{
+  int bit = (r->buf[r->pos / 8] >> (7 - r->pos % 8)) & 1;
+  r->pos++;
+  return bit;
+}
+
+/* Read n bits (1 <= n <= 64), LSB-first */
+static inline uint64_t bt_br_get_lsb(bt_bitreader *r, int n)
+{
+  int      off  = r->pos % 8;
+  uint64_t word = load_le64(r->buf + r->pos / 8) >> off;
+  if (n + off > 64)
+    word |= (uint64_t)r->buf[r->pos / 8 + 8] << (64 - off);
+  r->pos += n;
+  return bt_low_bits(word, n);
+}
+
+static inline int bt_br_bit_lsb(bt_bitreader *r)
+{
+  int bit = (r->buf[r->pos / 8] >> (r->pos % 8)) & 1;
+  r->pos++;
+  return bit;
+}
+
+/* Count 1 bits up to the next 0 bit (or 'max' 1 bits), consuming them and the 0 */
+static inline int bt_br_ones(bt_bitreader *r, int max)
+{
+  uint64_t word = ~bt_br_get(r, max + 1) << (63 - max);
+  int      ones = word ? __builtin_clzll(word) : max;
+  if (ones > max)
+    ones = max;
+  r->pos -= max + 1 - ones - (ones < max);
+  return ones;
+}
+
+#endif
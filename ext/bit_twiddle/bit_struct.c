@@ -0,0 +1,588 @@
+/* BitTwiddle::BitStruct: records made of packed bit fields
+ *
+ * The layout is turned into a table of (byte offset, bit shift, width) once; to
+ * extract a field, load the 8 bytes at its byte offset as a big-endian word (plus
+ * one more byte if the field straddles them), shift it up to drop the bits of
+ * preceding fields, and shift down to drop the following ones. Inserting a field
+ * ORs it into a zeroed record in the same way. */
+
+#include "bit_twiddle.h"
+
+typedef struct {
+  size_t byte;   /* offset of the first byte holding this field */
+  int    shift;  /* bits before the field in that byte (0-7) */
+  int    width;  /* 1-64 */
+} bs_field;
+
+typedef struct {
+  bs_field *fields;
+  long      nfields;  /* 0 until initialized */
+  VALUE     names;    /* frozen Array of Symbols */
+  size_t    bits;
+  size_t    bytes;    /* size of one record */
+} bit_struct;
+
+/* Extract a field from the record at 'rec', where 'avail' bytes are readable
+ * starting from 'rec' */
+static inline uint64_t
+field_get(const uchar *rec, size_t avail, const bs_field *f)
+{
+  const uchar *p = rec + f->byte;
+  uchar    tmp[9];
+  uint64_t word;
+
+  if (f->byte + 9 > avail) {
+    size_t n = avail - f->byte;
+    memset(tmp, 0, 9);
+    memcpy(tmp, p, n < 9 ? n : 9);
+    p = tmp;
+  }
+  word = load_be64(p) << f->shift;
+  if (f->shift + f->width > 64)
+    word |= p[8] >> (8 - f->shift);
+  return word >> (64 - f->width);
+}
+
+/* OR a field into a record; the record must be followed by 9 writable bytes,
+ * which are left unchanged */
+static inline void
+field_put(uchar *rec, const bs_field *f, uint64_t v)
+{
+  uchar *p   = rec + f->byte;
+  int    end = f->shift + f->width;
+
+  store_be64(p, load_be64(p) | ((v << (64 - f->width)) >> f->shift));
+  if (end > 64)
+    p[8] |= (uchar)(v << (72 - end));
+}
+
+static uint64_t
+field_value(VALUE value, const bs_field *f)
+{
+  uint64_t v = bt_num_to_u64(value);
+  if (f->width < 64 && (v >> f->width))
+    rb_raise(rb_eRangeError, "%"PRIsVALUE" doesn't fit in a %d-bit field", value, f->width);
+  return v;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void
+bit_struct_mark(void *ptr)
+{
+  bit_struct *bs = ptr;
+  rb_gc_mark(bs->names);
+}
+
+static void
+bit_struct_free(void *ptr)
+{
+  bit_struct *bs = ptr;
+  xfree(bs->fields);
+  xfree(bs);
+}
+
+static size_t
+bit_struct_memsize(const void *ptr)
+{
+  const bit_struct *bs = ptr;
+  return sizeof(bit_struct) + bs->nfields * sizeof(bs_field);
+}
+
+static const rb_data_type_t bit_struct_type = {
+  "BitTwiddle::BitStruct",
+  { bit_struct_mark, bit_struct_free, bit_struct_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+bit_struct_alloc(VALUE klass)
+{
+  bit_struct *bs;
+  VALUE obj = TypedData_Make_Struct(klass, bit_struct, &bit_struct_type, bs);
+  bs->names = Qnil;
+  return obj;
+}
+
+static bit_struct*
+get_bit_struct(VALUE self)
+{
+  bit_struct *bs;
+  TypedData_Get_Struct(self, bit_struct, &bit_struct_type, bs);
+  if (bs->nfields == 0)
+    rb_raise(rb_eRuntimeError, "uninitialized BitStruct");
+  return bs;
+}
+
+/* Document-method: BitTwiddle::BitStruct#initialize
+ * Define a record layout. Fields are given in order, with their widths in bits,
+ * and are packed MSB-first with no padding: the first field starts at the high
+ * bit of the first byte, as in network protocol headers. If the total width is
+ * not a multiple of 8, each record is padded with 0 bits at the end.
+ *
+ * @example
+ *   header = BitTwiddle::BitStruct.new(version: 3, length: 13, id: 48)
+ *   header.bytesize # => 8
+ *
+ * @param fields [Hash{Symbol => Integer}] Field names and widths (1 to 64 bits)
+ */
+static VALUE
+bit_struct_initialize(int argc, VALUE *argv, VALUE self)
+{
+  bit_struct *bs;
+  VALUE opts, pairs, names;
+  long  i, n;
+  size_t bit = 0;
+
+  rb_scan_args(argc, argv, ":", &opts);
+  TypedData_Get_Struct(self, bit_struct, &bit_struct_type, bs);
+  if (bs->nfields)
+    rb_raise(rb_eRuntimeError, "BitStruct is already initialized");
+  if (NIL_P(opts) || RHASH_SIZE(opts) == 0)
+    rb_raise(rb_eArgError, "a BitStruct needs at least one field");
+
+  pairs = rb_funcall(opts, rb_intern("to_a"), 0);
+  n     = RARRAY_LEN(pairs);
+  names = rb_ary_new_capa(n);
+  xfree(bs->fields); /* from an earlier call which raised an exception */
+  bs->fields = ZALLOC_N(bs_field, n);
+
+  for (i = 0; i < n; i++) {
+    VALUE pair  = RARRAY_AREF(pairs, i);
+    int   width = NUM2INT(RARRAY_AREF(pair, 1));
+    if (width < 1 || width > 64)
+      rb_raise(rb_eArgError, "field width must be from 1 to 64 bits (not %d)", width);
+    rb_ary_push(names, RARRAY_AREF(pair, 0));
+    bs->fields[i].byte  = bit / 8;
+    bs->fields[i].shift = bit % 8;
+    bs->fields[i].width = width;
+    bit += width;
+  }
+
+  bs->names   = rb_obj_freeze(names);
+  bs->bits    = bit;
+  bs->bytes   = (bit + 7) / 8;
+  bs->nfields = n;
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitStruct#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+bit_struct_initialize_copy(VALUE self, VALUE orig)
+{
+  bit_struct *dst, *src = get_bit_struct(orig);
+
+  TypedData_Get_Struct(self, bit_struct, &bit_struct_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->nfields)
+    rb_raise(rb_eRuntimeError, "BitStruct is already initialized");
+  *dst = *src;
+  dst->fields = ALLOC_N(bs_field, src->nfields);
+  memcpy(dst->fields, src->fields, src->nfields * sizeof(bs_field));
+  return self;
+}
+
+/* Document-method: BitTwiddle::BitStruct#members
+ * @return [Array<Symbol>] The field names, in order
+ */
+static VALUE
+bit_struct_members(VALUE self)
+{
+  return rb_ary_dup(get_bit_struct(self)->names);
+}
+
+/* Document-method: BitTwiddle::BitStruct#fields
+ * @return [Hash{Symbol => Integer}] The field names and widths, in order
+ */
+static VALUE
+bit_struct_fields(VALUE self)
+{
+  bit_struct *bs = get_bit_struct(self);
+  VALUE hash = rb_hash_new();
+  long  i;
+  for (i = 0; i < bs->nfields; i++)
+    rb_hash_aset(hash, RARRAY_AREF(bs->names, i), INT2FIX(bs->fields[i].width));
+  return hash;
+}
+
+/* Document-method: BitTwiddle::BitStruct#bit_size
+ * @return [Integer] The total width of the fields, in bits
+ */
+static VALUE
+bit_struct_bit_size(VALUE self)
+{
+  return SIZET2NUM(get_bit_struct(self)->bits);
+}
+
+/* Document-method: BitTwiddle::BitStruct#bytesize
+ * @return [Integer] The size of one record, in bytes
+ */
+static VALUE
+bit_struct_bytesize(VALUE self)
+{
+  return SIZET2NUM(get_bit_struct(self)->bytes);
+}
+
+/* Return a pointer to the record at byte 'offset' in 'str' (negative offsets
+ * count from the end), and the number of bytes from there to the end */
+static const uchar*
+record_at(const bit_struct *bs, VALUE str, VALUE offset, size_t *avail)
+{
+  long len = RSTRING_LEN(str), off = NIL_P(offset) ? 0 : NUM2LONG(offset);
+  if (off < 0)
+    off += len;
+  if (off < 0 || off > len || (size_t)(len - off) < bs->bytes)
+    rb_raise(rb_eIndexError, "no %"PRIuSIZE"-byte record at offset %ld in String of %ld bytes",
+             bs->bytes, NIL_P(offset) ? 0 : NUM2LONG(offset), len);
+  *avail = len - off;
+  return (const uchar*)RSTRING_PTR(str) + off;
+}
+
+static size_t
+record_count(const bit_struct *bs, VALUE buffer)
+{
+  if (RSTRING_LEN(buffer) % bs->bytes)
+    rb_raise(rb_eArgError, "buffer length must be a multiple of %"PRIuSIZE" bytes", bs->bytes);
+  return RSTRING_LEN(buffer) / bs->bytes;
+}
+
+static VALUE
+decode_hash(const bit_struct *bs, const uchar *rec, size_t avail)
+{
+  VALUE hash = rb_hash_new();
+  long  i;
+  for (i = 0; i < bs->nfields; i++)
+    rb_hash_aset(hash, RARRAY_AREF(bs->names, i), ULL2NUM(field_get(rec, avail, &bs->fields[i])));
+  return hash;
+}
+
+/* rb_hash_foreach callback which raises for a key that isn't a field name */
+static int
+check_field_name(VALUE key, VALUE value, VALUE names)
+{
+  if (!RTEST(rb_ary_includes(names, key)))
+    rb_raise(rb_eArgError, "unknown BitStruct field: %"PRIsVALUE, rb_inspect(key));
+  return ST_CONTINUE;
+}
+
+/* Encode a Hash, Array or Struct into the zeroed record at 'rec' */
+static void
+encode_record(const bit_struct *bs, uchar *rec, VALUE record)
+{
+  long i, found = 0;
+
+  if (RB_TYPE_P(record, T_HASH)) {
+    for (i = 0; i < bs->nfields; i++) {
+      VALUE v = rb_hash_lookup2(record, RARRAY_AREF(bs->names, i), Qundef);
+      if (v != Qundef) {
+        field_put(rec, &bs->fields[i], field_value(v, &bs->fields[i]));
+        found++;
+      }
+    }
+    /* only look for the misspelt key if there is one */
+    if (found < (long)RHASH_SIZE(record))
+      rb_hash_foreach(record, check_field_name, bs->names);
+  } else {
+    VALUE ary = rb_obj_is_kind_of(record, rb_cStruct) ? rb_funcall(record, rb_intern("to_a"), 0)
+                                                      : rb_Array(record);
+    if (RARRAY_LEN(ary) > bs->nfields)
+      rb_raise(rb_eArgError, "too many values for BitStruct (%ld for %ld)", RARRAY_LEN(ary), bs->nfields);
+    for (i = 0; i < RARRAY_LEN(ary); i++)
+      field_put(rec, &bs->fields[i], field_value(RARRAY_AREF(ary, i), &bs->fields[i]));
+  }
+}
+
+/* A String of 'bytes' zero bytes, with 9 more zero bytes after the end for
+ * field_put */
+static VALUE
+zeroed_records(size_t bytes)
+{
+  VALUE str = rb_str_new(NULL, bytes + 9);
+  memset(RSTRING_PTR(str), 0, bytes + 9);
+  rb_str_set_len(str, bytes);
+  return str;
+}
+
+/* Document-method: BitTwiddle::BitStruct#decode
+ * Extract the fields of the record at byte `offset` in `str`.
+ *
+ * If there is no whole record at `offset`, raise `IndexError`.
+ *
+ * @example
+ *   header = BitTwiddle::BitStruct.new(version: 3, length: 13, id: 48)
+ *   header.decode("\x40\x2A\x00\x00\x00\x00\x01\x00") # => {:version=>2, :length=>42, :id=>256}
+ *
+ * @param str [String]
+ * @param offset [Integer] Byte offset (default 0; negative offsets count from the end)
+ * @return [Hash{Symbol => Integer}]
+ */
+static VALUE
+bit_struct_decode(int argc, VALUE *argv, VALUE self)
+{
+  bit_struct  *bs = get_bit_struct(self);
+  VALUE        str, offset;
+  const uchar *rec;
+  size_t       avail;
+
+  rb_scan_args(argc, argv, "11", &str, &offset);
+  StringValue(str);
+  rec = record_at(bs, str, offset, &avail);
+  return decode_hash(bs, rec, avail);
+}
+
+/* Document-method: BitTwiddle::BitStruct#decode_values
+ * Like `#decode`, but return the field values in an Array. This is faster, and
+ * can be used to fill a Struct:
+ *
+ * @example
+ *   Header = Struct.new(*header.members)
+ *   Header.new(*header.decode_values(packet))
+ *
+ * @param str [String]
+ * @param offset [Integer] Byte offset (default 0; negative offsets count from the end)
+ * @return [Array<Integer>]
+ */
+static VALUE
+bit_struct_decode_values(int argc, VALUE *argv, VALUE self)
+{
+  bit_struct  *bs = get_bit_struct(self);
+  VALUE        str, offset, result;
+  const uchar *rec;
+  size_t       avail;
+  long         i;
+
+  rb_scan_args(argc, argv, "11", &str, &offset);
+  StringValue(str);
+  rec    = record_at(bs, str, offset, &avail);
+  result = rb_ary_new_capa(bs->nfields);
+  for (i = 0; i < bs->nfields; i++)
+    rb_ary_push(result, ULL2NUM(field_get(rec, avail, &bs->fields[i])));
+  return result;
+}
+
+/* Document-method: BitTwiddle::BitStruct#encode
+ * Pack field values into a record. `record` can be a Hash of field names to
+ * values (missing fields are 0), or an Array or Struct of values in field order.
+ *
+ * If a value is negative or too wide for its field, raise `RangeError`. If a
+ * Hash has a key which isn't a field name, raise `ArgumentError`.
+ *
+ * @example
+ *   header = BitTwiddle::BitStruct.new(version: 3, length: 13, id: 48)
+ *   header.encode(version: 2, length: 42, id: 256) # => "\x40\x2A\x00\x00\x00\x00\x01\x00"
+ *   header.encode([2, 42, 256])                     # => "\x40\x2A\x00\x00\x00\x00\x01\x00"
+ *
+ * @param record [Hash, Array, Struct]
+ * @return [String]
+ */
+static VALUE
+bit_struct_encode(VALUE self, VALUE record)
+{
+  bit_struct *bs = get_bit_struct(self);
+  VALUE result = zeroed_records(bs->bytes);
+  encode_record(bs, (uchar*)RSTRING_PTR(result), record);
+  return result;
+}
+
+/* Document-method: BitTwiddle::BitStruct#decode_all
+ * Decode every record in a buffer of consecutive records.
+ *
+ * If the buffer length is not a multiple of `#bytesize`, raise `ArgumentError`.
+ *
+ * @param buffer [String]
+ * @return [Array<Hash{Symbol => Integer}>]
+ */
+static VALUE
+bit_struct_decode_all(VALUE self, VALUE buffer)
+{
+  bit_struct  *bs = get_bit_struct(self);
+  const uchar *p;
+  size_t       n, i, len;
+  VALUE        result;
+
+  StringValue(buffer);
+  n      = record_count(bs, buffer);
+  len    = RSTRING_LEN(buffer);
+  result = rb_ary_new_capa(n);
+  for (i = 0; i < n; i++) {
+    p = (const uchar*)RSTRING_PTR(buffer);
+    rb_ary_push(result, decode_hash(bs, p + i * bs->bytes, len - i * bs->bytes));
+  }
+  RB_GC_GUARD(buffer);
+  return result;
+}
+
+/* Document-method: BitTwiddle::BitStruct#encode_all
+ * Encode an Array of records (each as for `#encode`) into one buffer.
+ *
+ * @param records [Array<Hash, Array, Struct>]
+ * @return [String]
+ */
+static VALUE
+bit_struct_encode_all(VALUE self, VALUE records)
+{
+  bit_struct *bs = get_bit_struct(self);
+  VALUE  result;
+  long   i, n;
+
+  records = rb_Array(records);
+  n       = RARRAY_LEN(records);
+  result  = zeroed_records(n * bs->bytes);
+  for (i = 0; i < RARRAY_LEN(records) && i < n; i++)
+    encode_record(bs, (uchar*)RSTRING_PTR(result) + i * bs->bytes, RARRAY_AREF(records, i));
+  return result;
+}
+
+/* Document-method: BitTwiddle::BitStruct#decode_columns
+ * Decode every record in a buffer of consecutive records into one column per
+ * field: a buffer of native-endian unsigned 64-bit integers (`"Q*"`) holding the
+ * values of that field from every record. No Ruby objects are created per
+ * record, so this is much faster than `#decode_all` for big buffers.
+ *
+ * If the buffer length is not a multiple of `#bytesize`, raise `ArgumentError`.
+ *
+ * @example
+ *   cols = header.decode_columns(packets)
+ *   cols[:length].unpack("Q*").sum
+ *
+ * @param buffer [String]
+ * @return [Hash{Symbol => String}]
+ */
+static VALUE
+bit_struct_decode_columns(VALUE self, VALUE buffer)
+{
+  bit_struct  *bs = get_bit_struct(self);
+  const uchar *p;
+  size_t       n, i, len;
+  uint64_t   **cols;
+  VALUE        result = rb_hash_new(), v;
+  long         f;
+
+  StringValue(buffer);
+  n    = record_count(bs, buffer);
+  len  = RSTRING_LEN(buffer);
+  cols = ALLOCV_N(uint64_t*, v, bs->nfields);
+  for (f = 0; f < bs->nfields; f++) {
+    VALUE col = rb_str_new(NULL, n * 8);
+    rb_hash_aset(result, RARRAY_AREF(bs->names, f), col);
+    cols[f] = (uint64_t*)RSTRING_PTR(col);
+  }
+
+  p = (const uchar*)RSTRING_PTR(buffer);
+  for (i = 0; i < n; i++) {
+    const uchar *rec = p + i * bs->bytes;
+    for (f = 0; f < bs->nfields; f++)
+      cols[f][i] = field_get(rec, len - i * bs->bytes, &bs->fields[f]);
+  }
+
+  ALLOCV_END(v);
+  RB_GC_GUARD(buffer);
+  return result;
+}
+
+/* Document-method: BitTwiddle::BitStruct#encode_columns
+ * The inverse of `#decode_columns`: build a buffer of records from one buffer of
+ * native-endian unsigned 64-bit integers (`"Q*"`) per field. All the columns must
+ * have the same length; missing columns are filled with 0.
+ *
+ * If a value is too wide for its field, raise `RangeError`.
+ *
+ * @param columns [Hash{Symbol => String}]
+ * @return [String]
+ */
+static VALUE
+bit_struct_encode_columns(VALUE self, VALUE columns)
+{
+  bit_struct *bs = get_bit_struct(self);
+  const uint64_t **cols;
+  VALUE   result, v, keep;
+  long    f;
+  size_t  n = 0, i;
+  int     have_n = 0;
+  uchar  *out;
+
+  Check_Type(columns, T_HASH);
+  keep = rb_ary_new_capa(bs->nfields);
+  cols = ALLOCV_N(const uint64_t*, v, bs->nfields);
+  for (f = 0; f < bs->nfields; f++) {
+    VALUE col = rb_hash_lookup2(columns, RARRAY_AREF(bs->names, f), Qnil);
+    if (NIL_P(col)) {
+      cols[f] = NULL;
+      continue;
+    }
+    col = rb_str_new_frozen(StringValue(col));
+    rb_ary_push(keep, col);
+    if (RSTRING_LEN(col) % 8)
+      rb_raise(rb_eArgError, "column buffer length must be a multiple of 8 bytes");
+    if (have_n && (size_t)RSTRING_LEN(col) / 8 != n)
+      rb_raise(rb_eArgError, "all columns must have the same length");
+    n       = RSTRING_LEN(col) / 8;
+    have_n  = 1;
+    cols[f] = (const uint64_t*)RSTRING_PTR(col);
+  }
+
+  /* check every value before building the result */
+  for (f = 0; f < bs->nfields; f++) {
+    int w = bs->fields[f].width;
+    if (!cols[f] || w == 64)
+      continue;
+    for (i = 0; i < n; i++) {
+      uint64_t x;
+      memcpy(&x, cols[f] + i, 8);
+      if (x >> w)
+        rb_raise(rb_eRangeError, "%"PRIsVALUE"[%"PRIuSIZE"] doesn't fit in a %d-bit field",
+                 RARRAY_AREF(bs->names, f), i, w);
+    }
+  }
+
+  result = zeroed_records(n * bs->bytes);
+  out    = (uchar*)RSTRING_PTR(result);
+  for (i = 0; i < n; i++) {
+    for (f = 0; f < bs->nfields; f++) {
+      uint64_t x;
+      if (!cols[f])
+        continue;
+      memcpy(&x, cols[f] + i, 8);
+      field_put(out + i * bs->bytes, &bs->fields[f], x);
+    }
+  }
+
+  ALLOCV_END(v);
+  RB_GC_GUARD(keep);
+  return result;
+}
+
+void Init_bt_bit_struct(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::BitStruct
+   * A layout of packed bit fields, such as a protocol header, which can decode
+   * and encode records one at a time or in bulk.
+   *
+   * @example
+   *   header = BitTwiddle::BitStruct.new(version: 3, length: 13, id: 48)
+   *   bytes  = header.encode(version: 2, length: 42, id: 256)
+   *   header.decode(bytes)              # => {:version=>2, :length=>42, :id=>256}
+   *   header.decode_columns(bytes * 3)  # => {:version=>"\x02\x00...", ...}
+   */
+  VALUE rb_cBitStruct = rb_define_class_under(rb_mBitTwiddle, "BitStruct", rb_cObject);
+
+  rb_define_alloc_func(rb_cBitStruct, bit_struct_alloc);
+  rb_define_method(rb_cBitStruct, "initialize",      bit_struct_initialize,      -1);
+  rb_define_method(rb_cBitStruct, "initialize_copy", bit_struct_initialize_copy,  1);
+  rb_define_method(rb_cBitStruct, "members",         bit_struct_members,          0);
+  rb_define_method(rb_cBitStruct, "fields",          bit_struct_fields,           0);
+  rb_define_method(rb_cBitStruct, "bit_size",        bit_struct_bit_size,         0);
+  rb_define_method(rb_cBitStruct, "bytesize",        bit_struct_bytesize,         0);
+  rb_define_method(rb_cBitStruct, "decode",          bit_struct_decode,          -1);
+  rb_define_method(rb_cBitStruct, "decode_values",   bit_struct_decode_values,   -1);
+  rb_define_method(rb_cBitStruct, "encode",          bit_struct_encode,           1);
+  rb_define_method(rb_cBitStruct, "decode_all",      bit_struct_decode_all,       1);
+  rb_define_method(rb_cBitStruct, "encode_all",      bit_struct_encode_all,       1);
+  rb_define_method(rb_cBitStruct, "decode_columns",  bit_struct_decode_columns,   1);
+  rb_define_method(rb_cBitStruct, "encode_columns",  bit_struct_encode_columns,   1);
+}
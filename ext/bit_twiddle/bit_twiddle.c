@@ -1,16 +1,9 @@
 /* Fast C implementation of additional bitwise operations for Ruby
  * Hand-crafted with ♥ by Alex Dowad, using ONLY the finest 1s and 0s */
 
-#include <ruby.h>
+#include "bit_twiddle.h"
 #include "bt_bignum.h"
 
-#ifndef HAVE_TYPE_ULONG
-typedef unsigned long ulong;
-#endif
-#ifndef HAVE_TYPE_UCHAR
-typedef unsigned char uchar;
-#endif
-
 #define fix_zero LONG2FIX(0L)
 #define BIGNUM_P(x) RB_TYPE_P((x), T_BIGNUM)
 
@@ -38,14 +31,6 @@ typedef unsigned char uchar;
 #error "Sorry, Integer#arith_rshift64 will not work if sizeof(long) > 8. Please report this error."
 #endif
 
-#if HAVE_BSWAP16 == 0
-/* stupid bug in GCC 4.7 */
-static inline uint16_t __builtin_bswap16(uint16_t value)
-{
-  return (value >> 8) | (value << 8);
-}
-#endif
-
 static int
 bnum_greater(VALUE bnum, BDIGIT value)
 {
@@ -275,16 +260,7 @@ def_int_method(popcount);
 static VALUE
 str_popcount(VALUE str)
 {
-  uchar *p    = (uchar*)RSTRING_PTR(str);
-  long length = RSTRING_LEN(str);
-  long bits   = 0;
-
-  /* This could be made faster by processing 4/8 bytes at a time */
-
-  while (length--)
-    bits += __builtin_popcount(*p++);
-
-  return LONG2FIX(bits);
+  return SIZET2NUM(bt_popcount_buf(RSTRING_PTR(str), RSTRING_LEN(str)));
 }
 
 static VALUE
@@ -1348,6 +1324,108 @@ bnum_bitreverse64(VALUE bnum)
  */
 def_int_method(bitreverse64);
 
+VALUE
+bt_u128_to_num(uint64_t lo, uint64_t hi)
+{
+  uint64_t words[2];
+
+  if (hi == 0)
+    return ULL2NUM(lo);
+
+  words[0] = lo;
+  words[1] = hi;
+  return rb_integer_unpack(words, 2, sizeof(uint64_t), 0,
+                           INTEGER_PACK_LSWORD_FIRST | INTEGER_PACK_NATIVE_BYTE_ORDER);
+}
+
+void
+bt_num_to_u128(VALUE num, uint64_t *lo, uint64_t *hi)
+{
+  uint64_t words[2];
+  int      sign;
+
+  num  = rb_to_int(num);
+  sign = rb_integer_pack(num, words, 2, sizeof(uint64_t), 0,
+                         INTEGER_PACK_LSWORD_FIRST | INTEGER_PACK_NATIVE_BYTE_ORDER);
+  if (sign < 0)
+    rb_raise(rb_eRangeError, "can't convert a negative number to a 128-bit value");
+  else if (sign > 1)
+    rb_raise(rb_eRangeError, "integer is too big for a 128-bit value");
+
+  *lo = words[0];
+  *hi = words[1];
+}
+
+uint64_t
+bt_num_to_u64(VALUE num)
+{
+  uint64_t lo, hi;
+  bt_num_to_u128(num, &lo, &hi);
+  if (hi)
+    rb_raise(rb_eRangeError, "integer is too big for a 64-bit value");
+  return lo;
+}
+
+/* Return the low 64 bits of a non-negative Integer */
+static uint64_t
+value_to_lo64(VALUE num)
+{
+  for (;;) {
+    if (FIXNUM_P(num)) {
+      long value = FIX2LONG(num);
+      if (value < 0)
+        rb_raise(rb_eRangeError, "can't multiply a negative number");
+      return (uint64_t)value;
+    } else if (BIGNUM_P(num)) {
+      if (RBIGNUM_NEGATIVE_P(num))
+        rb_raise(rb_eRangeError, "can't multiply a negative number");
+      return load_64_from_bignum(num);
+    } else {
+      num = rb_to_int(num);
+    }
+  }
+}
+
+static VALUE
+fnum_clmul64(VALUE fnum, VALUE other)
+{
+  uint64_t lo, hi;
+  long value = FIX2LONG(fnum);
+  if (value < 0)
+    rb_raise(rb_eRangeError, "can't multiply a negative number");
+  clmul64((uint64_t)value, value_to_lo64(other), &lo, &hi);
+  return bt_u128_to_num(lo, hi);
+}
+
+static VALUE
+bnum_clmul64(VALUE bnum, VALUE other)
+{
+  uint64_t lo, hi;
+  if (RBIGNUM_NEGATIVE_P(bnum))
+    rb_raise(rb_eRangeError, "can't multiply a negative number");
+  clmul64(load_64_from_bignum(bnum), value_to_lo64(other), &lo, &hi);
+  return bt_u128_to_num(lo, hi);
+}
+
+/* Document-method: Integer#clmul64
+ * Carry-less multiplication of the low 64 bits of this integer and `other`.
+ *
+ * The operands are treated as polynomials over GF(2) (bit N is the coefficient of
+ * x^N), so partial products are combined with XOR rather than addition. The full
+ * 128-bit product is returned; bits above the low 64 of each operand are ignored.
+ * Uses the PCLMULQDQ instruction if the CPU has it.
+ *
+ * If either number is negative, raise `RangeError`.
+ *
+ * @example
+ *   0b101.clmul64(0b11).to_s(2)   # => "1111"
+ *   (1 << 63).clmul64(1 << 63)    # => 85070591730234615865843651857942052864
+ *
+ * @param other [Integer] The other factor
+ * @return [Integer]
+ */
+def_int_method_with_arg(clmul64);
+
 /* Document-class: Integer
  * Ruby's good old Integer.
  *
@@ -1359,8 +1437,8 @@ def_int_method(bitreverse64);
  * `require "bit-twiddle/core_ext"` before trying to use any of the below methods.
  */
 
-/* Add all `bit-twiddle` methods directly to `Integer`. */
-static void init_core_extensions()
+/* Add all `bit-twiddle` methods directly to `Integer`, `Float` and `String`. */
+static void init_core_extensions(void)
 {
   rb_define_method(rb_cInteger, "popcount", int_popcount, 0);
   rb_define_method(rb_cString, "popcount", str_popcount,  0);
@@ -1401,6 +1479,13 @@ static void init_core_extensions()
   rb_define_method(rb_cInteger, "bitreverse16", int_bitreverse16, 0);
   rb_define_method(rb_cInteger, "bitreverse32", int_bitreverse32, 0);
   rb_define_method(rb_cInteger, "bitreverse64", int_bitreverse64, 0);
+
+  rb_define_method(rb_cInteger, "clmul64", int_clmul64, 1);
+
+  init_varint_core_extensions();
+  init_float_core_extensions();
+  init_string_access_core_extensions();
+  init_string_ops_core_extensions();
 }
 
 static VALUE
@@ -1463,11 +1548,19 @@ def_wrapper(bitreverse8);
 def_wrapper(bitreverse16);
 def_wrapper(bitreverse32);
 def_wrapper(bitreverse64);
+def_wrapper_with_arg(clmul64);
 
 void Init_bit_twiddle(void)
 {
   VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
 
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  /* no method keeps mutable state outside its receiver and arguments; the
+   * lookup tables and keyword IDs are all filled in here, before any Ractor
+   * can start */
+  rb_ext_ractor_safe(1);
+#endif
+
   rb_define_singleton_method(rb_mBitTwiddle, "add_core_extensions", bt_add_core_extensions, 0);
 
   /* Return the number of 1 bits in `int`.
@@ -1876,4 +1969,45 @@ void Init_bit_twiddle(void)
    * @return [Integer]
    */
   rb_define_singleton_method(rb_mBitTwiddle, "bitreverse64", bt_bitreverse64, 1);
+  /* Carry-less multiplication of the low 64 bits of `int` and `other`.
+   *
+   * The operands are treated as polynomials over GF(2), so partial products are
+   * combined with XOR rather than addition. The full 128-bit product is returned.
+   *
+   * @example
+   *   BitTwiddle.clmul64(0b101, 0b11).to_s(2) # => "1111"
+   *
+   * If either number is negative, raise `RangeError`.
+   *
+   * @param int [Integer] The integer to operate on
+   * @param other [Integer] The other factor
+   * @return [Integer]
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "clmul64", bt_clmul64, 2);
+
+  Init_bt_crc();
+  Init_bt_gf2();
+  Init_bt_packed_array();
+  Init_bt_varint();
+  Init_bt_elias_fano();
+  Init_bt_gorilla();
+  Init_bt_float_bits();
+  Init_bt_radix_sort();
+  Init_bt_bit_stream();
+  Init_bt_bit_struct();
+  Init_bt_pipeline();
+  Init_bt_string_match();
+  Init_bt_bit_transpose();
+  Init_bt_byte_shuffle();
+  Init_bt_gf256();
+  Init_bt_bloom_filter();
+  Init_bt_sketch();
+  Init_bt_slot_allocator();
+  Init_bt_radix_heap();
+  Init_bt_atomic_bitset();
+  Init_bt_bit_sliced_index();
+  Init_bt_wavelet_matrix();
+  Init_bt_positional_popcount();
+  Init_bt_string_access();
+  Init_bt_string_ops();
 }
@@ -0,0 +1,351 @@
+/* Declarations shared between the C files which make up bit-twiddle
+ * Everything in here is internal; the public interface is the Ruby methods */
+
+#ifndef BIT_TWIDDLE_H
+#define BIT_TWIDDLE_H
+
+#include <ruby.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __PCLMUL__
+#include <wmmintrin.h>
+#endif
+#if defined(__BMI2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef HAVE_TYPE_ULONG
+typedef unsigned long ulong;
+#endif
+#ifndef HAVE_TYPE_UCHAR
+typedef unsigned char uchar;
+#endif
+
+#if HAVE_BSWAP16 == 0
+/* stupid bug in GCC 4.7 */
+static inline uint16_t __builtin_bswap16(uint16_t value)
+{
+  return (value >> 8) | (value << 8);
+}
+#endif
+
+/* Unaligned loads and stores of fixed-endianness integers
+ * GCC and Clang compile the memcpy down to a single mov (plus bswap if needed) */
+static inline uint16_t load_le16(const uchar *p)
+{
+  uint16_t v;
+  memcpy(&v, p, 2);
+#ifdef WORDS_BIGENDIAN
+  v = __builtin_bswap16(v);
+#endif
+  return v;
+}
+
+static inline uint16_t load_be16(const uchar *p)
+{
+  uint16_t v;
+  memcpy(&v, p, 2);
+#ifndef WORDS_BIGENDIAN
+  v = __builtin_bswap16(v);
+#endif
+  return v;
+}
+
+static inline uint32_t load_le32(const uchar *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+#ifdef WORDS_BIGENDIAN
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+static inline uint64_t load_le64(const uchar *p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+#ifdef WORDS_BIGENDIAN
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static inline uint32_t load_be32(const uchar *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+#ifndef WORDS_BIGENDIAN
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+static inline uint64_t load_be64(const uchar *p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+#ifndef WORDS_BIGENDIAN
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static inline void store_le16(uchar *p, uint16_t v)
+{
+#ifdef WORDS_BIGENDIAN
+  v = __builtin_bswap16(v);
+#endif
+  memcpy(p, &v, 2);
+}
+
+static inline void store_be16(uchar *p, uint16_t v)
+{
+#ifndef WORDS_BIGENDIAN
+  v = __builtin_bswap16(v);
+#endif
+  memcpy(p, &v, 2);
+}
+
+static inline void store_le32(uchar *p, uint32_t v)
+{
+#ifdef WORDS_BIGENDIAN
+  v = __builtin_bswap32(v);
+#endif
+  memcpy(p, &v, 4);
+}
+
+static inline void store_be32(uchar *p, uint32_t v)
+{
+#ifndef WORDS_BIGENDIAN
+  v = __builtin_bswap32(v);
+#endif
+  memcpy(p, &v, 4);
+}
+
+static inline void store_le64(uchar *p, uint64_t v)
+{
+#ifdef WORDS_BIGENDIAN
+  v = __builtin_bswap64(v);
+#endif
+  memcpy(p, &v, 8);
+}
+
+static inline void store_be64(uchar *p, uint64_t v)
+{
+#ifndef WORDS_BIGENDIAN
+  v = __builtin_bswap64(v);
+#endif
+  memcpy(p, &v, 8);
+}
+
+/* Carry-less multiplication: multiply a and b as polynomials over GF(2)
+ * The 128-bit product is returned in *lo and *hi */
+static inline void clmul64(uint64_t a, uint64_t b, uint64_t *lo, uint64_t *hi)
+{
+#ifdef __PCLMUL__
+  uint64_t result[2];
+  __m128i  product = _mm_clmulepi64_si128(_mm_set_epi64x(0, (long long)a),
+                                          _mm_set_epi64x(0, (long long)b), 0x00);
+  _mm_storeu_si128((__m128i*)result, product);
+  *lo = result[0];
+  *hi = result[1];
+#else
+  /* 4 bits at a time: table[j] holds the product of a with j */
+  uint64_t tlo[16], thi[16], rlo = 0, rhi = 0;
+  int i;
+
+  tlo[0] = thi[0] = 0;
+  tlo[1] = a; thi[1] = 0;
+  for (i = 2; i < 16; i += 2) {
+    tlo[i]   = tlo[i/2] << 1;
+    thi[i]   = (thi[i/2] << 1) | (tlo[i/2] >> 63);
+    tlo[i+1] = tlo[i] ^ a;
+    thi[i+1] = thi[i];
+  }
+  for (i = 60; i >= 0; i -= 4) {
+    uint64_t nibble = (b >> i) & 0xF;
+    rhi = (rhi << 4) | (rlo >> 60);
+    rlo = (rlo << 4) ^ tlo[nibble];
+    rhi ^= thi[nibble];
+  }
+  *lo = rlo;
+  *hi = rhi;
+#endif
+}
+
+/* Count the 1 bits in a buffer
+ * With AVX2, each nibble is looked up in a 16-entry table with pshufb and the
+ * byte counts are summed with psadbw; with SSE2 but no popcnt instruction, the
+ * same is done with shifts and masks. Otherwise, 8 bytes at a time. */
+static inline size_t bt_popcount_buf(const void *buf, size_t len)
+{
+  const uchar *p = buf;
+  size_t a = 0, b = 0, c = 0, d = 0;
+
+#if defined(__AVX2__)
+  if (len >= 256) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    __m256i acc = _mm256_setzero_si256();
+    while (len >= 256) {
+      /* byte counts reach at most 8 * 8, so they can't overflow */
+      __m256i sum = _mm256_setzero_si256();
+      int i;
+      for (i = 0; i < 8; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + 32*i));
+        sum = _mm256_add_epi8(sum, _mm256_add_epi8(
+          _mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+          _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low))));
+      }
+      acc = _mm256_add_epi64(acc, _mm256_sad_epu8(sum, _mm256_setzero_si256()));
+      p += 256; len -= 256;
+    }
+    {
+      uint64_t lanes[4];
+      _mm256_storeu_si256((__m256i*)lanes, acc);
+      a = lanes[0] + lanes[1];
+      b = lanes[2] + lanes[3];
+    }
+  }
+#elif defined(__SSE2__) && !defined(__POPCNT__)
+  if (len >= 16) {
+    const __m128i m1 = _mm_set1_epi8(0x55), m2 = _mm_set1_epi8(0x33), m4 = _mm_set1_epi8(0x0F);
+    __m128i acc = _mm_setzero_si128();
+    while (len >= 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)p);
+      v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi16(v, 1), m1));
+      v = _mm_add_epi8(_mm_and_si128(v, m2), _mm_and_si128(_mm_srli_epi16(v, 2), m2));
+      v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi16(v, 4)), m4);
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(v, _mm_setzero_si128()));
+      p += 16; len -= 16;
+    }
+    {
+      uint64_t lanes[2];
+      _mm_storeu_si128((__m128i*)lanes, acc);
+      a = lanes[0] + lanes[1];
+    }
+  }
+#endif
+  while (len >= 32) {
+    a += __builtin_popcountll(load_le64(p));
+    b += __builtin_popcountll(load_le64(p + 8));
+    c += __builtin_popcountll(load_le64(p + 16));
+    d += __builtin_popcountll(load_le64(p + 24));
+    p += 32; len -= 32;
+  }
+  while (len >= 8) {
+    a += __builtin_popcountll(load_le64(p));
+    p += 8; len -= 8;
+  }
+  while (len--)
+    a += __builtin_popcount(*p++);
+
+  return a + b + c + d;
+}
+
+/* Position of the k-th 1 bit (counting from 0) in w, which must have more than k
+ * 1 bits; with BMI2, pdep deposits a single bit at exactly that position */
+static inline int bt_select64(uint64_t w, int k)
+{
+#ifdef __BMI2__
+  return __builtin_ctzll(_pdep_u64(1ULL << k, w));
+#else
+  /* find the byte using per-byte prefix popcounts, then finish within the byte */
+  const uint64_t L8 = 0x0101010101010101ULL, H8 = 0x8080808080808080ULL;
+  uint64_t s = w - ((w >> 1) & 0x5555555555555555ULL);
+  int place, i;
+  s = (s & 0x3333333333333333ULL) + ((s >> 2) & 0x3333333333333333ULL);
+  s = ((s + (s >> 4)) & 0x0F0F0F0F0F0F0F0FULL) * L8;
+  place = __builtin_popcountll((((uint64_t)k * L8 | H8) - s) & H8) * 8;
+  k -= ((s << 8) >> place) & 0xFF;
+  w >>= place;
+  for (i = 0; i < k; i++)
+    w &= w - 1;
+  return place + __builtin_ctzll(w);
+#endif
+}
+
+/* Conversion between Ruby Integers and 64/128-bit values (defined in bit_twiddle.c)
+ * Negative numbers, or numbers which don't fit, raise RangeError */
+VALUE bt_u128_to_num(uint64_t lo, uint64_t hi);
+void  bt_num_to_u128(VALUE num, uint64_t *lo, uint64_t *hi);
+uint64_t bt_num_to_u64(VALUE num);
+
+/* The polynomial hash of BitTwiddle.polyhash64, starting from 'h' and evaluated
+ * at 'k' (defined in gf2.c) */
+uint64_t bt_polyhash(uint64_t h, uint64_t k, const uchar *p, size_t len);
+
+/* Hashing for the probabilistic data structures: Strings go through polyhash64
+ * at a fixed point, which makes collisions very unlikely, and then through the
+ * MurmurHash3 finalizer, so every output bit depends on every input bit.
+ * Integers (which must fit in 64 bits) only need the finalizer, which is a
+ * bijection. bt_hash_value is defined in gf2.c */
+#define BT_HASH_POINT 0x9E3779B97F4A7C15ULL
+
+static inline uint64_t bt_fmix64(uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCDULL;
+  x ^= x >> 33;
+  x *= 0xC4CEB9FE1A85EC53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+uint64_t bt_hash_value(VALUE key, uint64_t seed);
+
+/* Split n elements of 'size' bytes into 'size' planes of n bytes, and back
+ * (defined in byte_shuffle.c); 'in' and 'out' must not overlap */
+void bt_byte_split(const uchar *in, uchar *out, size_t n, size_t size);
+void bt_byte_join(const uchar *in, uchar *out, size_t n, size_t size);
+
+/* Transpose a 64x64 bit matrix in place, with row i in m[i] and column j in
+ * bit j (defined in bit_transpose.c) */
+void bt_bit_transpose64(uint64_t *m);
+
+/* dst = dst OP src over n bytes (defined in string_ops.c) */
+enum bt_bitop { BT_XOR, BT_AND, BT_OR, BT_ANDNOT };
+void bt_bitop_buf(uchar *dst, const uchar *src, size_t n, enum bt_bitop op);
+
+/* Each of these defines the methods for one group of functionality
+ * They are called from Init_bit_twiddle */
+void Init_bt_crc(void);
+void Init_bt_gf2(void);
+void Init_bt_packed_array(void);
+void Init_bt_varint(void);
+void Init_bt_elias_fano(void);
+void Init_bt_gorilla(void);
+void Init_bt_float_bits(void);
+void Init_bt_radix_sort(void);
+void Init_bt_bit_stream(void);
+void Init_bt_bit_struct(void);
+void Init_bt_pipeline(void);
+void Init_bt_string_match(void);
+void Init_bt_bit_transpose(void);
+void Init_bt_byte_shuffle(void);
+void Init_bt_gf256(void);
+void Init_bt_bloom_filter(void);
+void Init_bt_sketch(void);
+void Init_bt_slot_allocator(void);
+void Init_bt_radix_heap(void);
+void Init_bt_atomic_bitset(void);
+void Init_bt_bit_sliced_index(void);
+void Init_bt_wavelet_matrix(void);
+void Init_bt_positional_popcount(void);
+void Init_bt_string_access(void);
+void Init_bt_string_ops(void);
+
+/* Methods which other files add to Integer, Float and String, when core
+ * extensions are requested */
+void init_varint_core_extensions(void);
+void init_float_core_extensions(void);
+void init_string_access_core_extensions(void);
+void init_string_ops_core_extensions(void);
+
+#endif
@@ -0,0 +1,543 @@
+/* BitTwiddle::BloomFilter: a split block Bloom filter
+ *
+ * The filter is an array of 256-bit blocks, each made of eight 32-bit words,
+ * with blocks aligned so that none straddles a cache line. The high 32 bits of
+ * a key's hash pick a block; the low 32 bits are multiplied by 8 different odd
+ * constants, and the top 5 bits of each product pick one bit to set in each of
+ * the 8 words. So adding or checking a key touches one cache line, and with
+ * AVX2 it is a handful of vector instructions.
+ *
+ * This is the layout used by Apache Parquet and Impala; the hash is not the
+ * same as theirs (see bt_hash_value), so the bits are not interchangeable. */
+
+#include "bit_twiddle.h"
+#include <math.h>
+
+#define BLOCK_WORDS   8
+#define BLOCK_BYTES   32
+#define HEADER_BYTES  32
+#define BATCH         16
+
+static const char bloom_magic[8] = { 'B', 'T', 'B', 'L', 'O', 'O', 'M', 1 };
+
+static const uint32_t salts[BLOCK_WORDS] = {
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+typedef struct {
+  uint32_t *blocks;   /* aligned to 64 bytes, within 'raw' */
+  void     *raw;
+  size_t    nblocks;  /* 0 until initialized */
+  uint64_t  count;    /* number of keys added */
+} bloom_filter;
+
+static inline uint32_t*
+block_for(const bloom_filter *bf, uint64_t h)
+{
+  return bf->blocks + ((h >> 32) * bf->nblocks >> 32) * BLOCK_WORDS;
+}
+
+static inline void
+block_add(uint32_t *block, uint32_t x)
+{
+#ifdef __AVX2__
+  __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(x),
+                   _mm256_loadu_si256((const __m256i*)salts)), 27);
+  __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+  _mm256_store_si256((__m256i*)block, _mm256_or_si256(_mm256_load_si256((const __m256i*)block), mask));
+#else
+  int i;
+  for (i = 0; i < BLOCK_WORDS; i++)
+    block[i] |= 1U << ((x * salts[i]) >> 27);
+#endif
+}
+
+static inline int
+block_check(const uint32_t *block, uint32_t x)
+{
+#ifdef __AVX2__
+  __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(x),
+                   _mm256_loadu_si256((const __m256i*)salts)), 27);
+  __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+  return _mm256_testc_si256(_mm256_load_si256((const __m256i*)block), mask);
+#else
+  int i;
+  for (i = 0; i < BLOCK_WORDS; i++)
+    if (!(block[i] & (1U << ((x * salts[i]) >> 27))))
+      return 0;
+  return 1;
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void
+bloom_free(void *ptr)
+{
+  bloom_filter *bf = ptr;
+  xfree(bf->raw);
+  xfree(bf);
+}
+
+static size_t
+bloom_memsize(const void *ptr)
+{
+  const bloom_filter *bf = ptr;
+  return sizeof(bloom_filter) + (bf->raw ? bf->nblocks * BLOCK_BYTES + 63 : 0);
+}
+
+static const rb_data_type_t bloom_type = {
+  "BitTwiddle::BloomFilter",
+  { 0, bloom_free, bloom_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+bloom_alloc(VALUE klass)
+{
+  bloom_filter *bf;
+  return TypedData_Make_Struct(klass, bloom_filter, &bloom_type, bf);
+}
+
+static bloom_filter*
+get_bloom(VALUE self)
+{
+  bloom_filter *bf;
+  TypedData_Get_Struct(self, bloom_filter, &bloom_type, bf);
+  if (bf->nblocks == 0)
+    rb_raise(rb_eRuntimeError, "uninitialized BloomFilter");
+  return bf;
+}
+
+/* Allocate zeroed, cache line aligned blocks for an uninitialized filter */
+static void
+bloom_allocate(bloom_filter *bf, size_t nblocks)
+{
+  xfree(bf->raw); /* from an earlier call which raised an exception */
+  bf->raw     = ruby_xcalloc(nblocks * BLOCK_BYTES + 63, 1);
+  bf->blocks  = (uint32_t*)(((uintptr_t)bf->raw + 63) & ~(uintptr_t)63);
+  bf->nblocks = nblocks;
+  bf->count   = 0;
+}
+
+/* The false positive rate when there are 'load' keys per block on average
+ * The number of keys in a block is Poisson distributed; a block with k keys has
+ * each bit of each word set with probability 1 - (31/32)^k. (The usual formula,
+ * which treats the filter as one big set of bits, is optimistic by about 1.5x
+ * at 1% and 2x at 0.1%, since some blocks get many more keys than others) */
+static double
+false_positive_rate(double load)
+{
+  double pk = exp(-load), empty = 1, fpp = 0;
+  int k;
+
+  for (k = 0; k < load + 12 * sqrt(load) + 32; k++) {
+    fpp   += pk * pow(1 - empty, BLOCK_WORDS);
+    pk    *= load / (k + 1);
+    empty *= 31.0 / 32;
+  }
+  return fpp;
+}
+
+/* The highest average number of keys per block which keeps the false positive
+ * rate under 'p' */
+static double
+keys_per_block(double p)
+{
+  double lo = 0, hi = 256;
+  int i;
+
+  for (i = 0; i < 40; i++) {
+    double mid = (lo + hi) / 2;
+    if (false_positive_rate(mid) <= p)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Document-method: BitTwiddle::BloomFilter#initialize
+ * Create an empty filter, sized so that after `capacity` keys have been added,
+ * the chance that `include?` returns `true` for a key which was never added is
+ * about `false_positive_rate`.
+ *
+ * @param capacity [Integer] Expected number of keys
+ * @param false_positive_rate [Float] Between 0 and 1 (default 0.01)
+ */
+static VALUE
+bloom_initialize(int argc, VALUE *argv, VALUE self)
+{
+  bloom_filter *bf;
+  VALUE  capacity, rate;
+  double n, p, blocks;
+
+  rb_scan_args(argc, argv, "11", &capacity, &rate);
+  TypedData_Get_Struct(self, bloom_filter, &bloom_type, bf);
+  if (bf->nblocks)
+    rb_raise(rb_eRuntimeError, "BloomFilter is already initialized");
+
+  n = NUM2DBL(capacity);
+  p = NIL_P(rate) ? 0.01 : NUM2DBL(rate);
+  if (!(n >= 0))
+    rb_raise(rb_eArgError, "capacity must not be negative");
+  if (!(p > 0 && p < 1))
+    rb_raise(rb_eArgError, "false positive rate must be between 0 and 1");
+
+  blocks = ceil(n / keys_per_block(p));
+  if (blocks > (double)(1ULL << 32))
+    rb_raise(rb_eArgError, "BloomFilter would be too large");
+  bloom_allocate(bf, blocks < 1 ? 1 : (size_t)blocks);
+  return self;
+}
+
+/* Document-method: BitTwiddle::BloomFilter#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+bloom_initialize_copy(VALUE self, VALUE orig)
+{
+  bloom_filter *dst, *src = get_bloom(orig);
+
+  TypedData_Get_Struct(self, bloom_filter, &bloom_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->nblocks)
+    rb_raise(rb_eRuntimeError, "BloomFilter is already initialized");
+  bloom_allocate(dst, src->nblocks);
+  memcpy(dst->blocks, src->blocks, src->nblocks * BLOCK_BYTES);
+  dst->count = src->count;
+  return self;
+}
+
+/* Document-method: BitTwiddle::BloomFilter.load
+ * Recreate a filter from the String returned by `BloomFilter#to_s`.
+ *
+ * @param str [String]
+ * @return [BloomFilter]
+ */
+static VALUE
+bloom_s_load(VALUE klass, VALUE str)
+{
+  VALUE obj = bloom_alloc(klass);
+  bloom_filter *bf;
+  const uchar *p;
+  uint64_t nblocks;
+  size_t i;
+
+  StringValue(str);
+  p = (const uchar*)RSTRING_PTR(str);
+  if (RSTRING_LEN(str) < HEADER_BYTES || memcmp(p, bloom_magic, 8))
+    rb_raise(rb_eArgError, "not a serialized BloomFilter");
+  nblocks = load_le64(p + 8);
+  if (nblocks == 0 || nblocks > (1ULL << 32) || (uint64_t)RSTRING_LEN(str) != HEADER_BYTES + nblocks * BLOCK_BYTES)
+    rb_raise(rb_eArgError, "serialized BloomFilter has the wrong length");
+
+  TypedData_Get_Struct(obj, bloom_filter, &bloom_type, bf);
+  bloom_allocate(bf, nblocks);
+  bf->count = load_le64(p + 16);
+  p += HEADER_BYTES;
+  for (i = 0; i < nblocks * BLOCK_WORDS; i++)
+    bf->blocks[i] = load_le32(p + 4*i);
+  RB_GC_GUARD(str);
+  return obj;
+}
+
+/* Document-method: BitTwiddle::BloomFilter#to_s
+ * Serialize the filter as a String: a 32-byte header (an 8-byte magic number,
+ * then the number of blocks and the number of keys added, as little-endian
+ * 64-bit integers, then 8 zero bytes) followed by the blocks, as little-endian
+ * 32-bit words. The blocks are at the same offsets in the String as in memory,
+ * relative to a 32-byte boundary.
+ *
+ * @return [String]
+ */
+static VALUE
+bloom_to_s(VALUE self)
+{
+  bloom_filter *bf = get_bloom(self);
+  VALUE  str = rb_str_new(NULL, HEADER_BYTES + bf->nblocks * BLOCK_BYTES);
+  uchar *p   = (uchar*)RSTRING_PTR(str);
+  size_t i;
+
+  memcpy(p, bloom_magic, 8);
+  store_le64(p + 8, bf->nblocks);
+  store_le64(p + 16, bf->count);
+  store_le64(p + 24, 0);
+  p += HEADER_BYTES;
+  for (i = 0; i < bf->nblocks * BLOCK_WORDS; i++)
+    store_le32(p + 4*i, bf->blocks[i]);
+  return str;
+}
+
+/* Document-method: BitTwiddle::BloomFilter#add
+ * Add a key to the filter.
+ *
+ * @param key [String, Integer] Integers must fit in 64 bits (signed or unsigned)
+ * @return [BloomFilter] `self`
+ */
+static VALUE
+bloom_add(VALUE self, VALUE key)
+{
+  bloom_filter *bf = get_bloom(self);
+  uint64_t h;
+
+  rb_check_frozen(self);
+  h = bt_hash_value(key, 0);
+  block_add(block_for(bf, h), (uint32_t)h);
+  bf->count++;
+  return self;
+}
+
+/* Document-method: BitTwiddle::BloomFilter#include?
+ * Check whether a key may have been added to the filter. `false` means it
+ * certainly was not; `true` means it probably was.
+ *
+ * @param key [String, Integer]
+ * @return [Boolean]
+ */
+static VALUE
+bloom_include_p(VALUE self, VALUE key)
+{
+  bloom_filter *bf = get_bloom(self);
+  uint64_t h = bt_hash_value(key, 0);
+  return block_check(block_for(bf, h), (uint32_t)h) ? Qtrue : Qfalse;
+}
+
+/* Hash the first 'len' keys (or as many as are left) into 'hashes', and return
+ * how many there were. This is done before the filter is touched, so a key
+ * which can't be hashed raises before any are added, and a #to_str method which
+ * shrinks the Array can't make us read past its end */
+static long
+hash_keys(VALUE keys, long len, uint64_t *hashes)
+{
+  long i;
+  for (i = 0; i < len && i < RARRAY_LEN(keys); i++)
+    hashes[i] = bt_hash_value(RARRAY_AREF(keys, i), 0);
+  return i;
+}
+
+/* Prefetch the block for key i + BATCH, so the cache misses for BATCH keys
+ * overlap */
+static inline void
+prefetch_ahead(const bloom_filter *bf, const uint64_t *hashes, long i, long n)
+{
+  if (i + BATCH < n)
+    __builtin_prefetch(block_for(bf, hashes[i + BATCH]));
+}
+
+static void
+prefetch_first(const bloom_filter *bf, const uint64_t *hashes, long n)
+{
+  long i;
+  for (i = 0; i < BATCH && i < n; i++)
+    __builtin_prefetch(block_for(bf, hashes[i]));
+}
+
+/* Document-method: BitTwiddle::BloomFilter#add_all
+ * Add each of `keys` to the filter. This is faster than calling `add` for each
+ * one, since memory accesses for several keys are overlapped.
+ *
+ * @param keys [Array<String, Integer>]
+ * @return [BloomFilter] `self`
+ */
+static VALUE
+bloom_add_all(VALUE self, VALUE keys)
+{
+  bloom_filter *bf = get_bloom(self);
+  uint64_t *hashes;
+  long n, i;
+  VALUE tmp;
+
+  rb_check_frozen(self);
+  keys = rb_Array(keys);
+  hashes = ALLOCV_N(uint64_t, tmp, RARRAY_LEN(keys) + 1);
+  n = hash_keys(keys, RARRAY_LEN(keys), hashes);
+  prefetch_first(bf, hashes, n);
+  for (i = 0; i < n; i++) {
+    prefetch_ahead(bf, hashes, i, n);
+    block_add(block_for(bf, hashes[i]), (uint32_t)hashes[i]);
+  }
+  bf->count += n;
+  ALLOCV_END(tmp);
+  return self;
+}
+
+/* Document-method: BitTwiddle::BloomFilter#include_all
+ * Check each of `keys`, as by `include?`.
+ *
+ * @example
+ *   bf = BitTwiddle::BloomFilter.new(1000)
+ *   bf.add_all(["a", "b"])
+ *   bf.include_all(["a", "b", "c"]) # => [true, true, false] (almost certainly)
+ *
+ * @param keys [Array<String, Integer>]
+ * @return [Array<Boolean>]
+ */
+static VALUE
+bloom_include_all(VALUE self, VALUE keys)
+{
+  bloom_filter *bf = get_bloom(self);
+  uint64_t *hashes;
+  long n, i;
+  VALUE result, tmp;
+
+  keys = rb_Array(keys);
+  hashes = ALLOCV_N(uint64_t, tmp, RARRAY_LEN(keys) + 1);
+  n = hash_keys(keys, RARRAY_LEN(keys), hashes);
+  result = rb_ary_new_capa(n);
+  prefetch_first(bf, hashes, n);
+  for (i = 0; i < n; i++) {
+    prefetch_ahead(bf, hashes, i, n);
+    rb_ary_push(result, block_check(block_for(bf, hashes[i]), (uint32_t)hashes[i]) ? Qtrue : Qfalse);
+  }
+  ALLOCV_END(tmp);
+  return result;
+}
+
+static bloom_filter*
+get_compatible(bloom_filter *bf, VALUE other)
+{
+  bloom_filter *of = get_bloom(other);
+  if (bf->nblocks != of->nblocks)
+    rb_raise(rb_eArgError, "BloomFilters must be the same size (%"PRIuSIZE" and %"PRIuSIZE" bytes)",
+             bf->nblocks * BLOCK_BYTES, of->nblocks * BLOCK_BYTES);
+  return of;
+}
+
+/* Document-method: BitTwiddle::BloomFilter#merge!
+ * Add all the keys of `other` (which must be the same size) to this filter, by
+ * ORing its bits into this one.
+ *
+ * @param other [BloomFilter]
+ * @return [BloomFilter] `self`
+ */
+static VALUE
+bloom_merge_bang(VALUE self, VALUE other)
+{
+  bloom_filter *bf = get_bloom(self), *of = get_compatible(bf, other);
+  rb_check_frozen(self);
+  bt_bitop_buf((uchar*)bf->blocks, (const uchar*)of->blocks, bf->nblocks * BLOCK_BYTES, BT_OR);
+  bf->count += of->count;
+  return self;
+}
+
+static VALUE
+bloom_combine(VALUE self, VALUE other, enum bt_bitop op)
+{
+  bloom_filter *bf = get_bloom(self), *of = get_compatible(bf, other), *rf;
+  VALUE result = rb_obj_dup(self);
+
+  rf = get_bloom(result);
+  bt_bitop_buf((uchar*)rf->blocks, (const uchar*)of->blocks, bf->nblocks * BLOCK_BYTES, op);
+  rf->count = (op == BT_OR) ? bf->count + of->count : (bf->count < of->count ? bf->count : of->count);
+  return result;
+}
+
+/* Document-method: BitTwiddle::BloomFilter#|
+ * A new filter which contains the keys of both filters (which must be the same
+ * size). It is exactly the filter which would result from adding all the keys
+ * to one.
+ *
+ * @param other [BloomFilter]
+ * @return [BloomFilter]
+ */
+static VALUE
+bloom_union(VALUE self, VALUE other)
+{
+  return bloom_combine(self, other, BT_OR);
+}
+
+/* Document-method: BitTwiddle::BloomFilter#&
+ * A new filter which contains the keys which are in both filters (which must be
+ * the same size). Its false positive rate may be higher than that of a filter
+ * built from just those keys.
+ *
+ * @param other [BloomFilter]
+ * @return [BloomFilter]
+ */
+static VALUE
+bloom_intersection(VALUE self, VALUE other)
+{
+  return bloom_combine(self, other, BT_AND);
+}
+
+/* Document-method: BitTwiddle::BloomFilter#clear
+ * Remove all keys.
+ *
+ * @return [BloomFilter] `self`
+ */
+static VALUE
+bloom_clear(VALUE self)
+{
+  bloom_filter *bf = get_bloom(self);
+  rb_check_frozen(self);
+  memset(bf->blocks, 0, bf->nblocks * BLOCK_BYTES);
+  bf->count = 0;
+  return self;
+}
+
+/* Document-method: BitTwiddle::BloomFilter#count
+ * The number of keys added (including any added more than once).
+ *
+ * @return [Integer]
+ */
+static VALUE
+bloom_count(VALUE self)
+{
+  return ULL2NUM(get_bloom(self)->count);
+}
+
+/* Document-method: BitTwiddle::BloomFilter#bit_size
+ * @return [Integer] The number of bits in the filter
+ */
+static VALUE
+bloom_bit_size(VALUE self)
+{
+  return SIZET2NUM(get_bloom(self)->nblocks * BLOCK_BYTES * 8);
+}
+
+/* Document-method: BitTwiddle::BloomFilter#fill_ratio
+ * The fraction of bits which are set. The chance of a false positive is about
+ * this to the 8th power.
+ *
+ * @return [Float]
+ */
+static VALUE
+bloom_fill_ratio(VALUE self)
+{
+  bloom_filter *bf = get_bloom(self);
+  size_t bytes = bf->nblocks * BLOCK_BYTES;
+  return DBL2NUM((double)bt_popcount_buf(bf->blocks, bytes) / (bytes * 8));
+}
+
+void Init_bt_bloom_filter(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::BloomFilter
+   * A set of Strings and Integers which can tell for certain that a key is not
+   * present, but may wrongly say that one is, with a chosen probability. It uses
+   * about 10 bits per key for a 1% false positive rate.
+   */
+  VALUE rb_cBloomFilter = rb_define_class_under(rb_mBitTwiddle, "BloomFilter", rb_cObject);
+
+  rb_define_alloc_func(rb_cBloomFilter, bloom_alloc);
+  rb_define_singleton_method(rb_cBloomFilter, "load", bloom_s_load, 1);
+  rb_define_method(rb_cBloomFilter, "initialize",      bloom_initialize,     -1);
+  rb_define_method(rb_cBloomFilter, "initialize_copy", bloom_initialize_copy, 1);
+  rb_define_method(rb_cBloomFilter, "add",             bloom_add,             1);
+  rb_define_method(rb_cBloomFilter, "<<",              bloom_add,             1);
+  rb_define_method(rb_cBloomFilter, "include?",        bloom_include_p,       1);
+  rb_define_method(rb_cBloomFilter, "add_all",         bloom_add_all,         1);
+  rb_define_method(rb_cBloomFilter, "include_all",     bloom_include_all,     1);
+  rb_define_method(rb_cBloomFilter, "merge!",          bloom_merge_bang,      1);
+  rb_define_method(rb_cBloomFilter, "|",               bloom_union,           1);
+  rb_define_method(rb_cBloomFilter, "&",               bloom_intersection,    1);
+  rb_define_method(rb_cBloomFilter, "clear",           bloom_clear,           0);
+  rb_define_method(rb_cBloomFilter, "count",           bloom_count,           0);
+  rb_define_method(rb_cBloomFilter, "bit_size",        bloom_bit_size,        0);
+  rb_define_method(rb_cBloomFilter, "fill_ratio",      bloom_fill_ratio,      0);
+  rb_define_method(rb_cBloomFilter, "to_s",            bloom_to_s,            0);
+}
@@ -0,0 +1,255 @@
+/* Byte shuffling: splitting an array of fixed-size elements into byte planes
+ * (byte 0 of every element, then byte 1 of every element, and so on), as done
+ * by the Blosc and HDF5 "shuffle" filters before compression
+ *
+ * For element sizes 2, 4, 8 and 16, SSE2 does 16 elements at a time. Take the
+ * 16*size bytes as one array; interleaving the bytes of its two halves with
+ * unpacklo/unpackhi rotates the bits of each byte's index left by 1. An index
+ * is (element << log2(size)) | byte, so 4 rounds turn it into
+ * (byte << 4) | element, which is the planar layout. Going back needs log2(size)
+ * rounds. */
+
+#include "bit_twiddle.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Interleave the first half of v[0..size-1] with the second half */
+static inline __attribute__((always_inline)) void
+riffle(__m128i *v, int size)
+{
+  __m128i t[16];
+  int h = size / 2, i;
+  for (i = 0; i < h; i++) {
+    t[2*i]     = _mm_unpacklo_epi8(v[i], v[i + h]);
+    t[2*i + 1] = _mm_unpackhi_epi8(v[i], v[i + h]);
+  }
+  for (i = 0; i < size; i++)
+    v[i] = t[i];
+}
+
+static inline __attribute__((always_inline)) size_t
+split_sse2(const uchar *in, uchar *out, size_t n, int size)
+{
+  __m128i v[16];
+  size_t  e;
+  int     k, r;
+
+  for (e = 0; e + 16 <= n; e += 16) {
+    for (k = 0; k < size; k++)
+      v[k] = _mm_loadu_si128((const __m128i*)(in + e*size + 16*k));
+    for (r = 0; r < 4; r++)
+      riffle(v, size);
+    for (k = 0; k < size; k++)
+      _mm_storeu_si128((__m128i*)(out + k*n + e), v[k]);
+  }
+  return e;
+}
+
+static inline __attribute__((always_inline)) size_t
+join_sse2(const uchar *in, uchar *out, size_t n, int size, int rounds)
+{
+  __m128i v[16];
+  size_t  e;
+  int     k, r;
+
+  for (e = 0; e + 16 <= n; e += 16) {
+    for (k = 0; k < size; k++)
+      v[k] = _mm_loadu_si128((const __m128i*)(in + k*n + e));
+    for (r = 0; r < rounds; r++)
+      riffle(v, size);
+    for (k = 0; k < size; k++)
+      _mm_storeu_si128((__m128i*)(out + e*size + 16*k), v[k]);
+  }
+  return e;
+}
+#endif
+
+/* Split n elements of 'size' bytes from 'in' into 'size' planes of n bytes in
+ * 'out', which must not overlap 'in' */
+void
+bt_byte_split(const uchar *in, uchar *out, size_t n, size_t size)
+{
+  size_t i = 0, k;
+
+#ifdef __SSE2__
+  switch (size) {
+  case 2:  i = split_sse2(in, out, n, 2);  break;
+  case 4:  i = split_sse2(in, out, n, 4);  break;
+  case 8:  i = split_sse2(in, out, n, 8);  break;
+  case 16: i = split_sse2(in, out, n, 16); break;
+  }
+#endif
+  for (; i < n; i++)
+    for (k = 0; k < size; k++)
+      out[k*n + i] = in[i*size + k];
+}
+
+/* The reverse of bt_byte_split */
+void
+bt_byte_join(const uchar *in, uchar *out, size_t n, size_t size)
+{
+  size_t i = 0, k;
+
+#ifdef __SSE2__
+  switch (size) {
+  case 2:  i = join_sse2(in, out, n, 2, 1);  break;
+  case 4:  i = join_sse2(in, out, n, 4, 2);  break;
+  case 8:  i = join_sse2(in, out, n, 8, 3);  break;
+  case 16: i = join_sse2(in, out, n, 16, 4); break;
+  }
+#endif
+  for (; i < n; i++)
+    for (k = 0; k < size; k++)
+      out[i*size + k] = in[k*n + i];
+}
+
+static size_t
+check_elem_size(VALUE buffer, VALUE elem_size)
+{
+  long s = NUM2LONG(elem_size);
+  if (s < 1)
+    rb_raise(rb_eArgError, "element size must be positive (not %ld)", s);
+  if (RSTRING_LEN(buffer) % s)
+    rb_raise(rb_eArgError, "buffer length must be a multiple of %ld bytes", s);
+  return s;
+}
+
+/* The into: keyword, interned in Init_bt_byte_shuffle */
+static ID kw_id;
+
+/* Parse (buffer, elem_size, into: nil) and return the String to write to */
+static VALUE
+shuffle_args(int argc, VALUE *argv, VALUE *buffer, size_t *size)
+{
+  VALUE elem_size, opts, into = Qundef;
+
+  rb_scan_args(argc, argv, "2:", buffer, &elem_size, &opts);
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, &kw_id, 0, 1, &into);
+
+  StringValue(*buffer);
+  *size = check_elem_size(*buffer, elem_size);
+
+  if (into == Qundef || NIL_P(into))
+    return rb_str_new(NULL, RSTRING_LEN(*buffer));
+  StringValue(into);
+  rb_str_modify(into);
+  rb_str_resize(into, RSTRING_LEN(*buffer));
+  return into;
+}
+
+/* Run 'fn' from 'buffer' to 'dest', going through a temporary copy if they are
+ * the same String */
+static void
+shuffle_into(VALUE buffer, VALUE dest, size_t size, void (*fn)(const uchar*, uchar*, size_t, size_t))
+{
+  size_t len = RSTRING_LEN(buffer);
+  VALUE  tmp;
+  uchar *copy;
+
+  if (len == 0)
+    return;
+  if (RSTRING_PTR(buffer) != RSTRING_PTR(dest)) {
+    fn((const uchar*)RSTRING_PTR(buffer), (uchar*)RSTRING_PTR(dest), len / size, size);
+    return;
+  }
+  copy = ALLOCV_N(uchar, tmp, len);
+  memcpy(copy, RSTRING_PTR(buffer), len);
+  fn(copy, (uchar*)RSTRING_PTR(dest), len / size, size);
+  ALLOCV_END(tmp);
+}
+
+/* Split a buffer of fixed-size elements into byte planes: byte 0 of every
+ * element, then byte 1 of every element, and so on. This is the transform done
+ * by the Blosc and HDF5 "shuffle" filters; numeric data usually compresses
+ * better afterwards, since the high bytes of similar numbers are often equal.
+ *
+ * The result goes in a new String, or in the String passed as `into:` (which is
+ * resized to fit, and may be `buffer` itself).
+ *
+ * @example
+ *   BitTwiddle.byte_shuffle([1, 2, 3].pack("S>*"), 2)  # => "\x00\x00\x00\x01\x02\x03"
+ *   out = String.new
+ *   BitTwiddle.byte_shuffle(floats.pack("d*"), 8, into: out)
+ *
+ * @param buffer [String]
+ * @param elem_size [Integer] Size of each element in bytes
+ * @param into [String] Where to put the result
+ * @return [String] The result
+ */
+static VALUE
+bt_byte_shuffle(int argc, VALUE *argv, VALUE self)
+{
+  VALUE  buffer, dest;
+  size_t size;
+
+  dest = shuffle_args(argc, argv, &buffer, &size);
+  shuffle_into(buffer, dest, size, bt_byte_split);
+  RB_GC_GUARD(buffer);
+  return dest;
+}
+
+/* The inverse of `BitTwiddle.byte_shuffle`.
+ *
+ * @param buffer [String]
+ * @param elem_size [Integer] Size of each element in bytes
+ * @param into [String] Where to put the result
+ * @return [String] The result
+ */
+static VALUE
+bt_byte_unshuffle(int argc, VALUE *argv, VALUE self)
+{
+  VALUE  buffer, dest;
+  size_t size;
+
+  dest = shuffle_args(argc, argv, &buffer, &size);
+  shuffle_into(buffer, dest, size, bt_byte_join);
+  RB_GC_GUARD(buffer);
+  return dest;
+}
+
+/* Like `BitTwiddle.byte_shuffle`, but modify `buffer` in place.
+ *
+ * @param buffer [String]
+ * @param elem_size [Integer] Size of each element in bytes
+ * @return [String] `buffer`
+ */
+static VALUE
+bt_byte_shuffle_bang(VALUE self, VALUE buffer, VALUE elem_size)
+{
+  size_t size;
+  StringValue(buffer);
+  size = check_elem_size(buffer, elem_size);
+  rb_str_modify(buffer);
+  shuffle_into(buffer, buffer, size, bt_byte_split);
+  return buffer;
+}
+
+/* Like `BitTwiddle.byte_unshuffle`, but modify `buffer` in place.
+ *
+ * @param buffer [String]
+ * @param elem_size [Integer] Size of each element in bytes
+ * @return [String] `buffer`
+ */
+static VALUE
+bt_byte_unshuffle_bang(VALUE self, VALUE buffer, VALUE elem_size)
+{
+  size_t size;
+  StringValue(buffer);
+  size = check_elem_size(buffer, elem_size);
+  rb_str_modify(buffer);
+  shuffle_into(buffer, buffer, size, bt_byte_join);
+  return buffer;
+}
+
+void Init_bt_byte_shuffle(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+
+  kw_id = rb_intern("into");
+  rb_define_singleton_method(rb_mBitTwiddle, "byte_shuffle",    bt_byte_shuffle,        -1);
+  rb_define_singleton_method(rb_mBitTwiddle, "byte_unshuffle",  bt_byte_unshuffle,      -1);
+  rb_define_singleton_method(rb_mBitTwiddle, "byte_shuffle!",   bt_byte_shuffle_bang,    2);
+  rb_define_singleton_method(rb_mBitTwiddle, "byte_unshuffle!", bt_byte_unshuffle_bang,  2);
+}
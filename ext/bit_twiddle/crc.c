@@ -0,0 +1,547 @@
+/* Cyclic redundancy checks over Strings
+ *
+ * BitTwiddle.crc32c uses the SSE4.2 'crc32' instruction when the extension
+ * was compiled for a CPU which has it; BitTwiddle::CRC is a table-driven
+ * engine which handles any polynomial from 8 to 64 bits wide */
+
+#include "bit_twiddle.h"
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+/* The register of a reflected CRC is kept in the low 'width' bits of a uint64_t,
+ * and shifted right as data is fed in. The register of a non-reflected CRC is
+ * kept left-aligned in a uint64_t (so the low 64-width bits are always zero),
+ * and shifted left. That way, one loop handles any width */
+typedef struct {
+  uint64_t table[16][256]; /* table[k][b] = CRC of byte b followed by k zero bytes */
+  uint64_t x2n[67];        /* x2n[k] = x^(2^k) mod P, for shifting the register */
+  uint64_t poly;           /* reflected, or left-aligned */
+  uint64_t init;           /* initial register value */
+  uint64_t xorout;
+  int      width;
+  int      refin;
+  int      refout;
+} crc_engine;
+
+static uint64_t
+reflect_bits(uint64_t value, int width)
+{
+  uint64_t result = 0;
+  int i;
+  for (i = 0; i < width; i++) {
+    result = (result << 1) | (value & 1);
+    value >>= 1;
+  }
+  return result;
+}
+
+/* Multiply a and b modulo P; both are register values */
+static uint64_t
+crc_multmodp(const crc_engine *crc, uint64_t a, uint64_t b)
+{
+  uint64_t product = 0;
+
+  if (crc->refin) {
+    /* bit (width-1) is x^0 and bit 0 is x^(width-1) */
+    uint64_t m = 1ULL << (crc->width - 1);
+    if (a == 0)
+      return 0;
+    for (;;) {
+      if (a & m) {
+        product ^= b;
+        if ((a & (m - 1)) == 0)
+          break;
+      }
+      m >>= 1;
+      b = (b & 1) ? (b >> 1) ^ crc->poly : b >> 1;
+    }
+  } else {
+    /* bit (64-width) is x^0 and bit 63 is x^(width-1) */
+    int bit;
+    for (bit = 64 - crc->width; bit < 64; bit++) {
+      if ((a >> bit) & 1)
+        product ^= b;
+      b = (b >> 63) ? (b << 1) ^ crc->poly : b << 1;
+    }
+  }
+
+  return product;
+}
+
+/* Return x^(8*len) mod P: multiplying a register by this is the same as feeding
+ * 'len' zero bytes through it */
+static uint64_t
+crc_x8nmodp(const crc_engine *crc, uint64_t len)
+{
+  uint64_t result = crc->refin ? 1ULL << (crc->width - 1) : 1ULL << (64 - crc->width);
+  int k = 3;
+
+  while (len) {
+    if (len & 1)
+      result = crc_multmodp(crc, crc->x2n[k], result);
+    len >>= 1;
+    k++;
+  }
+  return result;
+}
+
+static void
+crc_engine_init(crc_engine *crc, int width, uint64_t poly, uint64_t init,
+                int refin, int refout, uint64_t xorout)
+{
+  int i, k;
+
+  crc->width  = width;
+  crc->refin  = refin;
+  crc->refout = refout;
+  crc->xorout = xorout;
+
+  if (refin) {
+    crc->poly = reflect_bits(poly, width);
+    crc->init = reflect_bits(init, width);
+    for (i = 0; i < 256; i++) {
+      uint64_t r = i;
+      for (k = 0; k < 8; k++)
+        r = (r & 1) ? (r >> 1) ^ crc->poly : r >> 1;
+      crc->table[0][i] = r;
+    }
+    for (k = 1; k < 16; k++)
+      for (i = 0; i < 256; i++)
+        crc->table[k][i] = (crc->table[k-1][i] >> 8) ^ crc->table[0][crc->table[k-1][i] & 0xFF];
+    crc->x2n[0] = 1ULL << (width - 2);
+  } else {
+    crc->poly = poly << (64 - width);
+    crc->init = init << (64 - width);
+    for (i = 0; i < 256; i++) {
+      uint64_t r = (uint64_t)i << 56;
+      for (k = 0; k < 8; k++)
+        r = (r >> 63) ? (r << 1) ^ crc->poly : r << 1;
+      crc->table[0][i] = r;
+    }
+    for (k = 1; k < 16; k++)
+      for (i = 0; i < 256; i++)
+        crc->table[k][i] = (crc->table[k-1][i] << 8) ^ crc->table[0][crc->table[k-1][i] >> 56];
+    crc->x2n[0] = 1ULL << (65 - width);
+  }
+
+  for (k = 1; k < 67; k++)
+    crc->x2n[k] = crc_multmodp(crc, crc->x2n[k-1], crc->x2n[k-1]);
+}
+
+/* Slicing-by-16: fold 16 bytes into the register with 16 table lookups */
+static uint64_t
+crc_engine_update(const crc_engine *crc, uint64_t reg, const uchar *p, size_t len)
+{
+  const uint64_t (*t)[256] = crc->table;
+
+  if (crc->refin) {
+    while (len >= 16) {
+      uint64_t a = reg ^ load_le64(p), b = load_le64(p + 8);
+      reg = t[15][a & 0xFF]         ^ t[14][(a >> 8) & 0xFF]  ^
+            t[13][(a >> 16) & 0xFF] ^ t[12][(a >> 24) & 0xFF] ^
+            t[11][(a >> 32) & 0xFF] ^ t[10][(a >> 40) & 0xFF] ^
+            t[9][(a >> 48) & 0xFF]  ^ t[8][a >> 56]           ^
+            t[7][b & 0xFF]          ^ t[6][(b >> 8) & 0xFF]   ^
+            t[5][(b >> 16) & 0xFF]  ^ t[4][(b >> 24) & 0xFF]  ^
+            t[3][(b >> 32) & 0xFF]  ^ t[2][(b >> 40) & 0xFF]  ^
+            t[1][(b >> 48) & 0xFF]  ^ t[0][b >> 56];
+      p += 16; len -= 16;
+    }
+    while (len--)
+      reg = (reg >> 8) ^ t[0][(reg ^ *p++) & 0xFF];
+  } else {
+    while (len >= 16) {
+      uint64_t a = reg ^ load_be64(p), b = load_be64(p + 8);
+      reg = t[15][a >> 56]          ^ t[14][(a >> 48) & 0xFF] ^
+            t[13][(a >> 40) & 0xFF] ^ t[12][(a >> 32) & 0xFF] ^
+            t[11][(a >> 24) & 0xFF] ^ t[10][(a >> 16) & 0xFF] ^
+            t[9][(a >> 8) & 0xFF]   ^ t[8][a & 0xFF]          ^
+            t[7][b >> 56]           ^ t[6][(b >> 48) & 0xFF]  ^
+            t[5][(b >> 40) & 0xFF]  ^ t[4][(b >> 32) & 0xFF]  ^
+            t[3][(b >> 24) & 0xFF]  ^ t[2][(b >> 16) & 0xFF]  ^
+            t[1][(b >> 8) & 0xFF]   ^ t[0][b & 0xFF];
+      p += 16; len -= 16;
+    }
+    while (len--)
+      reg = (reg << 8) ^ t[0][(reg >> 56) ^ *p++];
+  }
+
+  return reg;
+}
+
+/* Convert between register values and the CRC values which users see */
+static uint64_t
+crc_engine_final(const crc_engine *crc, uint64_t reg)
+{
+  uint64_t value = crc->refin ? reflect_bits(reg, crc->width) : reg >> (64 - crc->width);
+  if (crc->refout)
+    value = reflect_bits(value, crc->width);
+  return value ^ crc->xorout;
+}
+
+static uint64_t
+crc_engine_unfinal(const crc_engine *crc, uint64_t value)
+{
+  value ^= crc->xorout;
+  if (crc->refout)
+    value = reflect_bits(value, crc->width);
+  return crc->refin ? reflect_bits(value, crc->width) : value << (64 - crc->width);
+}
+
+/* Registers for A and B (both started from 'init') -> register for A+B */
+static uint64_t
+crc_engine_combine(const crc_engine *crc, uint64_t reg1, uint64_t reg2, uint64_t len2)
+{
+  return crc_multmodp(crc, crc_x8nmodp(crc, len2), reg1 ^ crc->init) ^ reg2;
+}
+
+/* ------------------------------------------------------------------------- */
+/* CRC32C (Castagnoli) */
+
+static crc_engine crc32c_engine;
+
+#ifdef __SSE4_2__
+
+/* The 'crc32' instruction has a latency of 3 cycles, but a throughput of 1 per cycle,
+ * so to go at full speed we run 3 independent CRCs over adjacent blocks, then
+ * stitch them together by multiplying with x^(8*blocksize) mod P */
+#define CRC32C_LONG  8192
+#define CRC32C_SHORT 256
+
+static uint64_t crc32c_long_shift, crc32c_short_shift;
+
+static inline uint32_t
+crc32c_shift(uint64_t shift, uint32_t reg)
+{
+  return (uint32_t)crc_multmodp(&crc32c_engine, shift, reg);
+}
+
+static uint32_t
+crc32c_update(uint32_t reg, const uchar *p, size_t len)
+{
+  uint64_t crc0 = reg, crc1, crc2;
+
+  while (len && ((uintptr_t)p & 7)) {
+    crc0 = _mm_crc32_u8((uint32_t)crc0, *p++);
+    len--;
+  }
+
+  while (len >= 3 * CRC32C_LONG) {
+    const uchar *end = p + CRC32C_LONG;
+    crc1 = crc2 = 0;
+    do {
+      crc0 = _mm_crc32_u64(crc0, load_le64(p));
+      crc1 = _mm_crc32_u64(crc1, load_le64(p + CRC32C_LONG));
+      crc2 = _mm_crc32_u64(crc2, load_le64(p + 2*CRC32C_LONG));
+      p += 8;
+    } while (p < end);
+    crc0 = crc32c_shift(crc32c_long_shift, (uint32_t)crc0) ^ crc1;
+    crc0 = crc32c_shift(crc32c_long_shift, (uint32_t)crc0) ^ crc2;
+    p   += 2 * CRC32C_LONG;
+    len -= 3 * CRC32C_LONG;
+  }
+
+  while (len >= 3 * CRC32C_SHORT) {
+    const uchar *end = p + CRC32C_SHORT;
+    crc1 = crc2 = 0;
+    do {
+      crc0 = _mm_crc32_u64(crc0, load_le64(p));
+      crc1 = _mm_crc32_u64(crc1, load_le64(p + CRC32C_SHORT));
+      crc2 = _mm_crc32_u64(crc2, load_le64(p + 2*CRC32C_SHORT));
+      p += 8;
+    } while (p < end);
+    crc0 = crc32c_shift(crc32c_short_shift, (uint32_t)crc0) ^ crc1;
+    crc0 = crc32c_shift(crc32c_short_shift, (uint32_t)crc0) ^ crc2;
+    p   += 2 * CRC32C_SHORT;
+    len -= 3 * CRC32C_SHORT;
+  }
+
+  while (len >= 8) {
+    crc0 = _mm_crc32_u64(crc0, load_le64(p));
+    p += 8; len -= 8;
+  }
+  while (len--)
+    crc0 = _mm_crc32_u8((uint32_t)crc0, *p++);
+
+  return (uint32_t)crc0;
+}
+
+#else
+
+static uint32_t
+crc32c_update(uint32_t reg, const uchar *p, size_t len)
+{
+  return (uint32_t)crc_engine_update(&crc32c_engine, reg, p, len);
+}
+
+#endif
+
+/* Convert a polynomial, initial value or CRC passed in by the caller, which
+ * must be a non-negative Integer of at most 'width' bits */
+static uint64_t
+crc_param(VALUE value, int width, const char *name)
+{
+  uint64_t v;
+  int sign = rb_integer_pack(rb_to_int(value), &v, 1, sizeof(v), 0,
+                             INTEGER_PACK_LSWORD_FIRST | INTEGER_PACK_NATIVE_BYTE_ORDER);
+  if (sign < 0 || sign > 1 || (width < 64 && (v >> width)))
+    rb_raise(rb_eArgError, "%s must be from 0 to 2**%d - 1 (not %"PRIsVALUE")", name, width, value);
+  return v;
+}
+
+/* Return the CRC-32C (Castagnoli) checksum of the bytes in `str`.
+ *
+ * To checksum data which arrives in pieces, pass the checksum of the preceding
+ * data as `crc`.
+ *
+ * @example
+ *   BitTwiddle.crc32c("123456789").to_s(16) # => "e3069283"
+ *   BitTwiddle.crc32c("6789", BitTwiddle.crc32c("12345")).to_s(16) # => "e3069283"
+ *
+ * @param str [String] The bytes to checksum
+ * @param crc [Integer] Checksum of the preceding data
+ * @return [Integer]
+ */
+static VALUE
+bt_crc32c(int argc, VALUE *argv, VALUE self)
+{
+  VALUE    str, crc;
+  uint32_t reg = 0;
+
+  rb_scan_args(argc, argv, "11", &str, &crc);
+  StringValue(str);
+  if (!NIL_P(crc))
+    reg = (uint32_t)crc_param(crc, 32, "CRC");
+
+  reg = ~crc32c_update(~reg, (const uchar*)RSTRING_PTR(str), RSTRING_LEN(str));
+  return UINT2NUM(reg);
+}
+
+static uint64_t
+value_to_crc_len(VALUE len)
+{
+  long length = NUM2LONG(len);
+  if (length < 0)
+    rb_raise(rb_eArgError, "length can't be negative");
+  return (uint64_t)length;
+}
+
+/* Given the CRC-32C checksums of two Strings, return the checksum of their
+ * concatenation. Only the length of the second String is needed.
+ *
+ * This allows large buffers to be checksummed in parallel, one chunk per thread.
+ *
+ * @example
+ *   a = BitTwiddle.crc32c("12345")
+ *   b = BitTwiddle.crc32c("6789")
+ *   BitTwiddle.crc32c_combine(a, b, 4).to_s(16) # => "e3069283"
+ *
+ * @param crc1 [Integer] Checksum of the first String
+ * @param crc2 [Integer] Checksum of the second String
+ * @param len2 [Integer] Length in bytes of the second String
+ * @return [Integer]
+ */
+static VALUE
+bt_crc32c_combine(VALUE self, VALUE crc1, VALUE crc2, VALUE len2)
+{
+  const crc_engine *crc = &crc32c_engine;
+  uint64_t reg1 = crc_engine_unfinal(crc, crc_param(crc1, 32, "CRC"));
+  uint64_t reg2 = crc_engine_unfinal(crc, crc_param(crc2, 32, "CRC"));
+  return UINT2NUM((uint32_t)crc_engine_final(crc, crc_engine_combine(crc, reg1, reg2, value_to_crc_len(len2))));
+}
+
+/* ------------------------------------------------------------------------- */
+/* BitTwiddle::CRC */
+
+/* Keywords of CRC.new, interned in Init_bt_crc */
+static ID keywords[6];
+
+static const rb_data_type_t crc_type = {
+  "BitTwiddle::CRC",
+  { 0, RUBY_TYPED_DEFAULT_FREE, 0, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+crc_alloc(VALUE klass)
+{
+  crc_engine *crc;
+  VALUE obj = TypedData_Make_Struct(klass, crc_engine, &crc_type, crc);
+  crc->width = 0;
+  return obj;
+}
+
+static crc_engine*
+get_crc(VALUE self)
+{
+  crc_engine *crc;
+  TypedData_Get_Struct(self, crc_engine, &crc_type, crc);
+  if (crc->width == 0)
+    rb_raise(rb_eRuntimeError, "uninitialized CRC");
+  return crc;
+}
+
+/* Document-method: BitTwiddle::CRC#initialize
+ * Build the lookup tables for a CRC algorithm.
+ *
+ * The parameters follow the "Rocksoft model" which is used by most catalogues of
+ * CRC algorithms. `poly` and `init` are written in normal (not reflected) form,
+ * without the leading x^width term.
+ *
+ * @example
+ *   crc32 = BitTwiddle::CRC.new(width: 32, poly: 0x04C11DB7, init: 0xFFFFFFFF,
+ *                               refin: true, refout: true, xorout: 0xFFFFFFFF)
+ *   crc32.checksum("123456789").to_s(16) # => "cbf43926"
+ *
+ * @param width [Integer] Number of bits in the CRC, from 8 to 64
+ * @param poly [Integer] The generator polynomial
+ * @param init [Integer] Initial register value (default 0)
+ * @param refin [Boolean] Whether bits are fed in LSB-first (default false)
+ * @param refout [Boolean] Whether the final register value is reflected (default same as `refin`)
+ * @param xorout [Integer] Value XOR'd into the final register value (default 0)
+ */
+static VALUE
+crc_initialize(int argc, VALUE *argv, VALUE self)
+{
+  VALUE opts, values[6];
+  crc_engine *crc;
+  int width, refin, refout;
+
+  TypedData_Get_Struct(self, crc_engine, &crc_type, crc);
+  if (crc->width)
+    rb_raise(rb_eRuntimeError, "CRC is already initialized");
+  rb_scan_args(argc, argv, ":", &opts);
+  if (NIL_P(opts))
+    rb_raise(rb_eArgError, "missing keywords: width, poly");
+  rb_get_kwargs(opts, keywords, 2, 4, values);
+
+  width = NUM2INT(values[0]);
+  if (width < 8 || width > 64)
+    rb_raise(rb_eArgError, "CRC width must be from 8 to 64 bits (not %d)", width);
+
+  refin  = (values[3] != Qundef) && RTEST(values[3]);
+  refout = (values[4] != Qundef) ? RTEST(values[4]) : refin;
+
+  crc_engine_init(crc, width,
+                  crc_param(values[1], width, "polynomial"),
+                  (values[2] != Qundef) ? crc_param(values[2], width, "init value") : 0,
+                  refin, refout,
+                  (values[5] != Qundef) ? crc_param(values[5], width, "xorout value") : 0);
+  return self;
+}
+
+/* Document-method: BitTwiddle::CRC#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+crc_initialize_copy(VALUE self, VALUE orig)
+{
+  crc_engine *dst, *src = get_crc(orig);
+
+  TypedData_Get_Struct(self, crc_engine, &crc_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->width)
+    rb_raise(rb_eRuntimeError, "CRC is already initialized");
+  /* the tables are inline, so this copies everything */
+  *dst = *src;
+  return self;
+}
+
+/* Document-method: BitTwiddle::CRC#checksum
+ * Return the CRC of the bytes in `str`.
+ *
+ * To checksum data which arrives in pieces, pass the checksum of the preceding
+ * data as `crc`.
+ *
+ * @example
+ *   crc16 = BitTwiddle::CRC.new(width: 16, poly: 0x1021, init: 0xFFFF)
+ *   crc16.checksum("123456789").to_s(16)                         # => "29b1"
+ *   crc16.checksum("6789", crc16.checksum("12345")).to_s(16)     # => "29b1"
+ *
+ * @param str [String] The bytes to checksum
+ * @param crc [Integer] Checksum of the preceding data (if it is negative or
+ *   wider than the CRC, raise `ArgumentError`)
+ * @return [Integer]
+ */
+static VALUE
+crc_checksum(int argc, VALUE *argv, VALUE self)
+{
+  crc_engine *crc = get_crc(self);
+  VALUE str, prev;
+  uint64_t reg;
+
+  rb_scan_args(argc, argv, "11", &str, &prev);
+  StringValue(str);
+  reg = NIL_P(prev) ? crc->init : crc_engine_unfinal(crc, crc_param(prev, crc->width, "CRC"));
+  reg = crc_engine_update(crc, reg, (const uchar*)RSTRING_PTR(str), RSTRING_LEN(str));
+  return ULL2NUM(crc_engine_final(crc, reg));
+}
+
+/* Document-method: BitTwiddle::CRC#combine
+ * Given the CRCs of two Strings, return the CRC of their concatenation.
+ * Only the length of the second String is needed.
+ *
+ * @example
+ *   crc16 = BitTwiddle::CRC.new(width: 16, poly: 0x1021, init: 0xFFFF)
+ *   a, b  = crc16.checksum("12345"), crc16.checksum("6789")
+ *   crc16.combine(a, b, 4).to_s(16) # => "29b1"
+ *
+ * @param crc1 [Integer] CRC of the first String
+ * @param crc2 [Integer] CRC of the second String
+ * @param len2 [Integer] Length in bytes of the second String
+ * @return [Integer]
+ */
+static VALUE
+crc_combine(VALUE self, VALUE crc1, VALUE crc2, VALUE len2)
+{
+  crc_engine *crc = get_crc(self);
+  uint64_t reg1 = crc_engine_unfinal(crc, crc_param(crc1, crc->width, "CRC"));
+  uint64_t reg2 = crc_engine_unfinal(crc, crc_param(crc2, crc->width, "CRC"));
+  return ULL2NUM(crc_engine_final(crc, crc_engine_combine(crc, reg1, reg2, value_to_crc_len(len2))));
+}
+
+/* Document-method: BitTwiddle::CRC#width
+ * @return [Integer] Number of bits in the CRC
+ */
+static VALUE
+crc_width(VALUE self)
+{
+  return INT2FIX(get_crc(self)->width);
+}
+
+void Init_bt_crc(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::CRC
+   * A table-driven CRC algorithm, for any polynomial from 8 to 64 bits wide.
+   * Processes 16 bytes per step ("slicing-by-16").
+   */
+  VALUE rb_cCRC = rb_define_class_under(rb_mBitTwiddle, "CRC", rb_cObject);
+
+  keywords[0] = rb_intern("width");
+  keywords[1] = rb_intern("poly");
+  keywords[2] = rb_intern("init");
+  keywords[3] = rb_intern("refin");
+  keywords[4] = rb_intern("refout");
+  keywords[5] = rb_intern("xorout");
+
+  crc_engine_init(&crc32c_engine, 32, 0x1EDC6F41, 0xFFFFFFFF, 1, 1, 0xFFFFFFFF);
+#ifdef __SSE4_2__
+  crc32c_long_shift  = crc_x8nmodp(&crc32c_engine, CRC32C_LONG);
+  crc32c_short_shift = crc_x8nmodp(&crc32c_engine, CRC32C_SHORT);
+#endif
+
+  rb_define_singleton_method(rb_mBitTwiddle, "crc32c", bt_crc32c, -1);
+  rb_define_singleton_method(rb_mBitTwiddle, "crc32c_combine", bt_crc32c_combine, 3);
+
+  rb_define_alloc_func(rb_cCRC, crc_alloc);
+  rb_define_method(rb_cCRC, "initialize",      crc_initialize,      -1);
+  rb_define_method(rb_cCRC, "initialize_copy", crc_initialize_copy,  1);
+  rb_define_method(rb_cCRC, "checksum",        crc_checksum,        -1);
+  rb_define_method(rb_cCRC, "combine",         crc_combine,          3);
+  rb_define_method(rb_cCRC, "width",           crc_width,            0);
+}
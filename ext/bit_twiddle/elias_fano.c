@@ -0,0 +1,574 @@
+/* BitTwiddle::EliasFano: a compressed, immutable sequence of sorted unsigned
+ * integers
+ *
+ * Each value is split into its low L bits and the remaining high bits, where
+ * L = floor(log2(max / n)). The low bits are stored one after another, L bits
+ * each. The high bits are stored in unary, in the "upper" bitvector: value i
+ * sets bit (value >> L) + i. Since the high parts are non-decreasing, the upper
+ * bitvector has n 1 bits and at most 2n 0 bits.
+ *
+ * The high part of value i is select1(i) - i, where select1(i) is the position
+ * of the i-th 1 bit. The positions of every SAMPLE-th 1 bit (and 0 bit, for
+ * next_geq) are saved, so select only has to scan a few words from there and
+ * finish with an in-word select. */
+
+#include "bit_twiddle.h"
+
+#define SAMPLE 512
+
+typedef struct {
+  uint64_t *lower;    /* n * l bits */
+  uint64_t *upper;    /* upper_bits bits */
+  uint64_t *select1;  /* position of 1 bit number k*SAMPLE, for each k */
+  uint64_t *select0;  /* position of 0 bit number k*SAMPLE, for each k */
+  size_t    n;
+  size_t    upper_bits;
+  size_t    lower_words, upper_words, n_select1, n_select0;
+  int       l;
+} elias_fano;
+
+static inline uint64_t
+ef_lower(const elias_fano *ef, size_t i)
+{
+  size_t   bit;
+  int      off;
+  uint64_t v;
+
+  if (ef->l == 0)
+    return 0;
+  bit = i * ef->l;
+  off = bit % 64;
+  v   = ef->lower[bit / 64] >> off;
+  if (off + ef->l > 64)
+    v |= ef->lower[bit / 64 + 1] << (64 - off);
+  return v & ((1ULL << ef->l) - 1);
+}
+
+/* Position of the i-th 1 bit in the upper bitvector */
+static inline size_t
+ef_select1(const elias_fano *ef, size_t i)
+{
+  size_t   pos  = ef->select1[i / SAMPLE];
+  size_t   k    = i % SAMPLE;
+  size_t   word = pos / 64;
+  uint64_t w    = ef->upper[word] & (~0ULL << (pos % 64));
+
+  for (;;) {
+    size_t c = __builtin_popcountll(w);
+    if (k < c)
+      return word * 64 + bt_select64(w, k);
+    k -= c;
+    w  = ef->upper[++word];
+  }
+}
+
+/* Position of the i-th 0 bit in the upper bitvector */
+static inline size_t
+ef_select0(const elias_fano *ef, size_t i)
+{
+  size_t   pos  = ef->select0[i / SAMPLE];
+  size_t   k    = i % SAMPLE;
+  size_t   word = pos / 64;
+  uint64_t w    = ~ef->upper[word] & (~0ULL << (pos % 64));
+
+  for (;;) {
+    size_t c = __builtin_popcountll(w);
+    if (k < c)
+      return word * 64 + bt_select64(w, k);
+    k -= c;
+    w  = ~ef->upper[++word];
+  }
+}
+
+static inline uint64_t
+ef_get(const elias_fano *ef, size_t i)
+{
+  return ((uint64_t)(ef_select1(ef, i) - i) << ef->l) | ef_lower(ef, i);
+}
+
+/* Decode elements [start, start+count), starting from the 1 bit at position 'pos'
+ * Each element is found with lo_bit on the current word, then cleared; the low
+ * bits are read sequentially. The fields of 'ef' are copied into locals, since
+ * EMIT may store through a char pointer, which could otherwise alias them */
+#define EF_DECODE(ef, start, count, pos, EMIT) do {                           \
+  const uint64_t *_upper = (ef)->upper, *_lower = (ef)->lower;                \
+  const int       _l     = (ef)->l;                                           \
+  const uint64_t  _lmask = _l ? (~0ULL >> (64 - _l)) : 0;                     \
+  size_t   _i    = (start), _end = (start) + (count);                         \
+  size_t   _word = (pos) / 64;                                                \
+  size_t   _bit  = _i * _l;                                                   \
+  uint64_t _w    = _upper[_word] & (~0ULL << ((pos) % 64));                   \
+  while (_i < _end) {                                                         \
+    while (_w == 0)                                                           \
+      _w = _upper[++_word];                                                   \
+    {                                                                         \
+      size_t   _p   = _word * 64 + __builtin_ctzll(_w);                       \
+      int      _off = _bit % 64;                                              \
+      uint64_t _lo  = _lower[_bit / 64] >> _off;                              \
+      uint64_t value;                                                         \
+      if (_off + _l > 64)                                                     \
+        _lo |= _lower[_bit / 64 + 1] << (64 - _off);                          \
+      value = ((uint64_t)(_p - _i) << _l) | (_lo & _lmask);                   \
+      EMIT;                                                                   \
+    }                                                                         \
+    _w &= _w - 1;                                                             \
+    _bit += _l;                                                               \
+    _i++;                                                                     \
+  }                                                                           \
+} while (0)
+
+/* ------------------------------------------------------------------------- */
+
+static void
+ef_free(void *ptr)
+{
+  elias_fano *ef = ptr;
+  xfree(ef->lower);
+  xfree(ef->upper);
+  xfree(ef->select1);
+  xfree(ef->select0);
+  xfree(ef);
+}
+
+static size_t
+ef_memsize(const void *ptr)
+{
+  const elias_fano *ef = ptr;
+  return sizeof(elias_fano) +
+         8 * (ef->lower_words + ef->upper_words + ef->n_select1 + ef->n_select0);
+}
+
+static const rb_data_type_t elias_fano_type = {
+  "BitTwiddle::EliasFano",
+  { 0, ef_free, ef_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+ef_alloc(VALUE klass)
+{
+  elias_fano *ef;
+  return TypedData_Make_Struct(klass, elias_fano, &elias_fano_type, ef);
+}
+
+static elias_fano*
+get_elias_fano(VALUE self)
+{
+  elias_fano *ef;
+  TypedData_Get_Struct(self, elias_fano, &elias_fano_type, ef);
+  if (!ef->upper)
+    rb_raise(rb_eRuntimeError, "uninitialized EliasFano");
+  return ef;
+}
+
+/* Encode n sorted values (which the caller has checked) */
+static void
+ef_build(elias_fano *ef, const uint64_t *values, size_t n)
+{
+  uint64_t last = n ? values[n-1] : 0;
+  size_t   i, ones = 0, zeros = 0, word;
+
+  ef->n  = n;
+  ef->l  = (n && last / n) ? 63 - __builtin_clzll(last / n) : 0;
+  ef->upper_bits  = n + (size_t)(last >> ef->l) + 1;
+  /* one extra word each, so reads of 2 adjacent words and select scans never
+   * run off the end */
+  ef->lower_words = (n * ef->l + 63) / 64 + 1;
+  ef->upper_words = (ef->upper_bits + 63) / 64 + 1;
+  ef->lower = ZALLOC_N(uint64_t, ef->lower_words);
+  ef->upper = ZALLOC_N(uint64_t, ef->upper_words);
+
+  for (i = 0; i < n; i++) {
+    size_t pos = (size_t)(values[i] >> ef->l) + i;
+    ef->upper[pos / 64] |= 1ULL << (pos % 64);
+    if (ef->l) {
+      size_t   bit = i * ef->l;
+      int      off = bit % 64;
+      uint64_t low = values[i] & ((1ULL << ef->l) - 1);
+      ef->lower[bit / 64] |= low << off;
+      if (off + ef->l > 64)
+        ef->lower[bit / 64 + 1] |= low >> (64 - off);
+    }
+  }
+
+  ef->n_select1 = (n + SAMPLE - 1) / SAMPLE;
+  ef->n_select0 = (ef->upper_bits - n + SAMPLE - 1) / SAMPLE;
+  ef->select1   = ALLOC_N(uint64_t, ef->n_select1 ? ef->n_select1 : 1);
+  ef->select0   = ALLOC_N(uint64_t, ef->n_select0 ? ef->n_select0 : 1);
+
+  for (word = 0; word * 64 < ef->upper_bits; word++) {
+    uint64_t w = ef->upper[word];
+    int ones_here  = __builtin_popcountll(w);
+    int bits_here  = (ef->upper_bits - word * 64 < 64) ? (int)(ef->upper_bits - word * 64) : 64;
+    int zeros_here = bits_here - ones_here;
+    /* the first multiple of SAMPLE which is in this word, if any */
+    size_t next1 = (ones + SAMPLE - 1) / SAMPLE * SAMPLE;
+    size_t next0 = (zeros + SAMPLE - 1) / SAMPLE * SAMPLE;
+    if (next1 < ones + ones_here)
+      ef->select1[next1 / SAMPLE] = word * 64 + bt_select64(w, next1 - ones);
+    if (next0 < zeros + zeros_here)
+      ef->select0[next0 / SAMPLE] = word * 64 + bt_select64(~w, next0 - zeros);
+    ones  += ones_here;
+    zeros += zeros_here;
+  }
+}
+
+/* Raise ArgumentError unless values are in ascending order */
+static void
+check_sorted(const uint64_t *values, size_t n)
+{
+  size_t i;
+  for (i = 1; i < n; i++)
+    if (values[i] < values[i-1])
+      rb_raise(rb_eArgError, "values must be sorted in ascending order");
+}
+
+/* Document-method: BitTwiddle::EliasFano#initialize
+ * Encode a sorted list of unsigned 64-bit integers.
+ *
+ * If the values are not sorted in ascending order, raise `ArgumentError`. If any
+ * is negative or does not fit in 64 bits, raise `RangeError`.
+ *
+ * @example
+ *   ef = BitTwiddle::EliasFano.new([2, 3, 5, 7, 11, 13])
+ *   ef[4] # => 11
+ *
+ * @param values [Array<Integer>]
+ */
+static VALUE
+ef_initialize(VALUE self, VALUE values)
+{
+  elias_fano *ef;
+  uint64_t   *buf;
+  VALUE tmp;
+  long  i, n;
+
+  TypedData_Get_Struct(self, elias_fano, &elias_fano_type, ef);
+  if (ef->upper)
+    rb_raise(rb_eRuntimeError, "EliasFano is already initialized");
+
+  values = rb_Array(values);
+  n      = RARRAY_LEN(values);
+  /* ALLOCV memory is reclaimed by the GC if a conversion raises */
+  buf    = ALLOCV_N(uint64_t, tmp, n);
+  for (i = 0; i < n; i++)
+    buf[i] = bt_num_to_u64(rb_to_int(RARRAY_AREF(values, i)));
+  check_sorted(buf, n);
+
+  ef_build(ef, buf, n);
+  ALLOCV_END(tmp);
+  return self;
+}
+
+/* Document-method: BitTwiddle::EliasFano.from_buffer
+ * Encode a sorted `String` of unsigned 32 or 64-bit integers in native byte
+ * order (as produced by `Array#pack("L*")` or `Array#pack("Q*")`).
+ *
+ * If the values are not sorted in ascending order, raise `ArgumentError`.
+ *
+ * @example
+ *   ef = BitTwiddle::EliasFano.from_buffer([2, 3, 5, 7].pack("L*"))
+ *   ef.to_a # => [2, 3, 5, 7]
+ *
+ * @param buffer [String] The integers to store
+ * @param width [Integer] Size of each integer in `buffer`: 32 or 64 bits (default 32)
+ * @return [EliasFano]
+ */
+static VALUE
+ef_s_from_buffer(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE buffer, width, obj, tmp;
+  elias_fano *ef;
+  uint64_t   *buf;
+  const uchar *p;
+  size_t n, i;
+  int    w;
+
+  rb_scan_args(argc, argv, "11", &buffer, &width);
+  StringValue(buffer);
+  w = NIL_P(width) ? 32 : NUM2INT(width);
+  if (w != 32 && w != 64)
+    rb_raise(rb_eArgError, "buffer element width must be 32 or 64 bits (not %d)", w);
+  if (RSTRING_LEN(buffer) % (w / 8))
+    rb_raise(rb_eArgError, "buffer length must be a multiple of %d bytes", w / 8);
+
+  n   = RSTRING_LEN(buffer) / (w / 8);
+  p   = (const uchar*)RSTRING_PTR(buffer);
+  buf = ALLOCV_N(uint64_t, tmp, n);
+  if (w == 64) {
+    memcpy(buf, p, n * 8);
+  } else {
+    for (i = 0; i < n; i++) {
+      uint32_t v;
+      memcpy(&v, p + i*4, 4);
+      buf[i] = v;
+    }
+  }
+  check_sorted(buf, n);
+
+  obj = ef_alloc(klass);
+  TypedData_Get_Struct(obj, elias_fano, &elias_fano_type, ef);
+  ef_build(ef, buf, n);
+  ALLOCV_END(tmp);
+  return obj;
+}
+
+/* Document-method: BitTwiddle::EliasFano#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+ef_initialize_copy(VALUE self, VALUE orig)
+{
+  elias_fano *dst, *src = get_elias_fano(orig);
+
+  TypedData_Get_Struct(self, elias_fano, &elias_fano_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->upper)
+    rb_raise(rb_eRuntimeError, "EliasFano is already initialized");
+  *dst = *src;
+  dst->lower   = ALLOC_N(uint64_t, src->lower_words);
+  dst->upper   = ALLOC_N(uint64_t, src->upper_words);
+  dst->select1 = ALLOC_N(uint64_t, src->n_select1 ? src->n_select1 : 1);
+  dst->select0 = ALLOC_N(uint64_t, src->n_select0 ? src->n_select0 : 1);
+  memcpy(dst->lower,   src->lower,   8 * src->lower_words);
+  memcpy(dst->upper,   src->upper,   8 * src->upper_words);
+  memcpy(dst->select1, src->select1, 8 * src->n_select1);
+  memcpy(dst->select0, src->select0, 8 * src->n_select0);
+  return self;
+}
+
+/* Document-method: BitTwiddle::EliasFano#size
+ * @return [Integer] The number of elements
+ */
+static VALUE
+ef_size(VALUE self)
+{
+  return SIZET2NUM(get_elias_fano(self)->n);
+}
+
+/* Document-method: BitTwiddle::EliasFano#bytesize
+ * @return [Integer] The number of bytes of memory used to store the elements,
+ *   including the indexes used by `#[]` and `#next_geq`
+ */
+static VALUE
+ef_bytesize(VALUE self)
+{
+  elias_fano *ef = get_elias_fano(self);
+  return SIZET2NUM(8 * (ef->lower_words + ef->upper_words + ef->n_select1 + ef->n_select0));
+}
+
+/* Document-method: BitTwiddle::EliasFano#[]
+ * Return the element at `index`, in constant time. A negative index counts back
+ * from the end. If `index` is out of range, return `nil`.
+ *
+ * @param index [Integer]
+ * @return [Integer, nil]
+ */
+static VALUE
+ef_aref(VALUE self, VALUE index)
+{
+  elias_fano *ef = get_elias_fano(self);
+  long i = NUM2LONG(index);
+
+  if (i < 0)
+    i += ef->n;
+  if (i < 0 || (size_t)i >= ef->n)
+    return Qnil;
+  return ULL2NUM(ef_get(ef, i));
+}
+
+/* Find the index of the first element >= x; return n if there is none */
+static size_t
+ef_index_geq(const elias_fano *ef, uint64_t x, uint64_t *found)
+{
+  uint64_t high = x >> ef->l;
+  size_t   pos, i;
+
+  if (ef->n == 0 || high > ef->upper_bits - ef->n - 1)
+    return ef->n;
+
+  /* elements with high part >= 'high' start just after 0 bit number high-1 */
+  if (high == 0) {
+    pos = 0;
+    i   = 0;
+  } else {
+    pos = ef_select0(ef, high - 1) + 1;
+    i   = pos - high;
+  }
+
+  EF_DECODE(ef, i, ef->n - i, pos, {
+    if (value >= x) {
+      *found = value;
+      return _i;
+    }
+  });
+  return ef->n;
+}
+
+/* Document-method: BitTwiddle::EliasFano#next_geq
+ * Return the first element which is greater than or equal to `x`, or `nil` if
+ * there is none.
+ *
+ * This skips directly to the elements which share the high bits of `x`, so it
+ * takes constant time on average. Intersecting sorted lists by repeatedly
+ * skipping ahead with `next_geq` is much faster than comparing every element.
+ *
+ * @example
+ *   ef = BitTwiddle::EliasFano.new([2, 3, 5, 7, 11, 13])
+ *   ef.next_geq(6)  # => 7
+ *   ef.next_geq(7)  # => 7
+ *   ef.next_geq(14) # => nil
+ *
+ * @param x [Integer]
+ * @return [Integer, nil]
+ */
+static VALUE
+ef_next_geq(VALUE self, VALUE x)
+{
+  elias_fano *ef = get_elias_fano(self);
+  uint64_t value;
+
+  x = rb_to_int(x);
+  if (FIXNUM_P(x) ? FIX2LONG(x) <= 0 : RBIGNUM_NEGATIVE_P(x))
+    return ef->n ? ULL2NUM(ef_get(ef, 0)) : Qnil;
+  if (!FIXNUM_P(x) && rb_absint_size(x, NULL) > 8)
+    return Qnil;
+  if (ef_index_geq(ef, NUM2ULL(x), &value) == ef->n)
+    return Qnil;
+  return ULL2NUM(value);
+}
+
+/* Document-method: BitTwiddle::EliasFano#index_geq
+ * Return the index of the first element which is greater than or equal to `x`,
+ * or `nil` if there is none. This takes the same time as `#next_geq`.
+ *
+ * @example
+ *   ef = BitTwiddle::EliasFano.new([2, 3, 5, 7, 11, 13])
+ *   ef.index_geq(6) # => 3
+ *
+ * @param x [Integer]
+ * @return [Integer, nil]
+ */
+static VALUE
+ef_index_geq_m(VALUE self, VALUE x)
+{
+  elias_fano *ef = get_elias_fano(self);
+  uint64_t value;
+  size_t   i;
+
+  x = rb_to_int(x);
+  if (FIXNUM_P(x) ? FIX2LONG(x) <= 0 : RBIGNUM_NEGATIVE_P(x))
+    return ef->n ? INT2FIX(0) : Qnil;
+  if (!FIXNUM_P(x) && rb_absint_size(x, NULL) > 8)
+    return Qnil;
+  i = ef_index_geq(ef, NUM2ULL(x), &value);
+  return (i == ef->n) ? Qnil : SIZET2NUM(i);
+}
+
+static VALUE
+ef_enum_size(VALUE self, VALUE args, VALUE eobj)
+{
+  return ef_size(self);
+}
+
+/* Document-method: BitTwiddle::EliasFano#each
+ * Yield each element in turn.
+ *
+ * @yieldparam value [Integer]
+ * @return [EliasFano, Enumerator]
+ */
+static VALUE
+ef_each(VALUE self)
+{
+  elias_fano *ef;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, ef_enum_size);
+  ef = get_elias_fano(self);
+  EF_DECODE(ef, 0, ef->n, 0, rb_yield(ULL2NUM(value)));
+  return self;
+}
+
+/* Document-method: BitTwiddle::EliasFano#to_a
+ * @return [Array<Integer>] All the elements
+ */
+static VALUE
+ef_to_a(VALUE self)
+{
+  elias_fano *ef = get_elias_fano(self);
+  VALUE ary = rb_ary_new_capa(ef->n);
+  EF_DECODE(ef, 0, ef->n, 0, rb_ary_push(ary, ULL2NUM(value)));
+  return ary;
+}
+
+/* Document-method: BitTwiddle::EliasFano#to_buffer
+ * Decode all the elements into a `String` of unsigned 32 or 64-bit integers in
+ * native byte order (which can be read with `String#unpack("L*")` or
+ * `String#unpack("Q*")`).
+ *
+ * If `width` is 32 and the largest element does not fit in 32 bits, raise
+ * `RangeError`.
+ *
+ * @example
+ *   ef = BitTwiddle::EliasFano.new([2, 3, 5, 7])
+ *   ef.to_buffer.unpack("L*") # => [2, 3, 5, 7]
+ *
+ * @param width [Integer] Size of each integer in the result: 32 or 64 bits (default 32)
+ * @return [String]
+ */
+static VALUE
+ef_to_buffer(int argc, VALUE *argv, VALUE self)
+{
+  elias_fano *ef = get_elias_fano(self);
+  VALUE  width, result;
+  uchar *out;
+  int    w;
+
+  rb_scan_args(argc, argv, "01", &width);
+  w = NIL_P(width) ? 32 : NUM2INT(width);
+  if (w != 32 && w != 64)
+    rb_raise(rb_eArgError, "buffer element width must be 32 or 64 bits (not %d)", w);
+  if (w == 32 && ef->n && (ef_get(ef, ef->n - 1) >> 32))
+    rb_raise(rb_eRangeError, "elements don't fit in a 32-bit buffer");
+
+  result = rb_str_new(NULL, ef->n * (w / 8));
+  out    = (uchar*)RSTRING_PTR(result);
+  if (w == 32) {
+    EF_DECODE(ef, 0, ef->n, 0, {
+      uint32_t v32 = (uint32_t)value;
+      memcpy(out + _i*4, &v32, 4);
+    });
+  } else {
+    EF_DECODE(ef, 0, ef->n, 0, memcpy(out + _i*8, &value, 8));
+  }
+  return result;
+}
+
+void Init_bt_elias_fano(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::EliasFano
+   * An immutable, compressed list of sorted unsigned integers (such as a posting
+   * list or a column of timestamps), using the Elias-Fano encoding. Storage is
+   * less than 2 + log2(max/size) bits per element, plus at most 3/8 of a bit for
+   * the indexes which make `#[]` and `#next_geq` constant-time.
+   */
+  VALUE rb_cEliasFano = rb_define_class_under(rb_mBitTwiddle, "EliasFano", rb_cObject);
+
+  rb_include_module(rb_cEliasFano, rb_mEnumerable);
+  rb_define_alloc_func(rb_cEliasFano, ef_alloc);
+  rb_define_singleton_method(rb_cEliasFano, "from_buffer", ef_s_from_buffer, -1);
+
+  rb_define_method(rb_cEliasFano, "initialize",      ef_initialize,       1);
+  rb_define_method(rb_cEliasFano, "initialize_copy", ef_initialize_copy,  1);
+  rb_define_method(rb_cEliasFano, "size",            ef_size,             0);
+  rb_define_method(rb_cEliasFano, "length",          ef_size,             0);
+  rb_define_method(rb_cEliasFano, "bytesize",        ef_bytesize,         0);
+  rb_define_method(rb_cEliasFano, "[]",              ef_aref,             1);
+  rb_define_method(rb_cEliasFano, "next_geq",        ef_next_geq,         1);
+  rb_define_method(rb_cEliasFano, "index_geq",       ef_index_geq_m,      1);
+  rb_define_method(rb_cEliasFano, "each",            ef_each,             0);
+  rb_define_method(rb_cEliasFano, "to_a",            ef_to_a,             0);
+  rb_define_method(rb_cEliasFano, "to_buffer",       ef_to_buffer,       -1);
+}
@@ -50,4 +50,12 @@ checking_for("presence of __builtin_bswap16", "%s") do
   have_bswap16 ? "oh yeah" : "nope...but we can sure fix that"
 end
 
+# radix sort uses multiple threads for big buffers, where pthreads are available
+if have_header('pthread.h')
+  have_library('pthread', 'pthread_create')
+end
+
+# Ruby 3.0+: lets the extension be used from Ractors other than the main one
+have_func('rb_ext_ractor_safe', 'ruby.h')
+
 create_makefile 'bit_twiddle'
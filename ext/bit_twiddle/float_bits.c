@@ -0,0 +1,197 @@
+/* Reinterpreting Floats as bits, and order-preserving integer keys for floats
+ *
+ * For a key which sorts in the same order as the float, flip the sign bit of
+ * positive floats (so they sort above all negative ones), and flip all the bits
+ * of negative floats (so that more negative values get smaller keys). Then
+ * unsigned integer comparison of keys matches numeric comparison of floats, with
+ * -0.0 just below 0.0, and NaNs at either end depending on their sign bit. */
+
+#include "bit_twiddle.h"
+
+#define SIGN32 0x80000000U
+#define SIGN64 0x8000000000000000ULL
+
+static inline uint32_t
+float_key32(uint32_t bits)
+{
+  uint32_t mask = (uint32_t)((int32_t)bits >> 31);
+  return bits ^ (mask | SIGN32);
+}
+
+static inline uint32_t
+key_float32(uint32_t key)
+{
+  uint32_t mask = (uint32_t)((int32_t)key >> 31);
+  return key ^ (~mask | SIGN32);
+}
+
+static inline uint64_t
+float_key64(uint64_t bits)
+{
+  uint64_t mask = (uint64_t)((int64_t)bits >> 63);
+  return bits ^ (mask | SIGN64);
+}
+
+static inline uint64_t
+key_float64(uint64_t key)
+{
+  uint64_t mask = (uint64_t)((int64_t)key >> 63);
+  return key ^ (~mask | SIGN64);
+}
+
+static int
+value_to_width(VALUE width)
+{
+  int w = NIL_P(width) ? 64 : NUM2INT(width);
+  if (w != 32 && w != 64)
+    rb_raise(rb_eArgError, "float width must be 32 or 64 bits (not %d)", w);
+  return w;
+}
+
+/* Apply one of the key transforms to a buffer; the loops are simple enough for
+ * the compiler to vectorize */
+static VALUE
+transform_buffer(int argc, VALUE *argv, int to_key)
+{
+  VALUE  buffer, width, result;
+  size_t n, i;
+  uchar *p;
+  int    w;
+
+  rb_scan_args(argc, argv, "11", &buffer, &width);
+  StringValue(buffer);
+  w = value_to_width(width);
+  if (RSTRING_LEN(buffer) % (w / 8))
+    rb_raise(rb_eArgError, "buffer length must be a multiple of %d bytes", w / 8);
+
+  n      = RSTRING_LEN(buffer) / (w / 8);
+  result = rb_str_new(RSTRING_PTR(buffer), RSTRING_LEN(buffer));
+  p      = (uchar*)RSTRING_PTR(result);
+
+  if (w == 32) {
+    for (i = 0; i < n; i++) {
+      uint32_t v;
+      memcpy(&v, p + i*4, 4);
+      v = to_key ? float_key32(v) : key_float32(v);
+      memcpy(p + i*4, &v, 4);
+    }
+  } else {
+    for (i = 0; i < n; i++) {
+      uint64_t v;
+      memcpy(&v, p + i*8, 8);
+      v = to_key ? float_key64(v) : key_float64(v);
+      memcpy(p + i*8, &v, 8);
+    }
+  }
+  return result;
+}
+
+/* Convert a buffer of floats into unsigned integer keys which sort in the same
+ * order as the floats. This is useful for radix sorting, or for compressing
+ * floats with integer codecs.
+ *
+ * -0.0 gets a key just below 0.0; NaNs with the sign bit clear get keys above
+ * Infinity, and NaNs with the sign bit set get keys below -Infinity.
+ *
+ * @example
+ *   keys = BitTwiddle.float_to_keys([1.5, -2.0, 0.0].pack("d*"))
+ *   a, b, c = keys.unpack("Q*")
+ *   b < c && c < a                               # => true
+ *   BitTwiddle.keys_to_float(keys).unpack("d*") # => [1.5, -2.0, 0.0]
+ *
+ * @param buffer [String] Native-endian floats (as produced by `Array#pack("d*")`
+ *   or `Array#pack("f*")`)
+ * @param width [Integer] 64 for doubles (default) or 32 for single-precision floats
+ * @return [String] Unsigned integers of the same width, in native byte order
+ */
+static VALUE
+bt_float_to_keys(int argc, VALUE *argv, VALUE self)
+{
+  return transform_buffer(argc, argv, 1);
+}
+
+/* The inverse of `BitTwiddle.float_to_keys`.
+ *
+ * @param buffer [String] Unsigned integer keys in native byte order
+ * @param width [Integer] 64 (default) or 32
+ * @return [String] Native-endian floats
+ */
+static VALUE
+bt_keys_to_float(int argc, VALUE *argv, VALUE self)
+{
+  return transform_buffer(argc, argv, 0);
+}
+
+static VALUE
+flo_to_bits(VALUE self)
+{
+  double   d = RFLOAT_VALUE(rb_to_float(self));
+  uint64_t bits;
+  memcpy(&bits, &d, 8);
+  return ULL2NUM(bits);
+}
+
+static VALUE
+flo_s_from_bits(VALUE klass, VALUE num)
+{
+  uint64_t bits = bt_num_to_u64(num);
+  double   d;
+  memcpy(&d, &bits, 8);
+  return DBL2NUM(d);
+}
+
+/* Document-method: Float#to_bits
+ * Return the IEEE 754 bit pattern of this Float, as an unsigned 64-bit integer.
+ *
+ * @example
+ *   1.0.to_bits.to_s(16)  # => "3ff0000000000000"
+ *   -0.0.to_bits.to_s(16) # => "8000000000000000"
+ * @return [Integer]
+ */
+/* Document-method: Float.from_bits
+ * Return the Float with the given IEEE 754 bit pattern. The inverse of
+ * `Float#to_bits`.
+ *
+ * If `bits` is negative or does not fit in 64 bits, raise `RangeError`.
+ *
+ * @example
+ *   Float.from_bits(0x3ff0000000000000) # => 1.0
+ * @param bits [Integer]
+ * @return [Float]
+ */
+void
+init_float_core_extensions(void)
+{
+  rb_define_method(rb_cFloat, "to_bits", flo_to_bits, 0);
+  rb_define_singleton_method(rb_cFloat, "from_bits", flo_s_from_bits, 1);
+}
+
+static VALUE bt_float_to_bits(VALUE self, VALUE flo)   { return flo_to_bits(flo); }
+static VALUE bt_float_from_bits(VALUE self, VALUE num) { return flo_s_from_bits(rb_cFloat, num); }
+
+void Init_bt_float_bits(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+
+  rb_define_singleton_method(rb_mBitTwiddle, "float_to_keys", bt_float_to_keys, -1);
+  rb_define_singleton_method(rb_mBitTwiddle, "keys_to_float", bt_keys_to_float, -1);
+
+  /* Return the IEEE 754 bit pattern of `float`, as an unsigned 64-bit integer.
+   * @example
+   *   BitTwiddle.float_to_bits(1.0).to_s(16) # => "3ff0000000000000"
+   *
+   * @param float [Float] The number to operate on (an Integer is converted to Float)
+   * @return [Integer]
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "float_to_bits",   bt_float_to_bits,   1);
+  /* Return the Float with the IEEE 754 bit pattern `bits`.
+   * @example
+   *   BitTwiddle.float_from_bits(0x3ff0000000000000) # => 1.0
+   *
+   * If `bits` is negative or does not fit in 64 bits, raise `RangeError`.
+   *
+   * @param bits [Integer]
+   * @return [Float]
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "float_from_bits", bt_float_from_bits, 1);
+}
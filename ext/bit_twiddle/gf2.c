@@ -0,0 +1,267 @@
+/* Arithmetic in the binary fields GF(2^64) and GF(2^128), built on carry-less
+ * multiplication, and a polynomial hash over Strings which uses GF(2^64)
+ *
+ * Field elements are written in polynomial basis: bit N is the coefficient of x^N
+ * GF(2^64) is reduced modulo x^64 + x^4 + x^3 + x + 1
+ * GF(2^128) is reduced modulo x^128 + x^7 + x^2 + x + 1 */
+
+#include "bit_twiddle.h"
+
+#if defined(__VPCLMULQDQ__) && defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/* Reduce the 128-bit polynomial (hi, lo) modulo x^64 + x^4 + x^3 + x + 1
+ * x^64 == x^4 + x^3 + x + 1, so hi*x^64 is folded in as a few shifts and XORs;
+ * the up-to-4 bits which overflow from that are folded in once more */
+static inline uint64_t
+gf64_reduce(uint64_t lo, uint64_t hi)
+{
+  uint64_t over = (hi >> 63) ^ (hi >> 61) ^ (hi >> 60);
+  lo ^= hi ^ (hi << 1) ^ (hi << 3) ^ (hi << 4);
+  return lo ^ over ^ (over << 1) ^ (over << 3) ^ (over << 4);
+}
+
+static inline uint64_t
+gf64_mul(uint64_t a, uint64_t b)
+{
+  uint64_t lo, hi;
+  clmul64(a, b, &lo, &hi);
+  return gf64_reduce(lo, hi);
+}
+
+/* Reduce the 256-bit polynomial w[0..3] modulo x^128 + x^7 + x^2 + x + 1 */
+static inline void
+gf128_reduce(const uint64_t w[4], uint64_t *lo, uint64_t *hi)
+{
+  uint64_t over = (w[3] >> 63) ^ (w[3] >> 62) ^ (w[3] >> 57);
+  uint64_t rlo  = w[0] ^ w[2] ^ (w[2] << 1) ^ (w[2] << 2) ^ (w[2] << 7);
+  uint64_t rhi  = w[1] ^ w[3] ^ (w[3] << 1) ^ (w[3] << 2) ^ (w[3] << 7) ^
+                  (w[2] >> 63) ^ (w[2] >> 62) ^ (w[2] >> 57);
+  *lo = rlo ^ over ^ (over << 1) ^ (over << 2) ^ (over << 7);
+  *hi = rhi;
+}
+
+/* Karatsuba: 3 carry-less multiplications instead of 4 */
+static void
+gf128_mul(uint64_t alo, uint64_t ahi, uint64_t blo, uint64_t bhi, uint64_t *lo, uint64_t *hi)
+{
+  uint64_t w[4], mlo, mhi;
+
+  clmul64(alo, blo, &w[0], &w[1]);
+  clmul64(ahi, bhi, &w[2], &w[3]);
+  clmul64(alo ^ ahi, blo ^ bhi, &mlo, &mhi);
+  mlo ^= w[0] ^ w[2];
+  mhi ^= w[1] ^ w[3];
+  w[1] ^= mlo;
+  w[2] ^= mhi;
+
+  gf128_reduce(w, lo, hi);
+}
+
+/* Multiply `a` and `b` in GF(2^64).
+ *
+ * `a` and `b` are polynomials over GF(2) (bit N is the coefficient of x^N); the
+ * product is reduced modulo x^64 + x^4 + x^3 + x + 1.
+ *
+ * @example
+ *   BitTwiddle.gf64_mul(0b101, 0b11)  # => 15
+ *   BitTwiddle.gf64_mul(1 << 63, 2)   # => 27
+ *
+ * @param a [Integer] A 64-bit field element
+ * @param b [Integer] A 64-bit field element
+ * @return [Integer]
+ */
+static VALUE
+bt_gf64_mul(VALUE self, VALUE a, VALUE b)
+{
+  return ULL2NUM(gf64_mul(bt_num_to_u64(a), bt_num_to_u64(b)));
+}
+
+/* Reduce a polynomial of up to 128 bits (such as a product returned by
+ * `Integer#clmul64`) modulo x^64 + x^4 + x^3 + x + 1.
+ *
+ * @example
+ *   BitTwiddle.gf64_reduce(1 << 64) # => 27
+ *
+ * @param poly [Integer] A polynomial of degree < 128
+ * @return [Integer]
+ */
+static VALUE
+bt_gf64_reduce(VALUE self, VALUE poly)
+{
+  uint64_t lo, hi;
+  bt_num_to_u128(poly, &lo, &hi);
+  return ULL2NUM(gf64_reduce(lo, hi));
+}
+
+/* Multiply `a` and `b` in GF(2^128).
+ *
+ * `a` and `b` are polynomials over GF(2) (bit N is the coefficient of x^N); the
+ * product is reduced modulo x^128 + x^7 + x^2 + x + 1. This is the field used by
+ * GHASH, but GHASH numbers bits in the opposite order, so GHASH values must be
+ * bit-reversed before and after.
+ *
+ * @example
+ *   BitTwiddle.gf128_mul(1 << 127, 2) # => 135
+ *
+ * @param a [Integer] A 128-bit field element
+ * @param b [Integer] A 128-bit field element
+ * @return [Integer]
+ */
+static VALUE
+bt_gf128_mul(VALUE self, VALUE a, VALUE b)
+{
+  uint64_t alo, ahi, blo, bhi, lo, hi;
+  bt_num_to_u128(a, &alo, &ahi);
+  bt_num_to_u128(b, &blo, &bhi);
+  gf128_mul(alo, ahi, blo, bhi, &lo, &hi);
+  return bt_u128_to_num(lo, hi);
+}
+
+/* Polynomial hash: h = (...((seed*k + m1)*k + m2)*k + ... + mN)*k + len)*k
+ * Words are folded in several at a time with precomputed powers of k, which
+ * leaves only one reduction per group */
+#if defined(__VPCLMULQDQ__) && defined(__AVX2__)
+
+static uint64_t
+polyhash64_words(uint64_t h, uint64_t k, const uchar *p, size_t nwords)
+{
+  uint64_t pow[9], acc[4];
+  __m256i  k_8765, k_4321;
+  int i;
+
+  pow[1] = k;
+  for (i = 2; i <= 8; i++)
+    pow[i] = gf64_mul(pow[i-1], k);
+  /* lane 0 multiplies the low qword of each 128-bit half by 'k^...' */
+  k_8765 = _mm256_set_epi64x((long long)pow[5], (long long)pow[6], (long long)pow[7], (long long)pow[8]);
+  k_4321 = _mm256_set_epi64x((long long)pow[1], (long long)pow[2], (long long)pow[3], (long long)pow[4]);
+
+  while (nwords >= 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)p);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(p + 32));
+    __m256i s;
+    __m128i s128;
+    a = _mm256_xor_si256(a, _mm256_set_epi64x(0, 0, 0, (long long)h));
+    s = _mm256_xor_si256(_mm256_clmulepi64_epi128(a, k_8765, 0x00),
+                         _mm256_clmulepi64_epi128(a, k_8765, 0x11));
+    s = _mm256_xor_si256(s, _mm256_clmulepi64_epi128(b, k_4321, 0x00));
+    s = _mm256_xor_si256(s, _mm256_clmulepi64_epi128(b, k_4321, 0x11));
+    s128 = _mm_xor_si128(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+    _mm_storeu_si128((__m128i*)acc, s128);
+    h = gf64_reduce(acc[0], acc[1]);
+    p += 64;
+    nwords -= 8;
+  }
+
+  while (nwords--) {
+    h = gf64_mul(h ^ load_le64(p), k);
+    p += 8;
+  }
+  return h;
+}
+
+#else
+
+static uint64_t
+polyhash64_words(uint64_t h, uint64_t k, const uchar *p, size_t nwords)
+{
+  uint64_t k2 = gf64_mul(k, k), k3 = gf64_mul(k2, k), k4 = gf64_mul(k3, k);
+
+  while (nwords >= 4) {
+    uint64_t lo, hi, tlo, thi;
+    clmul64(h ^ load_le64(p), k4, &lo, &hi);
+    clmul64(load_le64(p + 8), k3, &tlo, &thi);
+    lo ^= tlo; hi ^= thi;
+    clmul64(load_le64(p + 16), k2, &tlo, &thi);
+    lo ^= tlo; hi ^= thi;
+    clmul64(load_le64(p + 24), k, &tlo, &thi);
+    lo ^= tlo; hi ^= thi;
+    h = gf64_reduce(lo, hi);
+    p += 32;
+    nwords -= 4;
+  }
+
+  while (nwords--) {
+    h = gf64_mul(h ^ load_le64(p), k);
+    p += 8;
+  }
+  return h;
+}
+
+#endif
+
+/* The hash computed by BitTwiddle.polyhash64 */
+uint64_t
+bt_polyhash(uint64_t h, uint64_t k, const uchar *p, size_t len)
+{
+  size_t nwords = len / 8;
+
+  h = polyhash64_words(h, k, p, nwords);
+  if (len & 7) {
+    uchar last[8] = {0};
+    memcpy(last, p + nwords * 8, len & 7);
+    h = gf64_mul(h ^ load_le64(last), k);
+  }
+  return gf64_mul(h ^ (uint64_t)len, k);
+}
+
+/* Hash a String or Integer for the probabilistic data structures; see
+ * bit_twiddle.h */
+uint64_t
+bt_hash_value(VALUE key, uint64_t seed)
+{
+  if (RB_INTEGER_TYPE_P(key))
+    return bt_fmix64(NUM2ULL(key) ^ seed);
+  StringValue(key);
+  return bt_fmix64(bt_polyhash(seed, BT_HASH_POINT, (const uchar*)RSTRING_PTR(key), RSTRING_LEN(key)));
+}
+
+/* Hash the bytes in `str` by evaluating them as a polynomial over GF(2^64) at
+ * the point `key`.
+ *
+ * `str` is split into little-endian 64-bit words m1, m2, ... mN (the last one
+ * padded with zero bytes), and the result is:
+ *
+ *     (...((seed*key + m1)*key + m2)*key + ... + mN)*key + length)*key
+ *
+ * where `length` is the number of bytes in `str`, and all arithmetic is in
+ * GF(2^64) (as with `BitTwiddle.gf64_mul`). For two different Strings of up to
+ * L words, the probability of a collision over a uniformly random `key` is at
+ * most (L+1)/2^64.
+ *
+ * Uses PCLMULQDQ (or VPCLMULQDQ) instructions if the CPU has them.
+ *
+ * @example
+ *   BitTwiddle.polyhash64("", 3)                       # => 0
+ *   BitTwiddle.polyhash64("hello", 0x9E3779B97F4A7C15) # => 15850941074801010713
+ *
+ * @param str [String] The bytes to hash
+ * @param key [Integer] The evaluation point (a 64-bit integer)
+ * @param seed [Integer] Initial value (default 0)
+ * @return [Integer]
+ */
+static VALUE
+bt_polyhash64(int argc, VALUE *argv, VALUE self)
+{
+  VALUE str, key, seed;
+  uint64_t h, k;
+
+  rb_scan_args(argc, argv, "21", &str, &key, &seed);
+  StringValue(str);
+  k = bt_num_to_u64(key);
+  h = NIL_P(seed) ? 0 : bt_num_to_u64(seed);
+
+  return ULL2NUM(bt_polyhash(h, k, (const uchar*)RSTRING_PTR(str), RSTRING_LEN(str)));
+}
+
+void Init_bt_gf2(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+
+  rb_define_singleton_method(rb_mBitTwiddle, "gf64_mul",    bt_gf64_mul,    2);
+  rb_define_singleton_method(rb_mBitTwiddle, "gf64_reduce", bt_gf64_reduce, 1);
+  rb_define_singleton_method(rb_mBitTwiddle, "gf128_mul",   bt_gf128_mul,   2);
+  rb_define_singleton_method(rb_mBitTwiddle, "polyhash64",  bt_polyhash64, -1);
+}
@@ -0,0 +1,672 @@
+/* Arithmetic in GF(2^8) over whole buffers, and Reed-Solomon erasure coding
+ * built on it
+ *
+ * The field is reduced modulo x^8 + x^4 + x^3 + x^2 + 1 (0x11D), as used by most
+ * Reed-Solomon storage codes. Multiplying a buffer by a constant c is a linear
+ * map on each byte, so:
+ *
+ * - With GFNI, it is one gf2p8affine instruction per 32 bytes, given the 8x8 bit
+ *   matrix of "multiply by c". (gf2p8mul itself can't be used, since it is
+ *   hard-wired to the AES polynomial 0x11B.)
+ * - With SSSE3/AVX2, c*x = c*(x & 0xF) ^ c*(x & 0xF0), and each half is looked up
+ *   in a 16-entry table with pshufb.
+ * - Otherwise, a 256-entry table row for c is used. */
+
+#include "bit_twiddle.h"
+
+#if defined(__AVX2__) || defined(__GFNI__)
+#include <immintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+static uchar gf_exp[512]; /* doubled, so gf_exp[log a + log b] needs no reduction */
+static uchar gf_log[256];
+static uchar gf_table[256][256];
+static uchar gf_nibbles[256][32]; /* c * (0..15), then c * (0..15 << 4) */
+#ifdef __GFNI__
+static uint64_t gf_affine[256];
+#endif
+
+static inline uchar
+gf_mul(uchar a, uchar b)
+{
+  return (a && b) ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static inline uchar
+gf_inv(uchar a)
+{
+  return gf_exp[255 - gf_log[a]];
+}
+
+static void
+gf_init_tables(void)
+{
+  int i, j, x = 1;
+
+  for (i = 0; i < 255; i++) {
+    gf_exp[i] = gf_exp[i + 255] = x;
+    gf_log[x] = i;
+    x <<= 1;
+    if (x & 0x100)
+      x ^= 0x11D;
+  }
+  for (i = 0; i < 256; i++) {
+    for (j = 0; j < 256; j++)
+      gf_table[i][j] = gf_mul(i, j);
+    for (j = 0; j < 16; j++) {
+      gf_nibbles[i][j]      = gf_mul(i, j);
+      gf_nibbles[i][j + 16] = gf_mul(i, j << 4);
+    }
+#ifdef __GFNI__
+    /* row r of the matrix (bit r of the product) goes in byte 7-r; its bit k
+     * says whether input bit k contributes */
+    {
+      uint64_t m = 0;
+      int r, k;
+      for (r = 0; r < 8; r++) {
+        uint64_t row = 0;
+        for (k = 0; k < 8; k++)
+          if ((gf_mul(i, 1 << k) >> r) & 1)
+            row |= 1 << k;
+        m |= row << (8 * (7 - r));
+      }
+      gf_affine[i] = m;
+    }
+#endif
+  }
+}
+
+/* dst = c * src, or dst ^= c * src if 'add' */
+static inline __attribute__((always_inline)) void
+gf_mul_region(uchar *dst, const uchar *src, size_t n, uchar c, int add)
+{
+  const uchar *row = gf_table[c];
+  size_t i = 0;
+
+#if defined(__GFNI__) && defined(__AVX2__)
+  {
+    __m256i m = _mm256_set1_epi64x((long long)gf_affine[c]);
+    for (; i + 32 <= n; i += 32) {
+      __m256i p = _mm256_gf2p8affine_epi64_epi8(_mm256_loadu_si256((const __m256i*)(src + i)), m, 0);
+      if (add)
+        p = _mm256_xor_si256(p, _mm256_loadu_si256((const __m256i*)(dst + i)));
+      _mm256_storeu_si256((__m256i*)(dst + i), p);
+    }
+  }
+#elif defined(__AVX2__)
+  {
+    __m256i lo   = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)gf_nibbles[c]));
+    __m256i hi   = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(gf_nibbles[c] + 16)));
+    __m256i mask = _mm256_set1_epi8(0x0F);
+    for (; i + 32 <= n; i += 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+      __m256i p = _mm256_xor_si256(
+        _mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+        _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+      if (add)
+        p = _mm256_xor_si256(p, _mm256_loadu_si256((const __m256i*)(dst + i)));
+      _mm256_storeu_si256((__m256i*)(dst + i), p);
+    }
+  }
+#endif
+#ifdef __SSSE3__
+  {
+    __m128i lo   = _mm_loadu_si128((const __m128i*)gf_nibbles[c]);
+    __m128i hi   = _mm_loadu_si128((const __m128i*)(gf_nibbles[c] + 16));
+    __m128i mask = _mm_set1_epi8(0x0F);
+    for (; i + 16 <= n; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+      __m128i p = _mm_xor_si128(
+        _mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+        _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+      if (add)
+        p = _mm_xor_si128(p, _mm_loadu_si128((const __m128i*)(dst + i)));
+      _mm_storeu_si128((__m128i*)(dst + i), p);
+    }
+  }
+#endif
+  if (add) {
+    for (; i < n; i++)
+      dst[i] ^= row[src[i]];
+  } else {
+    for (; i < n; i++)
+      dst[i] = row[src[i]];
+  }
+}
+
+static void
+gf_mul_add(uchar *dst, const uchar *src, size_t n, uchar c)
+{
+  gf_mul_region(dst, src, n, c, 1);
+}
+
+static void
+gf_mul_set(uchar *dst, const uchar *src, size_t n, uchar c)
+{
+  gf_mul_region(dst, src, n, c, 0);
+}
+
+/* out[i] = sum over j of matrix[i*nin + j] * in[j], for buffers of 'len' bytes
+ * The buffers are processed in slices, so each slice of the inputs is still in
+ * L1 cache when the next output is computed */
+#define GF_SLICE 4096
+
+static void
+gf_matrix_apply(const uchar *matrix, const uchar **in, long nin, uchar **out, long nout, size_t len)
+{
+  size_t off;
+  long   i, j;
+
+  for (off = 0; off < len; off += GF_SLICE) {
+    size_t n = (len - off < GF_SLICE) ? len - off : GF_SLICE;
+    for (i = 0; i < nout; i++) {
+      const uchar *coeffs = matrix + i*nin;
+      gf_mul_set(out[i] + off, in[0] + off, n, coeffs[0]);
+      for (j = 1; j < nin; j++)
+        if (coeffs[j])
+          gf_mul_add(out[i] + off, in[j] + off, n, coeffs[j]);
+    }
+  }
+}
+
+/* Invert the n x n matrix 'm' in place with Gauss-Jordan elimination; return 0
+ * if it is singular */
+static int
+gf_invert_matrix(uchar *m, long n, uchar *work)
+{
+  long i, j, k;
+
+  /* work = [m | I] */
+  for (i = 0; i < n; i++) {
+    memcpy(work + i*2*n, m + i*n, n);
+    memset(work + i*2*n + n, 0, n);
+    work[i*2*n + n + i] = 1;
+  }
+  for (i = 0; i < n; i++) {
+    uchar *pivot_row, inv;
+    for (k = i; k < n && !work[k*2*n + i]; k++)
+      ;
+    if (k == n)
+      return 0;
+    if (k != i) {
+      for (j = 0; j < 2*n; j++) {
+        uchar t = work[i*2*n + j];
+        work[i*2*n + j] = work[k*2*n + j];
+        work[k*2*n + j] = t;
+      }
+    }
+    pivot_row = work + i*2*n;
+    inv = gf_inv(pivot_row[i]);
+    for (j = 0; j < 2*n; j++)
+      pivot_row[j] = gf_mul(pivot_row[j], inv);
+    for (k = 0; k < n; k++) {
+      uchar f = work[k*2*n + i];
+      if (k != i && f)
+        for (j = 0; j < 2*n; j++)
+          work[k*2*n + j] ^= gf_mul(f, pivot_row[j]);
+    }
+  }
+  for (i = 0; i < n; i++)
+    memcpy(m + i*n, work + i*2*n + n, n);
+  return 1;
+}
+
+static uchar
+value_to_element(VALUE v)
+{
+  int x = NUM2INT(v);
+  if (x < 0 || x > 255)
+    rb_raise(rb_eRangeError, "GF(2^8) element must be from 0 to 255 (not %d)", x);
+  return (uchar)x;
+}
+
+/* Multiply two elements of GF(2^8), reduced modulo x^8 + x^4 + x^3 + x^2 + 1
+ * (0x11D), the field used by most Reed-Solomon codes.
+ *
+ * @example
+ *   BitTwiddle.gf256_mul(2, 0x80) # => 29
+ *
+ * @param a [Integer] From 0 to 255
+ * @param b [Integer] From 0 to 255
+ * @return [Integer]
+ */
+static VALUE
+bt_gf256_mul(VALUE self, VALUE a, VALUE b)
+{
+  return INT2FIX(gf_mul(value_to_element(a), value_to_element(b)));
+}
+
+/* Multiply each byte of `src` by `coeff` in GF(2^8) (see `BitTwiddle.gf256_mul`),
+ * and XOR the products into the bytes of `dst`, which is modified in place.
+ * This is the inner loop of Reed-Solomon encoding and decoding.
+ *
+ * @example
+ *   dst = "\x00\x01".b
+ *   BitTwiddle.gf256_mul_add(dst, "\x02\x03".b, 2) # => "\x04\x07"
+ *
+ * @param dst [String] Must be the same length as `src`
+ * @param src [String]
+ * @param coeff [Integer] From 0 to 255
+ * @return [String] `dst`
+ */
+static VALUE
+bt_gf256_mul_add(VALUE self, VALUE dst, VALUE src, VALUE coeff)
+{
+  uchar c = value_to_element(coeff);
+
+  StringValue(dst);
+  StringValue(src);
+  if (RSTRING_LEN(dst) != RSTRING_LEN(src))
+    rb_raise(rb_eArgError, "buffers must be the same length (%ld and %ld bytes)", RSTRING_LEN(dst), RSTRING_LEN(src));
+  rb_str_modify(dst);
+  if (c)
+    gf_mul_add((uchar*)RSTRING_PTR(dst), (const uchar*)RSTRING_PTR(src), RSTRING_LEN(src), c);
+  RB_GC_GUARD(src);
+  return dst;
+}
+
+/* Check that '*ary' is an Array of 'n' Strings of the same length (or nil, if
+ * 'allow_nil'), and replace it with a new Array of the Strings (converted with
+ * #to_str where needed); return the length, or -1 if they are all nil */
+static long
+check_buffers(VALUE *ary, long n, int allow_nil)
+{
+  VALUE strs;
+  long  i, len = -1;
+
+  Check_Type(*ary, T_ARRAY);
+  if (RARRAY_LEN(*ary) != n)
+    rb_raise(rb_eArgError, "expected %ld buffers (not %ld)", n, RARRAY_LEN(*ary));
+  strs = rb_ary_new_capa(n);
+  for (i = 0; i < n; i++) {
+    /* rb_ary_entry, since a #to_str method could have shortened the Array */
+    VALUE str = rb_ary_entry(*ary, i);
+    if (!(allow_nil && NIL_P(str))) {
+      StringValue(str);
+      if (len < 0)
+        len = RSTRING_LEN(str);
+      else if (RSTRING_LEN(str) != len)
+        rb_raise(rb_eArgError, "buffers must all be the same length");
+    }
+    rb_ary_push(strs, str);
+  }
+  *ary = strs;
+  return len;
+}
+
+/* Make 'n' new Strings of 'len' bytes, returning them in an Array */
+static VALUE
+new_buffers(long n, long len)
+{
+  VALUE result = rb_ary_new_capa(n);
+  long  i;
+  for (i = 0; i < n; i++)
+    rb_ary_push(result, rb_str_new(NULL, len));
+  return result;
+}
+
+/* Multiply the nout x nin matrix 'coeffs' by the Array of nin 'inputs', each of
+ * 'len' bytes, returning an Array of nout new Strings */
+static VALUE
+matrix_times_buffers(const uchar *coeffs, long nout, VALUE inputs, long nin, long len)
+{
+  VALUE  result = new_buffers(nout, len), tmp;
+  uchar **out   = ALLOCV(tmp, (nout + nin) * sizeof(uchar*));
+  const uchar **in = (const uchar**)(out + nout);
+  long   i;
+
+  for (i = 0; i < nout; i++)
+    out[i] = (uchar*)RSTRING_PTR(RARRAY_AREF(result, i));
+  for (i = 0; i < nin; i++)
+    in[i] = (const uchar*)RSTRING_PTR(RARRAY_AREF(inputs, i));
+  if (len > 0)
+    gf_matrix_apply(coeffs, in, nin, out, nout, len);
+  ALLOCV_END(tmp);
+  return result;
+}
+
+/* Multiply a matrix over GF(2^8) by a column of buffers: output `i` is the sum
+ * over `j` of `matrix[i][j] * inputs[j]`, where each product multiplies every
+ * byte of the buffer by the coefficient.
+ *
+ * @example
+ *   # parity = 1*a + 1*b, and 1*a + 2*b
+ *   p, q = BitTwiddle.gf256_matrix_mul([[1, 1], [1, 2]], ["\x01\x02".b, "\x03\x04".b])
+ *   p # => "\x02\x06"
+ *   q # => "\x07\x0A"
+ *
+ * @param matrix [Array<Array<Integer>>] Rows of coefficients from 0 to 255
+ * @param inputs [Array<String>] Buffers of the same length, one per column
+ * @return [Array<String>] One buffer per row
+ */
+static VALUE
+bt_gf256_matrix_mul(VALUE self, VALUE matrix, VALUE inputs)
+{
+  VALUE  result, tmp;
+  long   nout, nin, len, i, j;
+  uchar *coeffs;
+
+  Check_Type(matrix, T_ARRAY);
+  Check_Type(inputs, T_ARRAY);
+  nout = RARRAY_LEN(matrix);
+  nin  = RARRAY_LEN(inputs);
+  if (nin == 0)
+    rb_raise(rb_eArgError, "no input buffers");
+  len = check_buffers(&inputs, nin, 0);
+
+  coeffs = ALLOCV_N(uchar, tmp, nout*nin + 1);
+  for (i = 0; i < nout; i++) {
+    VALUE row = rb_Array(rb_ary_entry(matrix, i));
+    if (RARRAY_LEN(row) != nin)
+      rb_raise(rb_eArgError, "matrix rows must have %ld coefficients (one per input)", nin);
+    for (j = 0; j < nin; j++)
+      coeffs[i*nin + j] = value_to_element(rb_ary_entry(row, j));
+  }
+  result = matrix_times_buffers(coeffs, nout, inputs, nin, len);
+  ALLOCV_END(tmp);
+  return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+  uchar *matrix;   /* (data + parity) x data encoding matrix; top rows are the identity */
+  long   data;     /* 0 until initialized */
+  long   parity;
+} reed_solomon;
+
+static void
+reed_solomon_free(void *ptr)
+{
+  reed_solomon *rs = ptr;
+  xfree(rs->matrix);
+  xfree(rs);
+}
+
+static size_t
+reed_solomon_memsize(const void *ptr)
+{
+  const reed_solomon *rs = ptr;
+  return sizeof(reed_solomon) + (rs->data + rs->parity) * rs->data;
+}
+
+static const rb_data_type_t reed_solomon_type = {
+  "BitTwiddle::ReedSolomon",
+  { 0, reed_solomon_free, reed_solomon_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+reed_solomon_alloc(VALUE klass)
+{
+  reed_solomon *rs;
+  return TypedData_Make_Struct(klass, reed_solomon, &reed_solomon_type, rs);
+}
+
+static reed_solomon*
+get_reed_solomon(VALUE self)
+{
+  reed_solomon *rs;
+  TypedData_Get_Struct(self, reed_solomon, &reed_solomon_type, rs);
+  if (rs->data == 0)
+    rb_raise(rb_eRuntimeError, "uninitialized ReedSolomon");
+  return rs;
+}
+
+/* Document-method: BitTwiddle::ReedSolomon#initialize
+ * Create a code which adds `parity_shards` parity buffers to `data_shards` data
+ * buffers. Any `data_shards` of the resulting buffers are enough to recover all
+ * of them. The total number of shards can be at most 256.
+ *
+ * @param data_shards [Integer]
+ * @param parity_shards [Integer]
+ */
+static VALUE
+reed_solomon_initialize(VALUE self, VALUE data_shards, VALUE parity_shards)
+{
+  reed_solomon *rs;
+  long k = NUM2LONG(data_shards), m = NUM2LONG(parity_shards), n, r, c, i;
+  uchar *vandermonde, *top, *work;
+  VALUE tmp;
+
+  TypedData_Get_Struct(self, reed_solomon, &reed_solomon_type, rs);
+  if (rs->data)
+    rb_raise(rb_eRuntimeError, "ReedSolomon is already initialized");
+  if (k < 1 || m < 0 || k + m > 256)
+    rb_raise(rb_eArgError, "need at least 1 data shard, no negative parity shards, and at most 256 shards in all (not %ld + %ld)", k, m);
+  n = k + m;
+
+  /* rows of the Vandermonde matrix r^c (for r = 0...n) are linearly independent,
+   * any k at a time; multiplying by the inverse of its top k x k square keeps
+   * that property, and makes the top rows the identity */
+  vandermonde = ALLOCV(tmp, n*k + k*k + 2*k*k);
+  top  = vandermonde + n*k;
+  work = top + k*k;
+  for (r = 0; r < n; r++) {
+    uchar x = 1;
+    for (c = 0; c < k; c++) {
+      vandermonde[r*k + c] = x;
+      x = gf_mul(x, (uchar)r);
+    }
+  }
+  memcpy(top, vandermonde, k*k);
+  gf_invert_matrix(top, k, work);
+
+  xfree(rs->matrix); /* from an earlier call which raised an exception */
+  rs->matrix = ALLOC_N(uchar, n*k);
+  for (r = 0; r < n; r++) {
+    for (c = 0; c < k; c++) {
+      uchar sum = 0;
+      for (i = 0; i < k; i++)
+        sum ^= gf_mul(vandermonde[r*k + i], top[i*k + c]);
+      rs->matrix[r*k + c] = sum;
+    }
+  }
+  ALLOCV_END(tmp);
+  rs->data   = k;
+  rs->parity = m;
+  return self;
+}
+
+/* Document-method: BitTwiddle::ReedSolomon#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+reed_solomon_initialize_copy(VALUE self, VALUE orig)
+{
+  reed_solomon *dst, *src = get_reed_solomon(orig);
+  long size = (src->data + src->parity) * src->data;
+
+  TypedData_Get_Struct(self, reed_solomon, &reed_solomon_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->data)
+    rb_raise(rb_eRuntimeError, "ReedSolomon is already initialized");
+  *dst = *src;
+  dst->matrix = ALLOC_N(uchar, size);
+  memcpy(dst->matrix, src->matrix, size);
+  return self;
+}
+
+/* Document-method: BitTwiddle::ReedSolomon#data_shards
+ * @return [Integer]
+ */
+static VALUE
+reed_solomon_data_shards(VALUE self)
+{
+  return LONG2FIX(get_reed_solomon(self)->data);
+}
+
+/* Document-method: BitTwiddle::ReedSolomon#parity_shards
+ * @return [Integer]
+ */
+static VALUE
+reed_solomon_parity_shards(VALUE self)
+{
+  return LONG2FIX(get_reed_solomon(self)->parity);
+}
+
+/* Compute 'rows' (indices into the encoding matrix) times the data shards */
+static VALUE
+encode_rows(reed_solomon *rs, VALUE data, long len, const long *rows, long nrows)
+{
+  VALUE  result, tmp;
+  uchar *coeffs = ALLOCV_N(uchar, tmp, nrows*rs->data + 1);
+  long   i;
+
+  for (i = 0; i < nrows; i++)
+    memcpy(coeffs + i*rs->data, rs->matrix + rows[i]*rs->data, rs->data);
+  result = matrix_times_buffers(coeffs, nrows, data, rs->data, len);
+  ALLOCV_END(tmp);
+  return result;
+}
+
+/* The parity shards for the data shards */
+static VALUE
+encode_parity(reed_solomon *rs, VALUE data, long len)
+{
+  VALUE result, tmp;
+  long *rows = ALLOCV_N(long, tmp, rs->parity + 1), i;
+
+  for (i = 0; i < rs->parity; i++)
+    rows[i] = rs->data + i;
+  result = encode_rows(rs, data, len, rows, rs->parity);
+  ALLOCV_END(tmp);
+  return result;
+}
+
+/* Document-method: BitTwiddle::ReedSolomon#encode
+ * Compute the parity shards for `data_shards` buffers of equal length.
+ *
+ * @example
+ *   rs = BitTwiddle::ReedSolomon.new(4, 2)
+ *   parity = rs.encode(["abcd", "efgh", "ijkl", "mnop"])
+ *   parity.size # => 2
+ *
+ * @param data [Array<String>]
+ * @return [Array<String>] `parity_shards` buffers, the same length as the data
+ */
+static VALUE
+reed_solomon_encode(VALUE self, VALUE data)
+{
+  reed_solomon *rs = get_reed_solomon(self);
+  long len = check_buffers(&data, rs->data, 0);
+  return encode_parity(rs, data, len);
+}
+
+/* Document-method: BitTwiddle::ReedSolomon#reconstruct
+ * Given all the shards (data first, then parity) with missing ones replaced by
+ * `nil`, return a new Array with the missing shards filled in. At least
+ * `data_shards` shards must be present.
+ *
+ * @example
+ *   rs = BitTwiddle::ReedSolomon.new(4, 2)
+ *   data = ["abcd", "efgh", "ijkl", "mnop"]
+ *   shards = data + rs.encode(data)
+ *   shards[1] = shards[4] = nil
+ *   rs.reconstruct(shards)[1] # => "efgh"
+ *
+ * @param shards [Array<String, nil>] `data_shards + parity_shards` entries
+ * @return [Array<String>]
+ * @raise [ArgumentError] If too many shards are missing
+ */
+static VALUE
+reed_solomon_reconstruct(VALUE self, VALUE shards)
+{
+  reed_solomon *rs = get_reed_solomon(self);
+  long   k = rs->data, n = rs->data + rs->parity;
+  long   len = check_buffers(&shards, n, 1), i, j, present = 0, nmissing = 0;
+  long  *have, *missing;
+  uchar *sub, *work;
+  VALUE  result = rb_ary_dup(shards), basis, decoded, tmp;
+
+  have    = ALLOCV(tmp, (k + n) * sizeof(long) + 3*k*k);
+  missing = have + k;
+  sub     = (uchar*)(missing + n);
+  work    = sub + k*k;
+
+  for (i = 0; i < n; i++) {
+    if (NIL_P(RARRAY_AREF(shards, i)))
+      missing[nmissing++] = i;
+    else if (present < k)
+      have[present++] = i;
+  }
+  if (present < k) {
+    ALLOCV_END(tmp);
+    rb_raise(rb_eArgError, "need at least %ld shards to reconstruct (only %ld present)", k, present);
+  }
+  if (nmissing == 0) {
+    ALLOCV_END(tmp);
+    return result;
+  }
+
+  /* the data is the inverse of the rows we have, times the shards we have */
+  basis = rb_ary_new_capa(k);
+  for (i = 0; i < k; i++) {
+    memcpy(sub + i*k, rs->matrix + have[i]*k, k);
+    rb_ary_push(basis, RARRAY_AREF(shards, have[i]));
+  }
+  gf_invert_matrix(sub, k, work);
+  decoded = matrix_times_buffers(sub, k, basis, k, len);
+
+  for (j = 0; j < nmissing && missing[j] < k; j++)
+    rb_ary_store(result, missing[j], RARRAY_AREF(decoded, missing[j]));
+  if (j < nmissing) {
+    VALUE parity = encode_rows(rs, decoded, len, missing + j, nmissing - j);
+    for (i = j; i < nmissing; i++)
+      rb_ary_store(result, missing[i], RARRAY_AREF(parity, i - j));
+  }
+  ALLOCV_END(tmp);
+  return result;
+}
+
+/* Document-method: BitTwiddle::ReedSolomon#verify
+ * Check whether the parity shards match the data shards.
+ *
+ * @param shards [Array<String>] `data_shards + parity_shards` buffers
+ * @return [Boolean]
+ */
+static VALUE
+reed_solomon_verify(VALUE self, VALUE shards)
+{
+  reed_solomon *rs = get_reed_solomon(self);
+  long  len = check_buffers(&shards, rs->data + rs->parity, 0), i;
+  VALUE parity = encode_parity(rs, rb_ary_subseq(shards, 0, rs->data), len);
+
+  for (i = 0; i < rs->parity; i++) {
+    VALUE given = RARRAY_AREF(shards, rs->data + i);
+    if (memcmp(RSTRING_PTR(RARRAY_AREF(parity, i)), RSTRING_PTR(given), len))
+      return Qfalse;
+  }
+  return Qtrue;
+}
+
+void Init_bt_gf256(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::ReedSolomon
+   * A systematic Reed-Solomon erasure code over GF(2^8): `data_shards` buffers
+   * are extended with `parity_shards` parity buffers of the same length, and
+   * any `data_shards` of them are enough to rebuild the rest.
+   */
+  VALUE rb_cReedSolomon = rb_define_class_under(rb_mBitTwiddle, "ReedSolomon", rb_cObject);
+
+  gf_init_tables();
+
+  rb_define_singleton_method(rb_mBitTwiddle, "gf256_mul",        bt_gf256_mul,        2);
+  rb_define_singleton_method(rb_mBitTwiddle, "gf256_mul_add",    bt_gf256_mul_add,    3);
+  rb_define_singleton_method(rb_mBitTwiddle, "gf256_matrix_mul", bt_gf256_matrix_mul, 2);
+
+  rb_define_alloc_func(rb_cReedSolomon, reed_solomon_alloc);
+  rb_define_method(rb_cReedSolomon, "initialize",      reed_solomon_initialize,      2);
+  rb_define_method(rb_cReedSolomon, "initialize_copy", reed_solomon_initialize_copy, 1);
+  rb_define_method(rb_cReedSolomon, "data_shards",     reed_solomon_data_shards,     0);
+  rb_define_method(rb_cReedSolomon, "parity_shards",   reed_solomon_parity_shards,   0);
+  rb_define_method(rb_cReedSolomon, "encode",          reed_solomon_encode,          1);
+  rb_define_method(rb_cReedSolomon, "reconstruct",     reed_solomon_reconstruct,     1);
+  rb_define_method(rb_cReedSolomon, "verify",          reed_solomon_verify,          1);
+}
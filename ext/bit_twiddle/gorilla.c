@@ -0,0 +1,667 @@
+/* BitTwiddle::Gorilla: compression for time series, as in Facebook's Gorilla
+ * database
+ *
+ * Floats are XORed with the previous value; the XOR is usually 0 (written as a
+ * single 0 bit), or has long runs of leading and trailing zeroes, so only the
+ * "meaningful" bits in between are written. If they fit inside the window of
+ * meaningful bits used for the previous value, that window is reused:
+ *
+ *   0                              value is unchanged
+ *   10 <meaningful bits>           XOR fits in the previous window
+ *   11 <5 bits: leading zeroes> <6 bits: length> <meaningful bits>
+ *
+ * Integers (such as timestamps) are stored as the difference between
+ * consecutive deltas ("delta of delta"), which is 0 for regularly spaced values:
+ *
+ *   0                              delta of delta is 0
+ *   10   <7 bits>                  -64 to 63
+ *   110  <9 bits>                  -256 to 255
+ *   1110 <12 bits>                 -2048 to 2047
+ *   1111 <64 bits>                 anything else
+ *
+ * The first value in a series is written in full, in 64 bits. */
+
+#include "bit_twiddle.h"
+#include "bit_stream.h"
+
+#define GORILLA_FLOAT   0
+#define GORILLA_INTEGER 1
+
+/* State carried from one value to the next; the same for encoding and decoding */
+typedef struct {
+  uint64_t prev;        /* previous value (bits of a double, or an int64) */
+  uint64_t prev_delta;  /* integers only */
+  int      leading;     /* floats only: window used for the previous XOR */
+  int      trailing;
+} gorilla_state;
+
+typedef struct {
+  bt_bitwriter  w;
+  gorilla_state st;
+  size_t        count;
+  int           type;
+} gorilla;
+
+static inline void
+gorilla_state_init(gorilla_state *st)
+{
+  st->prev = st->prev_delta = 0;
+  st->leading  = 64; /* no window yet */
+  st->trailing = 0;
+}
+
+static inline void
+gorilla_put_float(bt_bitwriter *w, gorilla_state *st, uint64_t bits, size_t index)
+{
+  uint64_t x = bits ^ st->prev;
+  st->prev = bits;
+
+  if (index == 0) {
+    bt_bw_put(w, bits, 64);
+  } else if (x == 0) {
+    bt_bw_put(w, 0, 1);
+  } else {
+    int leading  = __builtin_clzll(x);
+    int trailing = __builtin_ctzll(x);
+    if (leading > 31)
+      leading = 31;
+    if (leading >= st->leading && trailing >= st->trailing) {
+      bt_bw_put(w, 2, 2);
+      bt_bw_put(w, x >> st->trailing, 64 - st->leading - st->trailing);
+    } else {
+      int len = 64 - leading - trailing;
+      /* a length of 64 is written as 0 */
+      bt_bw_put(w, (3 << 11) | (leading << 6) | (len & 63), 13);
+      bt_bw_put(w, x >> trailing, len);
+      st->leading  = leading;
+      st->trailing = trailing;
+    }
+  }
+}
+
+static inline uint64_t
+gorilla_get_float(bt_bitreader *r, gorilla_state *st, size_t index)
+{
+  if (index == 0) {
+    st->prev = bt_br_get(r, 64);
+  } else {
+    int ctrl = bt_br_ones(r, 2);
+    if (ctrl) {
+      if (ctrl == 2) {
+        uint64_t header = bt_br_get(r, 11);
+        int len = header & 63;
+        st->leading  = header >> 6;
+        st->trailing = 64 - st->leading - (len ? len : 64);
+        if (st->trailing < 0)
+          rb_raise(rb_eArgError, "corrupt Gorilla data");
+      } else if (st->leading == 64) {
+        rb_raise(rb_eArgError, "corrupt Gorilla data");
+      }
+      st->prev ^= bt_br_get(r, 64 - st->leading - st->trailing) << st->trailing;
+    }
+  }
+  return st->prev;
+}
+
+static inline void
+gorilla_put_integer(bt_bitwriter *w, gorilla_state *st, uint64_t v, size_t index)
+{
+  uint64_t delta = v - st->prev;
+  int64_t  dod   = (int64_t)(delta - st->prev_delta);
+  st->prev = v;
+
+  if (index == 0) {
+    bt_bw_put(w, v, 64);
+    return;
+  }
+  st->prev_delta = delta;
+
+  if (dod == 0)
+    bt_bw_put(w, 0, 1);
+  else if (dod >= -64 && dod < 64)
+    bt_bw_put(w, (2ULL << 7) | bt_low_bits(dod, 7), 9);
+  else if (dod >= -256 && dod < 256)
+    bt_bw_put(w, (6ULL << 9) | bt_low_bits(dod, 9), 12);
+  else if (dod >= -2048 && dod < 2048)
+    bt_bw_put(w, (14ULL << 12) | bt_low_bits(dod, 12), 16);
+  else {
+    bt_bw_put(w, 15, 4);
+    bt_bw_put(w, dod, 64);
+  }
+}
+
+static inline uint64_t
+sign_extend(uint64_t v, int bits)
+{
+  uint64_t m = 1ULL << (bits - 1);
+  return (v ^ m) - m;
+}
+
+static inline uint64_t
+gorilla_get_integer(bt_bitreader *r, gorilla_state *st, size_t index)
+{
+  static const int widths[5] = { 0, 7, 9, 12, 64 };
+  int ctrl;
+
+  if (index == 0)
+    return st->prev = bt_br_get(r, 64);
+
+  ctrl = bt_br_ones(r, 4);
+  if (ctrl)
+    st->prev_delta += sign_extend(bt_br_get(r, widths[ctrl]), widths[ctrl]);
+  return st->prev += st->prev_delta;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void
+gorilla_free(void *ptr)
+{
+  gorilla *g = ptr;
+  bt_bw_free(&g->w);
+  xfree(g);
+}
+
+static size_t
+gorilla_memsize(const void *ptr)
+{
+  const gorilla *g = ptr;
+  return sizeof(gorilla) + g->w.capa;
+}
+
+static const rb_data_type_t gorilla_type = {
+  "BitTwiddle::Gorilla",
+  { 0, gorilla_free, gorilla_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+gorilla_alloc(VALUE klass)
+{
+  gorilla *g;
+  VALUE obj = TypedData_Make_Struct(klass, gorilla, &gorilla_type, g);
+  g->type = -1;
+  return obj;
+}
+
+static gorilla*
+get_gorilla(VALUE self)
+{
+  gorilla *g;
+  TypedData_Get_Struct(self, gorilla, &gorilla_type, g);
+  if (g->type < 0)
+    rb_raise(rb_eRuntimeError, "uninitialized Gorilla");
+  return g;
+}
+
+static void
+gorilla_setup(gorilla *g, int type)
+{
+  bt_bw_init(&g->w);
+  gorilla_state_init(&g->st);
+  g->count = 0;
+  g->type  = type;
+}
+
+static inline void
+gorilla_put(gorilla *g, uint64_t v)
+{
+  if (g->type == GORILLA_FLOAT)
+    gorilla_put_float(&g->w, &g->st, v, g->count++);
+  else
+    gorilla_put_integer(&g->w, &g->st, v, g->count++);
+}
+
+static inline uint64_t
+gorilla_get(const gorilla *g, bt_bitreader *r, gorilla_state *st, size_t index)
+{
+  uint64_t v = (g->type == GORILLA_FLOAT) ? gorilla_get_float(r, st, index)
+                                          : gorilla_get_integer(r, st, index);
+  if (r->pos > r->bits)
+    rb_raise(rb_eArgError, "Gorilla data is truncated");
+  return v;
+}
+
+static inline uint64_t
+value_to_bits(const gorilla *g, VALUE value)
+{
+  if (g->type == GORILLA_FLOAT) {
+    double d = RFLOAT_VALUE(rb_to_float(value));
+    uint64_t bits;
+    memcpy(&bits, &d, 8);
+    return bits;
+  } else {
+    /* NUM2LL would truncate a Float */
+    if (!RB_INTEGER_TYPE_P(value))
+      rb_raise(rb_eTypeError, "an :integer series needs Integer values (not %"PRIsVALUE")",
+               rb_obj_class(value));
+    return (uint64_t)NUM2LL(value);
+  }
+}
+
+static inline VALUE
+bits_to_value(const gorilla *g, uint64_t bits)
+{
+  if (g->type == GORILLA_FLOAT) {
+    double d;
+    memcpy(&d, &bits, 8);
+    return DBL2NUM(d);
+  } else {
+    return LL2NUM((int64_t)bits);
+  }
+}
+
+static int
+value_to_type(VALUE type)
+{
+  ID id;
+  if (NIL_P(type))
+    return GORILLA_FLOAT;
+  id = SYM2ID(type);
+  if (id == rb_intern("float"))
+    return GORILLA_FLOAT;
+  if (id == rb_intern("integer"))
+    return GORILLA_INTEGER;
+  rb_raise(rb_eArgError, "Gorilla series type must be :float or :integer");
+}
+
+/* Document-method: BitTwiddle::Gorilla#initialize
+ * Create an empty series of Floats or Integers.
+ *
+ * @example
+ *   series = BitTwiddle::Gorilla.new(:integer)
+ *   series << 1_600_000_000 << 1_600_000_060 << 1_600_000_120
+ *   series.bytesize # => 10
+ *
+ * @param type [Symbol] `:float` (default) or `:integer`
+ */
+static VALUE
+gorilla_initialize(int argc, VALUE *argv, VALUE self)
+{
+  gorilla *g;
+  VALUE type;
+
+  rb_scan_args(argc, argv, "01", &type);
+  TypedData_Get_Struct(self, gorilla, &gorilla_type, g);
+  if (g->type >= 0)
+    rb_raise(rb_eRuntimeError, "Gorilla is already initialized");
+  gorilla_setup(g, value_to_type(type));
+  return self;
+}
+
+/* Document-method: BitTwiddle::Gorilla#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+gorilla_initialize_copy(VALUE self, VALUE orig)
+{
+  gorilla *dst, *src = get_gorilla(orig);
+
+  TypedData_Get_Struct(self, gorilla, &gorilla_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->type >= 0)
+    rb_raise(rb_eRuntimeError, "Gorilla is already initialized");
+  *dst = *src;
+  dst->w.buf = ALLOC_N(uchar, src->w.capa);
+  memcpy(dst->w.buf, src->w.buf, src->w.capa);
+  return self;
+}
+
+/* Document-method: BitTwiddle::Gorilla#type
+ * @return [Symbol] `:float` or `:integer`
+ */
+static VALUE
+gorilla_type_m(VALUE self)
+{
+  return ID2SYM(rb_intern(get_gorilla(self)->type == GORILLA_FLOAT ? "float" : "integer"));
+}
+
+/* Document-method: BitTwiddle::Gorilla#size
+ * @return [Integer] The number of values in the series
+ */
+static VALUE
+gorilla_size(VALUE self)
+{
+  return SIZET2NUM(get_gorilla(self)->count);
+}
+
+/* Document-method: BitTwiddle::Gorilla#bytesize
+ * @return [Integer] The number of bytes of compressed data (not counting the
+ *   small header added by `#to_s`)
+ */
+static VALUE
+gorilla_bytesize(VALUE self)
+{
+  return SIZET2NUM((bt_bw_bits(&get_gorilla(self)->w) + 7) / 8);
+}
+
+/* Document-method: BitTwiddle::Gorilla#<<
+ * Append a value to the series.
+ *
+ * For an `:integer` series, if `value` is not an `Integer`, raise `TypeError`,
+ * and if it does not fit in a signed 64-bit integer, raise `RangeError`.
+ *
+ * @param value [Float, Integer]
+ * @return [Gorilla] self
+ */
+static VALUE
+gorilla_push(VALUE self, VALUE value)
+{
+  gorilla *g = get_gorilla(self);
+  rb_check_frozen(self);
+  gorilla_put(g, value_to_bits(g, value));
+  return self;
+}
+
+/* Document-method: BitTwiddle::Gorilla#append
+ * Append all the values in a `String` of native-endian doubles (for a `:float`
+ * series, as produced by `Array#pack("d*")`) or signed 64-bit integers (for an
+ * `:integer` series, as produced by `Array#pack("q*")`).
+ *
+ * @example
+ *   series = BitTwiddle::Gorilla.new(:float)
+ *   series.append([1.5, 1.5, 2.0].pack("d*"))
+ *   series.to_a # => [1.5, 1.5, 2.0]
+ *
+ * @param buffer [String]
+ * @return [Gorilla] self
+ */
+static VALUE
+gorilla_append(VALUE self, VALUE buffer)
+{
+  gorilla *g = get_gorilla(self);
+  const uchar *p;
+  size_t n, i;
+
+  rb_check_frozen(self);
+  StringValue(buffer);
+  if (RSTRING_LEN(buffer) % 8)
+    rb_raise(rb_eArgError, "buffer length must be a multiple of 8 bytes");
+  n = RSTRING_LEN(buffer) / 8;
+  p = (const uchar*)RSTRING_PTR(buffer);
+
+  if (g->type == GORILLA_FLOAT) {
+    for (i = 0; i < n; i++) {
+      uint64_t v;
+      memcpy(&v, p + i*8, 8);
+      gorilla_put_float(&g->w, &g->st, v, g->count++);
+    }
+  } else {
+    for (i = 0; i < n; i++) {
+      uint64_t v;
+      memcpy(&v, p + i*8, 8);
+      gorilla_put_integer(&g->w, &g->st, v, g->count++);
+    }
+  }
+  return self;
+}
+
+/* Decode values [start, start+count) into 'out' as native 64-bit words,
+ * continuing from the reader state */
+static void
+gorilla_decode(const gorilla *g, bt_bitreader *r, gorilla_state *st, size_t start, size_t count, uchar *out)
+{
+  size_t i;
+  for (i = 0; i < count; i++) {
+    uint64_t v = gorilla_get(g, r, st, start + i);
+    memcpy(out + i*8, &v, 8);
+  }
+}
+
+static VALUE
+gorilla_enum_size(VALUE self, VALUE args, VALUE eobj)
+{
+  return gorilla_size(self);
+}
+
+/* Document-method: BitTwiddle::Gorilla#each
+ * Yield each value in turn.
+ *
+ * @yieldparam value [Float, Integer]
+ * @return [Gorilla, Enumerator]
+ */
+static VALUE
+gorilla_each(VALUE self)
+{
+  gorilla *g;
+  gorilla_state st;
+  bt_bitreader  r;
+  size_t i, count;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, gorilla_enum_size);
+  g = get_gorilla(self);
+  /* values appended by the block are not seen; and since the buffer could be
+   * reallocated, work from a copy */
+  count = g->count;
+  {
+    VALUE  copy = rb_str_new((const char*)g->w.buf, bt_bw_sync(&g->w) + BT_BITSTREAM_PAD);
+    bt_br_init(&r, (const uchar*)RSTRING_PTR(copy), bt_bw_bits(&g->w));
+    gorilla_state_init(&st);
+    for (i = 0; i < count; i++)
+      rb_yield(bits_to_value(g, gorilla_get(g, &r, &st, i)));
+    RB_GC_GUARD(copy);
+  }
+  return self;
+}
+
+/* Document-method: BitTwiddle::Gorilla#to_a
+ * @return [Array<Float>, Array<Integer>] All the values
+ */
+static VALUE
+gorilla_to_a(VALUE self)
+{
+  gorilla *g = get_gorilla(self);
+  gorilla_state st;
+  bt_bitreader  r;
+  VALUE  ary = rb_ary_new_capa(g->count);
+  size_t i;
+
+  bt_bw_sync(&g->w);
+  bt_br_init(&r, g->w.buf, bt_bw_bits(&g->w));
+  gorilla_state_init(&st);
+  for (i = 0; i < g->count; i++)
+    rb_ary_push(ary, bits_to_value(g, gorilla_get(g, &r, &st, i)));
+  return ary;
+}
+
+/* Document-method: BitTwiddle::Gorilla#to_buffer
+ * Decode all the values into a `String` of native-endian doubles or signed
+ * 64-bit integers (which can be read with `String#unpack("d*")` or
+ * `String#unpack("q*")`).
+ *
+ * @return [String]
+ */
+static VALUE
+gorilla_to_buffer(VALUE self)
+{
+  gorilla *g = get_gorilla(self);
+  gorilla_state st;
+  bt_bitreader  r;
+  VALUE result = rb_str_new(NULL, g->count * 8);
+
+  bt_bw_sync(&g->w);
+  bt_br_init(&r, g->w.buf, bt_bw_bits(&g->w));
+  gorilla_state_init(&st);
+  gorilla_decode(g, &r, &st, 0, g->count, (uchar*)RSTRING_PTR(result));
+  return result;
+}
+
+/* Document-method: BitTwiddle::Gorilla#each_block
+ * Decode the values `block_size` at a time, yielding each block as a `String`
+ * of native-endian doubles or signed 64-bit integers (as returned by
+ * `#to_buffer`). The last block may be shorter.
+ *
+ * @example
+ *   series.each_block(4096) { |buf| process(buf.unpack("d*")) }
+ *
+ * @param block_size [Integer] (default 1024)
+ * @yieldparam buffer [String]
+ * @return [Gorilla, Enumerator]
+ */
+static VALUE
+gorilla_each_block(int argc, VALUE *argv, VALUE self)
+{
+  gorilla *g;
+  gorilla_state st;
+  bt_bitreader  r;
+  VALUE  block_size, copy;
+  long   bs = 1024;
+  size_t i, count;
+
+  RETURN_ENUMERATOR(self, argc, argv);
+  rb_scan_args(argc, argv, "01", &block_size);
+  if (!NIL_P(block_size))
+    bs = NUM2LONG(block_size);
+  if (bs <= 0)
+    rb_raise(rb_eArgError, "block size must be positive");
+
+  g     = get_gorilla(self);
+  count = g->count;
+  copy  = rb_str_new((const char*)g->w.buf, bt_bw_sync(&g->w) + BT_BITSTREAM_PAD);
+  bt_br_init(&r, (const uchar*)RSTRING_PTR(copy), bt_bw_bits(&g->w));
+  gorilla_state_init(&st);
+
+  for (i = 0; i < count; i += bs) {
+    size_t n = (count - i < (size_t)bs) ? count - i : (size_t)bs;
+    VALUE  buf = rb_str_new(NULL, n * 8);
+    gorilla_decode(g, &r, &st, i, n, (uchar*)RSTRING_PTR(buf));
+    rb_yield(buf);
+  }
+  RB_GC_GUARD(copy);
+  return self;
+}
+
+/* Document-method: BitTwiddle::Gorilla#to_s
+ * Serialize the series as a `String`, which can be read back with
+ * `BitTwiddle::Gorilla.load`.
+ *
+ * The format is a type byte (`"F"` or `"I"`), the number of values as a LEB128
+ * varint, then the compressed bits.
+ *
+ * @return [String]
+ */
+static VALUE
+gorilla_to_s(VALUE self)
+{
+  gorilla *g = get_gorilla(self);
+  size_t bytes = bt_bw_sync(&g->w);
+  uchar  header[11], *h = header;
+  uint64_t n = g->count;
+  VALUE  result;
+
+  *h++ = (g->type == GORILLA_FLOAT) ? 'F' : 'I';
+  while (n >= 0x80) {
+    *h++ = (uchar)n | 0x80;
+    n >>= 7;
+  }
+  *h++ = (uchar)n;
+
+  result = rb_str_new(NULL, (h - header) + bytes);
+  memcpy(RSTRING_PTR(result), header, h - header);
+  memcpy(RSTRING_PTR(result) + (h - header), g->w.buf, bytes);
+  return result;
+}
+
+/* Document-method: BitTwiddle::Gorilla.load
+ * Read a series serialized by `#to_s`. More values can be appended to it.
+ *
+ * If `str` is not a valid serialized series, raise `ArgumentError`.
+ *
+ * @example
+ *   series = BitTwiddle::Gorilla.new
+ *   series << 1.0 << 2.0
+ *   BitTwiddle::Gorilla.load(series.to_s).to_a # => [1.0, 2.0]
+ *
+ * @param str [String]
+ * @return [Gorilla]
+ */
+static VALUE
+gorilla_s_load(VALUE klass, VALUE str)
+{
+  VALUE obj = gorilla_alloc(klass);
+  gorilla *g;
+  const uchar *p, *end;
+  uint64_t count = 0;
+  int shift = 0, type;
+  bt_bitreader r;
+  gorilla_state st;
+  size_t i, len;
+
+  StringValue(str);
+  p   = (const uchar*)RSTRING_PTR(str);
+  end = p + RSTRING_LEN(str);
+  if (p == end || (*p != 'F' && *p != 'I'))
+    rb_raise(rb_eArgError, "not a serialized Gorilla series");
+  type = (*p++ == 'F') ? GORILLA_FLOAT : GORILLA_INTEGER;
+  for (;;) {
+    if (p == end || shift > 63)
+      rb_raise(rb_eArgError, "not a serialized Gorilla series");
+    count |= (uint64_t)(*p & 0x7F) << shift;
+    shift += 7;
+    if (!(*p++ & 0x80))
+      break;
+  }
+  len = end - p;
+  if (count > (uint64_t)len * 8)
+    rb_raise(rb_eArgError, "Gorilla data is truncated");
+
+  TypedData_Get_Struct(obj, gorilla, &gorilla_type, g);
+  gorilla_setup(g, type);
+
+  /* decode everything once, to check the data and to recover the encoder's state
+   * (so more values can be appended); then rebuild the writer from the bits */
+  {
+    VALUE copy = rb_str_new(NULL, len + BT_BITSTREAM_PAD);
+    memcpy(RSTRING_PTR(copy), p, len);
+    memset(RSTRING_PTR(copy) + len, 0, BT_BITSTREAM_PAD);
+    bt_br_init(&r, (const uchar*)RSTRING_PTR(copy), len * 8);
+    gorilla_state_init(&st);
+    for (i = 0; i < count; i++)
+      gorilla_get(g, &r, &st, i);
+    if ((r.pos + 7) / 8 != len)
+      rb_raise(rb_eArgError, "Gorilla data has trailing garbage");
+
+    r.buf = (const uchar*)RSTRING_PTR(copy);
+    for (i = 0; i + 64 <= r.pos; i += 64)
+      bt_bw_put(&g->w, load_be64(r.buf + i/8), 64);
+    if (r.pos > i)
+      bt_bw_put(&g->w, load_be64(r.buf + i/8) >> (64 - (r.pos - i)), r.pos - i);
+    RB_GC_GUARD(copy);
+  }
+
+  g->st    = st;
+  g->count = count;
+  return obj;
+}
+
+void Init_bt_gorilla(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::Gorilla
+   * A compressed series of Floats or Integers, using the XOR and
+   * delta-of-delta encodings of Facebook's Gorilla time series database.
+   * Slowly-changing floating-point metrics and regularly spaced timestamps
+   * typically take 1 to 2 bytes per value.
+   */
+  VALUE rb_cGorilla = rb_define_class_under(rb_mBitTwiddle, "Gorilla", rb_cObject);
+
+  rb_include_module(rb_cGorilla, rb_mEnumerable);
+  rb_define_alloc_func(rb_cGorilla, gorilla_alloc);
+  rb_define_singleton_method(rb_cGorilla, "load", gorilla_s_load, 1);
+
+  rb_define_method(rb_cGorilla, "initialize",      gorilla_initialize,      -1);
+  rb_define_method(rb_cGorilla, "initialize_copy", gorilla_initialize_copy,  1);
+  rb_define_method(rb_cGorilla, "type",            gorilla_type_m,           0);
+  rb_define_method(rb_cGorilla, "size",            gorilla_size,             0);
+  rb_define_method(rb_cGorilla, "length",          gorilla_size,             0);
+  rb_define_method(rb_cGorilla, "bytesize",        gorilla_bytesize,         0);
+  rb_define_method(rb_cGorilla, "<<",              gorilla_push,             1);
+  rb_define_method(rb_cGorilla, "append",          gorilla_append,           1);
+  rb_define_method(rb_cGorilla, "each",            gorilla_each,             0);
+  rb_define_method(rb_cGorilla, "each_block",      gorilla_each_block,      -1);
+  rb_define_method(rb_cGorilla, "to_a",            gorilla_to_a,             0);
+  rb_define_method(rb_cGorilla, "to_buffer",       gorilla_to_buffer,        0);
+  rb_define_method(rb_cGorilla, "to_s",            gorilla_to_s,             0);
+}
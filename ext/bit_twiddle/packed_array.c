@@ -0,0 +1,763 @@
+/* BitTwiddle::PackedArray: an array of unsigned integers, each stored in exactly
+ * N bits
+ *
+ * For N <= 32, elements are stored in blocks of 128, using the same layout as
+ * SIMD-BP128: a block is a sequence of 4-word groups, and element i of the block
+ * goes in lane i%4 of those groups, at bit offset (i/4)*N within its lane. So
+ * 4 elements are packed or unpacked with each 128-bit SIMD operation, and any
+ * single element can still be found in O(1).
+ *
+ * For N > 32, elements are simply stored one after another in 64-bit words. */
+
+#include "bit_twiddle.h"
+#include "bt_bignum.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define BLOCK_SIZE 128
+
+typedef struct {
+  void  *data;     /* uint32_t[] for bits <= 32, otherwise uint64_t[] */
+  size_t size;     /* number of elements */
+  size_t capacity; /* number of elements which 'data' has room for; a multiple of BLOCK_SIZE */
+  int    bits;
+} packed_array;
+
+static inline uint64_t
+pa_mask(int bits)
+{
+  return (bits == 64) ? ~0ULL : (1ULL << bits) - 1;
+}
+
+/* Bytes needed to store 'capacity' elements */
+static inline size_t
+pa_bytes(int bits, size_t capacity)
+{
+  return capacity / 8 * bits;
+}
+
+static inline uint64_t
+pa_get(const packed_array *pa, size_t i)
+{
+  int bits = pa->bits;
+
+  if (bits <= 32) {
+    const uint32_t *lanes = (const uint32_t*)pa->data + (i / BLOCK_SIZE) * 4 * bits;
+    size_t   r    = i % BLOCK_SIZE;
+    size_t   bit  = (r / 4) * bits;
+    size_t   word = (bit / 32) * 4 + (r & 3);
+    int      off  = bit % 32;
+    uint64_t v    = lanes[word] >> off;
+    if (off + bits > 32)
+      v |= (uint64_t)lanes[word + 4] << (32 - off);
+    return v & pa_mask(bits);
+  } else {
+    const uint64_t *words = (const uint64_t*)pa->data;
+    size_t   bit = i * bits;
+    int      off = bit % 64;
+    uint64_t v   = words[bit / 64] >> off;
+    if (off + bits > 64)
+      v |= words[bit / 64 + 1] << (64 - off);
+    return v & pa_mask(bits);
+  }
+}
+
+static inline void
+pa_set(packed_array *pa, size_t i, uint64_t v)
+{
+  int      bits = pa->bits;
+  uint64_t mask = pa_mask(bits);
+
+  if (bits <= 32) {
+    uint32_t *lanes = (uint32_t*)pa->data + (i / BLOCK_SIZE) * 4 * bits;
+    size_t    r     = i % BLOCK_SIZE;
+    size_t    bit   = (r / 4) * bits;
+    size_t    word  = (bit / 32) * 4 + (r & 3);
+    int       off   = bit % 32;
+    lanes[word] = (lanes[word] & ~(uint32_t)(mask << off)) | (uint32_t)(v << off);
+    if (off + bits > 32)
+      lanes[word + 4] = (lanes[word + 4] & ~(uint32_t)(mask >> (32 - off))) | (uint32_t)(v >> (32 - off));
+  } else {
+    uint64_t *words = (uint64_t*)pa->data;
+    size_t    bit   = i * bits;
+    size_t    word  = bit / 64;
+    int       off   = bit % 64;
+    words[word] = (words[word] & ~(mask << off)) | (v << off);
+    if (off + bits > 64)
+      words[word + 1] = (words[word + 1] & ~(mask >> (64 - off))) | (v >> (64 - off));
+  }
+}
+
+/* Pack 128 uint32_t values into one BP128 block of 4*bits words, or the reverse
+ * These are always inlined into a switch on 'bits', so the compiler can fully
+ * unroll them with constant shift distances */
+#ifdef __SSE2__
+
+static inline __attribute__((always_inline)) void
+bp128_pack(const uint32_t *in, uint32_t *out, int bits)
+{
+  __m128i acc = _mm_setzero_si128();
+  int shift = 0, i;
+
+  for (i = 0; i < 32; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + 4*i));
+    acc = _mm_or_si128(acc, _mm_slli_epi32(v, shift));
+    if (shift + bits >= 32) {
+      _mm_storeu_si128((__m128i*)out, acc);
+      out += 4;
+      acc = (shift + bits > 32) ? _mm_srli_epi32(v, 32 - shift) : _mm_setzero_si128();
+      shift = shift + bits - 32;
+    } else {
+      shift += bits;
+    }
+  }
+}
+
+static inline __attribute__((always_inline)) void
+bp128_unpack(const uint32_t *in, uint32_t *out, int bits)
+{
+  __m128i mask = _mm_set1_epi32((int)(uint32_t)pa_mask(bits));
+  __m128i w    = _mm_loadu_si128((const __m128i*)in);
+  int shift = 0, i;
+
+  for (i = 0; i < 32; i++) {
+    __m128i v = _mm_srli_epi32(w, shift);
+    if (shift + bits > 32) {
+      in += 4;
+      w = _mm_loadu_si128((const __m128i*)in);
+      v = _mm_or_si128(v, _mm_slli_epi32(w, 32 - shift));
+      shift = shift + bits - 32;
+    } else if (shift + bits == 32) {
+      if (i < 31) {
+        in += 4;
+        w = _mm_loadu_si128((const __m128i*)in);
+      }
+      shift = 0;
+    } else {
+      shift += bits;
+    }
+    _mm_storeu_si128((__m128i*)(out + 4*i), _mm_and_si128(v, mask));
+  }
+}
+
+#else
+
+static inline __attribute__((always_inline)) void
+bp128_pack(const uint32_t *in, uint32_t *out, int bits)
+{
+  int lane, i;
+
+  for (lane = 0; lane < 4; lane++) {
+    uint32_t *o = out + lane, acc = 0;
+    int shift = 0;
+    for (i = 0; i < 32; i++) {
+      uint32_t v = in[4*i + lane];
+      acc |= v << shift;
+      if (shift + bits >= 32) {
+        *o = acc;
+        o += 4;
+        acc = (shift + bits > 32) ? v >> (32 - shift) : 0;
+        shift = shift + bits - 32;
+      } else {
+        shift += bits;
+      }
+    }
+  }
+}
+
+static inline __attribute__((always_inline)) void
+bp128_unpack(const uint32_t *in, uint32_t *out, int bits)
+{
+  uint32_t mask = (uint32_t)pa_mask(bits);
+  int lane, i;
+
+  for (lane = 0; lane < 4; lane++) {
+    const uint32_t *p = in + lane;
+    uint32_t w = *p;
+    int shift = 0;
+    for (i = 0; i < 32; i++) {
+      uint32_t v = w >> shift;
+      if (shift + bits > 32) {
+        p += 4;
+        w = *p;
+        v |= w << (32 - shift);
+        shift = shift + bits - 32;
+      } else if (shift + bits == 32) {
+        if (i < 31) {
+          p += 4;
+          w = *p;
+        }
+        shift = 0;
+      } else {
+        shift += bits;
+      }
+      out[4*i + lane] = v & mask;
+    }
+  }
+}
+
+#endif
+
+#define BP128_CASES(fn) \
+  case 1:  fn(in, out, 1);  break; case 2:  fn(in, out, 2);  break; \
+  case 3:  fn(in, out, 3);  break; case 4:  fn(in, out, 4);  break; \
+  case 5:  fn(in, out, 5);  break; case 6:  fn(in, out, 6);  break; \
+  case 7:  fn(in, out, 7);  break; case 8:  fn(in, out, 8);  break; \
+  case 9:  fn(in, out, 9);  break; case 10: fn(in, out, 10); break; \
+  case 11: fn(in, out, 11); break; case 12: fn(in, out, 12); break; \
+  case 13: fn(in, out, 13); break; case 14: fn(in, out, 14); break; \
+  case 15: fn(in, out, 15); break; case 16: fn(in, out, 16); break; \
+  case 17: fn(in, out, 17); break; case 18: fn(in, out, 18); break; \
+  case 19: fn(in, out, 19); break; case 20: fn(in, out, 20); break; \
+  case 21: fn(in, out, 21); break; case 22: fn(in, out, 22); break; \
+  case 23: fn(in, out, 23); break; case 24: fn(in, out, 24); break; \
+  case 25: fn(in, out, 25); break; case 26: fn(in, out, 26); break; \
+  case 27: fn(in, out, 27); break; case 28: fn(in, out, 28); break; \
+  case 29: fn(in, out, 29); break; case 30: fn(in, out, 30); break; \
+  case 31: fn(in, out, 31); break; case 32: fn(in, out, 32); break;
+
+static void
+bp128_pack_block(const uint32_t *in, uint32_t *out, int bits)
+{
+  switch (bits) {
+    BP128_CASES(bp128_pack)
+  }
+}
+
+static void
+bp128_unpack_block(const uint32_t *in, uint32_t *out, int bits)
+{
+  switch (bits) {
+    BP128_CASES(bp128_unpack)
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void
+pa_free(void *ptr)
+{
+  packed_array *pa = ptr;
+  xfree(pa->data);
+  xfree(pa);
+}
+
+static size_t
+pa_memsize(const void *ptr)
+{
+  const packed_array *pa = ptr;
+  return sizeof(packed_array) + pa_bytes(pa->bits, pa->capacity);
+}
+
+static const rb_data_type_t packed_array_type = {
+  "BitTwiddle::PackedArray",
+  { 0, pa_free, pa_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+pa_alloc(VALUE klass)
+{
+  packed_array *pa;
+  VALUE obj = TypedData_Make_Struct(klass, packed_array, &packed_array_type, pa);
+  pa->data     = NULL;
+  pa->size     = 0;
+  pa->capacity = 0;
+  pa->bits     = 0;
+  return obj;
+}
+
+static packed_array*
+get_packed_array(VALUE self)
+{
+  packed_array *pa;
+  TypedData_Get_Struct(self, packed_array, &packed_array_type, pa);
+  if (pa->bits == 0)
+    rb_raise(rb_eRuntimeError, "uninitialized PackedArray");
+  return pa;
+}
+
+/* Make room for at least 'size' elements; new space is zeroed */
+static void
+pa_reserve(packed_array *pa, size_t size)
+{
+  size_t capacity = pa->capacity ? pa->capacity : BLOCK_SIZE;
+  size_t old_bytes;
+
+  if (size <= pa->capacity)
+    return;
+  if (size > (SIZE_MAX / 64))
+    rb_raise(rb_eArgError, "PackedArray size too big");
+  while (capacity < size)
+    capacity *= 2;
+
+  old_bytes = pa_bytes(pa->bits, pa->capacity);
+  pa->data  = ruby_xrealloc(pa->data, pa_bytes(pa->bits, capacity));
+  memset((char*)pa->data + old_bytes, 0, pa_bytes(pa->bits, capacity) - old_bytes);
+  pa->capacity = capacity;
+}
+
+static int
+value_to_bits(VALUE bits)
+{
+  int n = NUM2INT(bits);
+  if (n < 1 || n > 64)
+    rb_raise(rb_eArgError, "bits per element must be from 1 to 64 (not %d)", n);
+  return n;
+}
+
+static uint64_t
+value_to_element(const packed_array *pa, VALUE value)
+{
+  uint64_t v;
+  value = rb_to_int(value);
+  if (FIXNUM_P(value) ? FIX2LONG(value) < 0 : RBIGNUM_NEGATIVE_P(value))
+    rb_raise(rb_eRangeError, "PackedArray elements can't be negative");
+  v = NUM2ULL(value);
+  if (v & ~pa_mask(pa->bits))
+    rb_raise(rb_eRangeError, "%llu doesn't fit in %d bits", (unsigned long long)v, pa->bits);
+  return v;
+}
+
+/* Document-method: BitTwiddle::PackedArray#initialize
+ * Create a PackedArray of `size` zeroes, each stored in `bits` bits.
+ *
+ * @example
+ *   ary = BitTwiddle::PackedArray.new(5, 1000)
+ *   ary.bytesize # => 640
+ *
+ * @param bits [Integer] Bits per element, from 1 to 64
+ * @param size [Integer] Initial number of elements (default 0)
+ */
+static VALUE
+pa_initialize(int argc, VALUE *argv, VALUE self)
+{
+  packed_array *pa;
+  VALUE bits, size;
+  long  n = 0;
+
+  rb_scan_args(argc, argv, "11", &bits, &size);
+  TypedData_Get_Struct(self, packed_array, &packed_array_type, pa);
+  if (pa->bits)
+    rb_raise(rb_eRuntimeError, "PackedArray is already initialized");
+
+  pa->bits = value_to_bits(bits);
+  if (!NIL_P(size)) {
+    n = NUM2LONG(size);
+    if (n < 0)
+      rb_raise(rb_eArgError, "negative array size");
+  }
+  pa_reserve(pa, n);
+  pa->size = n;
+  return self;
+}
+
+/* Document-method: BitTwiddle::PackedArray#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+pa_initialize_copy(VALUE self, VALUE orig)
+{
+  packed_array *dst, *src = get_packed_array(orig);
+  size_t bytes = pa_bytes(src->bits, src->capacity);
+
+  TypedData_Get_Struct(self, packed_array, &packed_array_type, dst);
+  if (dst == src)
+    return self;
+  xfree(dst->data);
+  dst->data     = xmalloc(bytes);
+  memcpy(dst->data, src->data, bytes);
+  dst->size     = src->size;
+  dst->capacity = src->capacity;
+  dst->bits     = src->bits;
+  return self;
+}
+
+/* Document-method: BitTwiddle::PackedArray#bits
+ * @return [Integer] The number of bits used to store each element
+ */
+static VALUE
+pa_bits(VALUE self)
+{
+  return INT2FIX(get_packed_array(self)->bits);
+}
+
+/* Document-method: BitTwiddle::PackedArray#size
+ * @return [Integer] The number of elements
+ */
+static VALUE
+pa_size(VALUE self)
+{
+  return SIZET2NUM(get_packed_array(self)->size);
+}
+
+/* Document-method: BitTwiddle::PackedArray#bytesize
+ * @return [Integer] The number of bytes of memory used to store the elements
+ */
+static VALUE
+pa_bytesize(VALUE self)
+{
+  packed_array *pa = get_packed_array(self);
+  return SIZET2NUM(pa_bytes(pa->bits, pa->capacity));
+}
+
+/* Document-method: BitTwiddle::PackedArray#[]
+ * Return the element at `index`. A negative index counts back from the end.
+ * If `index` is out of range, return `nil`.
+ *
+ * @param index [Integer]
+ * @return [Integer, nil]
+ */
+static VALUE
+pa_aref(VALUE self, VALUE index)
+{
+  packed_array *pa = get_packed_array(self);
+  long i = NUM2LONG(index);
+
+  if (i < 0)
+    i += pa->size;
+  if (i < 0 || (size_t)i >= pa->size)
+    return Qnil;
+  return ULL2NUM(pa_get(pa, i));
+}
+
+/* Document-method: BitTwiddle::PackedArray#[]=
+ * Store `value` at `index`. A negative index counts back from the end.
+ * If `index` is past the end, the array grows (filling any gap with zeroes).
+ *
+ * If `value` is negative or does not fit in the number of bits per element,
+ * raise `RangeError`.
+ *
+ * @param index [Integer]
+ * @param value [Integer]
+ * @return [Integer] `value`
+ */
+static VALUE
+pa_aset(VALUE self, VALUE index, VALUE value)
+{
+  packed_array *pa = get_packed_array(self);
+  long     i = NUM2LONG(index);
+  uint64_t v = value_to_element(pa, value);
+
+  rb_check_frozen(self);
+  if (i < 0) {
+    i += pa->size;
+    if (i < 0)
+      rb_raise(rb_eIndexError, "index %ld too small for array", i - (long)pa->size);
+  }
+  if ((size_t)i >= pa->size) {
+    pa_reserve(pa, i + 1);
+    pa->size = i + 1;
+  }
+  pa_set(pa, i, v);
+  return value;
+}
+
+/* Document-method: BitTwiddle::PackedArray#<<
+ * Append `value` to the end of the array.
+ *
+ * If `value` is negative or does not fit in the number of bits per element,
+ * raise `RangeError`.
+ *
+ * @param value [Integer]
+ * @return [PackedArray] self
+ */
+static VALUE
+pa_push(VALUE self, VALUE value)
+{
+  packed_array *pa = get_packed_array(self);
+  uint64_t v = value_to_element(pa, value);
+
+  rb_check_frozen(self);
+  pa_reserve(pa, pa->size + 1);
+  pa_set(pa, pa->size++, v);
+  return self;
+}
+
+static VALUE
+pa_enum_size(VALUE self, VALUE args, VALUE eobj)
+{
+  return pa_size(self);
+}
+
+/* Document-method: BitTwiddle::PackedArray#each
+ * Yield each element in turn.
+ *
+ * @yieldparam value [Integer]
+ * @return [PackedArray, Enumerator]
+ */
+static VALUE
+pa_each(VALUE self)
+{
+  packed_array *pa;
+  size_t i;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, pa_enum_size);
+  pa = get_packed_array(self);
+  /* the block could change the array, so re-check the size every time */
+  for (i = 0; i < pa->size; i++)
+    rb_yield(ULL2NUM(pa_get(pa, i)));
+  return self;
+}
+
+/* Document-method: BitTwiddle::PackedArray#to_a
+ * @return [Array<Integer>] All the elements
+ */
+static VALUE
+pa_to_a(VALUE self)
+{
+  packed_array *pa = get_packed_array(self);
+  VALUE  ary = rb_ary_new_capa(pa->size);
+  size_t i;
+
+  for (i = 0; i < pa->size; i++)
+    rb_ary_push(ary, ULL2NUM(pa_get(pa, i)));
+  return ary;
+}
+
+static int
+value_to_width(VALUE width)
+{
+  int w = NIL_P(width) ? 32 : NUM2INT(width);
+  if (w != 32 && w != 64)
+    rb_raise(rb_eArgError, "buffer element width must be 32 or 64 bits (not %d)", w);
+  return w;
+}
+
+/* Document-method: BitTwiddle::PackedArray.from_buffer
+ * Create a PackedArray from a `String` of unsigned 32 or 64-bit integers in
+ * native byte order (as produced by `Array#pack("L*")` or `Array#pack("Q*")`).
+ *
+ * If any value does not fit in `bits` bits, raise `RangeError`.
+ *
+ * @example
+ *   ary = BitTwiddle::PackedArray.from_buffer([1, 2, 3].pack("L*"), 2)
+ *   ary.to_a # => [1, 2, 3]
+ *
+ * @param buffer [String] The integers to store
+ * @param bits [Integer] Bits per element, from 1 to 64
+ * @param width [Integer] Size of each integer in `buffer`: 32 or 64 bits (default 32)
+ * @return [PackedArray]
+ */
+static VALUE
+pa_s_from_buffer(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE buffer, bits, width, obj;
+  packed_array *pa;
+  const uchar *p;
+  size_t n, i;
+  uint64_t mask, seen = 0;
+  int w;
+
+  rb_scan_args(argc, argv, "21", &buffer, &bits, &width);
+  StringValue(buffer);
+  w = value_to_width(width);
+  if (RSTRING_LEN(buffer) % (w / 8))
+    rb_raise(rb_eArgError, "buffer length must be a multiple of %d bytes", w / 8);
+
+  obj = pa_alloc(klass);
+  TypedData_Get_Struct(obj, packed_array, &packed_array_type, pa);
+  pa->bits = value_to_bits(bits);
+  mask     = pa_mask(pa->bits);
+  n        = RSTRING_LEN(buffer) / (w / 8);
+  pa_reserve(pa, n);
+  pa->size = n;
+  p        = (const uchar*)RSTRING_PTR(buffer);
+
+  if (pa->bits <= 32) {
+    uint32_t block[BLOCK_SIZE];
+    uint32_t *out = pa->data;
+    for (i = 0; i < n; i += BLOCK_SIZE) {
+      size_t count = (n - i < BLOCK_SIZE) ? n - i : BLOCK_SIZE, j;
+      if (w == 32 && count == BLOCK_SIZE) {
+        memcpy(block, p + i*4, sizeof(block));
+        for (j = 0; j < BLOCK_SIZE; j++)
+          seen |= block[j];
+      } else {
+        memset(block, 0, sizeof(block));
+        for (j = 0; j < count; j++) {
+          uint64_t v;
+          if (w == 32) {
+            uint32_t v32;
+            memcpy(&v32, p + (i+j)*4, 4);
+            v = v32;
+          } else {
+            memcpy(&v, p + (i+j)*8, 8);
+          }
+          seen |= v;
+          block[j] = (uint32_t)v;
+        }
+      }
+      if (seen & ~mask)
+        break;
+      bp128_pack_block(block, out, pa->bits);
+      out += 4 * pa->bits;
+    }
+  } else {
+    for (i = 0; i < n; i++) {
+      uint64_t v;
+      if (w == 32) {
+        uint32_t v32;
+        memcpy(&v32, p + i*4, 4);
+        v = v32;
+      } else {
+        memcpy(&v, p + i*8, 8);
+      }
+      seen |= v;
+      pa_set(pa, i, v & mask);
+    }
+  }
+
+  if (seen & ~mask)
+    rb_raise(rb_eRangeError, "buffer contains a value which doesn't fit in %d bits", pa->bits);
+  return obj;
+}
+
+/* Document-method: BitTwiddle::PackedArray#to_buffer
+ * Return all the elements as a `String` of unsigned 32 or 64-bit integers in
+ * native byte order (which can be read with `String#unpack("L*")` or
+ * `String#unpack("Q*")`).
+ *
+ * If the elements are more than 32 bits wide, `width` must be 64.
+ *
+ * @example
+ *   ary = BitTwiddle::PackedArray.from_buffer([1, 2, 3].pack("L*"), 2)
+ *   ary.to_buffer(64).unpack("Q*") # => [1, 2, 3]
+ *
+ * @param width [Integer] Size of each integer in the result: 32 or 64 bits (default 32)
+ * @return [String]
+ */
+static VALUE
+pa_to_buffer(int argc, VALUE *argv, VALUE self)
+{
+  packed_array *pa = get_packed_array(self);
+  VALUE  width, result;
+  uchar *out;
+  size_t i;
+  int    w;
+
+  rb_scan_args(argc, argv, "01", &width);
+  w = value_to_width(width);
+  if (pa->bits > w)
+    rb_raise(rb_eArgError, "%d-bit elements don't fit in a %d-bit buffer", pa->bits, w);
+
+  result = rb_str_new(NULL, pa->size * (w / 8));
+  out    = (uchar*)RSTRING_PTR(result);
+
+  if (pa->bits <= 32) {
+    uint32_t block[BLOCK_SIZE];
+    const uint32_t *in = pa->data;
+    for (i = 0; i < pa->size; i += BLOCK_SIZE) {
+      size_t count = (pa->size - i < BLOCK_SIZE) ? pa->size - i : BLOCK_SIZE, j;
+      bp128_unpack_block(in, block, pa->bits);
+      if (w == 32) {
+        memcpy(out + i*4, block, count * 4);
+      } else {
+        for (j = 0; j < count; j++) {
+          uint64_t v = block[j];
+          memcpy(out + (i+j)*8, &v, 8);
+        }
+      }
+      in += 4 * pa->bits;
+    }
+  } else {
+    for (i = 0; i < pa->size; i++) {
+      uint64_t v = pa_get(pa, i);
+      memcpy(out + i*8, &v, 8);
+    }
+  }
+
+  return result;
+}
+
+/* Document-method: BitTwiddle::PackedArray#sum
+ * Return the sum of all the elements.
+ *
+ * If a block or an initial value is given, this behaves like `Enumerable#sum`.
+ *
+ * @return [Integer]
+ */
+static VALUE
+pa_sum(int argc, VALUE *argv, VALUE self)
+{
+  packed_array *pa;
+  uint64_t lo = 0, hi = 0;
+  size_t i;
+
+  if (argc > 0 || rb_block_given_p())
+    return rb_call_super(argc, argv);
+
+  pa = get_packed_array(self);
+  if (pa->bits <= 32) {
+    uint32_t block[BLOCK_SIZE];
+    const uint32_t *in = pa->data;
+    /* padding after the last element is always zero, so whole blocks can be summed */
+    for (i = 0; i < pa->size; i += BLOCK_SIZE) {
+      uint64_t block_sum = 0;
+      int j;
+      bp128_unpack_block(in, block, pa->bits);
+      for (j = 0; j < BLOCK_SIZE; j++)
+        block_sum += block[j];
+      lo += block_sum;
+      hi += (lo < block_sum);
+      in += 4 * pa->bits;
+    }
+  } else {
+    for (i = 0; i < pa->size; i++) {
+      uint64_t v = pa_get(pa, i);
+      lo += v;
+      hi += (lo < v);
+    }
+  }
+
+  return bt_u128_to_num(lo, hi);
+}
+
+/* Document-method: BitTwiddle::PackedArray#popcount
+ * Return the total number of 1 bits in all the elements.
+ *
+ * @example
+ *   BitTwiddle::PackedArray.from_buffer([1, 2, 3].pack("L*"), 2).popcount # => 4
+ *
+ * @return [Integer]
+ */
+static VALUE
+pa_popcount(VALUE self)
+{
+  packed_array *pa = get_packed_array(self);
+  /* padding after the last element is always zero, so the whole buffer can be counted */
+  return SIZET2NUM(bt_popcount_buf(pa->data, pa_bytes(pa->bits, pa->capacity)));
+}
+
+void Init_bt_packed_array(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::PackedArray
+   * An array of unsigned integers, each stored in exactly the same number of bits
+   * (from 1 to 64). For 32 bits or less, storage uses the SIMD-BP128 layout, so
+   * conversion to and from buffers processes 4 elements per SIMD instruction.
+   */
+  VALUE rb_cPackedArray = rb_define_class_under(rb_mBitTwiddle, "PackedArray", rb_cObject);
+
+  rb_include_module(rb_cPackedArray, rb_mEnumerable);
+  rb_define_alloc_func(rb_cPackedArray, pa_alloc);
+  rb_define_singleton_method(rb_cPackedArray, "from_buffer", pa_s_from_buffer, -1);
+
+  rb_define_method(rb_cPackedArray, "initialize",      pa_initialize,      -1);
+  rb_define_method(rb_cPackedArray, "initialize_copy", pa_initialize_copy,  1);
+  rb_define_method(rb_cPackedArray, "bits",            pa_bits,             0);
+  rb_define_method(rb_cPackedArray, "size",            pa_size,             0);
+  rb_define_method(rb_cPackedArray, "length",          pa_size,             0);
+  rb_define_method(rb_cPackedArray, "bytesize",        pa_bytesize,         0);
+  rb_define_method(rb_cPackedArray, "[]",              pa_aref,             1);
+  rb_define_method(rb_cPackedArray, "[]=",             pa_aset,             2);
+  rb_define_method(rb_cPackedArray, "<<",              pa_push,             1);
+  rb_define_method(rb_cPackedArray, "each",            pa_each,             0);
+  rb_define_method(rb_cPackedArray, "to_a",            pa_to_a,             0);
+  rb_define_method(rb_cPackedArray, "to_buffer",       pa_to_buffer,       -1);
+  rb_define_method(rb_cPackedArray, "sum",             pa_sum,             -1);
+  rb_define_method(rb_cPackedArray, "popcount",        pa_popcount,         0);
+}
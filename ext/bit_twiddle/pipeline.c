@@ -0,0 +1,491 @@
+/* BitTwiddle.compile and BitTwiddle::Pipeline: a sequence of bit operations on
+ * fixed-width integers, compiled once into a table of opcodes and applied to a
+ * single Integer or to every element of a buffer in one C call
+ *
+ * Buffers are processed in blocks: each operation is applied to a whole block
+ * before the next one, so the inner loops are simple enough for the compiler to
+ * vectorize, and the opcode dispatch is paid once per block rather than once per
+ * element. */
+
+#include "bit_twiddle.h"
+
+#define BLOCK 256
+
+enum {
+  OP_XOR, OP_AND, OP_OR, OP_ADD, OP_SUB, OP_MUL,
+  OP_LSHIFT, OP_RSHIFT, OP_ARITH_RSHIFT, OP_LROT, OP_RROT,
+  OP_XOR_LSHIFT, OP_XOR_RSHIFT, OP_ADD_LSHIFT,
+  OP_NOT, OP_NEG, OP_BSWAP, OP_BITREVERSE,
+  NUM_OPS
+};
+
+#define ARG_NONE     0
+#define ARG_CONSTANT 1
+#define ARG_SHIFT    2
+
+static const struct {
+  const char *name;
+  int         arg;
+} op_info[NUM_OPS] = {
+  { "xor",          ARG_CONSTANT },
+  { "and",          ARG_CONSTANT },
+  { "or",           ARG_CONSTANT },
+  { "add",          ARG_CONSTANT },
+  { "sub",          ARG_CONSTANT },
+  { "mul",          ARG_CONSTANT },
+  { "lshift",       ARG_SHIFT },
+  { "rshift",       ARG_SHIFT },
+  { "arith_rshift", ARG_SHIFT },
+  { "lrot",         ARG_SHIFT },
+  { "rrot",         ARG_SHIFT },
+  { "xor_lshift",   ARG_SHIFT },
+  { "xor_rshift",   ARG_SHIFT },
+  { "add_lshift",   ARG_SHIFT },
+  { "not",          ARG_NONE },
+  { "neg",          ARG_NONE },
+  { "bswap",        ARG_NONE },
+  { "bitreverse",   ARG_NONE },
+};
+
+/* Names of the operations, interned in Init_bt_pipeline */
+static ID op_ids[NUM_OPS];
+
+typedef struct {
+  int      code;
+  uint64_t arg;
+} pipeline_op;
+
+typedef struct {
+  pipeline_op *ops;
+  long         nops;
+  int          width;  /* 0 until initialized */
+  VALUE        source; /* frozen Array of the operations as given */
+} pipeline;
+
+/* Reverse the bits within each byte */
+static inline uint64_t
+reverse_bits_in_bytes(uint64_t x)
+{
+  x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+  x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return x;
+}
+
+static inline uint8_t  bswap_8(uint8_t x)   { return x; }
+static inline uint16_t bswap_16(uint16_t x) { return __builtin_bswap16(x); }
+static inline uint32_t bswap_32(uint32_t x) { return __builtin_bswap32(x); }
+static inline uint64_t bswap_64(uint64_t x) { return __builtin_bswap64(x); }
+
+/* Apply every operation to x[0..n-1]; T is the element type, and U an unsigned
+ * type at least as wide as int, for arithmetic without integer promotion to a
+ * signed type */
+#define def_run(bits, U) \
+  static void \
+  run_ ## bits(const pipeline_op *ops, long nops, uint ## bits ## _t *x, size_t n) \
+  { \
+    typedef uint ## bits ## _t T; \
+    long   j; \
+    size_t i; \
+    for (j = 0; j < nops; j++) { \
+      T   k = (T)ops[j].arg; \
+      int s = (int)ops[j].arg; \
+      switch (ops[j].code) { \
+      case OP_XOR: for (i = 0; i < n; i++) x[i] ^= k; break; \
+      case OP_AND: for (i = 0; i < n; i++) x[i] &= k; break; \
+      case OP_OR:  for (i = 0; i < n; i++) x[i] |= k; break; \
+      case OP_ADD: for (i = 0; i < n; i++) x[i] = (T)((U)x[i] + k); break; \
+      case OP_SUB: for (i = 0; i < n; i++) x[i] = (T)((U)x[i] - k); break; \
+      case OP_MUL: for (i = 0; i < n; i++) x[i] = (T)((U)x[i] * k); break; \
+      case OP_LSHIFT: for (i = 0; i < n; i++) x[i] = (T)((U)x[i] << s); break; \
+      case OP_RSHIFT: for (i = 0; i < n; i++) x[i] = (T)(x[i] >> s); break; \
+      case OP_ARITH_RSHIFT: \
+        for (i = 0; i < n; i++) \
+          x[i] = (T)((x[i] >> s) | ((U)(T)(0 - (U)(x[i] >> (bits - 1))) << (bits - 1 - s))); \
+        break; \
+      case OP_RROT: \
+        s = (bits - s) % bits; \
+        if (s) \
+          for (i = 0; i < n; i++) x[i] = (T)(((U)x[i] << s) | (x[i] >> (bits - s))); \
+        break; \
+      case OP_LROT: \
+        if (s) \
+          for (i = 0; i < n; i++) x[i] = (T)(((U)x[i] << s) | (x[i] >> (bits - s))); \
+        break; \
+      case OP_XOR_LSHIFT: for (i = 0; i < n; i++) x[i] ^= (T)((U)x[i] << s); break; \
+      case OP_XOR_RSHIFT: for (i = 0; i < n; i++) x[i] ^= (T)(x[i] >> s); break; \
+      case OP_ADD_LSHIFT: for (i = 0; i < n; i++) x[i] = (T)((U)x[i] + ((U)x[i] << s)); break; \
+      case OP_NOT: for (i = 0; i < n; i++) x[i] = (T)~x[i]; break; \
+      case OP_NEG: for (i = 0; i < n; i++) x[i] = (T)(0 - (U)x[i]); break; \
+      case OP_BSWAP: for (i = 0; i < n; i++) x[i] = bswap_ ## bits(x[i]); break; \
+      case OP_BITREVERSE: \
+        for (i = 0; i < n; i++) \
+          x[i] = bswap_ ## bits((T)reverse_bits_in_bytes(x[i])); \
+        break; \
+      } \
+    } \
+  }
+
+def_run(8,  uint32_t)
+def_run(16, uint32_t)
+def_run(32, uint32_t)
+def_run(64, uint64_t)
+
+/* Apply the pipeline to 'n' elements at 'p', in place; 'p' need not be aligned */
+static void
+run_pipeline(const pipeline *pl, uchar *p, size_t n)
+{
+  uint64_t block[BLOCK];
+  size_t   esize = pl->width / 8, i, m;
+
+  for (i = 0; i < n; i += m) {
+    m = (n - i < BLOCK) ? n - i : BLOCK;
+    memcpy(block, p + i * esize, m * esize);
+    switch (pl->width) {
+    case 8:  run_8(pl->ops,  pl->nops, (uint8_t*)block,  m); break;
+    case 16: run_16(pl->ops, pl->nops, (uint16_t*)block, m); break;
+    case 32: run_32(pl->ops, pl->nops, (uint32_t*)block, m); break;
+    default: run_64(pl->ops, pl->nops, block,            m); break;
+    }
+    memcpy(p + i * esize, block, m * esize);
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void
+pipeline_mark(void *ptr)
+{
+  pipeline *pl = ptr;
+  rb_gc_mark(pl->source);
+}
+
+static void
+pipeline_free(void *ptr)
+{
+  pipeline *pl = ptr;
+  xfree(pl->ops);
+  xfree(pl);
+}
+
+static size_t
+pipeline_memsize(const void *ptr)
+{
+  const pipeline *pl = ptr;
+  return sizeof(pipeline) + pl->nops * sizeof(pipeline_op);
+}
+
+static const rb_data_type_t pipeline_type = {
+  "BitTwiddle::Pipeline",
+  { pipeline_mark, pipeline_free, pipeline_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+pipeline_alloc(VALUE klass)
+{
+  pipeline *pl;
+  VALUE obj = TypedData_Make_Struct(klass, pipeline, &pipeline_type, pl);
+  pl->source = Qnil;
+  return obj;
+}
+
+static pipeline*
+get_pipeline(VALUE self)
+{
+  pipeline *pl;
+  TypedData_Get_Struct(self, pipeline, &pipeline_type, pl);
+  if (pl->width == 0)
+    rb_raise(rb_eRuntimeError, "uninitialized Pipeline");
+  return pl;
+}
+
+static uint64_t
+width_mask(int width)
+{
+  return (width == 64) ? ~0ULL : (1ULL << width) - 1;
+}
+
+/* A constant operand may be given as an unsigned value or a negative one; either
+ * way it must fit in 'width' bits */
+static uint64_t
+constant_arg(VALUE value, int width)
+{
+  uint64_t mask = width_mask(width);
+  if (RTEST(rb_funcall(value, '<', 1, INT2FIX(0)))) {
+    int64_t v = NUM2LL(value);
+    if (width < 64 && v < -(1LL << (width - 1)))
+      rb_raise(rb_eRangeError, "%"PRIsVALUE" doesn't fit in %d bits", value, width);
+    return (uint64_t)v & mask;
+  } else {
+    uint64_t v = bt_num_to_u64(value);
+    if (v & ~mask)
+      rb_raise(rb_eRangeError, "%"PRIsVALUE" doesn't fit in %d bits", value, width);
+    return v;
+  }
+}
+
+static void
+parse_op(VALUE op, int width, pipeline_op *out)
+{
+  VALUE name, arg = Qnil;
+  ID    id;
+  int   code;
+
+  if (RB_TYPE_P(op, T_ARRAY)) {
+    if (RARRAY_LEN(op) < 1 || RARRAY_LEN(op) > 2)
+      rb_raise(rb_eArgError, "an operation must be [name] or [name, argument]");
+    name = RARRAY_AREF(op, 0);
+    if (RARRAY_LEN(op) == 2)
+      arg = RARRAY_AREF(op, 1);
+  } else {
+    name = op;
+  }
+  if (!SYMBOL_P(name))
+    rb_raise(rb_eArgError, "operation name must be a Symbol");
+
+  id = SYM2ID(name);
+  for (code = 0; code < NUM_OPS; code++)
+    if (id == op_ids[code])
+      break;
+  if (code == NUM_OPS)
+    rb_raise(rb_eArgError, "unknown operation :%"PRIsVALUE, rb_sym2str(name));
+
+  out->code = code;
+  out->arg  = 0;
+  if (op_info[code].arg == ARG_NONE) {
+    if (!NIL_P(arg))
+      rb_raise(rb_eArgError, ":%"PRIsVALUE" takes no argument", rb_sym2str(name));
+  } else if (NIL_P(arg)) {
+    rb_raise(rb_eArgError, ":%"PRIsVALUE" needs an argument", rb_sym2str(name));
+  } else if (!RB_INTEGER_TYPE_P(arg)) {
+    rb_raise(rb_eArgError, "argument of :%"PRIsVALUE" must be an Integer (not %"PRIsVALUE")",
+             rb_sym2str(name), rb_obj_class(arg));
+  } else if (op_info[code].arg == ARG_CONSTANT) {
+    out->arg = constant_arg(arg, width);
+  } else {
+    long s = NUM2LONG(arg);
+    if (code == OP_LROT || code == OP_RROT) {
+      s %= width;
+      if (s < 0)
+        s += width;
+    } else if (s < 0 || s >= width) {
+      rb_raise(rb_eArgError, "shift distance for :%"PRIsVALUE" must be from 0 to %d (not %ld)",
+               rb_sym2str(name), width - 1, s);
+    }
+    out->arg = s;
+  }
+}
+
+/* Compile a list of bit operations into a `Pipeline`, which applies them in
+ * order to `width`-bit unsigned integers. All arithmetic wraps around modulo
+ * 2^`width`. Each operation is a Symbol, or an Array of a Symbol and an Integer
+ * argument:
+ *
+ * - `[:xor, k]`, `[:and, k]`, `[:or, k]`: bitwise operation with the constant `k`
+ * - `[:add, k]`, `[:sub, k]`, `[:mul, k]`: wrapping arithmetic with `k` (which
+ *   can be negative)
+ * - `[:lshift, n]`, `[:rshift, n]`, `[:arith_rshift, n]`: shift by `n` bits
+ * - `[:lrot, n]`, `[:rrot, n]`: rotate by `n` bits
+ * - `[:xor_lshift, n]`, `[:xor_rshift, n]`: `x ^= x << n` and `x ^= x >> n`
+ * - `[:add_lshift, n]`: `x += x << n`
+ * - `:not`, `:neg`, `:bswap`, `:bitreverse`
+ *
+ * If an operation is unknown or has an invalid argument, raise `ArgumentError`;
+ * if a constant does not fit in `width` bits, raise `RangeError`.
+ *
+ * @example
+ *   # the MurmurHash3 64-bit finalizer
+ *   fmix64 = BitTwiddle.compile([[:xor_rshift, 33], [:mul, 0xff51afd7ed558ccd],
+ *                                [:xor_rshift, 33], [:mul, 0xc4ceb9fe1a85ec53],
+ *                                [:xor_rshift, 33]])
+ *   fmix64.call(1).to_s(16)                  # => "b456bcfc34c2cb2c"
+ *   fmix64.apply([1, 2, 3].pack("Q*")).unpack("Q*")
+ *
+ * @param ops [Array<Symbol, Array(Symbol, Integer)>]
+ * @param width [Integer] 8, 16, 32 or 64 (default 64)
+ * @return [Pipeline]
+ */
+static VALUE
+bt_compile(int argc, VALUE *argv, VALUE self)
+{
+  VALUE klass = rb_const_get(self, rb_intern("Pipeline"));
+  return rb_class_new_instance(argc, argv, klass);
+}
+
+/* Document-method: BitTwiddle::Pipeline#initialize
+ * Same as `BitTwiddle.compile`.
+ *
+ * @param ops [Array<Symbol, Array(Symbol, Integer)>]
+ * @param width [Integer] 8, 16, 32 or 64 (default 64)
+ */
+static VALUE
+pipeline_initialize(int argc, VALUE *argv, VALUE self)
+{
+  pipeline *pl;
+  VALUE ops, width;
+  long  i, n;
+  int   w;
+
+  rb_scan_args(argc, argv, "11", &ops, &width);
+  TypedData_Get_Struct(self, pipeline, &pipeline_type, pl);
+  if (pl->width)
+    rb_raise(rb_eRuntimeError, "Pipeline is already initialized");
+
+  w = NIL_P(width) ? 64 : NUM2INT(width);
+  if (w != 8 && w != 16 && w != 32 && w != 64)
+    rb_raise(rb_eArgError, "width must be 8, 16, 32 or 64 bits (not %d)", w);
+  ops = rb_ary_dup(rb_Array(ops));
+  n   = RARRAY_LEN(ops);
+
+  xfree(pl->ops); /* from an earlier call which raised an exception */
+  pl->ops = ALLOC_N(pipeline_op, n ? n : 1);
+  for (i = 0; i < n; i++)
+    parse_op(RARRAY_AREF(ops, i), w, &pl->ops[i]);
+
+  pl->nops   = n;
+  pl->source = rb_obj_freeze(ops);
+  pl->width  = w;
+  return self;
+}
+
+/* Document-method: BitTwiddle::Pipeline#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+pipeline_initialize_copy(VALUE self, VALUE orig)
+{
+  pipeline *dst, *src = get_pipeline(orig);
+
+  TypedData_Get_Struct(self, pipeline, &pipeline_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->width)
+    rb_raise(rb_eRuntimeError, "Pipeline is already initialized");
+  *dst = *src;
+  dst->ops = ALLOC_N(pipeline_op, src->nops ? src->nops : 1);
+  memcpy(dst->ops, src->ops, src->nops * sizeof(pipeline_op));
+  return self;
+}
+
+/* Document-method: BitTwiddle::Pipeline#width
+ * @return [Integer] The width of the integers operated on, in bits
+ */
+static VALUE
+pipeline_width(VALUE self)
+{
+  return INT2FIX(get_pipeline(self)->width);
+}
+
+/* Document-method: BitTwiddle::Pipeline#to_a
+ * @return [Array] The operations, as given to `BitTwiddle.compile`
+ */
+static VALUE
+pipeline_to_a(VALUE self)
+{
+  return rb_ary_dup(get_pipeline(self)->source);
+}
+
+/* Document-method: BitTwiddle::Pipeline#call
+ * Apply the operations to `int`.
+ *
+ * If `int` is negative or does not fit in `#width` bits, raise `RangeError`.
+ *
+ * @param int [Integer]
+ * @return [Integer]
+ */
+static VALUE
+pipeline_call(VALUE self, VALUE num)
+{
+  pipeline *pl = get_pipeline(self);
+  uint64_t  x  = bt_num_to_u64(num);
+  uchar     buf[8];
+
+  if (x & ~width_mask(pl->width))
+    rb_raise(rb_eRangeError, "%"PRIsVALUE" doesn't fit in %d bits", num, pl->width);
+
+  switch (pl->width) {
+  case 8:  { uint8_t  v = (uint8_t)x;  memcpy(buf, &v, 1); break; }
+  case 16: { uint16_t v = (uint16_t)x; memcpy(buf, &v, 2); break; }
+  case 32: { uint32_t v = (uint32_t)x; memcpy(buf, &v, 4); break; }
+  default: memcpy(buf, &x, 8); break;
+  }
+  run_pipeline(pl, buf, 1);
+  switch (pl->width) {
+  case 8:  { uint8_t  v; memcpy(&v, buf, 1); return INT2FIX(v); }
+  case 16: { uint16_t v; memcpy(&v, buf, 2); return INT2FIX(v); }
+  case 32: { uint32_t v; memcpy(&v, buf, 4); return UINT2NUM(v); }
+  default: memcpy(&x, buf, 8); return ULL2NUM(x);
+  }
+}
+
+static VALUE
+pipeline_apply_to(pipeline *pl, VALUE buffer)
+{
+  size_t esize = pl->width / 8;
+  if (RSTRING_LEN(buffer) % esize)
+    rb_raise(rb_eArgError, "buffer length must be a multiple of %d bytes", (int)esize);
+  run_pipeline(pl, (uchar*)RSTRING_PTR(buffer), RSTRING_LEN(buffer) / esize);
+  return buffer;
+}
+
+/* Document-method: BitTwiddle::Pipeline#apply
+ * Apply the operations to every element of a buffer of native-endian
+ * `#width`-bit unsigned integers (as produced by `Array#pack("Q*")` for 64 bits,
+ * `"L*"` for 32, `"S*"` for 16 or `"C*"` for 8), returning a new buffer.
+ *
+ * If the buffer length is not a multiple of the element size, raise `ArgumentError`.
+ *
+ * @param buffer [String]
+ * @return [String]
+ */
+static VALUE
+pipeline_apply(VALUE self, VALUE buffer)
+{
+  pipeline *pl = get_pipeline(self);
+  StringValue(buffer);
+  return pipeline_apply_to(pl, rb_str_new(RSTRING_PTR(buffer), RSTRING_LEN(buffer)));
+}
+
+/* Document-method: BitTwiddle::Pipeline#apply!
+ * Like `#apply`, but modify `buffer` in place.
+ *
+ * @param buffer [String]
+ * @return [String] `buffer`
+ */
+static VALUE
+pipeline_apply_bang(VALUE self, VALUE buffer)
+{
+  pipeline *pl = get_pipeline(self);
+  StringValue(buffer);
+  rb_str_modify(buffer);
+  return pipeline_apply_to(pl, buffer);
+}
+
+void Init_bt_pipeline(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::Pipeline
+   * A compiled sequence of bit operations on fixed-width integers, created by
+   * `BitTwiddle.compile`. Applying it to a buffer runs entirely in C, without
+   * creating an Integer for each intermediate value.
+   */
+  VALUE rb_cPipeline = rb_define_class_under(rb_mBitTwiddle, "Pipeline", rb_cObject);
+  int code;
+
+  for (code = 0; code < NUM_OPS; code++)
+    op_ids[code] = rb_intern(op_info[code].name);
+
+  rb_define_singleton_method(rb_mBitTwiddle, "compile", bt_compile, -1);
+
+  rb_define_alloc_func(rb_cPipeline, pipeline_alloc);
+  rb_define_method(rb_cPipeline, "initialize",      pipeline_initialize,      -1);
+  rb_define_method(rb_cPipeline, "initialize_copy", pipeline_initialize_copy,  1);
+  rb_define_method(rb_cPipeline, "width",           pipeline_width,            0);
+  rb_define_method(rb_cPipeline, "to_a",            pipeline_to_a,             0);
+  rb_define_method(rb_cPipeline, "call",            pipeline_call,             1);
+  rb_define_method(rb_cPipeline, "[]",              pipeline_call,             1);
+  rb_define_method(rb_cPipeline, "apply",           pipeline_apply,            1);
+  rb_define_method(rb_cPipeline, "apply!",          pipeline_apply_bang,       1);
+}
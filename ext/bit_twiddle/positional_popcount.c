@@ -0,0 +1,248 @@
+/* BitTwiddle.positional_popcount: for each bit position, count the words of a
+ * buffer which have that bit set
+ *
+ * The buffer is read as vectors of 32 (AVX2), 16 (SSE2) or 8 bytes, and each
+ * bit of a vector is treated as a separate counter. 16 vectors at a time are
+ * summed with a tree of carry-save adders (as in Harley-Seal popcount), which
+ * leaves 'ones', 'twos', 'fours' and 'eights' vectors holding the low bits of
+ * every counter and outputs one 'sixteens' vector. Only that vector has to be
+ * spread out: bit k of each of its bytes is added to a byte-sized counter in
+ * acc[k], and those are added to 64-bit totals before they can overflow.
+ * (Klarqvist, Mula and Lemire, 2019)
+ *
+ * Since every vector is a whole number of 8-byte words, bit k of byte b of a
+ * vector always belongs to bit k of byte b % 8 of a 64-bit word, and the same
+ * for smaller words. */
+
+#include "bit_twiddle.h"
+#include <ruby/thread.h>
+
+/* Release the GVL for buffers of at least this many bytes */
+#define NOGVL_THRESHOLD (1 << 20)
+
+#define CSA(h, l, a, b, c, and, or, xor)                                     \
+  do {                                                                       \
+    u = xor(a, b);                                                           \
+    h = or(and(a, b), and(u, c));                                            \
+    l = xor(u, c);                                                           \
+  } while (0)
+
+/* Define a function which adds up the bits of as many blocks of 16 vectors as
+ * there are in p[0, n), into counts[64] (indexed by byte % 8 * 8 + bit), and
+ * returns the number of bytes read */
+#define def_pospopcnt(name, V, load, store, zero, and, or, xor, add_bits)    \
+static size_t                                                                \
+name(const uchar *p, size_t n, uint64_t *counts)                             \
+{                                                                            \
+  const size_t step = sizeof(V);                                             \
+  V ones = zero(), twos = zero(), fours = zero(), eights = zero();           \
+  V twosA, twosB, foursA, foursB, eightsA, eightsB, sixteens, u, acc[8];     \
+  size_t i = 0;                                                              \
+  int k, blocks = 0;                                                         \
+                                                                             \
+  for (k = 0; k < 8; k++)                                                    \
+    acc[k] = zero();                                                         \
+  for (; i + 16*step <= n; i += 16*step) {                                   \
+    const uchar *q = p + i;                                                  \
+    CSA(twosA,   ones,   ones,   load(q),          load(q + step),    and, or, xor); \
+    CSA(twosB,   ones,   ones,   load(q + 2*step), load(q + 3*step),  and, or, xor); \
+    CSA(foursA,  twos,   twos,   twosA,            twosB,             and, or, xor); \
+    CSA(twosA,   ones,   ones,   load(q + 4*step), load(q + 5*step),  and, or, xor); \
+    CSA(twosB,   ones,   ones,   load(q + 6*step), load(q + 7*step),  and, or, xor); \
+    CSA(foursB,  twos,   twos,   twosA,            twosB,             and, or, xor); \
+    CSA(eightsA, fours,  fours,  foursA,           foursB,            and, or, xor); \
+    CSA(twosA,   ones,   ones,   load(q + 8*step), load(q + 9*step),  and, or, xor); \
+    CSA(twosB,   ones,   ones,   load(q + 10*step), load(q + 11*step), and, or, xor); \
+    CSA(foursA,  twos,   twos,   twosA,            twosB,             and, or, xor); \
+    CSA(twosA,   ones,   ones,   load(q + 12*step), load(q + 13*step), and, or, xor); \
+    CSA(twosB,   ones,   ones,   load(q + 14*step), load(q + 15*step), and, or, xor); \
+    CSA(foursB,  twos,   twos,   twosA,            twosB,             and, or, xor); \
+    CSA(eightsB, fours,  fours,  foursA,           foursB,            and, or, xor); \
+    CSA(sixteens, eights, eights, eightsA,         eightsB,           and, or, xor); \
+    add_bits(acc, sixteens);                                                 \
+    /* the byte counters in acc can't pass 255 */                            \
+    if (++blocks == 255) {                                                   \
+      for (k = 0; k < 8; k++) {                                              \
+        add_bytes(counts, acc[k], k, 16, step, store);                       \
+        acc[k] = zero();                                                     \
+      }                                                                      \
+      blocks = 0;                                                            \
+    }                                                                        \
+  }                                                                          \
+  for (k = 0; k < 8; k++)                                                    \
+    add_bytes(counts, acc[k], k, 16, step, store);                           \
+  add_vector(counts, ones,   1, step, store);                                \
+  add_vector(counts, twos,   2, step, store);                                \
+  add_vector(counts, fours,  4, step, store);                                \
+  add_vector(counts, eights, 8, step, store);                                \
+  return i;                                                                  \
+}
+
+/* Add weight * (byte b of v) to the counter for bit k of byte b */
+#define add_bytes(counts, v, k, weight, step, store)                         \
+  do {                                                                       \
+    uchar bytes_[32];                                                        \
+    size_t b_;                                                               \
+    store(bytes_, v);                                                        \
+    for (b_ = 0; b_ < step; b_++)                                            \
+      counts[b_ % 8 * 8 + k] += (uint64_t)weight * bytes_[b_];               \
+  } while (0)
+
+/* Add weight to the counter for each bit which is set in v */
+#define add_vector(counts, v, weight, step, store)                           \
+  do {                                                                       \
+    uchar bytes_[32];                                                        \
+    size_t b_;                                                               \
+    int k_;                                                                  \
+    store(bytes_, v);                                                        \
+    for (b_ = 0; b_ < step; b_++)                                            \
+      for (k_ = 0; k_ < 8; k_++)                                             \
+        counts[b_ % 8 * 8 + k_] += weight * ((bytes_[b_] >> k_) & 1);       \
+  } while (0)
+
+#ifdef __AVX2__
+static inline __m256i load256(const uchar *p)       { return _mm256_loadu_si256((const __m256i*)p); }
+static inline void    store256(uchar *p, __m256i v) { _mm256_storeu_si256((__m256i*)p, v); }
+
+/* For each k, add 1 to each byte of acc[k] where bit k of that byte of v is set
+ * (subtracting -1, the result of the comparison) */
+static inline void
+add_bits256(__m256i *acc, __m256i v)
+{
+  int k;
+  for (k = 0; k < 8; k++) {
+    const __m256i bit = _mm256_set1_epi8((char)(1 << k));
+    acc[k] = _mm256_sub_epi8(acc[k], _mm256_cmpeq_epi8(_mm256_and_si256(v, bit), bit));
+  }
+}
+
+def_pospopcnt(pospopcnt256, __m256i, load256, store256, _mm256_setzero_si256,
+              _mm256_and_si256, _mm256_or_si256, _mm256_xor_si256, add_bits256)
+#endif
+
+#ifdef __SSE2__
+static inline __m128i load128(const uchar *p)       { return _mm_loadu_si128((const __m128i*)p); }
+static inline void    store128(uchar *p, __m128i v) { _mm_storeu_si128((__m128i*)p, v); }
+
+static inline void
+add_bits128(__m128i *acc, __m128i v)
+{
+  int k;
+  for (k = 0; k < 8; k++) {
+    const __m128i bit = _mm_set1_epi8((char)(1 << k));
+    acc[k] = _mm_sub_epi8(acc[k], _mm_cmpeq_epi8(_mm_and_si128(v, bit), bit));
+  }
+}
+
+def_pospopcnt(pospopcnt128, __m128i, load128, store128, _mm_setzero_si128,
+              _mm_and_si128, _mm_or_si128, _mm_xor_si128, add_bits128)
+#endif
+
+static inline uint64_t load64(const uchar *p)        { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline void     store64(uchar *p, uint64_t v) { memcpy(p, &v, 8); }
+static inline uint64_t zero64(void)                  { return 0; }
+static inline uint64_t and64(uint64_t a, uint64_t b) { return a & b; }
+static inline uint64_t or64(uint64_t a, uint64_t b)  { return a | b; }
+static inline uint64_t xor64(uint64_t a, uint64_t b) { return a ^ b; }
+
+/* The byte counters are the bytes of a uint64_t; none can carry into the next */
+static inline void
+add_bits64(uint64_t *acc, uint64_t v)
+{
+  int k;
+  for (k = 0; k < 8; k++)
+    acc[k] += (v >> k) & 0x0101010101010101ULL;
+}
+
+def_pospopcnt(pospopcnt64, uint64_t, load64, store64, zero64, and64, or64, xor64, add_bits64)
+
+typedef struct {
+  const uchar *p;
+  size_t       n;
+  uint64_t     counts[64];
+} pospopcnt_job;
+
+static void*
+pospopcnt_buf(void *arg)
+{
+  pospopcnt_job *job = arg;
+  size_t i = 0;
+  int k;
+
+#ifdef __AVX2__
+  i += pospopcnt256(job->p + i, job->n - i, job->counts);
+#endif
+#ifdef __SSE2__
+  i += pospopcnt128(job->p + i, job->n - i, job->counts);
+#endif
+  i += pospopcnt64(job->p + i, job->n - i, job->counts);
+  for (; i < job->n; i++)
+    for (k = 0; k < 8; k++)
+      job->counts[i % 8 * 8 + k] += (job->p[i] >> k) & 1;
+  return NULL;
+}
+
+/* Count, for each bit position of the unsigned integers in `buffer`, how many of
+ * them have that bit set.
+ *
+ * @example
+ *   BitTwiddle.positional_popcount([1, 3, 0xF0].pack("C*"), 8) # => [2, 1, 0, 0, 1, 1, 1, 1]
+ *   # the fraction of words with each bit set
+ *   BitTwiddle.positional_popcount(words, 64).map { |c| c.fdiv(words.bytesize / 8) }
+ *
+ * For a long String, the GVL is released while counting.
+ *
+ * @param buffer [String] Integers in native byte order (as produced by
+ *   `Array#pack("C*")`, `"S*"`, `"L*"` or `"Q*"`)
+ * @param width [Integer] Size of each integer: 8, 16, 32 or 64 bits
+ * @return [Array<Integer>] `width` counts, for the least significant bit first
+ */
+static VALUE
+bt_positional_popcount(VALUE self, VALUE buffer, VALUE width)
+{
+  pospopcnt_job job;
+  VALUE result;
+  int w = NUM2INT(width), bytes, j;
+
+  StringValue(buffer);
+  if (w != 8 && w != 16 && w != 32 && w != 64)
+    rb_raise(rb_eArgError, "width must be 8, 16, 32 or 64 bits (not %d)", w);
+  bytes = w / 8;
+  if (RSTRING_LEN(buffer) % bytes)
+    rb_raise(rb_eArgError, "buffer length must be a multiple of %d bytes", bytes);
+
+  /* other threads can change 'buffer' while the GVL is released */
+  buffer = rb_str_new_frozen(buffer);
+  memset(&job, 0, sizeof(job));
+  job.p = (const uchar*)RSTRING_PTR(buffer);
+  job.n = RSTRING_LEN(buffer);
+  if (job.n >= NOGVL_THRESHOLD)
+    rb_thread_call_without_gvl(pospopcnt_buf, &job, NULL, NULL);
+  else
+    pospopcnt_buf(&job);
+  RB_GC_GUARD(buffer);
+
+  /* bit j of a word is in byte j / 8 (or, big-endian, bytes - 1 - j / 8), and
+   * that byte is at every offset in the 8 byte counters which is congruent to
+   * it mod 'bytes' */
+  result = rb_ary_new2(w);
+  for (j = 0; j < w; j++) {
+    uint64_t total = 0;
+    int b;
+#ifdef WORDS_BIGENDIAN
+    int byte = bytes - 1 - j / 8;
+#else
+    int byte = j / 8;
+#endif
+    for (b = byte; b < 8; b += bytes)
+      total += job.counts[b * 8 + j % 8];
+    rb_ary_push(result, ULL2NUM(total));
+  }
+  return result;
+}
+
+void Init_bt_positional_popcount(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  rb_define_singleton_method(rb_mBitTwiddle, "positional_popcount", bt_positional_popcount, 2);
+}
@@ -0,0 +1,343 @@
+/* BitTwiddle::RadixHeap: a monotone priority queue of unsigned 64-bit keys
+ *
+ * Every key in the heap is at least 'last', the most recently popped key.
+ * Bucket 0 holds keys equal to 'last', and bucket b (1 to 64) holds keys whose
+ * highest bit which differs from 'last' is bit b - 1. When bucket 0 is empty,
+ * pop_min finds the first non-empty bucket, makes its smallest key the new
+ * 'last', and redistributes the rest of that bucket into lower buckets. Each
+ * key can only move down, so it is moved at most 64 times, and pushing is just
+ * an XOR, a clz and an append. (Ahuja, Mehlhorn, Orlin and Tarjan, 1990) */
+
+#include "bit_twiddle.h"
+
+#define NBUCKETS 65
+
+typedef struct {
+  uint64_t *keys;
+  VALUE    *values;
+  size_t    n, cap;
+} bucket;
+
+typedef struct {
+  bucket   buckets[NBUCKETS];
+  uint64_t nonempty; /* bit b - 1 set when bucket b (1 to 64) is not empty */
+  uint64_t last;
+  size_t   size;
+} radix_heap;
+
+static inline int
+bucket_for(uint64_t key, uint64_t last)
+{
+  uint64_t x = key ^ last;
+  return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline void
+bucket_push(radix_heap *rh, int b, uint64_t key, VALUE value)
+{
+  bucket *bk = &rh->buckets[b];
+  if (bk->n == bk->cap) {
+    size_t cap = bk->cap ? bk->cap * 2 : 8;
+    REALLOC_N(bk->keys, uint64_t, cap);
+    REALLOC_N(bk->values, VALUE, cap);
+    bk->cap = cap;
+  }
+  bk->keys[bk->n]   = key;
+  bk->values[bk->n] = value;
+  bk->n++;
+  if (b)
+    rh->nonempty |= 1ULL << (b - 1);
+}
+
+/* Refill bucket 0 from the first non-empty bucket (which must exist) */
+static void
+radix_heap_refill(radix_heap *rh)
+{
+  int b = __builtin_ctzll(rh->nonempty) + 1;
+  bucket *bk = &rh->buckets[b];
+  uint64_t min = bk->keys[0];
+  size_t i, n = bk->n;
+
+  /* vectorized by the compiler */
+  for (i = 1; i < n; i++)
+    min = bk->keys[i] < min ? bk->keys[i] : min;
+  rh->last = min;
+
+  /* every key in bucket b goes to a lower bucket, so none is added back to b.
+   * bucket_push can run the GC, so the values stay in bucket b (to be marked)
+   * until all of them have been copied */
+  for (i = 0; i < n; i++)
+    bucket_push(rh, bucket_for(bk->keys[i], min), bk->keys[i], bk->values[i]);
+  bk->n = 0;
+  rh->nonempty &= ~(1ULL << (b - 1));
+}
+
+static void
+radix_heap_mark(void *ptr)
+{
+  radix_heap *rh = ptr;
+  size_t i;
+  int b;
+
+  for (b = 0; b < NBUCKETS; b++)
+    for (i = 0; i < rh->buckets[b].n; i++)
+      rb_gc_mark(rh->buckets[b].values[i]);
+}
+
+static void
+radix_heap_free(void *ptr)
+{
+  radix_heap *rh = ptr;
+  int b;
+
+  for (b = 0; b < NBUCKETS; b++) {
+    xfree(rh->buckets[b].keys);
+    xfree(rh->buckets[b].values);
+  }
+  xfree(rh);
+}
+
+static size_t
+radix_heap_memsize(const void *ptr)
+{
+  const radix_heap *rh = ptr;
+  size_t size = sizeof(radix_heap);
+  int b;
+
+  for (b = 0; b < NBUCKETS; b++)
+    size += rh->buckets[b].cap * (sizeof(uint64_t) + sizeof(VALUE));
+  return size;
+}
+
+static const rb_data_type_t radix_heap_type = {
+  "BitTwiddle::RadixHeap",
+  { radix_heap_mark, radix_heap_free, radix_heap_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+radix_heap_alloc(VALUE klass)
+{
+  radix_heap *rh;
+  return TypedData_Make_Struct(klass, radix_heap, &radix_heap_type, rh);
+}
+
+static radix_heap*
+get_radix_heap(VALUE self)
+{
+  radix_heap *rh;
+  TypedData_Get_Struct(self, radix_heap, &radix_heap_type, rh);
+  return rh;
+}
+
+static void
+radix_heap_push_key(radix_heap *rh, VALUE key, VALUE value)
+{
+  uint64_t k = bt_num_to_u64(key);
+  if (k < rh->last)
+    rb_raise(rb_eArgError, "key %llu is less than the last key popped (%llu)",
+             (unsigned long long)k, (unsigned long long)rh->last);
+  bucket_push(rh, bucket_for(k, rh->last), k, value);
+  rh->size++;
+}
+
+/* Document-method: BitTwiddle::RadixHeap#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+radix_heap_initialize_copy(VALUE self, VALUE orig)
+{
+  radix_heap *dst = get_radix_heap(self), *src = get_radix_heap(orig);
+  int b;
+
+  if (dst == src)
+    return self;
+  for (b = 0; b < NBUCKETS; b++) {
+    bucket *d = &dst->buckets[b], *s = &src->buckets[b];
+    if (d->cap < s->n) {
+      REALLOC_N(d->keys, uint64_t, s->n);
+      REALLOC_N(d->values, VALUE, s->n);
+      d->cap = s->n;
+    }
+    if (s->n) {
+      MEMCPY(d->keys, s->keys, uint64_t, s->n);
+      MEMCPY(d->values, s->values, VALUE, s->n);
+    }
+    d->n = s->n;
+  }
+  dst->nonempty = src->nonempty;
+  dst->last     = src->last;
+  dst->size     = src->size;
+  return self;
+}
+
+/* Document-method: BitTwiddle::RadixHeap#push
+ * Add `key`, with an associated `value`. `key` must be no less than the last
+ * key popped; otherwise, raise `ArgumentError`.
+ *
+ * @param key [Integer] 0 to 2^64 - 1
+ * @param value [Object] (default nil)
+ * @return [RadixHeap] `self`
+ */
+static VALUE
+radix_heap_push(int argc, VALUE *argv, VALUE self)
+{
+  VALUE key, value;
+  rb_check_frozen(self);
+  rb_scan_args(argc, argv, "11", &key, &value);
+  radix_heap_push_key(get_radix_heap(self), key, value);
+  return self;
+}
+
+/* Document-method: BitTwiddle::RadixHeap#push_all
+ * Add each of `keys`, with the value at the same index in `values` (or `nil`).
+ *
+ * @example
+ *   heap = BitTwiddle::RadixHeap.new
+ *   heap.push_all([30, 10, 20], [:c, :a, :b])
+ *   heap.pop_min # => [10, :a]
+ *
+ * @param keys [Array<Integer>]
+ * @param values [Array, nil] The same length as `keys`
+ * @return [RadixHeap] `self`
+ */
+static VALUE
+radix_heap_push_all(int argc, VALUE *argv, VALUE self)
+{
+  radix_heap *rh = get_radix_heap(self);
+  VALUE keys, values;
+  long i;
+
+  rb_check_frozen(self);
+  rb_scan_args(argc, argv, "11", &keys, &values);
+  keys = rb_Array(keys);
+  if (!NIL_P(values)) {
+    values = rb_Array(values);
+    if (RARRAY_LEN(values) != RARRAY_LEN(keys))
+      rb_raise(rb_eArgError, "%ld keys but %ld values", RARRAY_LEN(keys), RARRAY_LEN(values));
+  }
+  for (i = 0; i < RARRAY_LEN(keys); i++)
+    radix_heap_push_key(rh, RARRAY_AREF(keys, i), NIL_P(values) ? Qnil : RARRAY_AREF(values, i));
+  return self;
+}
+
+/* Document-method: BitTwiddle::RadixHeap#pop_min
+ * Remove a pair with the smallest key. Pairs with equal keys come out in no
+ * particular order.
+ *
+ * @return [Array(Integer, Object), nil] `[key, value]`, or `nil` if the heap is empty
+ */
+static VALUE
+radix_heap_pop_min(VALUE self)
+{
+  radix_heap *rh = get_radix_heap(self);
+  bucket *b0 = &rh->buckets[0];
+  VALUE value;
+
+  rb_check_frozen(self);
+  if (rh->size == 0)
+    return Qnil;
+  if (b0->n == 0)
+    radix_heap_refill(rh);
+  value = b0->values[--b0->n];
+  rh->size--;
+  return rb_assoc_new(ULL2NUM(rh->last), value);
+}
+
+/* Document-method: BitTwiddle::RadixHeap#min_key
+ * The smallest key, without removing it.
+ *
+ * @return [Integer, nil] `nil` if the heap is empty
+ */
+static VALUE
+radix_heap_min_key(VALUE self)
+{
+  radix_heap *rh = get_radix_heap(self);
+  bucket *bk;
+  uint64_t min;
+  size_t i;
+
+  if (rh->size == 0)
+    return Qnil;
+  if (rh->buckets[0].n)
+    return ULL2NUM(rh->last);
+  /* don't refill, which would raise the minimum for future pushes */
+  bk  = &rh->buckets[__builtin_ctzll(rh->nonempty) + 1];
+  min = bk->keys[0];
+  for (i = 1; i < bk->n; i++)
+    min = bk->keys[i] < min ? bk->keys[i] : min;
+  return ULL2NUM(min);
+}
+
+/* Document-method: BitTwiddle::RadixHeap#last_key
+ * The last key popped (or 0). Keys pushed from now on must be at least this.
+ *
+ * @return [Integer]
+ */
+static VALUE
+radix_heap_last_key(VALUE self)
+{
+  return ULL2NUM(get_radix_heap(self)->last);
+}
+
+/* Document-method: BitTwiddle::RadixHeap#size
+ * @return [Integer] The number of pairs in the heap
+ */
+static VALUE
+radix_heap_size(VALUE self)
+{
+  return SIZET2NUM(get_radix_heap(self)->size);
+}
+
+/* Document-method: BitTwiddle::RadixHeap#empty?
+ * @return [Boolean]
+ */
+static VALUE
+radix_heap_empty_p(VALUE self)
+{
+  return get_radix_heap(self)->size ? Qfalse : Qtrue;
+}
+
+/* Document-method: BitTwiddle::RadixHeap#clear
+ * Remove all pairs, and reset the last key popped to 0.
+ *
+ * @return [RadixHeap] `self`
+ */
+static VALUE
+radix_heap_clear(VALUE self)
+{
+  radix_heap *rh = get_radix_heap(self);
+  int b;
+
+  rb_check_frozen(self);
+  for (b = 0; b < NBUCKETS; b++)
+    rh->buckets[b].n = 0;
+  rh->nonempty = 0;
+  rh->last     = 0;
+  rh->size     = 0;
+  return self;
+}
+
+void Init_bt_radix_heap(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::RadixHeap
+   * A priority queue of (unsigned 64-bit Integer key, value) pairs, for uses
+   * where keys are never pushed which are smaller than the last one popped,
+   * such as Dijkstra's algorithm or event simulation. Pushing takes constant
+   * time, and popping takes amortized O(log(range of keys)) time.
+   */
+  VALUE rb_cRadixHeap = rb_define_class_under(rb_mBitTwiddle, "RadixHeap", rb_cObject);
+
+  rb_define_alloc_func(rb_cRadixHeap, radix_heap_alloc);
+  rb_define_method(rb_cRadixHeap, "initialize_copy", radix_heap_initialize_copy, 1);
+  rb_define_method(rb_cRadixHeap, "push",            radix_heap_push,           -1);
+  rb_define_method(rb_cRadixHeap, "push_all",        radix_heap_push_all,       -1);
+  rb_define_method(rb_cRadixHeap, "pop_min",         radix_heap_pop_min,         0);
+  rb_define_method(rb_cRadixHeap, "min_key",         radix_heap_min_key,         0);
+  rb_define_method(rb_cRadixHeap, "last_key",        radix_heap_last_key,        0);
+  rb_define_method(rb_cRadixHeap, "size",            radix_heap_size,            0);
+  rb_define_method(rb_cRadixHeap, "empty?",          radix_heap_empty_p,         0);
+  rb_define_method(rb_cRadixHeap, "clear",           radix_heap_clear,           0);
+}
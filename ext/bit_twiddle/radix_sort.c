@@ -0,0 +1,506 @@
+/* LSD radix sort for buffers of 32 or 64-bit keys
+ *
+ * Keys are sorted 8 bits at a time, from the least significant byte up,
+ * ping-ponging between the buffer and a temporary one. The histograms for every
+ * digit are built in a single read of the keys before any keys are moved; a
+ * digit which is the same for every key needs no pass at all (which is common
+ * for the high bytes of small values).
+ *
+ * Signed integers and floats are sorted by first converting them to unsigned
+ * keys which sort in the same order (flipping the sign bit, or as in
+ * BitTwiddle.float_to_keys), then converting back.
+ *
+ * For big inputs, each pass is split across threads: each thread counts the
+ * digits in its own slice of the keys, and from all the counts, each thread
+ * gets its own starting offset in every bucket, so the threads can scatter
+ * their keys independently and the sort stays stable. */
+
+#include "bit_twiddle.h"
+#include <ruby/thread.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <unistd.h>
+#define MAX_THREADS 16
+#else
+#define MAX_THREADS 1
+#endif
+
+/* below this, threads cost more than they save */
+#define PARALLEL_THRESHOLD (1 << 20)
+
+/* While scattering key i, prefetch the place in its bucket where key
+ * i + PREFETCH_AHEAD will go */
+#define PREFETCH_AHEAD 16
+
+#define KEYS_UNSIGNED 0
+#define KEYS_SIGNED   1
+#define KEYS_FLOAT    2
+
+/* signed:, float: and threads:, interned in Init_bt_radix_sort */
+static ID kw_ids[3];
+
+typedef struct {
+  uchar    *keys, *tmp;
+  uint32_t *index, *tmp_index; /* NULL if not sorting an index */
+  size_t    n;
+  int       width;
+  int       kind;
+  int       nthreads;
+  size_t  (*count)[256];       /* a histogram per digit, for sort_serial */
+  struct sort_slice *slices;   /* one per thread, for sort_parallel */
+} sort_job;
+
+typedef struct sort_slice {
+  sort_job *job;
+  const uchar    *src;
+  uchar          *dst;
+  const uint32_t *isrc;
+  uint32_t       *idst;
+  size_t start, end;
+  int    shift;
+  size_t count[256];  /* digit counts, then starting offsets for this slice */
+} sort_slice;
+
+static inline uint64_t
+load_key(const uchar *p, size_t i, int width)
+{
+  if (width == 32) {
+    uint32_t k;
+    memcpy(&k, p + i*4, 4);
+    return k;
+  } else {
+    uint64_t k;
+    memcpy(&k, p + i*8, 8);
+    return k;
+  }
+}
+
+static inline void
+store_key(uchar *p, size_t i, uint64_t k, int width)
+{
+  if (width == 32) {
+    uint32_t k32 = (uint32_t)k;
+    memcpy(p + i*4, &k32, 4);
+  } else {
+    memcpy(p + i*8, &k, 8);
+  }
+}
+
+/* Convert keys to or from a form which sorts correctly as unsigned integers */
+static void
+transform_keys(uchar *p, size_t n, int width, int kind, int to_unsigned)
+{
+  uint64_t sign = 1ULL << (width - 1);
+  size_t   i;
+
+  if (kind == KEYS_SIGNED) {
+    for (i = 0; i < n; i++)
+      store_key(p, i, load_key(p, i, width) ^ sign, width);
+  } else if (kind == KEYS_FLOAT) {
+    uint64_t all = (width == 32) ? 0xFFFFFFFFULL : ~0ULL;
+    for (i = 0; i < n; i++) {
+      uint64_t k = load_key(p, i, width);
+      if (to_unsigned)
+        k ^= (k & sign) ? all : sign;
+      else
+        k ^= (k & sign) ? sign : all;
+      store_key(p, i, k, width);
+    }
+  }
+}
+
+static inline __attribute__((always_inline)) void
+count_digits(const uchar *keys, size_t start, size_t end, int width, int shift, size_t *count)
+{
+  size_t i;
+  for (i = start; i < end; i++)
+    count[(load_key(keys, i, width) >> shift) & 0xFF]++;
+}
+
+/* Each of the 256 buckets is written sequentially, but they are spread across
+ * the destination, so there are more write streams than the hardware
+ * prefetcher follows. The bucket offsets say where upcoming keys will be
+ * written, so those lines can be prefetched */
+static inline __attribute__((always_inline)) void
+scatter(const uchar *src, uchar *dst, const uint32_t *isrc, uint32_t *idst,
+        size_t start, size_t end, int width, int shift, size_t *offset)
+{
+  size_t i, ahead = (end - start > PREFETCH_AHEAD) ? end - PREFETCH_AHEAD : start;
+
+  for (i = start; i < end; i++) {
+    uint64_t k   = load_key(src, i, width);
+    size_t   pos = offset[(k >> shift) & 0xFF]++;
+    if (i < ahead) {
+      size_t next = offset[(load_key(src, i + PREFETCH_AHEAD, width) >> shift) & 0xFF];
+      __builtin_prefetch(dst + next * (width / 8), 1);
+      if (idst)
+        __builtin_prefetch(idst + next, 1);
+    }
+    store_key(dst, pos, k, width);
+    if (idst)
+      idst[pos] = isrc[i];
+  }
+}
+
+static void
+scatter_slice(sort_slice *s)
+{
+  if (s->job->width == 32)
+    scatter(s->src, s->dst, s->isrc, s->idst, s->start, s->end, 32, s->shift, s->count);
+  else
+    scatter(s->src, s->dst, s->isrc, s->idst, s->start, s->end, 64, s->shift, s->count);
+}
+
+static void
+count_slice(sort_slice *s)
+{
+  memset(s->count, 0, sizeof(s->count));
+  if (s->job->width == 32)
+    count_digits(s->src, s->start, s->end, 32, s->shift, s->count);
+  else
+    count_digits(s->src, s->start, s->end, 64, s->shift, s->count);
+}
+
+/* Single-threaded: all histograms in one pass, then one scatter per digit */
+static void
+sort_serial(sort_job *job)
+{
+  int       digits = job->width / 8, d, b;
+  size_t    (*count)[256] = job->count;
+  uchar    *src = job->keys, *dst = job->tmp;
+  uint32_t *isrc = job->index, *idst = job->tmp_index;
+  size_t    i;
+
+  for (i = 0; i < job->n; i++) {
+    uint64_t k = load_key(job->keys, i, job->width);
+    for (d = 0; d < digits; d++)
+      count[d][(k >> (8*d)) & 0xFF]++;
+  }
+
+  for (d = 0; d < digits; d++) {
+    size_t offset[256], sum = 0;
+    for (b = 0; b < 256; b++) {
+      if (count[d][b] == job->n)
+        break;
+      offset[b] = sum;
+      sum += count[d][b];
+    }
+    if (b < 256)
+      continue; /* every key has the same digit */
+
+    if (job->width == 32)
+      scatter(src, dst, isrc, idst, 0, job->n, 32, 8*d, offset);
+    else
+      scatter(src, dst, isrc, idst, 0, job->n, 64, 8*d, offset);
+
+    { uchar *t = src; src = dst; dst = t; }
+    { uint32_t *t = isrc; isrc = idst; idst = t; }
+  }
+
+  if (src != job->keys) {
+    memcpy(job->keys, src, job->n * (job->width / 8));
+    if (job->index)
+      memcpy(job->index, isrc, job->n * 4);
+  }
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static void*
+count_thread(void *arg)
+{
+  count_slice(arg);
+  return NULL;
+}
+
+static void*
+scatter_thread(void *arg)
+{
+  scatter_slice(arg);
+  return NULL;
+}
+
+/* Run fn on each slice, using one thread per slice (the first on this thread) */
+static void
+run_slices(sort_slice *slices, int nthreads, void *(*fn)(void*))
+{
+  pthread_t threads[MAX_THREADS];
+  int started[MAX_THREADS], t;
+
+  for (t = 1; t < nthreads; t++)
+    started[t] = (pthread_create(&threads[t], NULL, fn, &slices[t]) == 0);
+  fn(&slices[0]);
+  for (t = 1; t < nthreads; t++) {
+    if (started[t])
+      pthread_join(threads[t], NULL);
+    else
+      fn(&slices[t]);
+  }
+}
+
+static void
+sort_parallel(sort_job *job)
+{
+  int       digits = job->width / 8, nthreads = job->nthreads, d, b, t;
+  sort_slice *slices = job->slices;
+  uchar    *src = job->keys, *dst = job->tmp;
+  uint32_t *isrc = job->index, *idst = job->tmp_index;
+
+  for (t = 0; t < nthreads; t++) {
+    slices[t].job   = job;
+    slices[t].start = job->n * t / nthreads;
+    slices[t].end   = job->n * (t + 1) / nthreads;
+  }
+
+  for (d = 0; d < digits; d++) {
+    size_t sum = 0;
+    int    constant = 0;
+
+    for (t = 0; t < nthreads; t++) {
+      slices[t].src   = src;
+      slices[t].dst   = dst;
+      slices[t].isrc  = isrc;
+      slices[t].idst  = idst;
+      slices[t].shift = 8 * d;
+    }
+    run_slices(slices, nthreads, count_thread);
+
+    /* bucket b of thread t starts after bucket b of threads 0..t-1 */
+    for (b = 0; b < 256 && !constant; b++) {
+      size_t total = 0;
+      for (t = 0; t < nthreads; t++) {
+        size_t c = slices[t].count[b];
+        slices[t].count[b] = sum + total;
+        total += c;
+      }
+      constant = (total == job->n);
+      sum += total;
+    }
+    if (constant)
+      continue;
+
+    run_slices(slices, nthreads, scatter_thread);
+    { uchar *tk = src; src = dst; dst = tk; }
+    { uint32_t *ti = isrc; isrc = idst; idst = ti; }
+  }
+
+  if (src != job->keys) {
+    memcpy(job->keys, src, job->n * (job->width / 8));
+    if (job->index)
+      memcpy(job->index, isrc, job->n * 4);
+  }
+}
+
+static int
+default_threads(size_t n)
+{
+  long cpus;
+  if (n < PARALLEL_THRESHOLD)
+    return 1;
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1)
+    return 1;
+  return (cpus > 8) ? 8 : (int)cpus;
+}
+
+#else
+
+static int
+default_threads(size_t n)
+{
+  return 1;
+}
+
+#endif
+
+static void*
+sort_without_gvl(void *arg)
+{
+  sort_job *job = arg;
+
+  transform_keys(job->keys, job->n, job->width, job->kind, 1);
+#ifdef HAVE_PTHREAD_H
+  if (job->nthreads > 1)
+    sort_parallel(job);
+  else
+#endif
+    sort_serial(job);
+  transform_keys(job->keys, job->n, job->width, job->kind, 0);
+  return NULL;
+}
+
+/* Parse (buffer, width = 64, signed: false, float: false, threads: nil) */
+static VALUE
+parse_args(int argc, VALUE *argv, sort_job *job)
+{
+  VALUE buffer, width, opts, kw[3];
+  int   w, t;
+
+  rb_scan_args(argc, argv, "11:", &buffer, &width, &opts);
+  kw[0] = kw[1] = kw[2] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kw_ids, 0, 3, kw);
+
+  StringValue(buffer);
+  w = NIL_P(width) ? 64 : NUM2INT(width);
+  if (w != 32 && w != 64)
+    rb_raise(rb_eArgError, "key width must be 32 or 64 bits (not %d)", w);
+  if (RSTRING_LEN(buffer) % (w / 8))
+    rb_raise(rb_eArgError, "buffer length must be a multiple of %d bytes", w / 8);
+
+  memset(job, 0, sizeof(*job));
+  job->width = w;
+  job->n     = RSTRING_LEN(buffer) / (w / 8);
+  job->kind  = KEYS_UNSIGNED;
+  if (kw[0] != Qundef && RTEST(kw[0]))
+    job->kind = KEYS_SIGNED;
+  if (kw[1] != Qundef && RTEST(kw[1])) {
+    if (job->kind == KEYS_SIGNED)
+      rb_raise(rb_eArgError, "keys can't be both signed integers and floats");
+    job->kind = KEYS_FLOAT;
+  }
+
+  if (kw[2] == Qundef || NIL_P(kw[2])) {
+    job->nthreads = default_threads(job->n);
+  } else {
+    t = NUM2INT(kw[2]);
+    if (t < 1)
+      rb_raise(rb_eArgError, "number of threads must be positive");
+    job->nthreads = (t > MAX_THREADS) ? MAX_THREADS : t;
+  }
+  if (job->nthreads > 1 && (size_t)job->nthreads > job->n)
+    job->nthreads = job->n ? (int)job->n : 1;
+
+  return buffer;
+}
+
+/* Sort 'buffer' (which must be safe to modify) in place */
+static void
+run_sort(VALUE buffer, sort_job *job, VALUE index)
+{
+  size_t bytes = job->n * (job->width / 8), aux, total;
+  uchar *scratch;
+  VALUE  v;
+
+  /* one allocation, made while we hold the GVL, for the histograms or slices
+   * (which need the strictest alignment, so they go first), the temporary keys
+   * and the temporary index. Running out of memory raises NoMemoryError, and
+   * nothing leaks */
+  if (job->nthreads > 1)
+    aux = job->nthreads * sizeof(sort_slice);
+  else
+    aux = 256 * (job->width / 8) * sizeof(size_t);
+  total = aux + bytes + (NIL_P(index) ? 0 : job->n * 4);
+  scratch = ALLOCV(v, total);
+  memset(scratch, 0, aux);
+
+  if (job->nthreads > 1)
+    job->slices = (sort_slice*)scratch;
+  else
+    job->count  = (size_t(*)[256])scratch;
+  job->keys = (uchar*)RSTRING_PTR(buffer);
+  job->tmp  = scratch + aux;
+  if (!NIL_P(index)) {
+    size_t i;
+    job->index     = (uint32_t*)RSTRING_PTR(index);
+    job->tmp_index = (uint32_t*)(scratch + aux + bytes);
+    for (i = 0; i < job->n; i++)
+      job->index[i] = (uint32_t)i;
+  }
+
+  /* the String can't be changed by another Ruby thread while the GVL is released */
+  rb_str_locktmp(buffer);
+  rb_thread_call_without_gvl(sort_without_gvl, job, NULL, NULL);
+  rb_str_unlocktmp(buffer);
+  ALLOCV_END(v);
+}
+
+/* Sort a buffer of unsigned 32 or 64-bit integers (as produced by
+ * `Array#pack("L*")` or `Array#pack("Q*")`) using LSD radix sort. Returns a new
+ * sorted buffer.
+ *
+ * With `signed: true`, the keys are sorted as signed integers (`"l*"` or
+ * `"q*"`); with `float: true`, as native-endian floats (`"f*"` or `"d*"`, where
+ * -0.0 sorts before 0.0, and NaNs go at either end depending on their sign bit).
+ *
+ * Big buffers are sorted with multiple threads, and other Ruby threads can run
+ * while sorting. `threads:` overrides the number of threads used.
+ *
+ * @example
+ *   BitTwiddle.radix_sort([3, 1, 2].pack("Q*")).unpack("Q*")                 # => [1, 2, 3]
+ *   BitTwiddle.radix_sort([1.5, -2.0].pack("d*"), float: true).unpack("d*") # => [-2.0, 1.5]
+ *
+ * @param buffer [String] The keys, in native byte order
+ * @param width [Integer] Size of each key: 32 or 64 bits (default 64)
+ * @return [String]
+ */
+static VALUE
+bt_radix_sort(int argc, VALUE *argv, VALUE self)
+{
+  sort_job job;
+  VALUE buffer = parse_args(argc, argv, &job);
+  VALUE result = rb_str_new(RSTRING_PTR(buffer), RSTRING_LEN(buffer));
+  run_sort(result, &job, Qnil);
+  return result;
+}
+
+/* Like `BitTwiddle.radix_sort`, but sort `buffer` in place.
+ *
+ * @param buffer [String] The keys, in native byte order
+ * @param width [Integer] Size of each key: 32 or 64 bits (default 64)
+ * @return [String] `buffer`
+ */
+static VALUE
+bt_radix_sort_bang(int argc, VALUE *argv, VALUE self)
+{
+  sort_job job;
+  VALUE buffer = parse_args(argc, argv, &job);
+  rb_str_modify(buffer);
+  run_sort(buffer, &job, Qnil);
+  return buffer;
+}
+
+/* Like `BitTwiddle.radix_sort`, but also return the original position of each
+ * sorted key, as a buffer of unsigned 32-bit integers (`"L*"`). This can be used
+ * to reorder other data (a "payload") in the same way as the keys. The sort is
+ * stable, so keys which are equal stay in their original order.
+ *
+ * If the buffer has 2^32 or more keys, raise `ArgumentError`.
+ *
+ * @example
+ *   keys, index = BitTwiddle.radix_sort_with_index([30, 10, 20].pack("Q*"))
+ *   keys.unpack("Q*")  # => [10, 20, 30]
+ *   index.unpack("L*") # => [1, 2, 0]
+ *
+ * @param buffer [String] The keys, in native byte order
+ * @param width [Integer] Size of each key: 32 or 64 bits (default 64)
+ * @return [Array(String, String)] The sorted keys, and the index
+ */
+static VALUE
+bt_radix_sort_with_index(int argc, VALUE *argv, VALUE self)
+{
+  sort_job job;
+  VALUE buffer = parse_args(argc, argv, &job);
+  VALUE result, index;
+
+  if ((uint64_t)job.n > UINT32_MAX)
+    rb_raise(rb_eArgError, "too many keys for a 32-bit index");
+  result = rb_str_new(RSTRING_PTR(buffer), RSTRING_LEN(buffer));
+  index  = rb_str_new(NULL, job.n * 4);
+  run_sort(result, &job, index);
+  return rb_assoc_new(result, index);
+}
+
+void Init_bt_radix_sort(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+
+  kw_ids[0] = rb_intern("signed");
+  kw_ids[1] = rb_intern("float");
+  kw_ids[2] = rb_intern("threads");
+
+  rb_define_singleton_method(rb_mBitTwiddle, "radix_sort",            bt_radix_sort,            -1);
+  rb_define_singleton_method(rb_mBitTwiddle, "radix_sort!",           bt_radix_sort_bang,       -1);
+  rb_define_singleton_method(rb_mBitTwiddle, "radix_sort_with_index", bt_radix_sort_with_index, -1);
+}
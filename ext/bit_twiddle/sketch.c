@@ -0,0 +1,1115 @@
+/* Cardinality and frequency sketches: BitTwiddle::HyperLogLog and
+ * BitTwiddle::CountMinSketch
+ *
+ * Both hash keys with bt_hash_value, so an Integer or String key is hashed the
+ * same way as for BloomFilter.
+ *
+ * HyperLogLog follows HyperLogLog++ (Heule, Nunkesser and Hall, 2013): 64-bit
+ * hashes, and a sparse representation for small cardinalities which records
+ * the position of the first 1 bit for a 2^25-register sketch, as a sorted list
+ * of (index << 6 | rank) entries. It is converted to dense registers once it
+ * would take more memory than them. Instead of the empirical bias correction
+ * tables of HyperLogLog++, the estimate uses the "improved raw estimator" of
+ * Ertl (2017), which is unbiased across the whole range of cardinalities and
+ * works from a histogram of register values, so it applies to the sparse
+ * representation unchanged. */
+
+#include "bit_twiddle.h"
+#include <math.h>
+
+#define SPARSE_P     25
+#define MIN_P        4
+#define MAX_P        18
+#define MIN_SPARSE   64
+
+static const char hll_magic[5] = { 'B', 'T', 'H', 'L', 'L' };
+static const char cms_magic[5] = { 'B', 'T', 'C', 'M', 'S' };
+
+/* ------------------------------------------------------------------------- */
+/* Serialization helpers */
+
+static uchar*
+put_varint(uchar *out, uint64_t v)
+{
+  while (v >= 0x80) {
+    *out++ = (uchar)v | 0x80;
+    v >>= 7;
+  }
+  *out++ = (uchar)v;
+  return out;
+}
+
+static inline size_t
+varint_size(uint64_t v)
+{
+  return v ? (size_t)(63 - __builtin_clzll(v)) / 7 + 1 : 1;
+}
+
+static const uchar*
+get_varint(const uchar *p, const uchar *end, uint64_t *value)
+{
+  uint64_t v = 0;
+  int shift;
+
+  for (shift = 0; shift < 64; shift += 7) {
+    if (p == end)
+      rb_raise(rb_eArgError, "serialized sketch is truncated");
+    v |= (uint64_t)(*p & 0x7F) << shift;
+    if (!(*p++ & 0x80)) {
+      *value = v;
+      return p;
+    }
+  }
+  rb_raise(rb_eArgError, "serialized sketch has a bad varint");
+}
+
+/* ------------------------------------------------------------------------- */
+/* HyperLogLog */
+
+typedef struct {
+  uchar    *registers; /* 2^p registers when dense, else NULL */
+  uint32_t *sparse;    /* index << 6 | rank, at precision SPARSE_P */
+  size_t    n_sparse;
+  size_t    cap_sparse;
+  int       p;         /* 0 until initialized */
+} hyperloglog;
+
+static inline size_t
+hll_size(const hyperloglog *hll)
+{
+  return (size_t)1 << hll->p;
+}
+
+/* The sparse list never takes more memory than the dense registers would */
+static inline size_t
+max_sparse(const hyperloglog *hll)
+{
+  return hll_size(hll) / 4;
+}
+
+/* Position of the first 1 bit in the hash bits after the first 'p' (which
+ * choose the register), counting from 1, and capped at 65 - p */
+static inline int
+hash_rank(uint64_t h, int p)
+{
+  return __builtin_clzll((h << p) | (1ULL << (p - 1))) + 1;
+}
+
+static inline void
+dense_add(uchar *registers, int p, uint64_t h)
+{
+  size_t idx = h >> (64 - p);
+  uchar  rank = hash_rank(h, p);
+  if (registers[idx] < rank)
+    registers[idx] = rank;
+}
+
+/* Fold one sparse entry into the dense registers: its low (SPARSE_P - p) index
+ * bits are the first hash bits after the dense index, so if any is set, the
+ * rank comes from them */
+static inline void
+dense_add_sparse(uchar *registers, int p, uint32_t entry)
+{
+  uint32_t idx  = entry >> 6;
+  uint32_t low  = idx & ((1U << (SPARSE_P - p)) - 1);
+  int      rank = low ? SPARSE_P - p - (31 - __builtin_clz(low)) : SPARSE_P - p + (int)(entry & 63);
+  idx >>= SPARSE_P - p;
+  if (registers[idx] < rank)
+    registers[idx] = rank;
+}
+
+static void
+hll_to_dense(hyperloglog *hll)
+{
+  size_t i;
+
+  hll->registers = ruby_xcalloc(hll_size(hll), 1);
+  for (i = 0; i < hll->n_sparse; i++)
+    dense_add_sparse(hll->registers, hll->p, hll->sparse[i]);
+  xfree(hll->sparse);
+  hll->sparse     = NULL;
+  hll->n_sparse   = 0;
+  hll->cap_sparse = 0;
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+/* Sort a sparse list and keep only the highest rank for each index; return the
+ * new length */
+static size_t
+sparse_dedup(uint32_t *sparse, size_t len)
+{
+  size_t i, n = 0;
+
+  qsort(sparse, len, sizeof(uint32_t), cmp_u32);
+  for (i = 0; i < len; i++) {
+    if (n && (sparse[n-1] >> 6) == (sparse[i] >> 6))
+      n--;
+    sparse[n++] = sparse[i];
+  }
+  return n;
+}
+
+/* Deduplicate the sparse list; then if it is still over half full, grow it, or
+ * switch to dense registers */
+static void
+hll_compact(hyperloglog *hll)
+{
+  size_t n;
+
+  if (hll->registers)
+    return;
+  n = hll->n_sparse = sparse_dedup(hll->sparse, hll->n_sparse);
+  if (n > hll->cap_sparse / 2) {
+    if (hll->cap_sparse < max_sparse(hll)) {
+      hll->cap_sparse *= 2;
+      REALLOC_N(hll->sparse, uint32_t, hll->cap_sparse);
+    } else {
+      hll_to_dense(hll);
+    }
+  }
+}
+
+static inline void
+sparse_add(hyperloglog *hll, uint32_t entry)
+{
+  if (hll->n_sparse == hll->cap_sparse) {
+    hll_compact(hll);
+    if (hll->registers) {
+      dense_add_sparse(hll->registers, hll->p, entry);
+      return;
+    }
+  }
+  hll->sparse[hll->n_sparse++] = entry;
+}
+
+static inline void
+hll_add_hash(hyperloglog *hll, uint64_t h)
+{
+  if (hll->registers)
+    dense_add(hll->registers, hll->p, h);
+  else
+    sparse_add(hll, (uint32_t)(h >> (64 - SPARSE_P)) << 6 | hash_rank(h, SPARSE_P));
+}
+
+/* Take the maximum of each pair of registers; 32 or 16 at a time with AVX2/SSE2 */
+static void
+registers_max(uchar *dst, const uchar *src, size_t n)
+{
+  size_t i = 0;
+#ifdef __AVX2__
+  for (; i + 32 <= n; i += 32)
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_max_epu8(_mm256_loadu_si256((const __m256i*)(dst + i)),
+                                                              _mm256_loadu_si256((const __m256i*)(src + i))));
+#endif
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16)
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_max_epu8(_mm_loadu_si128((const __m128i*)(dst + i)),
+                                                       _mm_loadu_si128((const __m128i*)(src + i))));
+#endif
+  for (; i < n; i++)
+    if (dst[i] < src[i])
+      dst[i] = src[i];
+}
+
+/* Count how many registers hold each value. Four sub-histograms let the
+ * increments for consecutive registers proceed independently */
+static void
+registers_histogram(const uchar *registers, size_t m, uint64_t *hist)
+{
+  uint32_t sub[4][66];
+  size_t i;
+  int k;
+
+  memset(sub, 0, sizeof(sub));
+  for (i = 0; i < m; i += 4) {
+    sub[0][registers[i]]++;
+    sub[1][registers[i+1]]++;
+    sub[2][registers[i+2]]++;
+    sub[3][registers[i+3]]++;
+  }
+  for (k = 0; k < 66; k++)
+    hist[k] = (uint64_t)sub[0][k] + sub[1][k] + sub[2][k] + sub[3][k];
+}
+
+static double
+ertl_sigma(double x)
+{
+  double y = 1, z = x, prev;
+  if (x == 1)
+    return HUGE_VAL;
+  do {
+    x *= x;
+    prev = z;
+    z += x * y;
+    y += y;
+  } while (z != prev);
+  return z;
+}
+
+static double
+ertl_tau(double x)
+{
+  double y = 1, z, prev;
+  if (x == 0 || x == 1)
+    return 0;
+  z = 1 - x;
+  do {
+    x = sqrt(x);
+    prev = z;
+    y *= 0.5;
+    z -= (1 - x) * (1 - x) * y;
+  } while (z != prev);
+  return z / 3;
+}
+
+/* Estimate the cardinality from the histogram of a sketch with m registers,
+ * each holding 0 to q + 1 */
+static double
+ertl_estimate(const uint64_t *hist, double m, int q)
+{
+  double z = m * ertl_tau(1 - hist[q+1] / m);
+  int k;
+
+  for (k = q; k >= 1; k--)
+    z = 0.5 * (z + hist[k]);
+  z += m * ertl_sigma(hist[0] / m);
+  return m * m / (2 * log(2) * z);
+}
+
+/* Compact the sketch and point 'view' at it. A frozen sketch isn't changed:
+ * instead 'view' gets a compacted copy of its sparse list (or the dense
+ * registers it would have switched to) in a temporary buffer, which the caller
+ * frees with ALLOCV_END(*tmp) */
+static void
+hll_compacted(VALUE self, hyperloglog *hll, hyperloglog *view, VALUE *tmp)
+{
+  uint32_t *sparse;
+  size_t    i, n, dense;
+
+  *tmp = 0;
+  if (!OBJ_FROZEN(self))
+    hll_compact(hll);
+  *view = *hll;
+  if (hll->registers || !OBJ_FROZEN(self))
+    return;
+
+  /* only a full-size sparse list can turn into registers. (Not ALLOCV, whose
+   * alloca would be freed when this returns) */
+  dense  = (hll->cap_sparse < max_sparse(hll)) ? 0 : hll_size(hll);
+  sparse = rb_alloc_tmp_buffer(tmp, hll->n_sparse * sizeof(uint32_t) + dense + 1);
+  MEMCPY(sparse, hll->sparse, uint32_t, hll->n_sparse);
+  n = sparse_dedup(sparse, hll->n_sparse);
+  view->sparse   = sparse;
+  view->n_sparse = n;
+  if (dense && n > hll->cap_sparse / 2) {
+    view->registers = (uchar*)(sparse + hll->n_sparse);
+    memset(view->registers, 0, dense);
+    for (i = 0; i < n; i++)
+      dense_add_sparse(view->registers, hll->p, sparse[i]);
+    view->sparse   = NULL;
+    view->n_sparse = 0;
+  }
+}
+
+/* Estimate the cardinality of a compacted sketch */
+static double
+hll_estimate(const hyperloglog *hll)
+{
+  uint64_t hist[66];
+  size_t i;
+
+  if (hll->registers) {
+    registers_histogram(hll->registers, hll_size(hll), hist);
+    return ertl_estimate(hist, hll_size(hll), 64 - hll->p);
+  }
+  memset(hist, 0, sizeof(hist));
+  hist[0] = ((uint64_t)1 << SPARSE_P) - hll->n_sparse;
+  for (i = 0; i < hll->n_sparse; i++)
+    hist[hll->sparse[i] & 63]++;
+  return ertl_estimate(hist, (double)((uint64_t)1 << SPARSE_P), 64 - SPARSE_P);
+}
+
+static void
+hll_free(void *ptr)
+{
+  hyperloglog *hll = ptr;
+  xfree(hll->registers);
+  xfree(hll->sparse);
+  xfree(hll);
+}
+
+static size_t
+hll_memsize(const void *ptr)
+{
+  const hyperloglog *hll = ptr;
+  return sizeof(hyperloglog) + (hll->registers ? hll_size(hll) : 0) + hll->cap_sparse * sizeof(uint32_t);
+}
+
+static const rb_data_type_t hll_type = {
+  "BitTwiddle::HyperLogLog",
+  { 0, hll_free, hll_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+hll_alloc(VALUE klass)
+{
+  hyperloglog *hll;
+  return TypedData_Make_Struct(klass, hyperloglog, &hll_type, hll);
+}
+
+static hyperloglog*
+get_hll(VALUE self)
+{
+  hyperloglog *hll;
+  TypedData_Get_Struct(self, hyperloglog, &hll_type, hll);
+  if (hll->p == 0)
+    rb_raise(rb_eRuntimeError, "uninitialized HyperLogLog");
+  return hll;
+}
+
+/* Set up an empty sparse sketch, with room for at least 'n' entries */
+static void
+hll_setup(hyperloglog *hll, int p, size_t n)
+{
+  xfree(hll->registers); /* from an earlier call which raised an exception */
+  xfree(hll->sparse);
+  hll->registers  = NULL;
+  hll->p          = p;
+  hll->cap_sparse = MIN_SPARSE < max_sparse(hll) ? MIN_SPARSE : max_sparse(hll);
+  while (hll->cap_sparse < n)
+    hll->cap_sparse *= 2;
+  hll->sparse     = ALLOC_N(uint32_t, hll->cap_sparse);
+  hll->n_sparse   = 0;
+}
+
+/* Document-method: BitTwiddle::HyperLogLog#initialize
+ * Create an empty sketch with 2^`precision` registers. The relative standard
+ * error of `count` is about 1.04 / sqrt(2^precision): 0.8% for the default of
+ * 14. While the sketch holds few keys, it is stored sparsely, which is both
+ * smaller and more accurate.
+ *
+ * @param precision [Integer] 4 to 18 (default 14)
+ */
+static VALUE
+hll_initialize(int argc, VALUE *argv, VALUE self)
+{
+  hyperloglog *hll;
+  VALUE precision;
+  int p;
+
+  rb_scan_args(argc, argv, "01", &precision);
+  TypedData_Get_Struct(self, hyperloglog, &hll_type, hll);
+  if (hll->p)
+    rb_raise(rb_eRuntimeError, "HyperLogLog is already initialized");
+  p = NIL_P(precision) ? 14 : NUM2INT(precision);
+  if (p < MIN_P || p > MAX_P)
+    rb_raise(rb_eArgError, "precision must be between %d and %d", MIN_P, MAX_P);
+  hll_setup(hll, p, 0);
+  return self;
+}
+
+/* Document-method: BitTwiddle::HyperLogLog#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+hll_initialize_copy(VALUE self, VALUE orig)
+{
+  hyperloglog *dst, *src = get_hll(orig);
+
+  TypedData_Get_Struct(self, hyperloglog, &hll_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->p)
+    rb_raise(rb_eRuntimeError, "HyperLogLog is already initialized");
+  hll_setup(dst, src->p, src->n_sparse);
+  if (src->registers) {
+    hll_to_dense(dst);
+    memcpy(dst->registers, src->registers, hll_size(src));
+  } else {
+    memcpy(dst->sparse, src->sparse, src->n_sparse * sizeof(uint32_t));
+    dst->n_sparse = src->n_sparse;
+  }
+  return self;
+}
+
+/* Document-method: BitTwiddle::HyperLogLog#add
+ * Add a key to the sketch.
+ *
+ * @param key [String, Integer] Integers must fit in 64 bits (signed or unsigned)
+ * @return [HyperLogLog] `self`
+ */
+static VALUE
+hll_add(VALUE self, VALUE key)
+{
+  hyperloglog *hll = get_hll(self);
+  rb_check_frozen(self);
+  hll_add_hash(hll, bt_hash_value(key, 0));
+  return self;
+}
+
+/* Document-method: BitTwiddle::HyperLogLog#add_all
+ * Add each of `keys` to the sketch.
+ *
+ * @param keys [Array<String, Integer>]
+ * @return [HyperLogLog] `self`
+ */
+static VALUE
+hll_add_all(VALUE self, VALUE keys)
+{
+  hyperloglog *hll = get_hll(self);
+  long i;
+
+  rb_check_frozen(self);
+  keys = rb_Array(keys);
+  for (i = 0; i < RARRAY_LEN(keys); i++)
+    hll_add_hash(hll, bt_hash_value(RARRAY_AREF(keys, i), 0));
+  return self;
+}
+
+/* Document-method: BitTwiddle::HyperLogLog#count
+ * Estimate the number of distinct keys which have been added.
+ *
+ * @example
+ *   hll = BitTwiddle::HyperLogLog.new
+ *   hll.add_all((1..100_000).to_a)
+ *   hll.count # => 99_5xx or 100_4xx or thereabouts
+ *
+ * @return [Integer]
+ */
+static VALUE
+hll_count(VALUE self)
+{
+  hyperloglog *hll = get_hll(self), view;
+  VALUE tmp;
+  double estimate;
+
+  hll_compacted(self, hll, &view, &tmp);
+  estimate = hll_estimate(&view);
+  ALLOCV_END(tmp);
+  return ULL2NUM((uint64_t)llround(estimate));
+}
+
+static hyperloglog*
+get_compatible_hll(hyperloglog *hll, VALUE other)
+{
+  hyperloglog *oh = get_hll(other);
+  if (hll->p != oh->p)
+    rb_raise(rb_eArgError, "HyperLogLogs must have the same precision (%d and %d)", hll->p, oh->p);
+  return oh;
+}
+
+/* Document-method: BitTwiddle::HyperLogLog#merge!
+ * Add all the keys counted by `other` (which must have the same precision) to
+ * this sketch.
+ *
+ * @param other [HyperLogLog]
+ * @return [HyperLogLog] `self`
+ */
+static VALUE
+hll_merge_bang(VALUE self, VALUE other)
+{
+  hyperloglog *hll = get_hll(self), *oh = get_compatible_hll(hll, other);
+  size_t i, n = oh->n_sparse;
+
+  rb_check_frozen(self);
+  if (hll == oh)
+    return self;
+  if (oh->registers) {
+    if (!hll->registers)
+      hll_to_dense(hll);
+    registers_max(hll->registers, oh->registers, hll_size(hll));
+  } else {
+    /* 'oh' itself can't change while we add its entries */
+    for (i = 0; i < n; i++) {
+      if (hll->registers)
+        dense_add_sparse(hll->registers, hll->p, oh->sparse[i]);
+      else
+        sparse_add(hll, oh->sparse[i]);
+    }
+  }
+  return self;
+}
+
+/* Document-method: BitTwiddle::HyperLogLog#|
+ * A new sketch counting the keys of both sketches (which must have the same
+ * precision).
+ *
+ * @param other [HyperLogLog]
+ * @return [HyperLogLog]
+ */
+static VALUE
+hll_union(VALUE self, VALUE other)
+{
+  get_compatible_hll(get_hll(self), other);
+  return hll_merge_bang(rb_obj_dup(self), other);
+}
+
+/* Document-method: BitTwiddle::HyperLogLog#precision
+ * @return [Integer]
+ */
+static VALUE
+hll_precision(VALUE self)
+{
+  return INT2FIX(get_hll(self)->p);
+}
+
+/* Document-method: BitTwiddle::HyperLogLog#sparse?
+ * Whether the sketch is still using its sparse representation.
+ *
+ * @return [Boolean]
+ */
+static VALUE
+hll_sparse_p(VALUE self)
+{
+  return get_hll(self)->registers ? Qfalse : Qtrue;
+}
+
+/* Document-method: BitTwiddle::HyperLogLog#clear
+ * Remove all keys, returning to the sparse representation.
+ *
+ * @return [HyperLogLog] `self`
+ */
+static VALUE
+hll_clear(VALUE self)
+{
+  hyperloglog *hll = get_hll(self);
+  rb_check_frozen(self);
+  hll_setup(hll, hll->p, 0);
+  return self;
+}
+
+/* Document-method: BitTwiddle::HyperLogLog#to_s
+ * Serialize the sketch as a String: 8 header bytes (a 5-byte magic number, a
+ * version, the precision and 0 for dense or 1 for sparse), then either the
+ * registers packed into 6 bits each (little-endian), or the number of sparse
+ * entries followed by the differences between successive entries, as LEB128
+ * varints.
+ *
+ * @return [String]
+ */
+static VALUE
+hll_to_s(VALUE self)
+{
+  hyperloglog view, *hll = &view;
+  VALUE  str, tmp;
+  uchar *p, *start;
+  size_t i;
+
+  hll_compacted(self, get_hll(self), &view, &tmp);
+  if (hll->registers) {
+    str = rb_str_new(NULL, 8 + hll_size(hll) / 4 * 3);
+    p   = (uchar*)RSTRING_PTR(str) + 8;
+    for (i = 0; i < hll_size(hll); i += 4) {
+      uint32_t v = hll->registers[i] | hll->registers[i+1] << 6 | hll->registers[i+2] << 12 | hll->registers[i+3] << 18;
+      *p++ = (uchar)v;
+      *p++ = (uchar)(v >> 8);
+      *p++ = (uchar)(v >> 16);
+    }
+  } else {
+    uint32_t prev = 0;
+    str = rb_str_new(NULL, 8 + 5 + hll->n_sparse * 5);
+    p   = put_varint((uchar*)RSTRING_PTR(str) + 8, hll->n_sparse);
+    for (i = 0; i < hll->n_sparse; i++) {
+      p = put_varint(p, hll->sparse[i] - prev);
+      prev = hll->sparse[i];
+    }
+  }
+  start = (uchar*)RSTRING_PTR(str);
+  memcpy(start, hll_magic, 5);
+  start[5] = 1;
+  start[6] = hll->p;
+  start[7] = hll->registers ? 0 : 1;
+  rb_str_set_len(str, p - start);
+  ALLOCV_END(tmp);
+  return str;
+}
+
+/* Document-method: BitTwiddle::HyperLogLog.load
+ * Recreate a sketch from the String returned by `HyperLogLog#to_s`.
+ *
+ * @param str [String]
+ * @return [HyperLogLog]
+ */
+static VALUE
+hll_s_load(VALUE klass, VALUE str)
+{
+  VALUE obj = hll_alloc(klass);
+  hyperloglog *hll;
+  const uchar *p, *end;
+  size_t i;
+  int prec;
+
+  StringValue(str);
+  p   = (const uchar*)RSTRING_PTR(str);
+  end = p + RSTRING_LEN(str);
+  if (RSTRING_LEN(str) < 8 || memcmp(p, hll_magic, 5) || p[5] != 1 || p[7] > 1)
+    rb_raise(rb_eArgError, "not a serialized HyperLogLog");
+  prec = p[6];
+  if (prec < MIN_P || prec > MAX_P)
+    rb_raise(rb_eArgError, "serialized HyperLogLog has a bad precision");
+  TypedData_Get_Struct(obj, hyperloglog, &hll_type, hll);
+
+  if (p[7] == 0) {
+    hll_setup(hll, prec, 0);
+    hll_to_dense(hll);
+    if ((size_t)(end - p) != 8 + hll_size(hll) / 4 * 3)
+      rb_raise(rb_eArgError, "serialized HyperLogLog has the wrong length");
+    p += 8;
+    for (i = 0; i < hll_size(hll); i += 4, p += 3) {
+      uint32_t v = p[0] | p[1] << 8 | p[2] << 16;
+      hll->registers[i]   = v & 63;
+      hll->registers[i+1] = (v >> 6) & 63;
+      hll->registers[i+2] = (v >> 12) & 63;
+      hll->registers[i+3] = v >> 18;
+    }
+    for (i = 0; i < hll_size(hll); i++)
+      if (hll->registers[i] > 65 - prec)
+        rb_raise(rb_eArgError, "serialized HyperLogLog has a bad register");
+  } else {
+    uint64_t n, delta, entry = 0;
+    p = get_varint(p + 8, end, &n);
+    if (n > ((size_t)1 << prec) / 4)
+      rb_raise(rb_eArgError, "serialized HyperLogLog has too many entries");
+    hll_setup(hll, prec, n);
+    for (i = 0; i < n; i++) {
+      p = get_varint(p, end, &delta);
+      /* entries must be in order of index, with one per index */
+      if ((i && ((entry + delta) >> 6) <= (entry >> 6)) || (entry += delta) >= (1ULL << (SPARSE_P + 6)) ||
+          (entry & 63) == 0 || (entry & 63) > 65 - SPARSE_P)
+        rb_raise(rb_eArgError, "serialized HyperLogLog has a bad entry");
+      hll->sparse[i] = (uint32_t)entry;
+    }
+    hll->n_sparse = n;
+    if (p != end)
+      rb_raise(rb_eArgError, "serialized HyperLogLog has the wrong length");
+  }
+  RB_GC_GUARD(str);
+  return obj;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Count-min sketch */
+
+typedef struct {
+  uint64_t *counters; /* depth rows of width counters */
+  uint64_t  total;
+  uint32_t  width;    /* 0 until initialized */
+  uint32_t  depth;
+} count_min;
+
+/* Row i uses the hash h1 + i*h2, where h1 and h2 are the two halves of the key's
+ * 64-bit hash (Kirsch and Mitzenmacher, 2006) */
+static inline uint64_t*
+cms_counter(const count_min *cms, uint64_t h, uint32_t row)
+{
+  uint32_t g = (uint32_t)h + row * (uint32_t)(h >> 32);
+  return cms->counters + (size_t)row * cms->width + ((uint64_t)g * cms->width >> 32);
+}
+
+static inline void
+cms_add_hash(count_min *cms, uint64_t h, uint64_t n)
+{
+  uint32_t i;
+  for (i = 0; i < cms->depth; i++)
+    *cms_counter(cms, h, i) += n;
+  cms->total += n;
+}
+
+static inline uint64_t
+cms_count_hash(const count_min *cms, uint64_t h)
+{
+  uint64_t min = UINT64_MAX;
+  uint32_t i;
+  for (i = 0; i < cms->depth; i++)
+    if (*cms_counter(cms, h, i) < min)
+      min = *cms_counter(cms, h, i);
+  return min;
+}
+
+static void
+cms_free(void *ptr)
+{
+  count_min *cms = ptr;
+  xfree(cms->counters);
+  xfree(cms);
+}
+
+static size_t
+cms_memsize(const void *ptr)
+{
+  const count_min *cms = ptr;
+  return sizeof(count_min) + (size_t)cms->width * cms->depth * sizeof(uint64_t);
+}
+
+static const rb_data_type_t cms_type = {
+  "BitTwiddle::CountMinSketch",
+  { 0, cms_free, cms_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+cms_alloc(VALUE klass)
+{
+  count_min *cms;
+  return TypedData_Make_Struct(klass, count_min, &cms_type, cms);
+}
+
+static count_min*
+get_cms(VALUE self)
+{
+  count_min *cms;
+  TypedData_Get_Struct(self, count_min, &cms_type, cms);
+  if (cms->width == 0)
+    rb_raise(rb_eRuntimeError, "uninitialized CountMinSketch");
+  return cms;
+}
+
+static void
+check_shape(uint64_t width, uint64_t depth)
+{
+  if (width < 1 || width > (1U << 30))
+    rb_raise(rb_eArgError, "width must be between 1 and 2^30");
+  if (depth < 1 || depth > 32)
+    rb_raise(rb_eArgError, "depth must be between 1 and 32");
+}
+
+static void
+cms_setup(count_min *cms, uint64_t width, uint64_t depth)
+{
+  check_shape(width, depth);
+  xfree(cms->counters); /* from an earlier call which raised an exception */
+  cms->counters = ruby_xcalloc(width * depth, sizeof(uint64_t));
+  cms->width    = (uint32_t)width;
+  cms->depth    = (uint32_t)depth;
+  cms->total    = 0;
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#initialize
+ * Create an empty sketch with `depth` rows of `width` counters. `count` never
+ * underestimates; it overestimates by more than e / `width` times `total` with
+ * probability at most e^-`depth`.
+ *
+ * @param width [Integer] 1 to 2^30
+ * @param depth [Integer] 1 to 32 (default 4)
+ */
+static VALUE
+cms_initialize(int argc, VALUE *argv, VALUE self)
+{
+  count_min *cms;
+  VALUE width, depth;
+
+  rb_scan_args(argc, argv, "11", &width, &depth);
+  TypedData_Get_Struct(self, count_min, &cms_type, cms);
+  if (cms->width)
+    rb_raise(rb_eRuntimeError, "CountMinSketch is already initialized");
+  cms_setup(cms, NUM2ULL(width), NIL_P(depth) ? 4 : NUM2ULL(depth));
+  return self;
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+cms_initialize_copy(VALUE self, VALUE orig)
+{
+  count_min *dst, *src = get_cms(orig);
+
+  TypedData_Get_Struct(self, count_min, &cms_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->width)
+    rb_raise(rb_eRuntimeError, "CountMinSketch is already initialized");
+  cms_setup(dst, src->width, src->depth);
+  memcpy(dst->counters, src->counters, (size_t)src->width * src->depth * sizeof(uint64_t));
+  dst->total = src->total;
+  return self;
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#add
+ * Add `n` occurrences of a key.
+ *
+ * @param key [String, Integer] Integers must fit in 64 bits (signed or unsigned)
+ * @param n [Integer] (default 1)
+ * @return [CountMinSketch] `self`
+ */
+static VALUE
+cms_add(int argc, VALUE *argv, VALUE self)
+{
+  count_min *cms = get_cms(self);
+  VALUE key, n;
+
+  rb_scan_args(argc, argv, "11", &key, &n);
+  rb_check_frozen(self);
+  cms_add_hash(cms, bt_hash_value(key, 0), NIL_P(n) ? 1 : bt_num_to_u64(n));
+  return self;
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#<<
+ * Add one occurrence of a key.
+ *
+ * @param key [String, Integer]
+ * @return [CountMinSketch] `self`
+ */
+static VALUE
+cms_push(VALUE self, VALUE key)
+{
+  count_min *cms = get_cms(self);
+  rb_check_frozen(self);
+  cms_add_hash(cms, bt_hash_value(key, 0), 1);
+  return self;
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#add_all
+ * Add one occurrence of each of `keys`.
+ *
+ * @param keys [Array<String, Integer>]
+ * @return [CountMinSketch] `self`
+ */
+static VALUE
+cms_add_all(VALUE self, VALUE keys)
+{
+  count_min *cms = get_cms(self);
+  long i;
+
+  rb_check_frozen(self);
+  keys = rb_Array(keys);
+  for (i = 0; i < RARRAY_LEN(keys); i++)
+    cms_add_hash(cms, bt_hash_value(RARRAY_AREF(keys, i), 0), 1);
+  return self;
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#count
+ * Estimate how many times a key has been added.
+ *
+ * @example
+ *   cms = BitTwiddle::CountMinSketch.new(1000)
+ *   cms.add("x", 5).add_all(["x", "y"])
+ *   cms.count("x") # => 6 (or, rarely, more)
+ *   cms.count("z") # => 0 (or, rarely, more)
+ *
+ * @param key [String, Integer]
+ * @return [Integer]
+ */
+static VALUE
+cms_count(VALUE self, VALUE key)
+{
+  return ULL2NUM(cms_count_hash(get_cms(self), bt_hash_value(key, 0)));
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#count_all
+ * Estimate the count of each of `keys`, as by `count`.
+ *
+ * @param keys [Array<String, Integer>]
+ * @return [Array<Integer>]
+ */
+static VALUE
+cms_count_all(VALUE self, VALUE keys)
+{
+  count_min *cms = get_cms(self);
+  VALUE result;
+  long i;
+
+  keys   = rb_Array(keys);
+  result = rb_ary_new_capa(RARRAY_LEN(keys));
+  for (i = 0; i < RARRAY_LEN(keys); i++)
+    rb_ary_push(result, ULL2NUM(cms_count_hash(cms, bt_hash_value(RARRAY_AREF(keys, i), 0))));
+  return result;
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#merge!
+ * Add all the counts of `other` (which must have the same width and depth) to
+ * this sketch.
+ *
+ * @param other [CountMinSketch]
+ * @return [CountMinSketch] `self`
+ */
+static VALUE
+cms_merge_bang(VALUE self, VALUE other)
+{
+  count_min *cms = get_cms(self), *oc = get_cms(other);
+  size_t i, n = (size_t)cms->width * cms->depth;
+
+  rb_check_frozen(self);
+  if (cms->width != oc->width || cms->depth != oc->depth)
+    rb_raise(rb_eArgError, "CountMinSketches must be the same shape (%ux%u and %ux%u)",
+             cms->width, cms->depth, oc->width, oc->depth);
+  /* vectorized by the compiler */
+  for (i = 0; i < n; i++)
+    cms->counters[i] += oc->counters[i];
+  cms->total += oc->total;
+  return self;
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#total
+ * The sum of all counts added.
+ *
+ * @return [Integer]
+ */
+static VALUE
+cms_total(VALUE self)
+{
+  return ULL2NUM(get_cms(self)->total);
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#width
+ * @return [Integer]
+ */
+static VALUE
+cms_width(VALUE self)
+{
+  return UINT2NUM(get_cms(self)->width);
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#depth
+ * @return [Integer]
+ */
+static VALUE
+cms_depth(VALUE self)
+{
+  return UINT2NUM(get_cms(self)->depth);
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#clear
+ * Reset all counts to zero.
+ *
+ * @return [CountMinSketch] `self`
+ */
+static VALUE
+cms_clear(VALUE self)
+{
+  count_min *cms = get_cms(self);
+  rb_check_frozen(self);
+  memset(cms->counters, 0, (size_t)cms->width * cms->depth * sizeof(uint64_t));
+  cms->total = 0;
+  return self;
+}
+
+/* Document-method: BitTwiddle::CountMinSketch#to_s
+ * Serialize the sketch as a String: 8 header bytes (a 5-byte magic number, a
+ * version and 2 zero bytes), then the width, depth, total and each counter, as
+ * LEB128 varints. Since most counters are small, this is usually much smaller
+ * than the sketch is in memory.
+ *
+ * @return [String]
+ */
+static VALUE
+cms_to_s(VALUE self)
+{
+  count_min *cms = get_cms(self);
+  size_t i, n = (size_t)cms->width * cms->depth, len;
+  VALUE  str;
+  uchar *start, *p;
+
+  len = 8 + varint_size(cms->width) + varint_size(cms->depth) + varint_size(cms->total);
+  for (i = 0; i < n; i++)
+    len += varint_size(cms->counters[i]);
+  str   = rb_str_new(NULL, len);
+  start = (uchar*)RSTRING_PTR(str);
+
+  memcpy(start, cms_magic, 5);
+  start[5] = 1;
+  start[6] = start[7] = 0;
+  p = put_varint(start + 8, cms->width);
+  p = put_varint(p, cms->depth);
+  p = put_varint(p, cms->total);
+  for (i = 0; i < n; i++)
+    p = put_varint(p, cms->counters[i]);
+  rb_str_set_len(str, p - start);
+  return str;
+}
+
+/* Document-method: BitTwiddle::CountMinSketch.load
+ * Recreate a sketch from the String returned by `CountMinSketch#to_s`.
+ *
+ * @param str [String]
+ * @return [CountMinSketch]
+ */
+static VALUE
+cms_s_load(VALUE klass, VALUE str)
+{
+  VALUE obj = cms_alloc(klass);
+  count_min *cms;
+  const uchar *p, *end;
+  uint64_t width, depth, total;
+  size_t i;
+
+  StringValue(str);
+  p   = (const uchar*)RSTRING_PTR(str);
+  end = p + RSTRING_LEN(str);
+  if (RSTRING_LEN(str) < 8 || memcmp(p, cms_magic, 5) || p[5] != 1 || p[6] || p[7])
+    rb_raise(rb_eArgError, "not a serialized CountMinSketch");
+  p = get_varint(p + 8, end, &width);
+  p = get_varint(p, end, &depth);
+  p = get_varint(p, end, &total);
+  /* every counter takes at least one byte */
+  check_shape(width, depth);
+  if (width * depth > (uint64_t)(end - p))
+    rb_raise(rb_eArgError, "serialized CountMinSketch is truncated");
+
+  TypedData_Get_Struct(obj, count_min, &cms_type, cms);
+  cms_setup(cms, width, depth);
+  cms->total = total;
+  for (i = 0; i < width * depth; i++)
+    p = get_varint(p, end, &cms->counters[i]);
+  if (p != end)
+    rb_raise(rb_eArgError, "serialized CountMinSketch has the wrong length");
+  RB_GC_GUARD(str);
+  return obj;
+}
+
+void Init_bt_sketch(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::HyperLogLog
+   * Estimates the number of distinct Strings or Integers added to it, using a
+   * fixed amount of memory (at most 2^precision bytes). Sketches can be merged,
+   * and serialized to compact Strings.
+   */
+  VALUE rb_cHyperLogLog = rb_define_class_under(rb_mBitTwiddle, "HyperLogLog", rb_cObject);
+  /* Document-class: BitTwiddle::CountMinSketch
+   * Estimates how many times each String or Integer has been added to it, using
+   * a fixed amount of memory. Counts may be too high, but are never too low.
+   */
+  VALUE rb_cCountMinSketch = rb_define_class_under(rb_mBitTwiddle, "CountMinSketch", rb_cObject);
+
+  rb_define_alloc_func(rb_cHyperLogLog, hll_alloc);
+  rb_define_singleton_method(rb_cHyperLogLog, "load", hll_s_load, 1);
+  rb_define_method(rb_cHyperLogLog, "initialize",      hll_initialize,     -1);
+  rb_define_method(rb_cHyperLogLog, "initialize_copy", hll_initialize_copy, 1);
+  rb_define_method(rb_cHyperLogLog, "add",             hll_add,             1);
+  rb_define_method(rb_cHyperLogLog, "<<",              hll_add,             1);
+  rb_define_method(rb_cHyperLogLog, "add_all",         hll_add_all,         1);
+  rb_define_method(rb_cHyperLogLog, "count",           hll_count,           0);
+  rb_define_method(rb_cHyperLogLog, "merge!",          hll_merge_bang,      1);
+  rb_define_method(rb_cHyperLogLog, "|",               hll_union,           1);
+  rb_define_method(rb_cHyperLogLog, "precision",       hll_precision,       0);
+  rb_define_method(rb_cHyperLogLog, "sparse?",         hll_sparse_p,        0);
+  rb_define_method(rb_cHyperLogLog, "clear",           hll_clear,           0);
+  rb_define_method(rb_cHyperLogLog, "to_s",            hll_to_s,            0);
+
+  rb_define_alloc_func(rb_cCountMinSketch, cms_alloc);
+  rb_define_singleton_method(rb_cCountMinSketch, "load", cms_s_load, 1);
+  rb_define_method(rb_cCountMinSketch, "initialize",      cms_initialize,     -1);
+  rb_define_method(rb_cCountMinSketch, "initialize_copy", cms_initialize_copy, 1);
+  rb_define_method(rb_cCountMinSketch, "add",             cms_add,            -1);
+  rb_define_method(rb_cCountMinSketch, "<<",              cms_push,            1);
+  rb_define_method(rb_cCountMinSketch, "add_all",         cms_add_all,         1);
+  rb_define_method(rb_cCountMinSketch, "count",           cms_count,           1);
+  rb_define_method(rb_cCountMinSketch, "[]",              cms_count,           1);
+  rb_define_method(rb_cCountMinSketch, "count_all",       cms_count_all,       1);
+  rb_define_method(rb_cCountMinSketch, "merge!",          cms_merge_bang,      1);
+  rb_define_method(rb_cCountMinSketch, "total",           cms_total,           0);
+  rb_define_method(rb_cCountMinSketch, "width",           cms_width,           0);
+  rb_define_method(rb_cCountMinSketch, "depth",           cms_depth,           0);
+  rb_define_method(rb_cCountMinSketch, "clear",           cms_clear,           0);
+  rb_define_method(rb_cCountMinSketch, "to_s",            cms_to_s,            0);
+}
@@ -0,0 +1,462 @@
+/* BitTwiddle::SlotAllocator: hands out small integer ids from a fixed range
+ *
+ * Level 0 is a bitmap with a 1 for each allocated slot. Each higher level has
+ * one bit per word of the level below, which is 1 when that word is full, up
+ * to a single top word. A free slot is found by following the first 0 bit
+ * (ctz of the inverted word) from the top down, so alloc, free and alloc_near
+ * each touch one word per level: 4 levels cover 16M slots.
+ *
+ * Bits for slots (and words) past the end of the range are kept at 1, so they
+ * look allocated (or full) and the search never needs a bounds check. */
+
+#include "bit_twiddle.h"
+
+#define MAX_LEVELS    7 /* 64^7 = 2^42 slots, more than MAX_CAPACITY */
+#define MAX_CAPACITY  ((size_t)1 << 40)
+#define NOT_FOUND     SIZE_MAX
+
+typedef struct {
+  uint64_t *words;              /* all levels, level 0 first */
+  size_t    offset[MAX_LEVELS]; /* where each level starts in 'words' */
+  size_t    nwords[MAX_LEVELS];
+  size_t    capacity;           /* 0 until initialized */
+  size_t    count;              /* number of slots allocated */
+  int       levels;
+} slot_allocator;
+
+static inline uint64_t*
+level(const slot_allocator *sa, int k)
+{
+  return sa->words + sa->offset[k];
+}
+
+/* Bits of the last word of a level which are past the end of it */
+static inline uint64_t
+padding(size_t nbits)
+{
+  return (nbits & 63) ? ~0ULL << (nbits & 63) : 0;
+}
+
+/* Set bit 'i' of level 0, and mark words which become full in the levels
+ * above */
+static void
+mark_allocated(slot_allocator *sa, size_t i)
+{
+  int k;
+  for (k = 0; k < sa->levels; k++, i >>= 6) {
+    uint64_t *w = level(sa, k) + (i >> 6);
+    *w |= 1ULL << (i & 63);
+    if (*w != ~0ULL)
+      break;
+  }
+  sa->count++;
+}
+
+static void
+mark_free(slot_allocator *sa, size_t i)
+{
+  int k;
+  for (k = 0; k < sa->levels; k++, i >>= 6) {
+    uint64_t *w = level(sa, k) + (i >> 6);
+    int was_full = (*w == ~0ULL);
+    *w &= ~(1ULL << (i & 63));
+    if (!was_full)
+      break;
+  }
+  sa->count--;
+}
+
+/* The first free slot at or after 'from', or NOT_FOUND: climb while the rest of
+ * the current word is full, then descend along the first non-full child */
+static size_t
+find_free(const slot_allocator *sa, size_t from)
+{
+  size_t i = from;
+  int k;
+
+  for (k = 0; k < sa->levels; k++) {
+    size_t   wi = i >> 6;
+    uint64_t w;
+    if (wi >= sa->nwords[k])
+      return NOT_FOUND;
+    w = ~level(sa, k)[wi] & (~0ULL << (i & 63));
+    if (w) {
+      i = wi * 64 + __builtin_ctzll(w);
+      break;
+    }
+    i = wi + 1;
+  }
+  if (k == sa->levels)
+    return NOT_FOUND;
+  while (k-- > 0)
+    i = i * 64 + __builtin_ctzll(~level(sa, k)[i]);
+  return i;
+}
+
+/* Lay out the levels for 'capacity' slots, keeping the allocated bits of level
+ * 0 (which may be shorter than the new one) */
+static void
+sa_build(slot_allocator *sa, size_t capacity, const uint64_t *bits, size_t nbits)
+{
+  size_t total = 0, n = capacity, j, b;
+  uint64_t *words;
+  int k = 0;
+
+  do {
+    sa->nwords[k] = (n + 63) / 64;
+    sa->offset[k] = total;
+    total += sa->nwords[k];
+    n = sa->nwords[k++];
+  } while (n > 1);
+  sa->levels = k;
+
+  words = ruby_xcalloc(total, sizeof(uint64_t));
+  if (bits)
+    memcpy(words, bits, (nbits + 63) / 64 * sizeof(uint64_t));
+  if (nbits & 63)
+    words[nbits / 64] &= ~padding(nbits); /* old padding */
+  xfree(sa->words);
+  sa->words    = words;
+  sa->capacity = capacity;
+
+  level(sa, 0)[sa->nwords[0] - 1] |= padding(capacity);
+  for (k = 1; k < sa->levels; k++) {
+    uint64_t *child = level(sa, k - 1), *w = level(sa, k);
+    for (j = 0; j < sa->nwords[k - 1]; j++)
+      if (child[j] == ~0ULL)
+        w[j / 64] |= 1ULL << (j & 63);
+    w[sa->nwords[k] - 1] |= padding(sa->nwords[k - 1]);
+  }
+
+  sa->count = 0;
+  for (b = 0; b < sa->nwords[0]; b++)
+    sa->count += __builtin_popcountll(level(sa, 0)[b]);
+  sa->count -= __builtin_popcountll(padding(capacity));
+}
+
+static void
+sa_free(void *ptr)
+{
+  slot_allocator *sa = ptr;
+  xfree(sa->words);
+  xfree(sa);
+}
+
+static size_t
+sa_memsize(const void *ptr)
+{
+  const slot_allocator *sa = ptr;
+  size_t words = 0;
+  int k;
+  for (k = 0; k < sa->levels; k++)
+    words += sa->nwords[k];
+  return sizeof(slot_allocator) + words * sizeof(uint64_t);
+}
+
+static const rb_data_type_t sa_type = {
+  "BitTwiddle::SlotAllocator",
+  { 0, sa_free, sa_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+sa_alloc(VALUE klass)
+{
+  slot_allocator *sa;
+  return TypedData_Make_Struct(klass, slot_allocator, &sa_type, sa);
+}
+
+static slot_allocator*
+get_sa(VALUE self)
+{
+  slot_allocator *sa;
+  TypedData_Get_Struct(self, slot_allocator, &sa_type, sa);
+  if (sa->capacity == 0)
+    rb_raise(rb_eRuntimeError, "uninitialized SlotAllocator");
+  return sa;
+}
+
+static size_t
+value_to_capacity(VALUE capacity)
+{
+  uint64_t n = bt_num_to_u64(capacity);
+  if (n < 1 || n > MAX_CAPACITY)
+    rb_raise(rb_eArgError, "capacity must be between 1 and 2^40");
+  return (size_t)n;
+}
+
+static size_t
+value_to_slot(const slot_allocator *sa, VALUE slot)
+{
+  long i = NUM2LONG(slot);
+  if (i < 0 || (size_t)i >= sa->capacity)
+    rb_raise(rb_eIndexError, "slot %ld out of range for SlotAllocator with capacity %"PRIuSIZE, i, sa->capacity);
+  return (size_t)i;
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#initialize
+ * Create an allocator for the slots 0 to `capacity - 1`, all free.
+ *
+ * @param capacity [Integer] 1 to 2^40
+ */
+static VALUE
+sa_initialize(VALUE self, VALUE capacity)
+{
+  slot_allocator *sa;
+  size_t n = value_to_capacity(capacity);
+
+  TypedData_Get_Struct(self, slot_allocator, &sa_type, sa);
+  if (sa->capacity)
+    rb_raise(rb_eRuntimeError, "SlotAllocator is already initialized");
+  sa_build(sa, n, NULL, 0);
+  return self;
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+sa_initialize_copy(VALUE self, VALUE orig)
+{
+  slot_allocator *dst, *src = get_sa(orig);
+
+  TypedData_Get_Struct(self, slot_allocator, &sa_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->capacity)
+    rb_raise(rb_eRuntimeError, "SlotAllocator is already initialized");
+  sa_build(dst, src->capacity, level(src, 0), src->capacity);
+  return self;
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#alloc
+ * Allocate the lowest-numbered free slot.
+ *
+ * @example
+ *   sa = BitTwiddle::SlotAllocator.new(100)
+ *   sa.alloc # => 0
+ *   sa.alloc # => 1
+ *   sa.free(0)
+ *   sa.alloc # => 0
+ *
+ * @return [Integer, nil] The slot, or `nil` if all are allocated
+ */
+static VALUE
+sa_alloc_slot(VALUE self)
+{
+  slot_allocator *sa = get_sa(self);
+  size_t i;
+
+  rb_check_frozen(self);
+  i = find_free(sa, 0);
+  if (i == NOT_FOUND)
+    return Qnil;
+  mark_allocated(sa, i);
+  return SIZET2NUM(i);
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#alloc_near
+ * Allocate the first free slot at or after `hint`, or if there is none, the
+ * lowest-numbered free slot. This keeps related ids close together (or lets
+ * ids be handed out round-robin, by passing the last one plus 1).
+ *
+ * @param hint [Integer] 0 to `capacity - 1`
+ * @return [Integer, nil] The slot, or `nil` if all are allocated
+ */
+static VALUE
+sa_alloc_near(VALUE self, VALUE hint)
+{
+  slot_allocator *sa = get_sa(self);
+  size_t i;
+
+  rb_check_frozen(self);
+  i = find_free(sa, value_to_slot(sa, hint));
+  if (i == NOT_FOUND)
+    i = find_free(sa, 0);
+  if (i == NOT_FOUND)
+    return Qnil;
+  mark_allocated(sa, i);
+  return SIZET2NUM(i);
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#free
+ * Return a slot to the allocator. If it is not allocated, raise
+ * `ArgumentError`.
+ *
+ * @param slot [Integer]
+ * @return [SlotAllocator] `self`
+ */
+static VALUE
+sa_free_slot(VALUE self, VALUE slot)
+{
+  slot_allocator *sa = get_sa(self);
+  size_t i;
+
+  rb_check_frozen(self);
+  i = value_to_slot(sa, slot);
+  if (!(level(sa, 0)[i >> 6] & (1ULL << (i & 63))))
+    rb_raise(rb_eArgError, "slot %"PRIuSIZE" is not allocated", i);
+  mark_free(sa, i);
+  return self;
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#allocated?
+ * @param slot [Integer]
+ * @return [Boolean]
+ */
+static VALUE
+sa_allocated_p(VALUE self, VALUE slot)
+{
+  slot_allocator *sa = get_sa(self);
+  size_t i = value_to_slot(sa, slot);
+  return (level(sa, 0)[i >> 6] & (1ULL << (i & 63))) ? Qtrue : Qfalse;
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#size
+ * @return [Integer] The number of allocated slots
+ */
+static VALUE
+sa_size(VALUE self)
+{
+  return SIZET2NUM(get_sa(self)->count);
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#capacity
+ * @return [Integer] The total number of slots
+ */
+static VALUE
+sa_capacity(VALUE self)
+{
+  return SIZET2NUM(get_sa(self)->capacity);
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#full?
+ * @return [Boolean] Whether every slot is allocated
+ */
+static VALUE
+sa_full_p(VALUE self)
+{
+  slot_allocator *sa = get_sa(self);
+  return (sa->count == sa->capacity) ? Qtrue : Qfalse;
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#grow
+ * Increase the number of slots to `capacity`. The new slots are free.
+ *
+ * @param capacity [Integer] At least the current capacity
+ * @return [SlotAllocator] `self`
+ */
+static VALUE
+sa_grow(VALUE self, VALUE capacity)
+{
+  slot_allocator *sa = get_sa(self);
+  size_t n;
+
+  rb_check_frozen(self);
+  n = value_to_capacity(capacity);
+  if (n < sa->capacity)
+    rb_raise(rb_eArgError, "SlotAllocator can't shrink (from %"PRIuSIZE" to %"PRIuSIZE" slots)", sa->capacity, n);
+  sa_build(sa, n, level(sa, 0), sa->capacity);
+  return self;
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#clear
+ * Free all slots.
+ *
+ * @return [SlotAllocator] `self`
+ */
+static VALUE
+sa_clear(VALUE self)
+{
+  slot_allocator *sa = get_sa(self);
+  rb_check_frozen(self);
+  sa_build(sa, sa->capacity, NULL, 0);
+  return self;
+}
+
+static VALUE
+sa_enum_size(VALUE self, VALUE args, VALUE eobj)
+{
+  return sa_size(self);
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#each
+ * Yield each allocated slot, in increasing order. Empty words of the bitmap
+ * are skipped 64 slots at a time.
+ *
+ * @yieldparam slot [Integer]
+ * @return [SlotAllocator, Enumerator]
+ */
+static VALUE
+sa_each(VALUE self)
+{
+  slot_allocator *sa;
+  size_t wi;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, sa_enum_size);
+  sa = get_sa(self);
+  /* the block may allocate, free or grow, so re-read everything each word */
+  for (wi = 0; wi < sa->nwords[0]; wi++) {
+    uint64_t w = level(sa, 0)[wi];
+    if (wi == sa->nwords[0] - 1)
+      w &= ~padding(sa->capacity);
+    while (w) {
+      rb_yield(SIZET2NUM(wi * 64 + __builtin_ctzll(w)));
+      w &= w - 1;
+    }
+  }
+  return self;
+}
+
+/* Document-method: BitTwiddle::SlotAllocator#to_a
+ * @return [Array<Integer>] The allocated slots, in increasing order
+ */
+static VALUE
+sa_to_a(VALUE self)
+{
+  slot_allocator *sa = get_sa(self);
+  VALUE  ary = rb_ary_new_capa(sa->count);
+  const uint64_t *bits = level(sa, 0);
+  size_t wi;
+
+  for (wi = 0; wi < sa->nwords[0]; wi++) {
+    uint64_t w = bits[wi];
+    if (wi == sa->nwords[0] - 1)
+      w &= ~padding(sa->capacity);
+    while (w) {
+      rb_ary_push(ary, SIZET2NUM(wi * 64 + __builtin_ctzll(w)));
+      w &= w - 1;
+    }
+  }
+  return ary;
+}
+
+void Init_bt_slot_allocator(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::SlotAllocator
+   * Allocates and frees integer ids (such as connection or buffer pool slots)
+   * from the range 0 to `capacity - 1`, always handing out the lowest free id
+   * (or the first free one after a hint). Every operation takes time
+   * proportional to log64(capacity), and the allocator uses a little over 1
+   * bit per slot.
+   */
+  VALUE rb_cSlotAllocator = rb_define_class_under(rb_mBitTwiddle, "SlotAllocator", rb_cObject);
+
+  rb_include_module(rb_cSlotAllocator, rb_mEnumerable);
+  rb_define_alloc_func(rb_cSlotAllocator, sa_alloc);
+  rb_define_method(rb_cSlotAllocator, "initialize",      sa_initialize,      1);
+  rb_define_method(rb_cSlotAllocator, "initialize_copy", sa_initialize_copy, 1);
+  rb_define_method(rb_cSlotAllocator, "alloc",           sa_alloc_slot,      0);
+  rb_define_method(rb_cSlotAllocator, "alloc_near",      sa_alloc_near,      1);
+  rb_define_method(rb_cSlotAllocator, "free",            sa_free_slot,       1);
+  rb_define_method(rb_cSlotAllocator, "allocated?",      sa_allocated_p,     1);
+  rb_define_method(rb_cSlotAllocator, "size",            sa_size,            0);
+  rb_define_method(rb_cSlotAllocator, "capacity",        sa_capacity,        0);
+  rb_define_method(rb_cSlotAllocator, "full?",           sa_full_p,          0);
+  rb_define_method(rb_cSlotAllocator, "grow",            sa_grow,            1);
+  rb_define_method(rb_cSlotAllocator, "clear",           sa_clear,           0);
+  rb_define_method(rb_cSlotAllocator, "each",            sa_each,            0);
+  rb_define_method(rb_cSlotAllocator, "to_a",            sa_to_a,            0);
+}
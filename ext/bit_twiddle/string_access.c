@@ -0,0 +1,302 @@
+/* Reading and writing fixed-size integers and floats at any byte offset in a
+ * String, without `unpack`/`pack` or intermediate Strings */
+
+#include "bit_twiddle.h"
+
+/* Return a pointer to the 'size' bytes at 'offset' in 'str'; a negative offset
+ * counts back from the end of the String */
+static inline uchar*
+str_field(VALUE str, VALUE offset, long size)
+{
+  long off = NUM2LONG(offset), len = RSTRING_LEN(str);
+  if (off < 0)
+    off += len;
+  if (off < 0 || off > len - size)
+    rb_raise(rb_eIndexError, "offset %ld out of range for %ld-byte value in String of %ld bytes", NUM2LONG(offset), size, len);
+  return (uchar*)RSTRING_PTR(str) + off;
+}
+
+static inline uint8_t load_8(const uchar *p)        { return *p; }
+static inline void    store_8(uchar *p, uint8_t v)  { *p = v; }
+
+static inline uint64_t
+value_to_unsigned(VALUE value, int bits)
+{
+  uint64_t v = bt_num_to_u64(value);
+  if (bits < 64 && (v >> bits))
+    rb_raise(rb_eRangeError, "integer %"PRIsVALUE" too big for %d-bit unsigned value", value, bits);
+  return v;
+}
+
+static inline int64_t
+value_to_signed(VALUE value, int bits)
+{
+  int64_t v = NUM2LL(value);
+  if (bits < 64 && (v < -(1LL << (bits - 1)) || v >= (1LL << (bits - 1))))
+    rb_raise(rb_eRangeError, "integer %"PRIsVALUE" out of range for %d-bit signed value", value, bits);
+  return v;
+}
+
+/* The value is read or written directly between the String's bytes and a
+ * Fixnum (or Bignum, for 64-bit values); loads and stores of the opposite
+ * endianness compile to a mov and a bswap */
+#define def_int_accessors(name, bits, load, store, conv) \
+  static VALUE str_get_u ## name(VALUE str, VALUE offset) \
+  { \
+    return conv ## U((uint ## bits ## _t)load(str_field(str, offset, bits/8))); \
+  } \
+  static VALUE str_get_i ## name(VALUE str, VALUE offset) \
+  { \
+    return conv ## S((int ## bits ## _t)load(str_field(str, offset, bits/8))); \
+  } \
+  static VALUE str_set_u ## name(VALUE str, VALUE offset, VALUE value) \
+  { \
+    uint64_t v = value_to_unsigned(value, bits); \
+    rb_str_modify(str); \
+    store(str_field(str, offset, bits/8), (uint ## bits ## _t)v); \
+    return value; \
+  } \
+  static VALUE str_set_i ## name(VALUE str, VALUE offset, VALUE value) \
+  { \
+    int64_t v = value_to_signed(value, bits); \
+    rb_str_modify(str); \
+    store(str_field(str, offset, bits/8), (uint ## bits ## _t)v); \
+    return value; \
+  }
+
+#define SMALL_U(v) INT2FIX(v)
+#define SMALL_S(v) INT2FIX(v)
+#define INT32_U(v) UINT2NUM(v)
+#define INT32_S(v) INT2NUM(v)
+#define INT64_U(v) ULL2NUM(v)
+#define INT64_S(v) LL2NUM(v)
+
+def_int_accessors(8,    8,  load_8,    store_8,    SMALL_)
+def_int_accessors(16le, 16, load_le16, store_le16, SMALL_)
+def_int_accessors(16be, 16, load_be16, store_be16, SMALL_)
+def_int_accessors(32le, 32, load_le32, store_le32, INT32_)
+def_int_accessors(32be, 32, load_be32, store_be32, INT32_)
+def_int_accessors(64le, 64, load_le64, store_le64, INT64_)
+def_int_accessors(64be, 64, load_be64, store_be64, INT64_)
+
+#define def_float_accessors(name, bits, ftype, load, store) \
+  static VALUE str_get_f ## name(VALUE str, VALUE offset) \
+  { \
+    uint ## bits ## _t v = load(str_field(str, offset, bits/8)); \
+    ftype f; \
+    memcpy(&f, &v, sizeof(f)); \
+    return DBL2NUM(f); \
+  } \
+  static VALUE str_set_f ## name(VALUE str, VALUE offset, VALUE value) \
+  { \
+    ftype f = (ftype)NUM2DBL(value); \
+    uint ## bits ## _t v; \
+    memcpy(&v, &f, sizeof(f)); \
+    rb_str_modify(str); \
+    store(str_field(str, offset, bits/8), v); \
+    return value; \
+  }
+
+def_float_accessors(32le, 32, float,  load_le32, store_le32)
+def_float_accessors(32be, 32, float,  load_be32, store_be32)
+def_float_accessors(64le, 64, double, load_le64, store_le64)
+def_float_accessors(64be, 64, double, load_be64, store_be64)
+
+/* Module functions: the same accessors, taking the String as the first argument */
+#define def_wrappers(name) \
+  static VALUE bt_get_ ## name(VALUE self, VALUE str, VALUE offset) \
+  { \
+    return str_get_ ## name(StringValue(str), offset); \
+  } \
+  static VALUE bt_set_ ## name(VALUE self, VALUE str, VALUE offset, VALUE value) \
+  { \
+    return str_set_ ## name(StringValue(str), offset, value); \
+  }
+
+def_wrappers(u8)
+def_wrappers(u16le)
+def_wrappers(u16be)
+def_wrappers(u32le)
+def_wrappers(u32be)
+def_wrappers(u64le)
+def_wrappers(u64be)
+def_wrappers(i8)
+def_wrappers(i16le)
+def_wrappers(i16be)
+def_wrappers(i32le)
+def_wrappers(i32be)
+def_wrappers(i64le)
+def_wrappers(i64be)
+def_wrappers(f32le)
+def_wrappers(f32be)
+def_wrappers(f64le)
+def_wrappers(f64be)
+
+void
+init_string_access_core_extensions(void)
+{
+  /* Read an integer at byte `offset`: `get_u8` ... `get_u64be` are unsigned and
+   * `get_i8` ... `get_i64be` signed; 16 to 64-bit values are little-endian
+   * (`le`) or big-endian (`be`).
+   *
+   * If the value does not fit entirely within the String, raise `IndexError`.
+   *
+   * @example
+   *   "\x01\x02\x03".get_u16le(1)     # => 770
+   *   "\x01\x02\x03".get_u16be(1)     # => 515
+   *   "\xFF\xFF\xFF\xFE".get_i32be(0) # => -2
+   *
+   * @param offset [Integer] Byte offset (negative offsets count back from the end)
+   * @return [Integer]
+   */
+  rb_define_method(rb_cString, "get_u8",    str_get_u8,     1);
+  rb_define_method(rb_cString, "get_u16le", str_get_u16le,  1);
+  rb_define_method(rb_cString, "get_u16be", str_get_u16be,  1);
+  rb_define_method(rb_cString, "get_u32le", str_get_u32le,  1);
+  rb_define_method(rb_cString, "get_u32be", str_get_u32be,  1);
+  rb_define_method(rb_cString, "get_u64le", str_get_u64le,  1);
+  rb_define_method(rb_cString, "get_u64be", str_get_u64be,  1);
+  rb_define_method(rb_cString, "get_i8",    str_get_i8,     1);
+  rb_define_method(rb_cString, "get_i16le", str_get_i16le,  1);
+  rb_define_method(rb_cString, "get_i16be", str_get_i16be,  1);
+  rb_define_method(rb_cString, "get_i32le", str_get_i32le,  1);
+  rb_define_method(rb_cString, "get_i32be", str_get_i32be,  1);
+  rb_define_method(rb_cString, "get_i64le", str_get_i64le,  1);
+  rb_define_method(rb_cString, "get_i64be", str_get_i64be,  1);
+
+  /* Write `value` as an integer at byte `offset`, overwriting the bytes which
+   * were there, with the same naming as `get_u8` ... `get_i64be`.
+   *
+   * If the value does not fit entirely within the String, raise `IndexError`;
+   * if `value` is out of range for the type, raise `RangeError`.
+   *
+   * @example
+   *   s = "\0" * 6; s.set_u32be(1, 0xAABBCCDD); s # => "\x00\xAA\xBB\xCC\xDD\x00"
+   *
+   * @param offset [Integer] Byte offset (negative offsets count back from the end)
+   * @param value [Integer]
+   * @return [Integer] `value`
+   */
+  rb_define_method(rb_cString, "set_u8",    str_set_u8,     2);
+  rb_define_method(rb_cString, "set_u16le", str_set_u16le,  2);
+  rb_define_method(rb_cString, "set_u16be", str_set_u16be,  2);
+  rb_define_method(rb_cString, "set_u32le", str_set_u32le,  2);
+  rb_define_method(rb_cString, "set_u32be", str_set_u32be,  2);
+  rb_define_method(rb_cString, "set_u64le", str_set_u64le,  2);
+  rb_define_method(rb_cString, "set_u64be", str_set_u64be,  2);
+  rb_define_method(rb_cString, "set_i8",    str_set_i8,     2);
+  rb_define_method(rb_cString, "set_i16le", str_set_i16le,  2);
+  rb_define_method(rb_cString, "set_i16be", str_set_i16be,  2);
+  rb_define_method(rb_cString, "set_i32le", str_set_i32le,  2);
+  rb_define_method(rb_cString, "set_i32be", str_set_i32be,  2);
+  rb_define_method(rb_cString, "set_i64le", str_set_i64le,  2);
+  rb_define_method(rb_cString, "set_i64be", str_set_i64be,  2);
+
+  /* Read a single (`f32`) or double (`f64`) precision float, little-endian
+   * (`le`) or big-endian (`be`), at byte `offset`.
+   *
+   * If the value does not fit entirely within the String, raise `IndexError`.
+   *
+   * @example
+   *   [0, 1.5].pack("Ce").get_f64le(1) # => 1.5
+   *
+   * @param offset [Integer] Byte offset (negative offsets count back from the end)
+   * @return [Float]
+   */
+  rb_define_method(rb_cString, "get_f32le", str_get_f32le,  1);
+  rb_define_method(rb_cString, "get_f32be", str_get_f32be,  1);
+  rb_define_method(rb_cString, "get_f64le", str_get_f64le,  1);
+  rb_define_method(rb_cString, "get_f64be", str_get_f64be,  1);
+
+  /* Write `value` as a float at byte `offset`, overwriting the bytes which were
+   * there, with the same naming as `get_f32le` ... `get_f64be`.
+   *
+   * If the value does not fit entirely within the String, raise `IndexError`.
+   *
+   * @param offset [Integer] Byte offset (negative offsets count back from the end)
+   * @param value [Float]
+   * @return [Float] `value`
+   */
+  rb_define_method(rb_cString, "set_f32le", str_set_f32le,  2);
+  rb_define_method(rb_cString, "set_f32be", str_set_f32be,  2);
+  rb_define_method(rb_cString, "set_f64le", str_set_f64le,  2);
+  rb_define_method(rb_cString, "set_f64be", str_set_f64be,  2);
+}
+
+void Init_bt_string_access(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+
+  /* Read an integer at byte `offset` in `str`, as `String#get_u8` ...
+   * `String#get_i64be` do.
+   *
+   * @example
+   *   BitTwiddle.get_u16le("\x01\x02\x03", 1) # => 770
+   *
+   * @param str [String]
+   * @param offset [Integer] Byte offset (negative offsets count back from the end)
+   * @return [Integer]
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "get_u8",    bt_get_u8,    2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_u16le", bt_get_u16le, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_u16be", bt_get_u16be, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_u32le", bt_get_u32le, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_u32be", bt_get_u32be, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_u64le", bt_get_u64le, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_u64be", bt_get_u64be, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_i8",    bt_get_i8,    2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_i16le", bt_get_i16le, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_i16be", bt_get_i16be, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_i32le", bt_get_i32le, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_i32be", bt_get_i32be, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_i64le", bt_get_i64le, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_i64be", bt_get_i64be, 2);
+
+  /* Write `value` as an integer at byte `offset` in `str`, as `String#set_u8`
+   * ... `String#set_i64be` do.
+   *
+   * @param str [String]
+   * @param offset [Integer] Byte offset (negative offsets count back from the end)
+   * @param value [Integer]
+   * @return [Integer] `value`
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "set_u8",    bt_set_u8,    3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_u16le", bt_set_u16le, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_u16be", bt_set_u16be, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_u32le", bt_set_u32le, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_u32be", bt_set_u32be, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_u64le", bt_set_u64le, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_u64be", bt_set_u64be, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_i8",    bt_set_i8,    3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_i16le", bt_set_i16le, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_i16be", bt_set_i16be, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_i32le", bt_set_i32le, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_i32be", bt_set_i32be, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_i64le", bt_set_i64le, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_i64be", bt_set_i64be, 3);
+
+  /* Read a float at byte `offset` in `str`, as `String#get_f32le` ...
+   * `String#get_f64be` do.
+   *
+   * @param str [String]
+   * @param offset [Integer] Byte offset (negative offsets count back from the end)
+   * @return [Float]
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "get_f32le", bt_get_f32le, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_f32be", bt_get_f32be, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_f64le", bt_get_f64le, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "get_f64be", bt_get_f64be, 2);
+
+  /* Write `value` as a float at byte `offset` in `str`, as `String#set_f32le`
+   * ... `String#set_f64be` do.
+   *
+   * @param str [String]
+   * @param offset [Integer] Byte offset (negative offsets count back from the end)
+   * @param value [Float]
+   * @return [Float] `value`
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "set_f32le", bt_set_f32le, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_f32be", bt_set_f32be, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_f64le", bt_set_f64le, 3);
+  rb_define_singleton_method(rb_mBitTwiddle, "set_f64be", bt_set_f64be, 3);
+}
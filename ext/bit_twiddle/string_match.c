@@ -0,0 +1,398 @@
+/* Bit-parallel edit distance and string searching
+ *
+ * Myers' algorithm computes a column of the Levenshtein DP table per character
+ * of the text, holding the differences between vertically adjacent cells (each
+ * +1, 0 or -1) as two bit vectors, one bit per pattern character. Patterns
+ * longer than 64 characters use one pair of words per 64 characters, passing
+ * horizontal differences from each word to the next (Hyyrö's block version).
+ *
+ * With a bound k on the distance, only cells within k diagonals of the main
+ * diagonal can be on an alignment of cost <= k, so the bounded version (for
+ * k < 32) keeps a single 2k+1 bit window which slides down one row per column.
+ * Cells just outside the window are assumed to differ from their neighbours by
+ * +1; the resulting values are costs of real alignments, so they are never too
+ * low, and are exact when the distance is <= k.
+ *
+ * Everything here works on bytes, not characters. */
+
+#include "bit_twiddle.h"
+
+typedef struct {
+  uint64_t *peq;   /* peq[c * words + w]: bit i set if pattern[w*64 + i] == c */
+  size_t    len;
+  size_t    words;
+} myers_pattern;
+
+static void
+myers_pattern_init(myers_pattern *pat, const uchar *p, size_t len, uint64_t *peq)
+{
+  size_t i;
+  pat->peq   = peq;
+  pat->len   = len;
+  pat->words = (len + 63) / 64;
+  memset(peq, 0, 256 * pat->words * sizeof(uint64_t));
+  for (i = 0; i < len; i++)
+    peq[p[i] * pat->words + i / 64] |= 1ULL << (i % 64);
+}
+
+/* The Levenshtein distance between the pattern and 'text', or -1 if it is more
+ * than 'max' (where max < 0 means no bound) */
+static long
+myers_full(const myers_pattern *pat, const uchar *text, size_t n, long max, uint64_t *vp, uint64_t *vn)
+{
+  size_t   words = pat->words, j, w;
+  uint64_t last  = 1ULL << ((pat->len - 1) % 64);
+  long     score = pat->len;
+
+  for (w = 0; w < words; w++) {
+    vp[w] = ~0ULL;
+    vn[w] = 0;
+  }
+
+  for (j = 0; j < n; j++) {
+    const uint64_t *eq = pat->peq + text[j] * words;
+    uint64_t hp_carry = 1, hn_carry = 0;
+
+    for (w = 0; w < words; w++) {
+      uint64_t x  = eq[w] | hn_carry;
+      uint64_t d0 = (((x & vp[w]) + vp[w]) ^ vp[w]) | x | vn[w];
+      uint64_t hp = vn[w] | ~(d0 | vp[w]);
+      uint64_t hn = d0 & vp[w];
+      uint64_t c;
+
+      if (w == words - 1)
+        score += ((hp & last) != 0) - ((hn & last) != 0);
+
+      c  = hp >> 63;
+      hp = (hp << 1) | hp_carry;
+      hp_carry = c;
+      c  = hn >> 63;
+      hn = (hn << 1) | hn_carry;
+      hn_carry = c;
+
+      vp[w] = hn | ~(d0 | hp);
+      vn[w] = hp & d0;
+    }
+
+    /* the last row can only go down by 1 per remaining column */
+    if (max >= 0 && score - (long)(n - j - 1) > max)
+      return -1;
+  }
+  return (max >= 0 && score > max) ? -1 : score;
+}
+
+/* 64 bits of a pattern bitmask, starting from bit 'offset' (which may be negative) */
+static inline uint64_t
+peq_window(const uint64_t *eq, size_t words, long offset)
+{
+  size_t   w;
+  int      s;
+  uint64_t lo, hi;
+
+  if (offset < 0)
+    return eq[0] << -offset;
+  w  = offset / 64;
+  s  = offset % 64;
+  lo = (w < words) ? eq[w] : 0;
+  if (s == 0)
+    return lo;
+  hi = (w + 1 < words) ? eq[w + 1] : 0;
+  return (lo >> s) | (hi << (64 - s));
+}
+
+/* Like myers_full, with max from 0 to 31, using the sliding diagonal band
+ * described above; bit t of the window holds row j-k+t (row 0 is the empty
+ * pattern prefix). Rows above row 0 are treated as having D[i][j] = j - i, which
+ * fits the recurrences and makes row 0 come out as D[0][j] = j. */
+static long
+myers_banded(const myers_pattern *pat, const uchar *text, size_t n, int k)
+{
+  uint64_t mask = (k == 31) ? ~0ULL >> 1 : (1ULL << (2*k + 1)) - 1;
+  uint64_t vn   = (1ULL << (k + 1)) - 1;   /* rows -k..0: D decreases going down */
+  uint64_t vp   = mask & ~vn;              /* rows 1..k:  D increases going down */
+  long     diag = 0;                        /* D[j][j] */
+  long     m    = pat->len, t;
+  size_t   j;
+
+  if (labs(m - (long)n) > k)
+    return -1;
+
+  for (j = 1; j <= n; j++) {
+    uint64_t eq = peq_window(pat->peq + text[j-1] * pat->words, pat->words, (long)j - k - 1) & mask;
+    uint64_t d0, hp, hn;
+    int      hd, vd;
+
+    /* slide the window down a row; the new bottom row is assumed to be +1 */
+    vp = (vp >> 1) | (1ULL << (2*k));
+    vn = vn >> 1;
+
+    d0 = (((eq & vp) + vp) ^ vp) | eq | vn;
+    hp = vn | ~(d0 | vp);
+    hn = d0 & vp;
+    hd = k ? (int)((hp >> (k - 1)) & 1) - (int)((hn >> (k - 1)) & 1) : 1;
+
+    hp = (hp << 1) | 1;
+    hn = hn << 1;
+    vp = (hn | ~(d0 | hp)) & mask;
+    vn = (hp & d0) & mask;
+    vd = (int)((vp >> k) & 1) - (int)((vn >> k) & 1);
+
+    diag += hd + vd;
+  }
+
+  /* move from D[n][n] (bit k) to D[m][n] (bit t) */
+  t = m - (long)n + k;
+  if (t > k) {
+    uint64_t bits = (((1ULL << (t - k)) - 1) << (k + 1));
+    diag += __builtin_popcountll(vp & bits) - __builtin_popcountll(vn & bits);
+  } else if (t < k) {
+    uint64_t bits = (((1ULL << (k - t)) - 1) << (t + 1));
+    diag -= __builtin_popcountll(vp & bits) - __builtin_popcountll(vn & bits);
+  }
+  return (diag > k) ? -1 : diag;
+}
+
+static long
+value_to_max(VALUE max)
+{
+  long k;
+  if (NIL_P(max))
+    return -1;
+  k = NUM2LONG(max);
+  if (k < 0)
+    rb_raise(rb_eArgError, "maximum distance must not be negative");
+  return k;
+}
+
+/* Distance between the pattern and 'text'; 'vecs' has room for 2 * words */
+static long
+myers_distance(const myers_pattern *pat, const uchar *text, size_t n, long max, uint64_t *vecs)
+{
+  if (pat->len == 0)
+    return (max >= 0 && (long)n > max) ? -1 : (long)n;
+  if (n == 0)
+    return (max >= 0 && (long)pat->len > max) ? -1 : (long)pat->len;
+  if (max >= 0 && max < 32 && pat->words > 1)
+    return myers_banded(pat, text, n, (int)max);
+  return myers_full(pat, text, n, max, vecs, vecs + pat->words);
+}
+
+static inline VALUE
+distance_to_value(long d)
+{
+  return (d < 0) ? Qnil : LONG2NUM(d);
+}
+
+/* Return the Levenshtein distance between `a` and `b`: the smallest number of
+ * single byte insertions, deletions and substitutions which turn one into the
+ * other. This uses Myers' bit-vector algorithm, which handles 64 bytes of the
+ * shorter String with each machine word operation.
+ *
+ * If `max` is given and the distance is more than `max`, return `nil`; this is
+ * faster, especially when `max` is small.
+ *
+ * Strings are compared byte by byte, so a multibyte character counts as several
+ * bytes.
+ *
+ * @example
+ *   BitTwiddle.myers_distance("kitten", "sitting")    # => 3
+ *   BitTwiddle.myers_distance("kitten", "sitting", 2) # => nil
+ *
+ * @param a [String]
+ * @param b [String]
+ * @param max [Integer] Maximum distance of interest
+ * @return [Integer, nil]
+ */
+static VALUE
+bt_myers_distance(int argc, VALUE *argv, VALUE self)
+{
+  VALUE a, b, max, tmp;
+  myers_pattern pat;
+  uint64_t *buf;
+  long k, d;
+
+  rb_scan_args(argc, argv, "21", &a, &b, &max);
+  StringValue(a);
+  StringValue(b);
+  k = value_to_max(max);
+
+  /* the shorter String goes in the bit vectors */
+  if (RSTRING_LEN(a) > RSTRING_LEN(b)) {
+    VALUE t = a; a = b; b = t;
+  }
+  {
+    size_t words = (RSTRING_LEN(a) + 63) / 64;
+    buf = ALLOCV_N(uint64_t, tmp, 258 * (words ? words : 1));
+    myers_pattern_init(&pat, (const uchar*)RSTRING_PTR(a), RSTRING_LEN(a), buf);
+    d = myers_distance(&pat, (const uchar*)RSTRING_PTR(b), RSTRING_LEN(b), k, buf + 256 * words);
+  }
+  ALLOCV_END(tmp);
+  return distance_to_value(d);
+}
+
+/* Return the Levenshtein distance between `pattern` and each of `candidates`, as
+ * by `BitTwiddle.myers_distance`. The bit vectors for `pattern` are only built
+ * once, so this is faster than calling `myers_distance` for each candidate.
+ *
+ * @example
+ *   BitTwiddle.myers_distances("apple", ["apply", "maple", "banana"])    # => [1, 2, 5]
+ *   BitTwiddle.myers_distances("apple", ["apply", "maple", "banana"], 1) # => [1, nil, nil]
+ *
+ * @param pattern [String]
+ * @param candidates [Array<String>]
+ * @param max [Integer] Maximum distance of interest
+ * @return [Array<Integer, nil>]
+ */
+static VALUE
+bt_myers_distances(int argc, VALUE *argv, VALUE self)
+{
+  VALUE pattern, candidates, max, tmp, result;
+  myers_pattern pat;
+  uint64_t *buf;
+  size_t words;
+  long   i, k;
+
+  rb_scan_args(argc, argv, "21", &pattern, &candidates, &max);
+  StringValue(pattern);
+  candidates = rb_Array(candidates);
+  k = value_to_max(max);
+
+  pattern = rb_str_new_frozen(pattern);
+  words   = (RSTRING_LEN(pattern) + 63) / 64;
+  buf     = ALLOCV_N(uint64_t, tmp, 258 * (words ? words : 1));
+  myers_pattern_init(&pat, (const uchar*)RSTRING_PTR(pattern), RSTRING_LEN(pattern), buf);
+
+  result = rb_ary_new_capa(RARRAY_LEN(candidates));
+  for (i = 0; i < RARRAY_LEN(candidates); i++) {
+    VALUE str = RARRAY_AREF(candidates, i);
+    StringValue(str);
+    rb_ary_push(result, distance_to_value(
+      myers_distance(&pat, (const uchar*)RSTRING_PTR(str), RSTRING_LEN(str), k, buf + 256 * words)));
+  }
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(pattern);
+  return result;
+}
+
+static void
+check_search_pattern(VALUE pattern)
+{
+  if (RSTRING_LEN(pattern) < 1 || RSTRING_LEN(pattern) > 64)
+    rb_raise(rb_eArgError, "pattern must be from 1 to 64 bytes long (not %ld)", RSTRING_LEN(pattern));
+}
+
+/* Return the offsets in `text` of every occurrence of `pattern` (including
+ * overlapping ones), using the Shift-Or algorithm: one shift and one OR per byte
+ * of `text`, whatever the pattern.
+ *
+ * @example
+ *   BitTwiddle.shift_or_search("abracadabra", "abra") # => [0, 7]
+ *   BitTwiddle.shift_or_search("aaaa", "aa")          # => [0, 1, 2]
+ *
+ * @param text [String]
+ * @param pattern [String] From 1 to 64 bytes
+ * @return [Array<Integer>]
+ */
+static VALUE
+bt_shift_or_search(VALUE self, VALUE text, VALUE pattern)
+{
+  uint64_t     mask[256], state = ~0ULL, hit;
+  const uchar *p, *t;
+  long         m, n, i;
+  VALUE        result = rb_ary_new();
+
+  StringValue(text);
+  StringValue(pattern);
+  check_search_pattern(pattern);
+  p = (const uchar*)RSTRING_PTR(pattern);
+  m = RSTRING_LEN(pattern);
+  n = RSTRING_LEN(text);
+  hit = 1ULL << (m - 1);
+
+  for (i = 0; i < 256; i++)
+    mask[i] = ~0ULL;
+  for (i = 0; i < m; i++)
+    mask[p[i]] &= ~(1ULL << i);
+
+  for (i = 0; i < n; i++) {
+    t = (const uchar*)RSTRING_PTR(text);
+    state = (state << 1) | mask[t[i]];
+    if (!(state & hit))
+      rb_ary_push(result, LONG2FIX(i - m + 1));
+  }
+  return result;
+}
+
+/* Return the end offsets (the offset just after the last byte) of every
+ * substring of `text` which is within Levenshtein distance `max_errors` of
+ * `pattern`, using the bit-parallel Bitap (Wu-Manber) algorithm.
+ *
+ * If `max_errors` is not less than the length of `pattern`, raise
+ * `ArgumentError`, since then an empty substring would match everywhere.
+ *
+ * @example
+ *   BitTwiddle.bitap_search("the quick brown fox", "quack", 1) # => [9]
+ *   BitTwiddle.bitap_search("abcabd", "abc", 0)                # => [3]
+ *
+ * @param text [String]
+ * @param pattern [String] From 1 to 64 bytes
+ * @param max_errors [Integer]
+ * @return [Array<Integer>]
+ */
+static VALUE
+bt_bitap_search(VALUE self, VALUE text, VALUE pattern, VALUE max_errors)
+{
+  uint64_t     mask[256], *r, hit;
+  const uchar *p;
+  long         m, n, i, d, k = NUM2LONG(max_errors);
+  VALUE        result = rb_ary_new(), tmp;
+
+  StringValue(text);
+  StringValue(pattern);
+  check_search_pattern(pattern);
+  p = (const uchar*)RSTRING_PTR(pattern);
+  m = RSTRING_LEN(pattern);
+  n = RSTRING_LEN(text);
+  if (k < 0 || k >= m)
+    rb_raise(rb_eArgError, "max_errors must be from 0 to the pattern length - 1");
+  hit = 1ULL << (m - 1);
+
+  memset(mask, 0, sizeof(mask));
+  for (i = 0; i < m; i++)
+    mask[p[i]] |= 1ULL << i;
+
+  /* r[d] has bit i set if pattern[0..i] matches a suffix of the text so far with
+   * at most d errors (Shift-And form) */
+  r = ALLOCV_N(uint64_t, tmp, k + 1);
+  for (d = 0; d <= k; d++)
+    r[d] = (d == 0) ? 0 : (1ULL << d) - 1;
+
+  for (i = 0; i < n; i++) {
+    uint64_t eq = mask[((const uchar*)RSTRING_PTR(text))[i]];
+    uint64_t prev_old = r[0], prev_new;
+
+    r[0] = ((r[0] << 1) | 1) & eq;
+    prev_new = r[0];
+    for (d = 1; d <= k; d++) {
+      uint64_t old = r[d];
+      /* match, insertion (text byte skipped), substitution, deletion */
+      r[d] = (((old << 1) | 1) & eq) | prev_old | ((prev_old | prev_new) << 1) | 1;
+      prev_old = old;
+      prev_new = r[d];
+    }
+    if (r[k] & hit)
+      rb_ary_push(result, LONG2FIX(i + 1));
+  }
+  ALLOCV_END(tmp);
+  return result;
+}
+
+void Init_bt_string_match(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+
+  rb_define_singleton_method(rb_mBitTwiddle, "myers_distance",  bt_myers_distance,  -1);
+  rb_define_singleton_method(rb_mBitTwiddle, "myers_distances", bt_myers_distances, -1);
+  rb_define_singleton_method(rb_mBitTwiddle, "shift_or_search", bt_shift_or_search,  2);
+  rb_define_singleton_method(rb_mBitTwiddle, "bitap_search",    bt_bitap_search,     3);
+}
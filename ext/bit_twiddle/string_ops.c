@@ -0,0 +1,266 @@
+/* In-place bitwise operations between Strings
+ *
+ * These stream over the bytes 32 (AVX2), 16 (SSE2) or 8 at a time, and never
+ * allocate. */
+
+#include "bit_twiddle.h"
+
+#define def_bitop_loop(load, store, xor, and, or, andnot, step)             \
+  for (; i + step <= n; i += step) {                                         \
+    x = load(dst + i);                                                       \
+    y = load(src + i);                                                       \
+    switch (op) {                                                            \
+    case BT_XOR:    x = xor(x, y);    break;                                 \
+    case BT_AND:    x = and(x, y);    break;                                 \
+    case BT_OR:     x = or(x, y);     break;                                 \
+    case BT_ANDNOT: x = andnot(y, x); break;                                 \
+    }                                                                        \
+    store(dst + i, x);                                                       \
+  }
+
+#ifdef __AVX2__
+static inline __m256i load256(const uchar *p)         { return _mm256_loadu_si256((const __m256i*)p); }
+static inline void    store256(uchar *p, __m256i v)   { _mm256_storeu_si256((__m256i*)p, v); }
+#endif
+#ifdef __SSE2__
+static inline __m128i load128(const uchar *p)         { return _mm_loadu_si128((const __m128i*)p); }
+static inline void    store128(uchar *p, __m128i v)   { _mm_storeu_si128((__m128i*)p, v); }
+#endif
+static inline uint64_t load64(const uchar *p)         { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline void     store64(uchar *p, uint64_t v)  { memcpy(p, &v, 8); }
+static inline uint64_t xor64(uint64_t a, uint64_t b)    { return a ^ b; }
+static inline uint64_t and64(uint64_t a, uint64_t b)    { return a & b; }
+static inline uint64_t or64(uint64_t a, uint64_t b)     { return a | b; }
+static inline uint64_t andnot64(uint64_t a, uint64_t b) { return ~a & b; }
+
+/* The switch on 'op' is hoisted out of the loops by the compiler, since 'op'
+ * never changes within them */
+void
+bt_bitop_buf(uchar *dst, const uchar *src, size_t n, enum bt_bitop op)
+{
+  size_t i = 0;
+
+#ifdef __AVX2__
+  {
+    __m256i x, y;
+    def_bitop_loop(load256, store256, _mm256_xor_si256, _mm256_and_si256, _mm256_or_si256, _mm256_andnot_si256, 32);
+  }
+#endif
+#ifdef __SSE2__
+  {
+    __m128i x, y;
+    def_bitop_loop(load128, store128, _mm_xor_si128, _mm_and_si128, _mm_or_si128, _mm_andnot_si128, 16);
+  }
+#endif
+  {
+    uint64_t x, y;
+    def_bitop_loop(load64, store64, xor64, and64, or64, andnot64, 8);
+  }
+  for (; i < n; i++) {
+    switch (op) {
+    case BT_XOR:    dst[i] ^= src[i];  break;
+    case BT_AND:    dst[i] &= src[i];  break;
+    case BT_OR:     dst[i] |= src[i];  break;
+    case BT_ANDNOT: dst[i] &= ~src[i]; break;
+    }
+  }
+}
+
+static VALUE
+str_bitop(VALUE str, VALUE other, enum bt_bitop op)
+{
+  StringValue(other);
+  if (RSTRING_LEN(str) != RSTRING_LEN(other))
+    rb_raise(rb_eArgError, "Strings must be the same length (%ld and %ld bytes)", RSTRING_LEN(str), RSTRING_LEN(other));
+  rb_str_modify(str);
+  bt_bitop_buf((uchar*)RSTRING_PTR(str), (const uchar*)RSTRING_PTR(other), RSTRING_LEN(str), op);
+  RB_GC_GUARD(other);
+  return str;
+}
+
+/* XOR each byte of this `String` with the corresponding byte of `other`, in place.
+ *
+ * If the Strings are not the same length, raise `ArgumentError`.
+ *
+ * @example
+ *   "abc".xor!("\x01\x02\x03") # => "```"
+ *
+ * @param other [String]
+ * @return [String] `self`
+ */
+static VALUE
+str_xor_bang(VALUE str, VALUE other)
+{
+  return str_bitop(str, other, BT_XOR);
+}
+
+/* AND each byte of this `String` with the corresponding byte of `other`, in place.
+ *
+ * If the Strings are not the same length, raise `ArgumentError`.
+ *
+ * @example
+ *   "\xFF\x0F".b.and!("\x3C\x3C") # => "<\f"
+ *
+ * @param other [String]
+ * @return [String] `self`
+ */
+static VALUE
+str_and_bang(VALUE str, VALUE other)
+{
+  return str_bitop(str, other, BT_AND);
+}
+
+/* OR each byte of this `String` with the corresponding byte of `other`, in place.
+ *
+ * If the Strings are not the same length, raise `ArgumentError`.
+ *
+ * @example
+ *   "ABC".or!("   ") # => "abc"
+ *
+ * @param other [String]
+ * @return [String] `self`
+ */
+static VALUE
+str_or_bang(VALUE str, VALUE other)
+{
+  return str_bitop(str, other, BT_OR);
+}
+
+/* Clear the bits of this `String` which are set in the corresponding bytes of
+ * `other` (`self & ~other`), in place.
+ *
+ * If the Strings are not the same length, raise `ArgumentError`.
+ *
+ * @example
+ *   "abc".andnot!("   ") # => "ABC"
+ *
+ * @param other [String]
+ * @return [String] `self`
+ */
+static VALUE
+str_andnot_bang(VALUE str, VALUE other)
+{
+  return str_bitop(str, other, BT_ANDNOT);
+}
+
+/* XOR this `String` in place with `key`, repeated as many times as needed to
+ * cover it (as for WebSocket masking, or a repeating-key cipher).
+ *
+ * @example
+ *   masked = "Hello".xor_key!("\x37\xfa\x21\x3d")
+ *   masked.xor_key!("\x37\xfa\x21\x3d") # => "Hello"
+ *
+ * @param key [String] At least 1 byte
+ * @return [String] `self`
+ */
+static VALUE
+str_xor_key_bang(VALUE str, VALUE key)
+{
+  uchar  *p, *pattern;
+  size_t  klen, len, i = 0, phase = 0, j;
+  VALUE   tmp;
+
+  StringValue(key);
+  klen = RSTRING_LEN(key);
+  if (klen == 0)
+    rb_raise(rb_eArgError, "key must not be empty");
+  rb_str_modify(str);
+  p   = (uchar*)RSTRING_PTR(str);
+  len = RSTRING_LEN(str);
+
+  /* the key followed by its first 32 bytes (repeated if need be), so 32 bytes
+   * of key stream can be loaded starting at any phase */
+  pattern = ALLOCV_N(uchar, tmp, klen + 32);
+  for (j = 0; j < klen + 32; j++)
+    pattern[j] = RSTRING_PTR(key)[j % klen];
+
+#ifdef __AVX2__
+  for (; i + 32 <= len; i += 32) {
+    store256(p + i, _mm256_xor_si256(load256(p + i), load256(pattern + phase)));
+    phase = (phase + 32) % klen;
+  }
+#endif
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16) {
+    store128(p + i, _mm_xor_si128(load128(p + i), load128(pattern + phase)));
+    phase = (phase + 16) % klen;
+  }
+#endif
+  for (; i + 8 <= len; i += 8) {
+    store64(p + i, load64(p + i) ^ load64(pattern + phase));
+    phase = (phase + 8) % klen;
+  }
+  for (; i < len; i++) {
+    p[i] ^= pattern[phase];
+    phase = (phase + 1) % klen;
+  }
+
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(key);
+  return str;
+}
+
+void
+init_string_ops_core_extensions(void)
+{
+  rb_define_method(rb_cString, "xor!",     str_xor_bang,     1);
+  rb_define_method(rb_cString, "and!",     str_and_bang,     1);
+  rb_define_method(rb_cString, "or!",      str_or_bang,      1);
+  rb_define_method(rb_cString, "andnot!",  str_andnot_bang,  1);
+  rb_define_method(rb_cString, "xor_key!", str_xor_key_bang, 1);
+}
+
+static VALUE bt_xor_bang(VALUE self, VALUE dst, VALUE src)     { return str_xor_bang(StringValue(dst), src); }
+static VALUE bt_and_bang(VALUE self, VALUE dst, VALUE src)     { return str_and_bang(StringValue(dst), src); }
+static VALUE bt_or_bang(VALUE self, VALUE dst, VALUE src)      { return str_or_bang(StringValue(dst), src); }
+static VALUE bt_andnot_bang(VALUE self, VALUE dst, VALUE src)  { return str_andnot_bang(StringValue(dst), src); }
+static VALUE bt_xor_key_bang(VALUE self, VALUE str, VALUE key) { return str_xor_key_bang(StringValue(str), key); }
+
+void Init_bt_string_ops(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+
+  /* XOR each byte of `dst` with the corresponding byte of `src`, in place, as
+   * `String#xor!` does.
+   *
+   * @example
+   *   BitTwiddle.xor!("abc", "\x01\x02\x03") # => "```"
+   *
+   * @param dst [String]
+   * @param src [String] The same length as `dst`
+   * @return [String] `dst`
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "xor!",     bt_xor_bang,     2);
+  /* AND each byte of `dst` with the corresponding byte of `src`, in place, as
+   * `String#and!` does.
+   *
+   * @param dst [String]
+   * @param src [String] The same length as `dst`
+   * @return [String] `dst`
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "and!",     bt_and_bang,     2);
+  /* OR each byte of `dst` with the corresponding byte of `src`, in place, as
+   * `String#or!` does.
+   *
+   * @param dst [String]
+   * @param src [String] The same length as `dst`
+   * @return [String] `dst`
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "or!",      bt_or_bang,      2);
+  /* Clear the bits of `dst` which are set in `src` (`dst & ~src`), in place, as
+   * `String#andnot!` does.
+   *
+   * @param dst [String]
+   * @param src [String] The same length as `dst`
+   * @return [String] `dst`
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "andnot!",  bt_andnot_bang,  2);
+  /* XOR `str` in place with `key`, repeated as many times as needed to cover
+   * it, as `String#xor_key!` does.
+   *
+   * @param str [String]
+   * @param key [String] At least 1 byte
+   * @return [String] `str`
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "xor_key!", bt_xor_key_bang, 2);
+}
@@ -0,0 +1,816 @@
+/* Integer stream codecs: LEB128 varints (plain and zigzag), Stream VByte,
+ * zigzag and delta transforms
+ *
+ * "Buffers" are Strings of unsigned 32 or 64-bit integers in native byte order,
+ * as produced by Array#pack("L*") or Array#pack("Q*") (or "l*"/"q*" for the
+ * functions which treat values as signed) */
+
+#include "bit_twiddle.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#define CONT_BITS 0x8080808080808080ULL
+
+static int
+value_to_width(VALUE width)
+{
+  int w = NUM2INT(width);
+  if (w != 32 && w != 64)
+    rb_raise(rb_eArgError, "buffer element width must be 32 or 64 bits (not %d)", w);
+  return w;
+}
+
+static size_t
+buffer_count(VALUE buffer, int width)
+{
+  if (RSTRING_LEN(buffer) % (width / 8))
+    rb_raise(rb_eArgError, "buffer length must be a multiple of %d bytes", width / 8);
+  return RSTRING_LEN(buffer) / (width / 8);
+}
+
+static inline uint64_t
+buffer_get(const uchar *p, size_t i, int width)
+{
+  if (width == 32) {
+    uint32_t v;
+    memcpy(&v, p + i*4, 4);
+    return v;
+  } else {
+    uint64_t v;
+    memcpy(&v, p + i*8, 8);
+    return v;
+  }
+}
+
+static inline void
+buffer_set(uchar *p, size_t i, int width, uint64_t v)
+{
+  if (width == 32) {
+    uint32_t v32 = (uint32_t)v;
+    memcpy(p + i*4, &v32, 4);
+  } else {
+    memcpy(p + i*8, &v, 8);
+  }
+}
+
+static inline uint64_t
+zigzag(uint64_t v, int width)
+{
+  if (width == 32)
+    return (uint32_t)((v << 1) ^ (uint64_t)((int32_t)(uint32_t)v >> 31));
+  else
+    return (v << 1) ^ (uint64_t)((int64_t)v >> 63);
+}
+
+static inline uint64_t
+unzigzag(uint64_t v)
+{
+  return (v >> 1) ^ -(v & 1);
+}
+
+/* ------------------------------------------------------------------------- */
+/* LEB128 */
+
+static inline int
+varint_size(uint64_t v)
+{
+  return 1 + (63 - __builtin_clzll(v | 1)) / 7;
+}
+
+static inline uchar*
+varint_put(uchar *out, uint64_t v)
+{
+  while (v >= 0x80) {
+    *out++ = (uchar)v | 0x80;
+    v >>= 7;
+  }
+  *out++ = (uchar)v;
+  return out;
+}
+
+/* Gather the low 7 bits of each of the low 'len' bytes of w (len <= 8) */
+static inline uint64_t
+varint_gather(uint64_t w, int len)
+{
+  uint64_t keep = (len == 8) ? ~0ULL : (1ULL << (8 * len)) - 1;
+#ifdef __BMI2__
+  return _pext_u64(w, 0x7F7F7F7F7F7F7F7FULL & keep);
+#else
+  w &= 0x7F7F7F7F7F7F7F7FULL & keep;
+  w = (w & 0x007F007F007F007FULL) | ((w & 0x7F007F007F007F00ULL) >> 1);
+  w = (w & 0x00003FFF00003FFFULL) | ((w & 0x3FFF00003FFF0000ULL) >> 2);
+  return (w & 0x000000000FFFFFFFULL) | ((w & 0x0FFFFFFF00000000ULL) >> 4);
+#endif
+}
+
+/* Decode one varint from p, a byte at a time (for varints near the end of the
+ * String, or which are longer than 8 bytes) */
+static const uchar*
+varint_get_slow(const uchar *p, uint64_t *value)
+{
+  uint64_t v = 0;
+  int shift = 0;
+
+  for (;;) {
+    uchar b = *p++;
+    if (shift == 63 && b > 1)
+      rb_raise(rb_eArgError, "varint is too big for 64 bits");
+    v |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+      break;
+    shift += 7;
+    if (shift > 63)
+      rb_raise(rb_eArgError, "varint is too long");
+  }
+
+  *value = v;
+  return p;
+}
+
+/* Decode one varint from p (which is known to be followed by a terminating byte
+ * somewhere before 'end'); return a pointer to the following byte */
+static inline const uchar*
+varint_get(const uchar *p, const uchar *end, uint64_t *value)
+{
+  if (end - p >= 8) {
+    uint64_t w = load_le64(p);
+    uint64_t m = ~w & CONT_BITS;
+    if (m) {
+      int len = __builtin_ctzll(m) / 8 + 1;
+      *value = varint_gather(w, len);
+      return p + len;
+    }
+  }
+  return varint_get_slow(p, value);
+}
+
+/* Number of varints in a String (= number of bytes without the continuation bit) */
+static size_t
+varint_count(const uchar *p, size_t len)
+{
+  size_t conts = 0;
+
+  while (len >= 8) {
+    conts += __builtin_popcountll(load_le64(p) & CONT_BITS);
+    p += 8; len -= 8;
+  }
+  while (len--)
+    conts += *p++ >> 7;
+
+  return conts;
+}
+
+static VALUE
+varint_encode(VALUE buffer, VALUE width, int is_signed)
+{
+  int    w = value_to_width(width);
+  size_t n, i, size = 0;
+  const uchar *in;
+  uchar *out;
+  VALUE  result;
+
+  StringValue(buffer);
+  n  = buffer_count(buffer, w);
+  in = (const uchar*)RSTRING_PTR(buffer);
+
+  for (i = 0; i < n; i++) {
+    uint64_t v = buffer_get(in, i, w);
+    size += varint_size(is_signed ? zigzag(v, w) : v);
+  }
+
+  result = rb_str_new(NULL, size);
+  out    = (uchar*)RSTRING_PTR(result);
+  for (i = 0; i < n; i++) {
+    uint64_t v = buffer_get(in, i, w);
+    out = varint_put(out, is_signed ? zigzag(v, w) : v);
+  }
+  return result;
+}
+
+static VALUE
+varint_decode(VALUE str, VALUE width, int is_signed)
+{
+  int    w = value_to_width(width);
+  const uchar *p, *end;
+  size_t n, i = 0;
+  uchar *out;
+  VALUE  result;
+
+  StringValue(str);
+  p   = (const uchar*)RSTRING_PTR(str);
+  end = p + RSTRING_LEN(str);
+  if (p < end && (end[-1] & 0x80))
+    rb_raise(rb_eArgError, "last varint is truncated");
+
+  n      = RSTRING_LEN(str) - varint_count(p, RSTRING_LEN(str));
+  result = rb_str_new(NULL, n * (w / 8));
+  out    = (uchar*)RSTRING_PTR(result);
+
+  while (i < n) {
+    uint64_t v;
+#ifdef __SSE2__
+    /* Runs of small values, one byte each, are common; widen 16 at once */
+    if (!is_signed && end - p >= 16) {
+      __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+      if (_mm_movemask_epi8(bytes) == 0) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i lo16 = _mm_unpacklo_epi8(bytes, zero), hi16 = _mm_unpackhi_epi8(bytes, zero);
+        __m128i d[4];
+        int k;
+        d[0] = _mm_unpacklo_epi16(lo16, zero); d[1] = _mm_unpackhi_epi16(lo16, zero);
+        d[2] = _mm_unpacklo_epi16(hi16, zero); d[3] = _mm_unpackhi_epi16(hi16, zero);
+        if (w == 32) {
+          for (k = 0; k < 4; k++)
+            _mm_storeu_si128((__m128i*)(out + i*4 + k*16), d[k]);
+        } else {
+          for (k = 0; k < 4; k++) {
+            _mm_storeu_si128((__m128i*)(out + i*8 + k*32),      _mm_unpacklo_epi32(d[k], zero));
+            _mm_storeu_si128((__m128i*)(out + i*8 + k*32 + 16), _mm_unpackhi_epi32(d[k], zero));
+          }
+        }
+        p += 16;
+        i += 16;
+        continue;
+      }
+    }
+#endif
+    p = varint_get(p, end, &v);
+    if (is_signed) {
+      v = unzigzag(v);
+      if (w == 32 && (int64_t)v != (int32_t)v)
+        rb_raise(rb_eRangeError, "varint is too big for a 32-bit buffer");
+    } else if (w == 32 && (v >> 32)) {
+      rb_raise(rb_eRangeError, "varint is too big for a 32-bit buffer");
+    }
+    buffer_set(out, i++, w, v);
+  }
+
+  return result;
+}
+
+/* Encode a buffer of unsigned integers as LEB128 varints (as used by Protocol
+ * Buffers): 7 bits per byte, least-significant group first, with the high bit
+ * of each byte set if more bytes follow.
+ *
+ * @example
+ *   BitTwiddle.varint_encode([1, 300].pack("Q*"), 64).bytes # => [1, 172, 2]
+ *
+ * @param buffer [String] Unsigned integers in native byte order
+ * @param width [Integer] Size of each integer in `buffer`: 32 or 64 bits
+ * @return [String]
+ */
+static VALUE
+bt_varint_encode(VALUE self, VALUE buffer, VALUE width)
+{
+  return varint_encode(buffer, width, 0);
+}
+
+/* Decode a String of LEB128 varints into a buffer of unsigned integers.
+ *
+ * If the last varint is truncated, or a varint is too big for 64 bits, raise
+ * `ArgumentError`. If `width` is 32 and a value is too big for 32 bits, raise
+ * `RangeError`.
+ *
+ * @example
+ *   BitTwiddle.varint_decode([1, 172, 2].pack("C*"), 64).unpack("Q*") # => [1, 300]
+ *
+ * @param str [String] The varints to decode
+ * @param width [Integer] Size of each integer in the result: 32 or 64 bits
+ * @return [String]
+ */
+static VALUE
+bt_varint_decode(VALUE self, VALUE str, VALUE width)
+{
+  return varint_decode(str, width, 0);
+}
+
+/* Encode a buffer of signed integers as zigzag LEB128 varints (the `sint32` and
+ * `sint64` encoding of Protocol Buffers), so that small negative numbers are
+ * also encoded in few bytes.
+ *
+ * @example
+ *   BitTwiddle.svarint_encode([-1, 1, -64].pack("q*"), 64).bytes # => [1, 2, 127]
+ *
+ * @param buffer [String] Signed integers in native byte order
+ * @param width [Integer] Size of each integer in `buffer`: 32 or 64 bits
+ * @return [String]
+ */
+static VALUE
+bt_svarint_encode(VALUE self, VALUE buffer, VALUE width)
+{
+  return varint_encode(buffer, width, 1);
+}
+
+/* Decode a String of zigzag LEB128 varints into a buffer of signed integers.
+ *
+ * @example
+ *   BitTwiddle.svarint_decode([1, 2, 127].pack("C*"), 64).unpack("q*") # => [-1, 1, -64]
+ *
+ * @param str [String] The varints to decode
+ * @param width [Integer] Size of each integer in the result: 32 or 64 bits
+ * @return [String]
+ */
+static VALUE
+bt_svarint_decode(VALUE self, VALUE str, VALUE width)
+{
+  return varint_decode(str, width, 1);
+}
+
+/* Decode the LEB128 varint which starts at byte `offset` in `str`.
+ *
+ * @example
+ *   BitTwiddle.read_varint("\x01\xAC\x02", 1) # => [300, 3]
+ *
+ * @param str [String]
+ * @param offset [Integer] (default 0)
+ * @return [Array(Integer, Integer)] The value, and the offset of the following byte
+ */
+static VALUE
+bt_read_varint(int argc, VALUE *argv, VALUE self)
+{
+  VALUE str, offset;
+  const uchar *start, *p, *end, *q;
+  long  off = 0;
+  uint64_t v;
+
+  rb_scan_args(argc, argv, "11", &str, &offset);
+  StringValue(str);
+  if (!NIL_P(offset))
+    off = NUM2LONG(offset);
+  if (off < 0 || off >= RSTRING_LEN(str))
+    rb_raise(rb_eIndexError, "offset %ld is outside the String", off);
+
+  start = (const uchar*)RSTRING_PTR(str);
+  p     = start + off;
+  end   = start + RSTRING_LEN(str);
+  for (q = p; q < end && (*q & 0x80); q++)
+    ;
+  if (q == end)
+    rb_raise(rb_eArgError, "varint is truncated");
+
+  p = varint_get(p, end, &v);
+  return rb_assoc_new(ULL2NUM(v), LONG2NUM(p - start));
+}
+
+/* ------------------------------------------------------------------------- */
+/* Stream VByte: a control byte for each group of 4 integers, with 2 bits giving
+ * the number of bytes (1-4) used by each; all the control bytes come first,
+ * followed by the data bytes. Decoding moves 4 integers into place with a single
+ * pshufb, using a shuffle mask looked up by control byte */
+
+static uchar svb_lengths[256];
+#ifdef __SSSE3__
+static uchar svb_shuffles[256][16];
+#endif
+
+static void
+init_streamvbyte_tables(void)
+{
+  int c, k, j;
+  for (c = 0; c < 256; c++) {
+    int offset = 0;
+    for (k = 0; k < 4; k++) {
+      int len = ((c >> (2*k)) & 3) + 1;
+#ifdef __SSSE3__
+      for (j = 0; j < 4; j++)
+        svb_shuffles[c][4*k + j] = (j < len) ? offset + j : 0x80;
+#else
+      (void)j;
+#endif
+      offset += len;
+    }
+    svb_lengths[c] = offset;
+  }
+}
+
+/* Encode a buffer of unsigned 32-bit integers with Stream VByte.
+ *
+ * The count of integers is not stored; it must be passed to
+ * `BitTwiddle.streamvbyte_decode`.
+ *
+ * @example
+ *   BitTwiddle.streamvbyte_encode([1, 300, 70000].pack("L*")).bytesize # => 7
+ *
+ * @param buffer [String] Unsigned 32-bit integers in native byte order
+ * @return [String]
+ */
+static VALUE
+bt_streamvbyte_encode(VALUE self, VALUE buffer)
+{
+  size_t n, i, ctrl_len, size;
+  const uchar *in;
+  uchar *ctrl, *data;
+  VALUE  result;
+
+  StringValue(buffer);
+  n        = buffer_count(buffer, 32);
+  in       = (const uchar*)RSTRING_PTR(buffer);
+  ctrl_len = (n + 3) / 4;
+  size     = ctrl_len;
+  for (i = 0; i < n; i++)
+    size += (39 - __builtin_clz((uint32_t)buffer_get(in, i, 32) | 1)) / 8;
+
+  result = rb_str_new(NULL, size);
+  ctrl   = (uchar*)RSTRING_PTR(result);
+  data   = ctrl + ctrl_len;
+  memset(ctrl, 0, ctrl_len);
+
+  for (i = 0; i < n; i++) {
+    uint32_t v   = (uint32_t)buffer_get(in, i, 32);
+    int      len = (39 - __builtin_clz(v | 1)) / 8;
+    uchar    le[4];
+    ctrl[i / 4] |= (len - 1) << (2 * (i % 4));
+    store_le32(le, v);
+    memcpy(data, le, len);
+    data += len;
+  }
+
+  return result;
+}
+
+/* Decode `count` unsigned 32-bit integers encoded with Stream VByte.
+ *
+ * If `str` is not the right length for `count` integers, raise `ArgumentError`.
+ *
+ * @example
+ *   str = BitTwiddle.streamvbyte_encode([1, 300, 70000].pack("L*"))
+ *   BitTwiddle.streamvbyte_decode(str, 3).unpack("L*") # => [1, 300, 70000]
+ *
+ * @param str [String] The encoded integers
+ * @param count [Integer] Number of integers
+ * @return [String] Unsigned 32-bit integers in native byte order
+ */
+static VALUE
+bt_streamvbyte_decode(VALUE self, VALUE str, VALUE count)
+{
+  long   n = NUM2LONG(count);
+  size_t ctrl_len, data_len = 0, i;
+  const uchar *ctrl, *data, *end;
+  uchar *out;
+  VALUE  result;
+
+  StringValue(str);
+  if (n < 0)
+    rb_raise(rb_eArgError, "count can't be negative");
+  ctrl_len = (n + 3) / 4;
+  if ((size_t)RSTRING_LEN(str) < ctrl_len)
+    rb_raise(rb_eArgError, "Stream VByte data is too short");
+
+  ctrl = (const uchar*)RSTRING_PTR(str);
+  data = ctrl + ctrl_len;
+  end  = ctrl + RSTRING_LEN(str);
+
+  /* the final control byte may describe fewer than 4 integers */
+  for (i = 0; i < (size_t)n; i++)
+    data_len += ((ctrl[i / 4] >> (2 * (i % 4))) & 3) + 1;
+  if (data_len != (size_t)(end - data))
+    rb_raise(rb_eArgError, "Stream VByte data is the wrong length for %ld integers", n);
+
+  result = rb_str_new(NULL, n * 4);
+  out    = (uchar*)RSTRING_PTR(result);
+  i      = 0;
+
+#ifdef __SSSE3__
+  /* each 16-byte load must stay inside the String */
+  while (i < (size_t)n / 4 && end - data >= 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)data);
+    __m128i mask  = _mm_loadu_si128((const __m128i*)svb_shuffles[ctrl[i]]);
+    _mm_storeu_si128((__m128i*)(out + i*16), _mm_shuffle_epi8(bytes, mask));
+    data += svb_lengths[ctrl[i]];
+    i++;
+  }
+#endif
+
+  for (i *= 4; i < (size_t)n; i++) {
+    int len = ((ctrl[i / 4] >> (2 * (i % 4))) & 3) + 1;
+    uint32_t v;
+    uchar    le[4] = {0};
+    memcpy(le, data, len);
+    v = load_le32(le);
+    memcpy(out + i*4, &v, 4);
+    data += len;
+  }
+
+  return result;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Zigzag and delta transforms on buffers */
+
+/* Map signed integers to unsigned ones so that values near zero (of either sign)
+ * become small: 0, -1, 1, -2, 2... become 0, 1, 2, 3, 4...
+ *
+ * @example
+ *   BitTwiddle.zigzag_encode([0, -1, 1, -2].pack("l*"), 32).unpack("L*") # => [0, 1, 2, 3]
+ *
+ * @param buffer [String] Signed integers in native byte order
+ * @param width [Integer] Size of each integer in `buffer`: 32 or 64 bits
+ * @return [String]
+ */
+static VALUE
+bt_zigzag_encode(VALUE self, VALUE buffer, VALUE width)
+{
+  int    w = value_to_width(width);
+  size_t n, i;
+  VALUE  result;
+  uchar *p;
+
+  StringValue(buffer);
+  n      = buffer_count(buffer, w);
+  result = rb_str_new(RSTRING_PTR(buffer), RSTRING_LEN(buffer));
+  p      = (uchar*)RSTRING_PTR(result);
+  for (i = 0; i < n; i++)
+    buffer_set(p, i, w, zigzag(buffer_get(p, i, w), w));
+  return result;
+}
+
+/* The inverse of `BitTwiddle.zigzag_encode`.
+ *
+ * @example
+ *   BitTwiddle.zigzag_decode([0, 1, 2, 3].pack("L*"), 32).unpack("l*") # => [0, -1, 1, -2]
+ *
+ * @param buffer [String] Unsigned integers in native byte order
+ * @param width [Integer] Size of each integer in `buffer`: 32 or 64 bits
+ * @return [String]
+ */
+static VALUE
+bt_zigzag_decode(VALUE self, VALUE buffer, VALUE width)
+{
+  int    w = value_to_width(width);
+  size_t n, i;
+  VALUE  result;
+  uchar *p;
+
+  StringValue(buffer);
+  n      = buffer_count(buffer, w);
+  result = rb_str_new(RSTRING_PTR(buffer), RSTRING_LEN(buffer));
+  p      = (uchar*)RSTRING_PTR(result);
+  for (i = 0; i < n; i++)
+    buffer_set(p, i, w, unzigzag(buffer_get(p, i, w)));
+  return result;
+}
+
+static void
+delta_encode(uchar *p, size_t n, int width)
+{
+  size_t i = 0;
+
+  if (width == 32) {
+    uint32_t prev = 0;
+#ifdef __SSE2__
+    __m128i last = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+      __m128i cur = _mm_loadu_si128((const __m128i*)(p + i*4));
+      __m128i shifted = _mm_or_si128(_mm_slli_si128(cur, 4), _mm_srli_si128(last, 12));
+      _mm_storeu_si128((__m128i*)(p + i*4), _mm_sub_epi32(cur, shifted));
+      last = cur;
+    }
+    if (i)
+      prev = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(last, 12));
+#endif
+    for (; i < n; i++) {
+      uint32_t cur, delta;
+      memcpy(&cur, p + i*4, 4);
+      delta = cur - prev;
+      memcpy(p + i*4, &delta, 4);
+      prev = cur;
+    }
+  } else {
+    uint64_t prev = 0;
+    for (; i < n; i++) {
+      uint64_t cur, delta;
+      memcpy(&cur, p + i*8, 8);
+      delta = cur - prev;
+      memcpy(p + i*8, &delta, 8);
+      prev = cur;
+    }
+  }
+}
+
+static void
+delta_decode(uchar *p, size_t n, int width)
+{
+  size_t i = 0;
+
+  if (width == 32) {
+    uint32_t sum = 0;
+#ifdef __SSE2__
+    /* prefix sum within each group of 4, then add the running total */
+    __m128i total = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(p + i*4));
+      x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+      x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+      x = _mm_add_epi32(x, total);
+      _mm_storeu_si128((__m128i*)(p + i*4), x);
+      total = _mm_shuffle_epi32(x, 0xFF);
+    }
+    sum = (uint32_t)_mm_cvtsi128_si32(total);
+#endif
+    for (; i < n; i++) {
+      uint32_t delta;
+      memcpy(&delta, p + i*4, 4);
+      sum += delta;
+      memcpy(p + i*4, &sum, 4);
+    }
+  } else {
+    uint64_t sum = 0;
+    for (; i < n; i++) {
+      uint64_t delta;
+      memcpy(&delta, p + i*8, 8);
+      sum += delta;
+      memcpy(p + i*8, &sum, 8);
+    }
+  }
+}
+
+static int
+value_to_order(VALUE order)
+{
+  int o = NIL_P(order) ? 1 : NUM2INT(order);
+  if (o != 1 && o != 2)
+    rb_raise(rb_eArgError, "delta order must be 1 or 2 (not %d)", o);
+  return o;
+}
+
+/* Replace each integer in a buffer with its difference from the previous one
+ * (the first is left as is). With `order` 2, this is done twice, giving the
+ * "delta of delta", which is small for regularly spaced values like timestamps.
+ *
+ * Arithmetic wraps around, so this works for signed or unsigned integers.
+ *
+ * @example
+ *   BitTwiddle.delta_encode([10, 20, 30, 41].pack("Q*"), 64).unpack("Q*")    # => [10, 10, 10, 11]
+ *   BitTwiddle.delta_encode([10, 20, 30, 41].pack("Q*"), 64, 2).unpack("q*") # => [10, 0, 0, 1]
+ *
+ * @param buffer [String] Integers in native byte order
+ * @param width [Integer] Size of each integer in `buffer`: 32 or 64 bits
+ * @param order [Integer] 1 or 2 (default 1)
+ * @return [String]
+ */
+static VALUE
+bt_delta_encode(int argc, VALUE *argv, VALUE self)
+{
+  VALUE  buffer, width, order, result;
+  int    w, o;
+  size_t n;
+
+  rb_scan_args(argc, argv, "21", &buffer, &width, &order);
+  StringValue(buffer);
+  w      = value_to_width(width);
+  o      = value_to_order(order);
+  n      = buffer_count(buffer, w);
+  result = rb_str_new(RSTRING_PTR(buffer), RSTRING_LEN(buffer));
+  while (o--)
+    delta_encode((uchar*)RSTRING_PTR(result), n, w);
+  return result;
+}
+
+/* The inverse of `BitTwiddle.delta_encode`: replace each integer with the
+ * running total (a prefix sum).
+ *
+ * @example
+ *   BitTwiddle.delta_decode([10, 10, 10, 11].pack("Q*"), 64).unpack("Q*")  # => [10, 20, 30, 41]
+ *   BitTwiddle.delta_decode([10, 0, 0, 1].pack("q*"), 64, 2).unpack("Q*")  # => [10, 20, 30, 41]
+ *
+ * @param buffer [String] Integers in native byte order
+ * @param width [Integer] Size of each integer in `buffer`: 32 or 64 bits
+ * @param order [Integer] 1 or 2 (default 1)
+ * @return [String]
+ */
+static VALUE
+bt_delta_decode(int argc, VALUE *argv, VALUE self)
+{
+  VALUE  buffer, width, order, result;
+  int    w, o;
+  size_t n;
+
+  rb_scan_args(argc, argv, "21", &buffer, &width, &order);
+  StringValue(buffer);
+  w      = value_to_width(width);
+  o      = value_to_order(order);
+  n      = buffer_count(buffer, w);
+  result = rb_str_new(RSTRING_PTR(buffer), RSTRING_LEN(buffer));
+  while (o--)
+    delta_decode((uchar*)RSTRING_PTR(result), n, w);
+  return result;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Scalar helpers on Integer */
+
+static VALUE
+int_zigzag64(VALUE self)
+{
+  return ULL2NUM(zigzag((uint64_t)NUM2LL(self), 64));
+}
+
+static VALUE
+int_unzigzag64(VALUE self)
+{
+  return LL2NUM((int64_t)unzigzag(bt_num_to_u64(self)));
+}
+
+static VALUE
+int_to_varint(VALUE self)
+{
+  uchar buf[10];
+  uchar *end = varint_put(buf, bt_num_to_u64(self));
+  return rb_str_new((const char*)buf, end - buf);
+}
+
+/* Document-method: Integer#zigzag64
+ * Zigzag-encode this integer as a 64-bit value: 0, -1, 1, -2, 2... become
+ * 0, 1, 2, 3, 4...
+ *
+ * If the receiver does not fit in a signed 64-bit integer, raise `RangeError`.
+ *
+ * @example
+ *   -3.zigzag64 # => 5
+ *   3.zigzag64  # => 6
+ * @return [Integer]
+ */
+/* Document-method: Integer#unzigzag64
+ * The inverse of `Integer#zigzag64`.
+ *
+ * If the receiver is negative or does not fit in 64 bits, raise `RangeError`.
+ *
+ * @example
+ *   5.unzigzag64 # => -3
+ * @return [Integer]
+ */
+/* Document-method: Integer#to_varint
+ * Encode this integer as a LEB128 varint.
+ *
+ * If the receiver is negative or does not fit in 64 bits, raise `RangeError`.
+ *
+ * @example
+ *   300.to_varint.bytes # => [172, 2]
+ * @return [String]
+ */
+void
+init_varint_core_extensions(void)
+{
+  rb_define_method(rb_cInteger, "zigzag64",   int_zigzag64,   0);
+  rb_define_method(rb_cInteger, "unzigzag64", int_unzigzag64, 0);
+  rb_define_method(rb_cInteger, "to_varint",  int_to_varint,  0);
+}
+
+static VALUE bt_zigzag64(VALUE self, VALUE num)   { return int_zigzag64(num); }
+static VALUE bt_unzigzag64(VALUE self, VALUE num) { return int_unzigzag64(num); }
+static VALUE bt_to_varint(VALUE self, VALUE num)  { return int_to_varint(num); }
+
+void Init_bt_varint(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+
+  init_streamvbyte_tables();
+
+  rb_define_singleton_method(rb_mBitTwiddle, "varint_encode",  bt_varint_encode,  2);
+  rb_define_singleton_method(rb_mBitTwiddle, "varint_decode",  bt_varint_decode,  2);
+  rb_define_singleton_method(rb_mBitTwiddle, "svarint_encode", bt_svarint_encode, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "svarint_decode", bt_svarint_decode, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "read_varint",    bt_read_varint,   -1);
+  rb_define_singleton_method(rb_mBitTwiddle, "streamvbyte_encode", bt_streamvbyte_encode, 1);
+  rb_define_singleton_method(rb_mBitTwiddle, "streamvbyte_decode", bt_streamvbyte_decode, 2);
+  rb_define_singleton_method(rb_mBitTwiddle, "zigzag_encode",  bt_zigzag_encode,  2);
+  rb_define_singleton_method(rb_mBitTwiddle, "zigzag_decode",  bt_zigzag_decode,  2);
+  rb_define_singleton_method(rb_mBitTwiddle, "delta_encode",   bt_delta_encode,  -1);
+  rb_define_singleton_method(rb_mBitTwiddle, "delta_decode",   bt_delta_decode,  -1);
+
+  /* Zigzag-encode `int` as a 64-bit value: 0, -1, 1, -2, 2... become 0, 1, 2, 3, 4...
+   * @example
+   *   BitTwiddle.zigzag64(-3) # => 5
+   *
+   * If `int` does not fit in a signed 64-bit integer, raise `RangeError`.
+   *
+   * @param int [Integer] The integer to operate on
+   * @return [Integer]
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "zigzag64",   bt_zigzag64,   1);
+  /* The inverse of `BitTwiddle.zigzag64`.
+   * @example
+   *   BitTwiddle.unzigzag64(5) # => -3
+   *
+   * If `int` is negative or does not fit in 64 bits, raise `RangeError`.
+   *
+   * @param int [Integer] The integer to operate on
+   * @return [Integer]
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "unzigzag64", bt_unzigzag64, 1);
+  /* Encode `int` as a LEB128 varint.
+   * @example
+   *   BitTwiddle.to_varint(300).bytes # => [172, 2]
+   *
+   * If `int` is negative or does not fit in 64 bits, raise `RangeError`.
+   *
+   * @param int [Integer] The integer to operate on
+   * @return [String]
+   */
+  rb_define_singleton_method(rb_mBitTwiddle, "to_varint",  bt_to_varint,  1);
+}
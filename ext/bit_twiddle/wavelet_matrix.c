@@ -0,0 +1,591 @@
+/* BitTwiddle::WaveletMatrix: rank, select and range queries over a sequence of
+ * small unsigned integers ("symbols")
+ *
+ * There is one bitvector per bit of the symbols, from the most significant
+ * down. Level 0 holds the top bit of each symbol, in sequence order. Then the
+ * sequence is stably partitioned, with the symbols whose bit was 0 first, and
+ * level 1 holds the next bit of each symbol in that order, and so on. A
+ * position i at level l with bit b moves to rank0(i) at the next level if b is
+ * 0, or to zeros(l) + rank1(i) if b is 1, so every query is one or two rank or
+ * select operations per level. (Claude, Navarro and Ordonez, 2015)
+ *
+ * rank1 is a cumulative count per 512-bit block plus up to 8 popcounts.
+ * select1 and select0 start from the block of every SAMPLE-th 1 or 0 bit,
+ * binary search the block counts, then finish with an in-word select. */
+
+#include "bit_twiddle.h"
+
+#define BLOCK_BITS 512
+#define SAMPLE     4096
+
+typedef struct {
+  uint64_t *words;    /* n bits, and one extra word */
+  uint64_t *ranks;    /* 1 bits before each block, and the total at the end */
+  uint64_t *select1;  /* block of 1 bit number k*SAMPLE, for each k */
+  uint64_t *select0;  /* block of 0 bit number k*SAMPLE, for each k */
+  size_t    zeros, n_select1, n_select0;
+} wm_level;
+
+typedef struct {
+  wm_level levels[32];
+  size_t   n, nblocks;
+  int      bits;  /* number of levels; enough for the largest symbol */
+  int      width; /* of the symbols it was built from; 0 until initialized */
+} wavelet_matrix;
+
+static inline int
+wm_bit(const wm_level *lv, size_t i)
+{
+  return (lv->words[i / 64] >> (i % 64)) & 1;
+}
+
+/* Number of 1 bits before position i */
+static inline size_t
+wm_rank1(const wm_level *lv, size_t i)
+{
+  size_t b = i / BLOCK_BITS, w, r = lv->ranks[b];
+
+  for (w = b * (BLOCK_BITS / 64); w < i / 64; w++)
+    r += __builtin_popcountll(lv->words[w]);
+  if (i % 64)
+    r += __builtin_popcountll(lv->words[i / 64] & ((1ULL << (i % 64)) - 1));
+  return r;
+}
+
+static inline size_t
+wm_rank0(const wm_level *lv, size_t i)
+{
+  return i - wm_rank1(lv, i);
+}
+
+/* Position of 1 bit number k (which must exist) */
+static size_t
+wm_select1(const wavelet_matrix *wm, const wm_level *lv, size_t k)
+{
+  size_t s = k / SAMPLE, lo = lv->select1[s], w;
+  size_t hi = (s + 1 < lv->n_select1) ? lv->select1[s + 1] : wm->nblocks - 1;
+
+  /* last block with fewer than k + 1 1 bits before it */
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo + 1) / 2;
+    if (lv->ranks[mid] <= k)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  k -= lv->ranks[lo];
+  for (w = lo * (BLOCK_BITS / 64); ; w++) {
+    size_t c = __builtin_popcountll(lv->words[w]);
+    if (k < c)
+      return w * 64 + bt_select64(lv->words[w], (int)k);
+    k -= c;
+  }
+}
+
+/* Position of 0 bit number k (which must exist) */
+static size_t
+wm_select0(const wavelet_matrix *wm, const wm_level *lv, size_t k)
+{
+  size_t s = k / SAMPLE, lo = lv->select0[s], w;
+  size_t hi = (s + 1 < lv->n_select0) ? lv->select0[s + 1] : wm->nblocks - 1;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo + 1) / 2;
+    if (mid * BLOCK_BITS - lv->ranks[mid] <= k)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  k -= lo * BLOCK_BITS - lv->ranks[lo];
+  for (w = lo * (BLOCK_BITS / 64); ; w++) {
+    size_t c = __builtin_popcountll(~lv->words[w]);
+    if (k < c)
+      return w * 64 + bt_select64(~lv->words[w], (int)k);
+    k -= c;
+  }
+}
+
+/* Bit of symbol c which is stored at level l */
+static inline int
+symbol_bit(const wavelet_matrix *wm, uint64_t c, int l)
+{
+  return (c >> (wm->bits - 1 - l)) & 1;
+}
+
+/* Follow positions [*start, *stop) at level l down to the next level, on the
+ * side given by bit */
+static inline void
+wm_descend(const wavelet_matrix *wm, int l, int bit, size_t *start, size_t *stop)
+{
+  const wm_level *lv = &wm->levels[l];
+  if (bit) {
+    *start = lv->zeros + wm_rank1(lv, *start);
+    *stop  = lv->zeros + wm_rank1(lv, *stop);
+  } else {
+    *start = wm_rank0(lv, *start);
+    *stop  = wm_rank0(lv, *stop);
+  }
+}
+
+/* Number of symbols less than c in positions [start, stop) */
+static size_t
+wm_count_less(const wavelet_matrix *wm, size_t start, size_t stop, uint64_t c)
+{
+  size_t count = 0;
+  int l;
+
+  if (wm->bits < 64 && (c >> wm->bits))
+    return stop - start;
+  for (l = 0; l < wm->bits && start < stop; l++) {
+    int bit = symbol_bit(wm, c, l);
+    if (bit)
+      count += wm_rank0(&wm->levels[l], stop) - wm_rank0(&wm->levels[l], start);
+    wm_descend(wm, l, bit, &start, &stop);
+  }
+  return count;
+}
+
+static void
+wm_free_levels(wavelet_matrix *wm)
+{
+  int l;
+  for (l = 0; l < 32; l++) {
+    wm_level *lv = &wm->levels[l];
+    xfree(lv->words);
+    xfree(lv->ranks);
+    xfree(lv->select1);
+    xfree(lv->select0);
+    lv->words = lv->ranks = lv->select1 = lv->select0 = NULL;
+  }
+}
+
+static void
+wm_free(void *ptr)
+{
+  wm_free_levels(ptr);
+  xfree(ptr);
+}
+
+static size_t
+wm_level_words(const wavelet_matrix *wm, const wm_level *lv)
+{
+  return (wm->n + 63) / 64 + 1 + wm->nblocks + 1 + lv->n_select1 + lv->n_select0;
+}
+
+static size_t
+wm_memsize(const void *ptr)
+{
+  const wavelet_matrix *wm = ptr;
+  size_t size = sizeof(wavelet_matrix);
+  int l;
+
+  for (l = 0; l < wm->bits; l++)
+    size += 8 * wm_level_words(wm, &wm->levels[l]);
+  return size;
+}
+
+static const rb_data_type_t wavelet_matrix_type = {
+  "BitTwiddle::WaveletMatrix",
+  { 0, wm_free, wm_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+wm_alloc(VALUE klass)
+{
+  wavelet_matrix *wm;
+  return TypedData_Make_Struct(klass, wavelet_matrix, &wavelet_matrix_type, wm);
+}
+
+static wavelet_matrix*
+get_wavelet_matrix(VALUE self)
+{
+  wavelet_matrix *wm;
+  TypedData_Get_Struct(self, wavelet_matrix, &wavelet_matrix_type, wm);
+  if (wm->width == 0)
+    rb_raise(rb_eRuntimeError, "uninitialized WaveletMatrix");
+  return wm;
+}
+
+/* Fill in the rank and select directories of a level whose bits are set */
+static void
+wm_index_level(wavelet_matrix *wm, wm_level *lv)
+{
+  size_t b, w, ones = 0, next1 = 0, next0 = 0;
+
+  for (b = 0; b < wm->nblocks; b++) {
+    size_t end = (b + 1) * BLOCK_BITS < wm->n ? (b + 1) * BLOCK_BITS : wm->n;
+    lv->ranks[b] = ones;
+    for (w = b * (BLOCK_BITS / 64); w * 64 < end; w++)
+      ones += __builtin_popcountll(lv->words[w]);
+    for (; next1 < ones; next1 += SAMPLE)
+      lv->select1[next1 / SAMPLE] = b;
+    for (; next0 < end - ones; next0 += SAMPLE)
+      lv->select0[next0 / SAMPLE] = b;
+  }
+  lv->ranks[wm->nblocks] = ones;
+  lv->zeros = wm->n - ones;
+}
+
+static inline uint32_t
+load_symbol(const uchar *p, size_t i, int width)
+{
+  uint32_t v32;
+  uint16_t v16;
+
+  switch (width) {
+  case 8:
+    return p[i];
+  case 16:
+    memcpy(&v16, p + 2*i, 2);
+    return v16;
+  default:
+    memcpy(&v32, p + 4*i, 4);
+    return v32;
+  }
+}
+
+/* Document-method: BitTwiddle::WaveletMatrix#initialize
+ * Index a sequence of unsigned integer symbols. There is one level of n bits
+ * for each bit of the largest symbol, plus about 13% for rank and select.
+ *
+ * @example
+ *   wm = BitTwiddle::WaveletMatrix.new("abracadabra")
+ *   wm.rank("a".ord, 8)        # => 4, the "a"s before position 8
+ *   wm.select("a".ord, 2)      # => 5, the position of the third "a"
+ *   wm.quantile(0...4, 0)      # => 97, the smallest of "abra"
+ *   wm.range_freq(0..10, 98..114) # => 6, the letters from "b" to "r"
+ *
+ * @param symbols [String] Unsigned integers in native byte order (as produced
+ *   by `Array#pack("C*")`, `"S*"` or `"L*"`)
+ * @param width [Integer] Size of each symbol: 8, 16 or 32 bits (default 8)
+ */
+static VALUE
+wm_initialize(int argc, VALUE *argv, VALUE self)
+{
+  wavelet_matrix *wm;
+  VALUE symbols, width, tmp;
+  const uchar *p;
+  uint32_t *cur, *ones, max = 0;
+  size_t i, n, nwords;
+  int w, l;
+
+  rb_scan_args(argc, argv, "11", &symbols, &width);
+  TypedData_Get_Struct(self, wavelet_matrix, &wavelet_matrix_type, wm);
+  if (wm->width)
+    rb_raise(rb_eRuntimeError, "WaveletMatrix is already initialized");
+  StringValue(symbols);
+  w = NIL_P(width) ? 8 : NUM2INT(width);
+  if (w != 8 && w != 16 && w != 32)
+    rb_raise(rb_eArgError, "symbol width must be 8, 16 or 32 bits (not %d)", w);
+  if (RSTRING_LEN(symbols) % (w / 8))
+    rb_raise(rb_eArgError, "buffer length must be a multiple of %d bytes", w / 8);
+
+  p  = (const uchar*)RSTRING_PTR(symbols);
+  n  = RSTRING_LEN(symbols) / (w / 8);
+  /* ALLOCV memory is reclaimed by the GC if an allocation below raises */
+  cur  = ALLOCV_N(uint32_t, tmp, 2 * n + 1);
+  ones = cur + n;
+  for (i = 0; i < n; i++) {
+    cur[i] = load_symbol(p, i, w);
+    max   |= cur[i];
+  }
+
+  wm_free_levels(wm); /* from an earlier call which raised an exception */
+  wm->n       = n;
+  wm->nblocks = (n + BLOCK_BITS - 1) / BLOCK_BITS;
+  wm->bits    = max ? 32 - __builtin_clz(max) : 1;
+  nwords      = (n + 63) / 64 + 1;
+
+  for (l = 0; l < wm->bits; l++) {
+    wm_level *lv = &wm->levels[l];
+    int shift = wm->bits - 1 - l;
+    size_t nz = 0, no = 0;
+
+    lv->words     = ZALLOC_N(uint64_t, nwords);
+    lv->ranks     = ALLOC_N(uint64_t, wm->nblocks + 1);
+    for (i = 0; i < n; i++) {
+      uint32_t bit = (cur[i] >> shift) & 1;
+      lv->words[i / 64] |= (uint64_t)bit << (i % 64);
+      if (bit)
+        ones[no++] = cur[i];
+      else
+        cur[nz++] = cur[i];
+    }
+    memcpy(cur + nz, ones, no * sizeof(uint32_t));
+
+    lv->n_select1 = (no + SAMPLE - 1) / SAMPLE;
+    lv->n_select0 = (nz + SAMPLE - 1) / SAMPLE;
+    lv->select1   = ALLOC_N(uint64_t, lv->n_select1 + 1);
+    lv->select0   = ALLOC_N(uint64_t, lv->n_select0 + 1);
+    wm_index_level(wm, lv);
+  }
+
+  ALLOCV_END(tmp);
+  wm->width = w;
+  RB_GC_GUARD(symbols);
+  return self;
+}
+
+/* Document-method: BitTwiddle::WaveletMatrix#initialize_copy
+ * @!visibility private
+ */
+static VALUE
+wm_initialize_copy(VALUE self, VALUE orig)
+{
+  wavelet_matrix *dst, *src = get_wavelet_matrix(orig);
+  size_t nwords = (src->n + 63) / 64 + 1;
+  int l;
+
+  TypedData_Get_Struct(self, wavelet_matrix, &wavelet_matrix_type, dst);
+  if (dst == src)
+    return self;
+  if (dst->width)
+    rb_raise(rb_eRuntimeError, "WaveletMatrix is already initialized");
+  /* an earlier copy may have raised part way through */
+  wm_free_levels(dst);
+  for (l = 0; l < src->bits; l++) {
+    wm_level *d = &dst->levels[l];
+    const wm_level *s = &src->levels[l];
+    /* copy the sizes but not the pointers, so that if an allocation raises,
+     * 'dst' only owns what it has allocated */
+    d->zeros     = s->zeros;
+    d->n_select1 = s->n_select1;
+    d->n_select0 = s->n_select0;
+    d->words   = ALLOC_N(uint64_t, nwords);
+    d->ranks   = ALLOC_N(uint64_t, src->nblocks + 1);
+    d->select1 = ALLOC_N(uint64_t, s->n_select1 + 1);
+    d->select0 = ALLOC_N(uint64_t, s->n_select0 + 1);
+    MEMCPY(d->words,   s->words,   uint64_t, nwords);
+    MEMCPY(d->ranks,   s->ranks,   uint64_t, src->nblocks + 1);
+    MEMCPY(d->select1, s->select1, uint64_t, s->n_select1 + 1);
+    MEMCPY(d->select0, s->select0, uint64_t, s->n_select0 + 1);
+  }
+  dst->n       = src->n;
+  dst->nblocks = src->nblocks;
+  dst->bits    = src->bits;
+  dst->width   = src->width;
+  return self;
+}
+
+/* Convert a position in the sequence, counting from the end if negative */
+static size_t
+wm_index(const wavelet_matrix *wm, VALUE index, int allow_end)
+{
+  long i = NUM2LONG(index);
+  if (i < 0)
+    i += (long)wm->n;
+  if (i < 0 || (size_t)i > wm->n || ((size_t)i == wm->n && !allow_end))
+    rb_raise(rb_eIndexError, "index %ld out of range for WaveletMatrix of %"PRIuSIZE" symbols",
+             NUM2LONG(index), wm->n);
+  return i;
+}
+
+/* Convert a Range of positions to [*start, *stop) */
+static void
+wm_positions(const wavelet_matrix *wm, VALUE range, size_t *start, size_t *stop)
+{
+  long beg, len;
+  VALUE ok = rb_range_beg_len(range, &beg, &len, (long)wm->n, 0);
+  if (ok == Qfalse)
+    rb_raise(rb_eTypeError, "positions must be a Range");
+  if (NIL_P(ok))
+    rb_raise(rb_eRangeError, "positions out of range for WaveletMatrix of %"PRIuSIZE" symbols", wm->n);
+  *start = beg;
+  *stop  = beg + len;
+}
+
+/* Convert a symbol bound to 0 .. 2^64 - 1, saturating */
+static uint64_t
+wm_bound(VALUE v, uint64_t if_nil)
+{
+  if (NIL_P(v))
+    return if_nil;
+  v = rb_to_int(v);
+  if (RTEST(rb_funcall(v, '<', 1, INT2FIX(0))))
+    return 0;
+  if (RTEST(rb_funcall(v, '>', 1, ULL2NUM(UINT64_MAX))))
+    return UINT64_MAX;
+  return bt_num_to_u64(v);
+}
+
+/* Document-method: BitTwiddle::WaveletMatrix#[]
+ * @param index [Integer] Position in the sequence (negative counts from the end)
+ * @return [Integer] The symbol at `index`
+ */
+static VALUE
+wm_access(VALUE self, VALUE index)
+{
+  wavelet_matrix *wm = get_wavelet_matrix(self);
+  size_t i = wm_index(wm, index, 0);
+  uint32_t c = 0;
+  int l;
+
+  for (l = 0; l < wm->bits; l++) {
+    const wm_level *lv = &wm->levels[l];
+    int bit = wm_bit(lv, i);
+    c = (c << 1) | bit;
+    i = bit ? lv->zeros + wm_rank1(lv, i) : wm_rank0(lv, i);
+  }
+  return UINT2NUM(c);
+}
+
+/* Document-method: BitTwiddle::WaveletMatrix#rank
+ * @param symbol [Integer]
+ * @param index [Integer] Position in the sequence, from 0 to `size`
+ * @return [Integer] The number of occurrences of `symbol` before `index`
+ */
+static VALUE
+wm_rank(VALUE self, VALUE symbol, VALUE index)
+{
+  wavelet_matrix *wm = get_wavelet_matrix(self);
+  uint64_t c = bt_num_to_u64(symbol);
+  size_t start = 0, stop = wm_index(wm, index, 1);
+  int l;
+
+  if (c >> wm->bits)
+    return INT2FIX(0);
+  for (l = 0; l < wm->bits && start < stop; l++)
+    wm_descend(wm, l, symbol_bit(wm, c, l), &start, &stop);
+  return SIZET2NUM(stop - start);
+}
+
+/* Document-method: BitTwiddle::WaveletMatrix#select
+ * @param symbol [Integer]
+ * @param k [Integer] 0 for the first occurrence, 1 for the second, etc.
+ * @return [Integer, nil] The position of occurrence `k` of `symbol`, or `nil`
+ *   if there are not that many
+ */
+static VALUE
+wm_select(VALUE self, VALUE symbol, VALUE k)
+{
+  wavelet_matrix *wm = get_wavelet_matrix(self);
+  uint64_t c = bt_num_to_u64(symbol);
+  long nth = NUM2LONG(k);
+  size_t start = 0, stop = wm->n, pos;
+  int l;
+
+  if (nth < 0 || (c >> wm->bits))
+    return Qnil;
+  for (l = 0; l < wm->bits; l++)
+    wm_descend(wm, l, symbol_bit(wm, c, l), &start, &stop);
+  if ((size_t)nth >= stop - start)
+    return Qnil;
+
+  /* walk back up from the position among the symbols equal to c */
+  pos = start + nth;
+  for (l = wm->bits - 1; l >= 0; l--) {
+    const wm_level *lv = &wm->levels[l];
+    pos = symbol_bit(wm, c, l) ? wm_select1(wm, lv, pos - lv->zeros) : wm_select0(wm, lv, pos);
+  }
+  return SIZET2NUM(pos);
+}
+
+/* Document-method: BitTwiddle::WaveletMatrix#quantile
+ * Find the `k`-th smallest symbol among the given positions, without sorting
+ * them. `quantile(range, 0)` is the minimum, and `quantile(range, range.size / 2)`
+ * is the median.
+ *
+ * @param positions [Range<Integer>]
+ * @param k [Integer] From 0 to the number of positions - 1
+ * @return [Integer, nil] `nil` if `k` is out of range
+ */
+static VALUE
+wm_quantile(VALUE self, VALUE positions, VALUE k)
+{
+  wavelet_matrix *wm = get_wavelet_matrix(self);
+  size_t start, stop, rank;
+  long nth = NUM2LONG(k);
+  uint32_t c = 0;
+  int l;
+
+  wm_positions(wm, positions, &start, &stop);
+  if (nth < 0 || (size_t)nth >= stop - start)
+    return Qnil;
+  rank = nth;
+  for (l = 0; l < wm->bits; l++) {
+    const wm_level *lv = &wm->levels[l];
+    size_t zeros = wm_rank0(lv, stop) - wm_rank0(lv, start);
+    int bit = rank >= zeros;
+    if (bit)
+      rank -= zeros;
+    c = (c << 1) | bit;
+    wm_descend(wm, l, bit, &start, &stop);
+  }
+  return UINT2NUM(c);
+}
+
+/* Document-method: BitTwiddle::WaveletMatrix#range_freq
+ * Count the symbols among the given positions which are in a range of values.
+ * This takes 2 rank operations per level, however many symbols match.
+ *
+ * @param positions [Range<Integer>]
+ * @param values [Range<Integer>] May be endless or beginless
+ * @return [Integer]
+ */
+static VALUE
+wm_range_freq(VALUE self, VALUE positions, VALUE values)
+{
+  wavelet_matrix *wm = get_wavelet_matrix(self);
+  size_t start, stop;
+  uint64_t lo, hi;
+  VALUE beg, end;
+  int excl;
+
+  wm_positions(wm, positions, &start, &stop);
+  if (!rb_range_values(values, &beg, &end, &excl))
+    rb_raise(rb_eTypeError, "values must be a Range");
+  lo = wm_bound(beg, 0);
+  hi = wm_bound(end, UINT64_MAX);
+  /* make hi exclusive; symbols are at most 32 bits, so UINT64_MAX covers all */
+  if (!excl && hi < UINT64_MAX)
+    hi++;
+  if (lo >= hi)
+    return INT2FIX(0);
+  return SIZET2NUM(wm_count_less(wm, start, stop, hi) - wm_count_less(wm, start, stop, lo));
+}
+
+/* Document-method: BitTwiddle::WaveletMatrix#size
+ * @return [Integer] The number of symbols
+ */
+static VALUE
+wm_size(VALUE self)
+{
+  return SIZET2NUM(get_wavelet_matrix(self)->n);
+}
+
+/* Document-method: BitTwiddle::WaveletMatrix#bits
+ * @return [Integer] The number of levels (the bit length of the largest symbol)
+ */
+static VALUE
+wm_bits(VALUE self)
+{
+  return INT2FIX(get_wavelet_matrix(self)->bits);
+}
+
+void Init_bt_wavelet_matrix(void)
+{
+  VALUE rb_mBitTwiddle = rb_define_module("BitTwiddle");
+  /* Document-class: BitTwiddle::WaveletMatrix
+   * An immutable index over a sequence of 8, 16 or 32-bit unsigned integers,
+   * such as the bytes of a text or a column of IDs, which counts and finds
+   * occurrences of a symbol before any position, and finds the k-th smallest
+   * symbol or the number of symbols in a range of values within any range of
+   * positions. Each query takes O(bits per symbol) rank or select operations.
+   */
+  VALUE rb_cWaveletMatrix = rb_define_class_under(rb_mBitTwiddle, "WaveletMatrix", rb_cObject);
+
+  rb_define_alloc_func(rb_cWaveletMatrix, wm_alloc);
+  rb_define_method(rb_cWaveletMatrix, "initialize",      wm_initialize,     -1);
+  rb_define_method(rb_cWaveletMatrix, "initialize_copy", wm_initialize_copy, 1);
+  rb_define_method(rb_cWaveletMatrix, "[]",              wm_access,          1);
+  rb_define_method(rb_cWaveletMatrix, "access",          wm_access,          1);
+  rb_define_method(rb_cWaveletMatrix, "rank",            wm_rank,            2);
+  rb_define_method(rb_cWaveletMatrix, "select",          wm_select,          2);
+  rb_define_method(rb_cWaveletMatrix, "quantile",        wm_quantile,        2);
+  rb_define_method(rb_cWaveletMatrix, "range_freq",      wm_range_freq,      2);
+  rb_define_method(rb_cWaveletMatrix, "size",            wm_size,            0);
+  rb_define_method(rb_cWaveletMatrix, "length",          wm_size,            0);
+  rb_define_method(rb_cWaveletMatrix, "bits",            wm_bits,            0);
+}
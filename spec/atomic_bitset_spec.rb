@@ -0,0 +1,83 @@
+describe BitTwiddle::AtomicBitset do
+  it "sets and clears bits, reporting their old values" do
+    bs = BitTwiddle::AtomicBitset.new(100)
+    expect(bs.size).to eq 100
+    expect(bs.test_and_set(42)).to eq false
+    expect(bs.test_and_set(42)).to eq true
+    expect(bs[42]).to eq true
+    expect(bs[41]).to eq false
+    expect(bs.count).to eq 1
+    expect(bs.test_and_clear(42)).to eq true
+    expect(bs.test_and_clear(42)).to eq false
+    expect(bs.count).to eq 0
+  end
+
+  it "updates whole words" do
+    bs = BitTwiddle::AtomicBitset.new(130)
+    expect(bs.fetch_or_word(1, 0b1010)).to eq 0
+    expect(bs.fetch_or_word(1, 0b0110)).to eq 0b1010
+    expect(bs.word(1)).to eq 0b1110
+    expect(bs[65]).to eq true
+    expect(bs.compare_and_swap_word(1, 0, 1)).to eq false
+    expect(bs.compare_and_swap_word(1, 0b1110, 2**64 - 1)).to eq true
+    expect(bs.count).to eq 64
+    expect(bs.fetch_or_word(2, 3)).to eq 0
+    expect { bs.fetch_or_word(2, 4) }.to raise_error(ArgumentError)
+    expect { bs.word(3) }.to raise_error(IndexError)
+  end
+
+  it "sets many bits at once, returning those which were new" do
+    bs = BitTwiddle::AtomicBitset.new(1000)
+    expect(bs.test_and_set_all([3, 5, 3])).to eq [3, 5]
+    expect(bs.test_and_set_all([5, 7])).to eq [7]
+    expect(bs.test_and_set_all([7, 8, 9].pack("Q*"))).to eq [8, 9].pack("Q*")
+    expect(bs.test_and_set_all([9, 10].pack("L*"), 32)).to eq [10].pack("L")
+    expect { bs.test_and_set_all([11, 1000].pack("Q*")) }.to raise_error(IndexError)
+    expect(bs[11]).to eq false
+    expect { bs.test_and_set_all([12, 1000]) }.to raise_error(IndexError)
+    expect(bs[12]).to eq false
+    expect { bs.test_and_set_all("abc", 32) }.to raise_error(ArgumentError)
+    expect { bs.test_and_set_all("", 16) }.to raise_error(ArgumentError)
+  end
+
+  it "gives each bit to exactly one of several threads" do
+    bs = BitTwiddle::AtomicBitset.new(200_000)
+    ids = (0...200_000).to_a.shuffle(random: Random.new(47)).pack("Q*")
+    threads = 4.times.map { Thread.new { bs.test_and_set_all(ids).bytesize / 8 } }
+    expect(threads.map(&:value).inject(:+)).to eq 200_000
+    expect(bs.count).to eq 200_000
+  end
+
+  it "is frozen but still updatable, and can be copied and cleared" do
+    bs = BitTwiddle::AtomicBitset.new(10)
+    expect(bs.frozen?).to eq true
+    bs.test_and_set(1)
+    copy = bs.dup
+    expect(copy.frozen?).to eq true
+    bs.clear
+    expect(bs.count).to eq 0
+    expect(copy[1]).to eq true
+  end
+
+  if defined?(Ractor)
+    it "can be shared between Ractors" do
+      bs = BitTwiddle::AtomicBitset.new(500)
+      expect(Ractor.shareable?(bs)).to eq true
+      warn, Warning[:experimental] = Warning[:experimental], false
+      begin
+        ractors = 3.times.map { Ractor.new(bs) { |b| (0...500).count { |i| !b.test_and_set(i) } } }
+      ensure
+        Warning[:experimental] = warn
+      end
+      expect(ractors.map(&:take).inject(:+)).to eq 500
+    end
+  end
+
+  it "checks its arguments" do
+    expect { BitTwiddle::AtomicBitset.new(0) }.to raise_error(ArgumentError)
+    bs = BitTwiddle::AtomicBitset.new(10)
+    expect { bs.test_and_set(10) }.to raise_error(IndexError)
+    expect { bs[-1] }.to raise_error(IndexError)
+    expect { BitTwiddle::AtomicBitset.allocate.count }.to raise_error(RuntimeError)
+  end
+end
@@ -0,0 +1,80 @@
+describe BitTwiddle::BitSlicedIndex do
+  it "finds rows by comparison" do
+    bsi = BitTwiddle::BitSlicedIndex.new([5, 1, 9, 5].pack("L*"))
+    expect(bsi.size).to eq 4
+    expect(bsi.bits).to eq 4
+    expect(bsi.lt(5).unpack1("b4")).to eq "0100"
+    expect(bsi.le(5).unpack1("b4")).to eq "1101"
+    expect(bsi.eq(5).unpack1("b4")).to eq "1001"
+    expect(bsi.gt(5).unpack1("b4")).to eq "0010"
+    expect(bsi.ge(5).unpack1("b4")).to eq "1011"
+    expect(bsi.between(2, 9).unpack1("b4")).to eq "1011"
+    expect(bsi.between(9, 2).unpack1("b4")).to eq "0000"
+    expect(bsi.gt(1000).unpack1("b4")).to eq "0000"
+    expect(bsi.lt(1000).unpack1("b4")).to eq "1111"
+    expect(bsi.sum).to eq 20
+    expect(bsi.sum(bsi.eq(5))).to eq 10
+    expect(bsi[2]).to eq 9
+    expect(bsi[-1]).to eq 5
+  end
+
+  [32, 64].each do |width|
+    it "matches a reference on random #{width}-bit columns" do
+      rng = Random.new(48 + width)
+      [1, 63, 64, 65, 3000, 70_000].each do |n|
+        values = Array.new(n) do
+          case rng.rand(4)
+          when 0 then rng.rand(2**width)
+          when 1 then rng.rand(100)
+          when 2 then 2**width - 1
+          else rng.rand(2**rng.rand(1..width))
+          end
+        end
+        bsi = BitTwiddle::BitSlicedIndex.new(values.pack(width == 32 ? "L*" : "Q*"), width)
+        expect(bsi.sum).to eq values.inject(:+)
+        expect(bsi[n - 1]).to eq values[-1]
+        [0, 50, 2**width - 1, values.sample(random: rng), rng.rand(2**width)].each do |c|
+          { lt: :<, le: :<=, eq: :==, gt: :>, ge: :>= }.each do |method, op|
+            expected = values.map { |v| v.send(op, c) ? "1" : "0" }.join
+            expect(bsi.send(method, c).unpack1("b*")[0, n]).to eq expected
+          end
+          expect(bsi.sum(bsi.lt(c))).to eq values.select { |v| v < c }.inject(0, :+)
+        end
+      end
+    end
+  end
+
+  it "keeps unused bits of results clear" do
+    bsi = BitTwiddle::BitSlicedIndex.new([0, 0, 0].pack("Q*"), 64)
+    expect(bsi.bits).to eq 0
+    expect(bsi.ge(0)).to eq "\x07".b
+    expect(bsi.sum("\xFF".b)).to eq 0
+  end
+
+  it "handles an empty column" do
+    bsi = BitTwiddle::BitSlicedIndex.new("")
+    expect(bsi.size).to eq 0
+    expect(bsi.eq(0)).to eq ""
+    expect(bsi.sum).to eq 0
+    expect { bsi[0] }.to raise_error(IndexError)
+  end
+
+  it "copies" do
+    bsi = BitTwiddle::BitSlicedIndex.new([3, 4].pack("L*"))
+    expect(bsi.dup.sum).to eq 7
+    other = BitTwiddle::BitSlicedIndex.new([1].pack("L*"))
+    expect { bsi.send(:initialize_copy, other) }.to raise_error(RuntimeError)
+    expect { bsi.freeze.send(:initialize_copy, other) }.to raise_error(RuntimeError)
+    expect(bsi.sum).to eq 7
+  end
+
+  it "rejects bad arguments" do
+    expect { BitTwiddle::BitSlicedIndex.new("abc") }.to raise_error(ArgumentError)
+    expect { BitTwiddle::BitSlicedIndex.new("", 16) }.to raise_error(ArgumentError)
+    bsi = BitTwiddle::BitSlicedIndex.new([1, 2].pack("L*"))
+    expect { bsi.lt(2**64) }.to raise_error(RangeError)
+    expect { bsi.sum("\x00\x00") }.to raise_error(ArgumentError)
+    expect { bsi.send(:initialize, "") }.to raise_error(RuntimeError)
+    expect { BitTwiddle::BitSlicedIndex.allocate.sum }.to raise_error(RuntimeError)
+  end
+end
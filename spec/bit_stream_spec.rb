@@ -0,0 +1,162 @@
+describe BitTwiddle::BitWriter do
+  it "writes bits MSB-first by default" do
+    w = BitTwiddle::BitWriter.new
+    w.write(5, 3).write(1, 5).write(0xABC, 12)
+    expect(w.order).to eq :msb
+    expect(w.pos).to eq 20
+    expect(w.bytesize).to eq 3
+    expect(w.to_s).to eq "\xA1\xAB\xC0".b
+  end
+
+  it "writes bits LSB-first" do
+    w = BitTwiddle::BitWriter.new(:lsb)
+    w.write(5, 3).write(1, 5).write(0xABC, 12)
+    expect(w.to_s).to eq "\x0D\xBC\x0A".b
+  end
+
+  it "rejects values which don't fit" do
+    w = BitTwiddle::BitWriter.new
+    expect { w.write(8, 3) }.to raise_error(RangeError)
+    expect { w.write(-1, 8) }.to raise_error(RangeError)
+    expect { w.write(1, 65) }.to raise_error(ArgumentError)
+    expect { w.write_bit(2) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::BitWriter.new(:middle) }.to raise_error(ArgumentError)
+  end
+
+  it "can keep writing after #to_s" do
+    w = BitTwiddle::BitWriter.new
+    w.write(1, 1)
+    expect(w.to_s).to eq "\x80".b
+    w.write(1, 1)
+    expect(w.to_s).to eq "\xC0".b
+  end
+
+  it "can't be written to when frozen" do
+    w = BitTwiddle::BitWriter.new.write(1, 1).freeze
+    expect { w.write(1, 1) }.to raise_error(RuntimeError)
+    expect { w.write_bit(1) }.to raise_error(RuntimeError)
+    expect { w.write_unary(1) }.to raise_error(RuntimeError)
+    expect { w.write_rice(1, 1) }.to raise_error(RuntimeError)
+    expect { w.write_golomb(1, 3) }.to raise_error(RuntimeError)
+    expect { w.write_bytes("a") }.to raise_error(RuntimeError)
+    expect { w.align }.to raise_error(RuntimeError)
+    expect(w.to_s).to eq "\x80".b
+  end
+
+  it "rejects unary codes which are far too long" do
+    w = BitTwiddle::BitWriter.new
+    expect { w.write_unary(2**40) }.to raise_error(RangeError)
+    expect { w.write_rice(2**62, 0) }.to raise_error(RangeError)
+    expect { w.write_golomb(2**50, 3) }.to raise_error(RangeError)
+    expect(w.pos).to eq 0
+  end
+
+  it "can be copied" do
+    w = BitTwiddle::BitWriter.new.write(3, 2)
+    copy = w.dup.write(3, 2)
+    expect(w.to_s).to eq "\xC0".b
+    expect(copy.to_s).to eq "\xF0".b
+  end
+end
+
+describe BitTwiddle::BitReader do
+  [:msb, :lsb].each do |order|
+    it "reads back random fields of 0 to 64 bits in #{order} order" do
+      rng = Random.new(34)
+      fields = Array.new(3000) { n = rng.rand(65); [rng.rand(1 << n), n] }
+      w = BitTwiddle::BitWriter.new(order)
+      fields.each { |v, n| w.write(v, n) }
+      expect(w.pos).to eq fields.sum { |_, n| n }
+
+      r = BitTwiddle::BitReader.new(w.to_s, order)
+      fields.each do |v, n|
+        expect(r.peek(n)).to eq v
+        expect(r.read(n)).to eq v
+      end
+      expect(r.bits_left).to be < 8
+    end
+
+    it "reads back unary, Rice and Golomb codes in #{order} order" do
+      rng = Random.new(35)
+      codes = Array.new(2000) do
+        case rng.rand(4)
+        when 0 then [:unary, rng.rand(200)]
+        when 1 then [:rice, rng.rand(1 << 20), rng.rand(12..20)]
+        when 2 then [:golomb, rng.rand(10_000), rng.rand(1..1000)]
+        else        [:bit, rng.rand(2)]
+        end
+      end
+      codes += [[:rice, (1 << 64) - 1, 64], [:rice, 0, 0], [:golomb, 5, 1], [:golomb, (1 << 64) - 1, (1 << 64) - 1], [:unary, 64], [:unary, 128]]
+      w = BitTwiddle::BitWriter.new(order)
+      codes.each { |type, v, k| k ? w.send("write_#{type}", v, k) : w.send("write_#{type}", v) }
+
+      r = BitTwiddle::BitReader.new(w.to_s, order)
+      codes.each do |type, v, k|
+        expect(k ? r.send("read_#{type}", k) : r.send("read_#{type}")).to eq v
+      end
+    end
+
+    it "reads and writes aligned bytes in #{order} order" do
+      w = BitTwiddle::BitWriter.new(order)
+      w.write(1, 3).write_bytes("hello, world!").write(1, 1).align.write(0xFF, 8)
+      expect(w.pos).to eq 8 * 16
+
+      r = BitTwiddle::BitReader.new(w.to_s, order)
+      expect(r.read(3)).to eq 1
+      expect(r.read_bytes(13)).to eq "hello, world!"
+      expect(r.read(1)).to eq 1
+      expect(r.align.pos).to eq 8 * 15
+      expect(r.read(8)).to eq 0xFF
+      expect(r.eof?).to eq true
+    end
+  end
+
+  it "reads back Rice codes with k = 0" do
+    [:msb, :lsb].each do |order|
+      values = [0, 1, 2, 7, 100, 63, 64, 65]
+      w = BitTwiddle::BitWriter.new(order)
+      values.each { |v| w.write_rice(v, 0) }
+      r = BitTwiddle::BitReader.new(w.to_s, order)
+      expect(values.map { r.read_rice(0) }).to eq values
+    end
+  end
+
+  it "uses the shorter truncated binary code for small Golomb remainders" do
+    w = BitTwiddle::BitWriter.new
+    w.write_golomb(0, 5) # 0, then 00
+    w.write_golomb(4, 5) # 0, then 111
+    expect(w.pos).to eq 7
+  end
+
+  it "peeks, skips and seeks" do
+    r = BitTwiddle::BitReader.new("\xF0\x0F".b)
+    expect(r.bit_size).to eq 16
+    expect(r.peek(8)).to eq 0xF0
+    expect(r.skip(4).read(8)).to eq 0x00
+    expect(r.peek(16)).to eq 0xF000 # zero-padded past the end
+    expect(r.read_bit).to eq 1
+    r.pos = 2
+    expect(r.read(4)).to eq 0xC
+    expect { r.pos = 17 }.to raise_error(ArgumentError)
+  end
+
+  it "raises EOFError when reading past the end" do
+    r = BitTwiddle::BitReader.new("\xFF".b)
+    expect { r.read(9) }.to raise_error(EOFError)
+    expect { r.read_unary }.to raise_error(EOFError)
+    expect(r.pos).to eq 0
+    expect { r.skip(9) }.to raise_error(EOFError)
+    expect { r.read_bytes(2) }.to raise_error(EOFError)
+    r.read(8)
+    expect { r.read_bit }.to raise_error(EOFError)
+    expect(r.read(0)).to eq 0
+  end
+
+  it "does not see later changes to the String" do
+    str = "\x01".b
+    r = BitTwiddle::BitReader.new(str)
+    str.replace("\x02")
+    expect(r.read(8)).to eq 1
+    expect(r.dup.pos).to eq 8
+  end
+end
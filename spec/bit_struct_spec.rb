@@ -0,0 +1,74 @@
+describe BitTwiddle::BitStruct do
+  let(:header) { BitTwiddle::BitStruct.new(version: 3, length: 13, id: 48) }
+  let(:packet) { "\x40\x2A\x00\x00\x00\x00\x01\x00".b }
+
+  it "describes its layout" do
+    expect(header.members).to eq [:version, :length, :id]
+    expect(header.fields).to eq(version: 3, length: 13, id: 48)
+    expect(header.bit_size).to eq 64
+    expect(header.bytesize).to eq 8
+    expect(BitTwiddle::BitStruct.new(a: 1, b: 8).bytesize).to eq 2
+  end
+
+  it "decodes and encodes single records" do
+    expect(header.decode(packet)).to eq(version: 2, length: 42, id: 256)
+    expect(header.decode_values(packet)).to eq [2, 42, 256]
+    expect(header.encode(version: 2, length: 42, id: 256)).to eq packet
+    expect(header.encode([2, 42, 256])).to eq packet
+    expect(header.encode(Struct.new(:a, :b, :c).new(2, 42, 256))).to eq packet
+    expect(header.encode(length: 42)).to eq "\x00\x2A\x00\x00\x00\x00\x00\x00".b
+  end
+
+  it "decodes records at an offset" do
+    str = "xyz".b + packet + packet
+    expect(header.decode(str, 3)).to eq(version: 2, length: 42, id: 256)
+    expect(header.decode(str, -8)).to eq(version: 2, length: 42, id: 256)
+    expect { header.decode(str, 12) }.to raise_error(IndexError)
+    expect { header.decode("short") }.to raise_error(IndexError)
+  end
+
+  it "round-trips random layouts and values, agreeing with a BitWriter" do
+    rng = Random.new(36)
+    20.times do
+      widths = Array.new(rng.rand(1..12)) { rng.rand(1..64) }
+      layout = widths.each_with_index.map { |w, i| [:"f#{i}", w] }.to_h
+      bs     = BitTwiddle::BitStruct.new(**layout)
+      values = widths.map { |w| rng.rand(1 << w) }
+
+      writer = BitTwiddle::BitWriter.new
+      values.zip(widths) { |v, w| writer.write(v, w) }
+      expect(bs.encode(values)).to eq writer.to_s
+      expect(bs.decode_values(bs.encode(values))).to eq values
+    end
+  end
+
+  it "decodes and encodes buffers of records in bulk" do
+    rng = Random.new(37)
+    bs = BitTwiddle::BitStruct.new(a: 5, b: 64, c: 1, d: 17)
+    records = Array.new(100) { { a: rng.rand(32), b: rng.rand(1 << 64), c: rng.rand(2), d: rng.rand(1 << 17) } }
+    buffer = bs.encode_all(records)
+    expect(buffer.bytesize).to eq 100 * 11
+    expect(buffer).to eq records.map { |r| bs.encode(r) }.join
+    expect(bs.decode_all(buffer)).to eq records
+
+    cols = bs.decode_columns(buffer)
+    expect(cols.keys).to eq [:a, :b, :c, :d]
+    cols.each { |name, col| expect(col.unpack('Q*')).to eq records.map { |r| r[name] } }
+    expect(bs.encode_columns(cols)).to eq buffer
+    expect(bs.encode_columns(b: cols[:b])).to eq bs.encode_all(records.map { |r| { b: r[:b] } })
+  end
+
+  it "rejects bad layouts and values" do
+    expect { BitTwiddle::BitStruct.new }.to raise_error(ArgumentError)
+    expect { BitTwiddle::BitStruct.new(a: 0) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::BitStruct.new(a: 65) }.to raise_error(ArgumentError)
+    expect { header.encode(version: 8) }.to raise_error(RangeError)
+    expect { header.encode([1, 2, 3, 4]) }.to raise_error(ArgumentError)
+    expect { header.encode(version: 1, lenght: 2) }.to raise_error(ArgumentError, /lenght/)
+    expect { header.encode("version" => 1) }.to raise_error(ArgumentError)
+    expect { header.encode_all([{ id: 1 }, { ids: 1 }]) }.to raise_error(ArgumentError)
+    expect { header.decode_all("x" * 9) }.to raise_error(ArgumentError)
+    expect { header.encode_columns(version: [8].pack('Q')) }.to raise_error(RangeError)
+    expect { header.encode_columns(version: [1].pack('Q'), id: [1, 2].pack('Q*')) }.to raise_error(ArgumentError)
+  end
+end
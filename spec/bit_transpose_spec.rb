@@ -0,0 +1,98 @@
+describe "Bit matrix transposition" do
+  def reference_bitshuffle(buf, size)
+    n = buf.bytesize / size / 8 * 8
+    bits = Array.new(size * 8) { [] }
+    n.times do |i|
+      size.times do |k|
+        byte = buf.getbyte(i * size + k)
+        8.times { |b| bits[8 * k + b] << byte[b] }
+      end
+    end
+    out = bits.map { |row| row.each_slice(8).map { |s| s.each_with_index.sum { |bit, j| bit << j } }.pack("C*") }.join
+    out + buf.byteslice(n * size, buf.bytesize - n * size)
+  end
+
+  def random_bytes(rng, len)
+    Array.new(len) { rng.rand(256) }.pack("C*")
+  end
+
+  describe "BitTwiddle.transpose8x8" do
+    it "transposes an Integer as an 8x8 matrix" do
+      expect(BitTwiddle.transpose8x8(0xFF)).to eq 0x0101010101010101
+      expect(BitTwiddle.transpose8x8(0x0101010101010101)).to eq 0xFF
+      expect(BitTwiddle.transpose8x8(0x8040201008040201)).to eq 0x8040201008040201
+      expect(BitTwiddle.transpose8x8(0)).to eq 0
+    end
+
+    it "moves bit 8i+j to bit 8j+i" do
+      rng = Random.new(39)
+      50.times do
+        x = rng.rand(1 << 64)
+        expected = (0...64).sum { |n| x[n] << (8 * (n % 8) + n / 8) }
+        expect(BitTwiddle.transpose8x8(x)).to eq expected
+        expect(BitTwiddle.transpose8x8(BitTwiddle.transpose8x8(x))).to eq x
+      end
+    end
+
+    it "transposes each 8 bytes of a String" do
+      rng = Random.new(139)
+      xs = Array.new(9) { rng.rand(1 << 64) }
+      result = BitTwiddle.transpose8x8(xs.pack("Q<*"))
+      expect(result.unpack("Q<*")).to eq(xs.map { |x| BitTwiddle.transpose8x8(x) })
+    end
+
+    it "rejects bad arguments" do
+      expect { BitTwiddle.transpose8x8("1234567") }.to raise_error(ArgumentError)
+      expect { BitTwiddle.transpose8x8(-1) }.to raise_error(RangeError)
+      expect { BitTwiddle.transpose8x8(1 << 64) }.to raise_error(RangeError)
+    end
+  end
+
+  describe "BitTwiddle.transpose64x64" do
+    it "swaps rows and columns" do
+      rng = Random.new(239)
+      rows = Array.new(128) { rng.rand(1 << 64) }
+      result = BitTwiddle.transpose64x64(rows.pack("Q*")).unpack("Q*")
+      rows.each_slice(64).with_index do |m, blk|
+        expected = (0...64).map { |j| (0...64).sum { |i| m[i][j] << i } }
+        expect(result[blk * 64, 64]).to eq expected
+      end
+    end
+
+    it "transposes the anti-diagonal to itself" do
+      rows = Array.new(64) { |i| 1 << (63 - i) }
+      expect(BitTwiddle.transpose64x64(rows.pack("Q*")).unpack("Q*")).to eq rows
+    end
+
+    it "rejects buffers which aren't a multiple of 512 bytes" do
+      expect { BitTwiddle.transpose64x64("\0" * 511) }.to raise_error(ArgumentError)
+      expect(BitTwiddle.transpose64x64("")).to eq ""
+    end
+  end
+
+  describe "BitTwiddle.bitshuffle" do
+    it "groups bits by position" do
+      shuffled = BitTwiddle.bitshuffle([1, 2, 3, 4, 5, 6, 7, 8].pack("L*"), 4)
+      expect(shuffled.unpack("C*").first(3)).to eq [85, 102, 120]
+      expect(shuffled.unpack("C*").drop(4)).to eq [0] * 28
+    end
+
+    it "matches a reference implementation and round trips" do
+      rng = Random.new(339)
+      [1, 2, 3, 4, 8, 16].each do |size|
+        [0, 1, 7, 8, 15, 16, 24, 32, 40, 128, 136, 1000].each do |n|
+          buf = random_bytes(rng, n * size)
+          shuffled = BitTwiddle.bitshuffle(buf, size)
+          expect(shuffled).to eq reference_bitshuffle(buf, size)
+          expect(BitTwiddle.bitunshuffle(shuffled, size)).to eq buf
+        end
+      end
+    end
+
+    it "rejects bad element sizes" do
+      expect { BitTwiddle.bitshuffle("abc", 2) }.to raise_error(ArgumentError)
+      expect { BitTwiddle.bitshuffle("abc", 0) }.to raise_error(ArgumentError)
+      expect { BitTwiddle.bitunshuffle("abcd", -4) }.to raise_error(ArgumentError)
+    end
+  end
+end
@@ -0,0 +1,127 @@
+describe BitTwiddle::BloomFilter do
+  it "has no false negatives" do
+    bf = BitTwiddle::BloomFilter.new(1000)
+    keys = (0...1000).map { |i| "key#{i}" }
+    keys.each { |k| bf << k }
+    expect(keys.all? { |k| bf.include?(k) }).to eq true
+    expect(bf.count).to eq 1000
+  end
+
+  it "accepts Integers, including negative ones" do
+    bf = BitTwiddle::BloomFilter.new(100)
+    bf.add(0).add(-1).add(2**64 - 2)
+    expect(bf.include?(0)).to eq true
+    expect(bf.include?(-1)).to eq true
+    expect(bf.include?(2**64 - 1)).to eq true
+    expect(bf.include?(2**64 - 2)).to eq true
+    expect { bf.add(2**64) }.to raise_error(RangeError)
+  end
+
+  it "has about the requested false positive rate" do
+    [0.1, 0.01].each do |rate|
+      bf = BitTwiddle::BloomFilter.new(5000, rate)
+      bf.add_all((0...5000).to_a)
+      found = bf.include_all((5000...105000).to_a).count(true)
+      expect(found).to be < 100000 * rate * 1.3
+      expect(found).to be > 100000 * rate * 0.7
+    end
+  end
+
+  it "sizes itself from the capacity and rate" do
+    expect(BitTwiddle::BloomFilter.new(0).bit_size).to eq 256
+    small = BitTwiddle::BloomFilter.new(1000, 0.01).bit_size
+    expect(small % 256).to eq 0
+    expect(small).to be_between(8000, 14000)
+    expect(BitTwiddle::BloomFilter.new(1000, 0.001).bit_size).to be > small
+  end
+
+  it "does bulk operations which agree with single ones" do
+    bf = BitTwiddle::BloomFilter.new(200)
+    one = BitTwiddle::BloomFilter.new(200)
+    keys = (0...150).map { |i| i.even? ? i * 7 : "s#{i}" }
+    expect(bf.add_all(keys).equal?(bf)).to eq true
+    keys.each { |k| one.add(k) }
+    expect(bf.to_s).to eq one.to_s
+    probes = keys + (0...150).map { |i| "t#{i}" }
+    expect(bf.include_all(probes)).to eq probes.map { |k| one.include?(k) }
+    expect(bf.include_all([])).to eq []
+  end
+
+  it "combines filters of the same size" do
+    a = BitTwiddle::BloomFilter.new(100).add_all(%w(a b c))
+    b = BitTwiddle::BloomFilter.new(100).add_all(%w(c d))
+    both = BitTwiddle::BloomFilter.new(100).add_all(%w(a b c d))
+    expect((a | b).to_s[32..-1]).to eq both.to_s[32..-1]
+    expect((a | b).count).to eq 5
+    expect((a & b).include?("c")).to eq true
+    expect((a & b).include_all(%w(a b d))).to eq [false, false, false]
+    expect(a.include?("d")).to eq false
+    a.merge!(b)
+    expect(a.include_all(%w(a b c d))).to eq [true] * 4
+    expect(a.count).to eq 5
+    expect { a | BitTwiddle::BloomFilter.new(10000) }.to raise_error(ArgumentError)
+  end
+
+  it "round trips through a String" do
+    bf = BitTwiddle::BloomFilter.new(300).add_all((0...300).map(&:to_s))
+    str = bf.to_s
+    expect(str.bytesize).to eq 32 + bf.bit_size / 8
+    expect(str[0, 8]).to eq "BTBLOOM\x01".b
+    copy = BitTwiddle::BloomFilter.load(str)
+    expect(copy.count).to eq 300
+    expect(copy.to_s).to eq str
+    expect(copy.include?("299")).to eq true
+    expect { BitTwiddle::BloomFilter.load(str[0...-1]) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::BloomFilter.load("x" * 64) }.to raise_error(ArgumentError)
+  end
+
+  it "reports how full it is, and can be cleared or copied" do
+    bf = BitTwiddle::BloomFilter.new(100)
+    expect(bf.fill_ratio).to eq 0.0
+    bf.add("x")
+    expect(bf.fill_ratio).to eq 8.0 / bf.bit_size
+    copy = bf.dup
+    bf.clear
+    expect(bf.include?("x")).to eq false
+    expect(bf.count).to eq 0
+    expect(copy.include?("x")).to eq true
+  end
+
+  it "checks its arguments" do
+    expect { BitTwiddle::BloomFilter.new(-1) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::BloomFilter.new(10, 0) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::BloomFilter.new(10, 1.5) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::BloomFilter.new(10).add(:sym) }.to raise_error(TypeError)
+    expect { BitTwiddle::BloomFilter.allocate.include?("a") }.to raise_error(RuntimeError)
+  end
+
+  it "can't be changed when frozen" do
+    bf = BitTwiddle::BloomFilter.new(100)
+    bf.add("x")
+    bf.freeze
+    expect { bf.add("y") }.to raise_error(RuntimeError)
+    expect { bf << "y" }.to raise_error(RuntimeError)
+    expect { bf.add_all(["y"]) }.to raise_error(RuntimeError)
+    expect { bf.merge!(BitTwiddle::BloomFilter.new(100)) }.to raise_error(RuntimeError)
+    expect { bf.clear }.to raise_error(RuntimeError)
+    expect(bf.include?("x")).to eq true
+    expect(bf.count).to eq 1
+  end
+
+  it "hashes every key before adding any" do
+    bf = BitTwiddle::BloomFilter.new(100)
+    keys = ["a", "b"]
+    shrink = Object.new
+    shrink.define_singleton_method(:to_str) { keys.clear; "c" }
+    keys.push(shrink, *(1..40).map(&:to_s))
+    expect { bf.add_all(keys) }.not_to raise_error
+    expect(bf.include?("a")).to eq true
+    expect(bf.include?("c")).to eq true
+    expect(bf.count).to eq 3
+
+    bf.clear
+    expect { bf.add_all(["a", :sym]) }.to raise_error(TypeError)
+    expect(bf.count).to eq 0
+    expect(bf.include?("a")).to eq false
+  end
+end
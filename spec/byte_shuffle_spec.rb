@@ -0,0 +1,60 @@
+describe "Byte shuffling" do
+  def reference_shuffle(buf, size)
+    bytes = buf.bytes
+    n = bytes.size / size
+    (0...size).flat_map { |k| (0...n).map { |i| bytes[i * size + k] } }.pack("C*")
+  end
+
+  def random_bytes(rng, len)
+    Array.new(len) { rng.rand(256) }.pack("C*")
+  end
+
+  describe "BitTwiddle.byte_shuffle" do
+    it "splits elements into byte planes" do
+      expect(BitTwiddle.byte_shuffle([1, 2, 3].pack("S>*"), 2)).to eq "\x00\x00\x00\x01\x02\x03".b
+      expect(BitTwiddle.byte_shuffle("abcdef", 3)).to eq "adbecf"
+      expect(BitTwiddle.byte_shuffle("", 4)).to eq ""
+    end
+
+    it "matches a reference implementation and round trips" do
+      rng = Random.new(40)
+      [1, 2, 3, 4, 5, 8, 12, 16, 32].each do |size|
+        [0, 1, 15, 16, 17, 31, 32, 100, 257].each do |n|
+          buf = random_bytes(rng, n * size)
+          shuffled = BitTwiddle.byte_shuffle(buf, size)
+          expect(shuffled).to eq reference_shuffle(buf, size)
+          expect(BitTwiddle.byte_unshuffle(shuffled, size)).to eq buf
+        end
+      end
+    end
+
+    it "writes into a destination String" do
+      buf = [1.0, 2.0, 3.0].pack("d*")
+      out = "leftover contents which are longer than needed".b
+      expect(BitTwiddle.byte_shuffle(buf, 8, into: out).equal?(out)).to eq true
+      expect(out).to eq reference_shuffle(buf, 8)
+      back = String.new
+      BitTwiddle.byte_unshuffle(out, 8, into: back)
+      expect(back).to eq buf
+    end
+
+    it "works in place" do
+      rng = Random.new(140)
+      buf = random_bytes(rng, 800)
+      copy = buf.dup
+      expect(BitTwiddle.byte_shuffle!(copy, 4).equal?(copy)).to eq true
+      expect(copy).to eq reference_shuffle(buf, 4)
+      BitTwiddle.byte_unshuffle(copy, 4, into: copy)
+      expect(copy).to eq buf
+      BitTwiddle.byte_shuffle(copy, 8, into: copy)
+      BitTwiddle.byte_unshuffle!(copy, 8)
+      expect(copy).to eq buf
+    end
+
+    it "rejects bad arguments" do
+      expect { BitTwiddle.byte_shuffle("abc", 2) }.to raise_error(ArgumentError)
+      expect { BitTwiddle.byte_shuffle("abc", 0) }.to raise_error(ArgumentError)
+      expect { BitTwiddle.byte_unshuffle!("abcd".freeze, 2) }.to raise_error(RuntimeError)
+    end
+  end
+end
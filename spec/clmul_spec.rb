@@ -0,0 +1,122 @@
+# Slow but obviously correct reference implementations
+def ref_clmul(a, b)
+  result = 0
+  0.upto(b.bit_length) { |i| result ^= (a << i) if b[i] == 1 }
+  result
+end
+
+def ref_polymod(x, modulus)
+  degree = modulus.bit_length - 1
+  while x.bit_length > degree
+    x ^= modulus << (x.bit_length - 1 - degree)
+  end
+  x
+end
+
+GF64_MODULUS  = (1 << 64)  | 0x1B
+GF128_MODULUS = (1 << 128) | 0x87
+
+describe "#clmul64" do
+  it "returns 0 if either operand is 0" do
+    expect(0.clmul64(12345)).to eq 0
+    expect(12345.clmul64(0)).to eq 0
+  end
+
+  it "combines partial products with XOR" do
+    expect(0b101.clmul64(0b11)).to eq 0b1111
+    expect(0b11.clmul64(0b11)).to eq 0b101
+  end
+
+  it "returns the full 128-bit product" do
+    expect((1 << 63).clmul64(1 << 63)).to eq 1 << 126
+    expect(MASK_64.clmul64(MASK_64)).to eq ref_clmul(MASK_64, MASK_64)
+  end
+
+  it "matches a bit-at-a-time implementation" do
+    rng = Random.new(27)
+    1000.times do
+      a, b = rng.rand(1 << 64), rng.rand(1 << 64)
+      expect(a.clmul64(b)).to eq ref_clmul(a, b)
+    end
+  end
+
+  it "ignores bits above the low 64" do
+    expect(((1 << 70) | 3).clmul64((1 << 65) | 3)).to eq 0b101
+  end
+
+  it "raises a RangeError for negative numbers" do
+    expect { -1.clmul64(1) }.to raise_error(RangeError)
+    expect { 1.clmul64(-1) }.to raise_error(RangeError)
+    expect { (-2**70).clmul64(1) }.to raise_error(RangeError)
+  end
+
+  it "is also available on the BitTwiddle module" do
+    expect(BitTwiddle.clmul64(0b101, 0b11)).to eq 0b1111
+  end
+end
+
+describe "BitTwiddle.gf64_mul" do
+  it "multiplies modulo x^64 + x^4 + x^3 + x + 1" do
+    expect(BitTwiddle.gf64_mul(1 << 63, 2)).to eq 0x1B
+    rng = Random.new(64)
+    500.times do
+      a, b = rng.rand(1 << 64), rng.rand(1 << 64)
+      expect(BitTwiddle.gf64_mul(a, b)).to eq ref_polymod(ref_clmul(a, b), GF64_MODULUS)
+    end
+  end
+
+  it "rejects numbers wider than 64 bits" do
+    expect { BitTwiddle.gf64_mul(1 << 64, 1) }.to raise_error(RangeError)
+  end
+end
+
+describe "BitTwiddle.gf64_reduce" do
+  it "reduces 128-bit polynomials" do
+    rng = Random.new(65)
+    500.times do
+      x = rng.rand(1 << 128)
+      expect(BitTwiddle.gf64_reduce(x)).to eq ref_polymod(x, GF64_MODULUS)
+    end
+  end
+
+  it "rejects numbers wider than 128 bits" do
+    expect { BitTwiddle.gf64_reduce(1 << 128) }.to raise_error(RangeError)
+    expect { BitTwiddle.gf64_reduce(-1) }.to raise_error(RangeError)
+  end
+end
+
+describe "BitTwiddle.gf128_mul" do
+  it "multiplies modulo x^128 + x^7 + x^2 + x + 1" do
+    expect(BitTwiddle.gf128_mul(1 << 127, 2)).to eq 0x87
+    rng = Random.new(128)
+    500.times do
+      a, b = rng.rand(1 << 128), rng.rand(1 << 128)
+      expect(BitTwiddle.gf128_mul(a, b)).to eq ref_polymod(ref_clmul(a, b), GF128_MODULUS)
+    end
+  end
+end
+
+describe "BitTwiddle.polyhash64" do
+  def ref_polyhash(str, key, seed = 0)
+    mul = lambda { |a, b| ref_polymod(ref_clmul(a, b), GF64_MODULUS) }
+    h = seed
+    padded = str + ("\0" * ((8 - str.bytesize % 8) % 8))
+    padded.unpack('Q<*').each { |word| h = mul[h ^ word, key] }
+    mul[h ^ str.bytesize, key]
+  end
+
+  it "evaluates the String as a polynomial in GF(2^64)" do
+    rng = Random.new(99)
+    [0, 1, 7, 8, 9, 31, 32, 33, 63, 64, 65, 200].each do |len|
+      str  = rng.bytes(len)
+      key  = rng.rand(1 << 64)
+      seed = rng.rand(1 << 64)
+      expect(BitTwiddle.polyhash64(str, key)).to eq ref_polyhash(str, key)
+      expect(BitTwiddle.polyhash64(str, key, seed)).to eq ref_polyhash(str, key, seed)
+    end
+  end
+
+  it "distinguishes Strings which differ only in trailing zero bytes" do
+    expect(BitTwiddle.polyhash64("a", 12345)).not_to eq BitTwiddle.polyhash64("a\0", 12345)
+  end
+end
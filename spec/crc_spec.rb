@@ -0,0 +1,129 @@
+require 'zlib'
+
+describe "BitTwiddle.crc32c" do
+  it "returns 0 for an empty String" do
+    expect(BitTwiddle.crc32c("")).to eq 0
+  end
+
+  it "returns the standard check value for '123456789'" do
+    expect(BitTwiddle.crc32c("123456789")).to eq 0xE3069283
+  end
+
+  it "matches a bit-at-a-time implementation on Strings of many lengths" do
+    slow = lambda do |str|
+      crc = 0xFFFFFFFF
+      str.each_byte do |b|
+        crc ^= b
+        8.times { crc = (crc & 1) == 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1 }
+      end
+      crc ^ 0xFFFFFFFF
+    end
+    rng = Random.new(42)
+    [0, 1, 7, 8, 15, 16, 17, 100, 767, 768, 769, 2000].each do |len|
+      str = rng.bytes(len)
+      expect(BitTwiddle.crc32c(str)).to eq slow[str]
+    end
+  end
+
+  it "gives the same result for long Strings whether checksummed in one piece or many" do
+    str = Random.new(1).bytes(100_000)
+    crc = 0
+    str.bytes.each_slice(333) { |piece| crc = BitTwiddle.crc32c(piece.pack('C*'), crc) }
+    expect(BitTwiddle.crc32c(str)).to eq crc
+    # unaligned start
+    expect(BitTwiddle.crc32c(str[3..-1], BitTwiddle.crc32c(str[0,3]))).to eq crc
+  end
+end
+
+describe "BitTwiddle.crc32c_combine" do
+  it "returns the checksum of two concatenated Strings" do
+    rng = Random.new(7)
+    [[0, 0], [1, 0], [0, 1], [5, 4], [100, 1000], [70_000, 3]].each do |len1, len2|
+      a, b = rng.bytes(len1), rng.bytes(len2)
+      crc = BitTwiddle.crc32c_combine(BitTwiddle.crc32c(a), BitTwiddle.crc32c(b), len2)
+      expect(crc).to eq BitTwiddle.crc32c(a + b)
+    end
+  end
+
+  it "raises ArgumentError for a negative length" do
+    expect { BitTwiddle.crc32c_combine(0, 0, -1) }.to raise_error(ArgumentError)
+  end
+end
+
+describe BitTwiddle::CRC do
+  # check values from the "Catalogue of parametrised CRC algorithms"
+  CATALOGUE = {
+    "CRC-8"            => [{ width: 8,  poly: 0x07 }, 0xF4],
+    "CRC-8/MAXIM"      => [{ width: 8,  poly: 0x31, refin: true }, 0xA1],
+    "CRC-12/UMTS"      => [{ width: 12, poly: 0x80F, refout: true }, 0xDAF],
+    "CRC-16/ARC"       => [{ width: 16, poly: 0x8005, refin: true }, 0xBB3D],
+    "CRC-16/CCITT"     => [{ width: 16, poly: 0x1021, init: 0xFFFF }, 0x29B1],
+    "CRC-24/OPENPGP"   => [{ width: 24, poly: 0x864CFB, init: 0xB704CE }, 0x21CF02],
+    "CRC-32"           => [{ width: 32, poly: 0x04C11DB7, init: 0xFFFFFFFF, refin: true, xorout: 0xFFFFFFFF }, 0xCBF43926],
+    "CRC-32/BZIP2"     => [{ width: 32, poly: 0x04C11DB7, init: 0xFFFFFFFF, xorout: 0xFFFFFFFF }, 0xFC891918],
+    "CRC-32C"          => [{ width: 32, poly: 0x1EDC6F41, init: 0xFFFFFFFF, refin: true, xorout: 0xFFFFFFFF }, 0xE3069283],
+    "CRC-40/GSM"       => [{ width: 40, poly: 0x0004820009, xorout: 0xFFFFFFFFFF }, 0xD4164FC646],
+    "CRC-64/ECMA-182"  => [{ width: 64, poly: 0x42F0E1EBA9EA3693 }, 0x6C40DF5F0B497347],
+    "CRC-64/XZ"        => [{ width: 64, poly: 0x42F0E1EBA9EA3693, init: (1 << 64) - 1, refin: true, xorout: (1 << 64) - 1 }, 0x995DC9BBDF1939FA],
+  }
+
+  CATALOGUE.each do |name, (params, check)|
+    it "computes #{name}" do
+      expect(BitTwiddle::CRC.new(**params).checksum("123456789")).to eq check
+    end
+
+    it "can resume and combine #{name} checksums" do
+      crc = BitTwiddle::CRC.new(**params)
+      str = Random.new(name.hash).bytes(1000)
+      expected = crc.checksum(str)
+      [0, 1, 15, 16, 17, 500, 999, 1000].each do |split|
+        a, b = str[0, split], str[split..-1]
+        expect(crc.checksum(b, crc.checksum(a))).to eq expected
+        expect(crc.combine(crc.checksum(a), crc.checksum(b), b.size)).to eq expected
+      end
+    end
+  end
+
+  it "agrees with Zlib.crc32" do
+    crc32 = BitTwiddle::CRC.new(**CATALOGUE["CRC-32"][0])
+    str = Random.new(3).bytes(12345)
+    expect(crc32.checksum(str)).to eq Zlib.crc32(str)
+  end
+
+  it "returns its width" do
+    expect(BitTwiddle::CRC.new(width: 24, poly: 0x864CFB).width).to eq 24
+  end
+
+  it "rejects widths outside 8-64 bits" do
+    expect { BitTwiddle::CRC.new(width: 7, poly: 1) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::CRC.new(width: 65, poly: 1) }.to raise_error(ArgumentError)
+  end
+
+  it "rejects a polynomial which is wider than the CRC" do
+    expect { BitTwiddle::CRC.new(width: 8, poly: 0x107) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::CRC.new(width: 8, poly: 7, init: -1) }.to raise_error(ArgumentError)
+  end
+
+  it "rejects a previous checksum which is wider than the CRC" do
+    crc16 = BitTwiddle::CRC.new(width: 16, poly: 0x1021, init: 0xFFFF)
+    expect { crc16.checksum("abc", 0x10000) }.to raise_error(ArgumentError)
+    expect { crc16.combine(0x10000, 0, 1) }.to raise_error(ArgumentError)
+    expect { crc16.checksum("abc", -1) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.crc32c("a", -1) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.crc32c("a", 2**32) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.crc32c_combine(-1, 0, 1) }.to raise_error(ArgumentError)
+    expect(crc16.checksum("abc", 0xFFFF)).to be_a(Integer)
+    crc64 = BitTwiddle::CRC.new(width: 64, poly: 0x42F0E1EBA9EA3693)
+    expect(crc64.checksum("abc", 2**64 - 1)).to be_a(Integer)
+  end
+
+  it "can be copied" do
+    crc32 = BitTwiddle::CRC.new(width: 32, poly: 0x04C11DB7, init: 0xFFFFFFFF,
+                                refin: true, xorout: 0xFFFFFFFF)
+    copy = crc32.dup
+    expect(copy.width).to eq 32
+    expect(copy.checksum("123456789")).to eq 0xCBF43926
+    expect { copy.send(:initialize_copy, BitTwiddle::CRC.new(width: 8, poly: 7)) }.to raise_error(RuntimeError)
+    expect { crc32.send(:initialize, width: 8, poly: 7) }.to raise_error(RuntimeError)
+  end
+end
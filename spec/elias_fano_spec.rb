@@ -0,0 +1,91 @@
+describe BitTwiddle::EliasFano do
+  def sorted_values(rng, n, max)
+    Array.new(n) { rng.rand(max + 1) }.sort
+  end
+
+  it "stores and retrieves sorted lists of many sizes and densities" do
+    rng = Random.new(30)
+    [[0, 10], [1, 0], [1, 1 << 40], [5, 5], [1000, 1000], [1000, 1 << 20], [3000, (1 << 64) - 1]].each do |n, max|
+      values = sorted_values(rng, n, max)
+      ef = BitTwiddle::EliasFano.new(values)
+      expect(ef.size).to eq n
+      expect(ef.to_a).to eq values
+      expect(ef.each.to_a).to eq values
+      values.each_with_index { |v, i| expect(ef[i]).to eq v }
+    end
+  end
+
+  it "handles long runs of duplicates and big gaps" do
+    values = [0] * 700 + [1 << 33] * 10 + [(1 << 33) + 1] + [1 << 50] * 600
+    ef = BitTwiddle::EliasFano.new(values)
+    expect(ef.to_a).to eq values
+    expect(ef[705]).to eq 1 << 33
+    expect(ef[-1]).to eq 1 << 50
+  end
+
+  it "returns nil for indices out of range, and counts negative indices from the end" do
+    ef = BitTwiddle::EliasFano.new([2, 3, 5])
+    expect(ef[-1]).to eq 5
+    expect(ef[-3]).to eq 2
+    expect(ef[3]).to be_nil
+    expect(ef[-4]).to be_nil
+  end
+
+  it "finds the next element >= x" do
+    rng = Random.new(31)
+    [[1, 100], [10, 1000], [2000, 100_000], [2000, 2000], [500, 1 << 60]].each do |n, max|
+      values = sorted_values(rng, n, max)
+      ef = BitTwiddle::EliasFano.new(values)
+      probes = Array.new(300) { rng.rand(max + 2) } + values.sample(50, random: rng) + [0, -5, max + 1, 1 << 70]
+      probes.each do |x|
+        expected = values.index { |v| v >= x }
+        expect(ef.index_geq(x)).to eq expected
+        expect(ef.next_geq(x)).to eq(expected && values[expected])
+      end
+    end
+  end
+
+  it "returns nil from next_geq for an empty list" do
+    ef = BitTwiddle::EliasFano.new([])
+    expect(ef.next_geq(0)).to be_nil
+    expect(ef.next_geq(-1)).to be_nil
+    expect(ef.index_geq(0)).to be_nil
+  end
+
+  it "rejects unsorted values" do
+    expect { BitTwiddle::EliasFano.new([1, 3, 2]) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::EliasFano.from_buffer([1, 3, 2].pack('L*')) }.to raise_error(ArgumentError)
+  end
+
+  it "rejects negative values and values which don't fit in 64 bits" do
+    expect { BitTwiddle::EliasFano.new([-1, 2]) }.to raise_error(RangeError)
+    expect { BitTwiddle::EliasFano.new([1, 1 << 64]) }.to raise_error(RangeError)
+  end
+
+  it "converts to and from buffers" do
+    rng = Random.new(32)
+    values = sorted_values(rng, 5000, 1 << 31)
+    ef = BitTwiddle::EliasFano.from_buffer(values.pack('L*'))
+    expect(ef.to_a).to eq values
+    expect(ef.to_buffer).to eq values.pack('L*')
+    expect(ef.to_buffer(64)).to eq values.pack('Q*')
+    expect(BitTwiddle::EliasFano.from_buffer(values.pack('Q*'), 64).to_a).to eq values
+  end
+
+  it "raises RangeError when the elements don't fit in a 32-bit buffer" do
+    ef = BitTwiddle::EliasFano.new([1, 1 << 32])
+    expect { ef.to_buffer(32) }.to raise_error(RangeError)
+  end
+
+  it "uses less than 2 + log2(max/size) bits per element, plus the select indexes" do
+    rng = Random.new(33)
+    n, max = 100_000, 1 << 32
+    ef = BitTwiddle::EliasFano.new(sorted_values(rng, n, max))
+    expect(ef.bytesize * 8.0 / n).to be < 2 + Math.log2(max / n) + 0.375
+  end
+
+  it "can be copied" do
+    ef = BitTwiddle::EliasFano.new([1, 2, 3])
+    expect(ef.dup.to_a).to eq [1, 2, 3]
+  end
+end
@@ -0,0 +1,61 @@
+describe "Float#to_bits" do
+  it "returns the IEEE 754 bit pattern" do
+    expect(1.0.to_bits).to eq 0x3FF0000000000000
+    expect(-0.0.to_bits).to eq 0x8000000000000000
+    expect(Float::INFINITY.to_bits).to eq 0x7FF0000000000000
+    expect(BitTwiddle.float_to_bits(-2.5)).to eq [-2.5].pack('G').unpack1('Q>')
+    expect(BitTwiddle.float_to_bits(1)).to eq 0x3FF0000000000000
+  end
+end
+
+describe "Float.from_bits" do
+  it "is the inverse of Float#to_bits" do
+    rng = Random.new(32)
+    1000.times do
+      f = [rng.rand(1 << 64)].pack('Q').unpack1('d')
+      next if f.nan?
+      expect(Float.from_bits(f.to_bits)).to eql f
+    end
+    expect(BitTwiddle.float_from_bits(0x3FF0000000000000)).to eq 1.0
+    expect(Float.from_bits(0x7FF8000000000000).nan?).to eq true
+  end
+
+  it "raises RangeError for negative numbers and numbers which don't fit in 64 bits" do
+    expect { Float.from_bits(-1) }.to raise_error(RangeError)
+    expect { Float.from_bits(1 << 64) }.to raise_error(RangeError)
+  end
+end
+
+describe "BitTwiddle.float_to_keys" do
+  SPECIAL = [-Float::INFINITY, -Float::MAX, -1.5, -Float::MIN, -5e-324, -0.0, 0.0, 5e-324, Float::MIN, 1.0, Float::MAX, Float::INFINITY]
+
+  it "produces keys which sort in the same order as the floats" do
+    rng = Random.new(33)
+    [[64, 'd*', 'Q*'], [32, 'f*', 'L*']].each do |width, ffmt, kfmt|
+      floats = (SPECIAL + Array.new(1000) { (rng.rand - 0.5) * 10 ** rng.rand(-30..30) }).pack(ffmt).unpack(ffmt)
+      keys = BitTwiddle.float_to_keys(floats.pack(ffmt), width).unpack(kfmt)
+      sorted = floats.each_with_index.sort_by { |f, i| [f, f.equal?(-0.0) || (f == 0 && 1 / f < 0) ? 0 : 1] }
+      expect(keys.each_with_index.sort.map(&:last).map { |i| floats[i] }).to eq sorted.map(&:first)
+    end
+  end
+
+  it "places NaNs at either end, depending on their sign" do
+    pos_nan = [0x7FF8000000000000].pack('Q').unpack1('d')
+    neg_nan = [0xFFF8000000000000].pack('Q').unpack1('d')
+    keys = BitTwiddle.float_to_keys([neg_nan, -Float::INFINITY, Float::INFINITY, pos_nan].pack('d*')).unpack('Q*')
+    expect(keys).to eq keys.sort
+  end
+
+  it "is inverted by keys_to_float" do
+    rng = Random.new(34)
+    [[64, 8], [32, 4]].each do |width, size|
+      buf = rng.bytes(size * 500)
+      expect(BitTwiddle.keys_to_float(BitTwiddle.float_to_keys(buf, width), width)).to eq buf
+    end
+  end
+
+  it "rejects widths other than 32 and 64, and partial elements" do
+    expect { BitTwiddle.float_to_keys('', 16) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.float_to_keys('abcd') }.to raise_error(ArgumentError)
+  end
+end
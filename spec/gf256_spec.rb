@@ -0,0 +1,155 @@
+describe "GF(2^8) arithmetic" do
+  def slow_mul(a, b)
+    r = 0
+    8.times do |i|
+      r ^= a << i if b[i] == 1
+    end
+    15.downto(8) { |i| r ^= 0x11D << (i - 8) if r[i] == 1 }
+    r
+  end
+
+  def random_bytes(rng, len)
+    Array.new(len) { rng.rand(256) }.pack("C*")
+  end
+
+  describe "BitTwiddle.gf256_mul" do
+    it "multiplies modulo 0x11D" do
+      expect(BitTwiddle.gf256_mul(2, 0x80)).to eq 29
+      expect(BitTwiddle.gf256_mul(0, 77)).to eq 0
+      expect(BitTwiddle.gf256_mul(1, 77)).to eq 77
+      rng = Random.new(41)
+      200.times do
+        a, b = rng.rand(256), rng.rand(256)
+        expect(BitTwiddle.gf256_mul(a, b)).to eq slow_mul(a, b)
+      end
+    end
+
+    it "rejects values which aren't field elements" do
+      expect { BitTwiddle.gf256_mul(256, 1) }.to raise_error(RangeError)
+      expect { BitTwiddle.gf256_mul(1, -1) }.to raise_error(RangeError)
+    end
+  end
+
+  describe "BitTwiddle.gf256_mul_add" do
+    it "XORs the product into dst" do
+      dst = "\x00\x01".b
+      expect(BitTwiddle.gf256_mul_add(dst, "\x02\x03".b, 2).equal?(dst)).to eq true
+      expect(dst).to eq "\x04\x07".b
+    end
+
+    it "matches scalar multiplication for every coefficient" do
+      rng = Random.new(141)
+      src = random_bytes(rng, 100)
+      dst = random_bytes(rng, 100)
+      256.times do |c|
+        expected = dst.bytes.zip(src.bytes).map { |d, s| d ^ slow_mul(c, s) }.pack("C*")
+        expect(BitTwiddle.gf256_mul_add(dst.dup, src, c)).to eq expected
+      end
+    end
+
+    it "rejects buffers of different lengths" do
+      expect { BitTwiddle.gf256_mul_add("ab", "abc", 1) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe "BitTwiddle.gf256_matrix_mul" do
+    it "multiplies a coefficient matrix by a column of buffers" do
+      p, q = BitTwiddle.gf256_matrix_mul([[1, 1], [1, 2]], ["\x01\x02".b, "\x03\x04".b])
+      expect(p).to eq "\x02\x06".b
+      expect(q).to eq "\x07\x0A".b
+    end
+
+    it "matches a reference on buffers longer than one slice" do
+      rng = Random.new(241)
+      inputs = Array.new(3) { random_bytes(rng, 5000) }
+      matrix = Array.new(4) { Array.new(3) { rng.rand(256) } }
+      result = BitTwiddle.gf256_matrix_mul(matrix, inputs)
+      matrix.each_with_index do |row, i|
+        expected = (0...5000).map { |b| row.each_with_index.inject(0) { |acc, (c, j)| acc ^ slow_mul(c, inputs[j].getbyte(b)) } }
+        expect(result[i].bytes).to eq expected
+      end
+    end
+
+    it "converts buffers with #to_str" do
+      buffer = Object.new
+      def buffer.to_str
+        "\x03\x04".b
+      end
+      expect(BitTwiddle.gf256_matrix_mul([[1, 1]], ["\x01\x02".b, buffer])).to eq ["\x02\x06".b]
+    end
+
+    it "rejects mismatched shapes" do
+      expect { BitTwiddle.gf256_matrix_mul([[1, 2, 3]], ["a", "b"]) }.to raise_error(ArgumentError)
+      expect { BitTwiddle.gf256_matrix_mul([[1, 2]], ["a", "bc"]) }.to raise_error(ArgumentError)
+      expect { BitTwiddle.gf256_matrix_mul([[1]], []) }.to raise_error(ArgumentError)
+    end
+  end
+end
+
+describe BitTwiddle::ReedSolomon do
+  def random_bytes(rng, len)
+    Array.new(len) { rng.rand(256) }.pack("C*")
+  end
+
+  it "makes systematic parity and verifies it" do
+    rs = BitTwiddle::ReedSolomon.new(4, 2)
+    expect(rs.data_shards).to eq 4
+    expect(rs.parity_shards).to eq 2
+    data = ["abcd", "efgh", "ijkl", "mnop"]
+    parity = rs.encode(data)
+    expect(parity.size).to eq 2
+    expect(parity.map(&:bytesize)).to eq [4, 4]
+    expect(rs.verify(data + parity)).to eq true
+    parity[1] = parity[1].dup.tap { |s| s.setbyte(0, s.getbyte(0) ^ 1) }
+    expect(rs.verify(data + parity)).to eq false
+  end
+
+  it "reconstructs any missing shards from any data_shards of them" do
+    rng = Random.new(341)
+    [[1, 1], [3, 2], [5, 3], [10, 4]].each do |k, m|
+      rs = BitTwiddle::ReedSolomon.new(k, m)
+      data = Array.new(k) { random_bytes(rng, 1000) }
+      shards = data + rs.encode(data)
+      20.times do
+        lost = (0...k + m).to_a.sample(rng.rand(m + 1), random: rng)
+        damaged = shards.each_with_index.map { |s, i| lost.include?(i) ? nil : s }
+        expect(rs.reconstruct(damaged)).to eq shards
+      end
+    end
+  end
+
+  it "raises if too many shards are missing" do
+    rs = BitTwiddle::ReedSolomon.new(2, 1)
+    shards = ["ab", "cd"] + rs.encode(["ab", "cd"])
+    expect { rs.reconstruct([nil, nil, shards[2]]) }.to raise_error(ArgumentError)
+  end
+
+  it "checks its arguments" do
+    expect { BitTwiddle::ReedSolomon.new(0, 2) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::ReedSolomon.new(200, 57) }.to raise_error(ArgumentError)
+    rs = BitTwiddle::ReedSolomon.new(2, 2)
+    expect { rs.encode(["a"]) }.to raise_error(ArgumentError)
+    expect { rs.encode(["a", "bc"]) }.to raise_error(ArgumentError)
+    expect(rs.encode(["", ""])).to eq ["", ""]
+  end
+
+  it "converts shards with #to_str" do
+    shard = Struct.new(:to_str)
+    rs = BitTwiddle::ReedSolomon.new(2, 1)
+    data = ["ab", "cd"]
+    parity = rs.encode(data)
+    expect(rs.encode([shard.new("ab"), shard.new("cd")])).to eq parity
+    expect(rs.verify([shard.new("ab"), "cd", shard.new(parity[0])])).to eq true
+    expect(rs.reconstruct([nil, shard.new("cd"), shard.new(parity[0])])).to eq data + parity
+  end
+
+  it "works with 256 shards in all" do
+    rs = BitTwiddle::ReedSolomon.new(200, 56)
+    rng = Random.new(441)
+    data = Array.new(200) { random_bytes(rng, 16) }
+    shards = data + rs.encode(data)
+    damaged = shards.dup
+    (0...56).each { |i| damaged[i * 4] = nil }
+    expect(rs.reconstruct(damaged)).to eq shards
+  end
+end
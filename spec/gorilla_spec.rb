@@ -0,0 +1,120 @@
+describe BitTwiddle::Gorilla do
+  it "starts out empty" do
+    series = BitTwiddle::Gorilla.new
+    expect(series.type).to eq :float
+    expect(series.size).to eq 0
+    expect(series.to_a).to eq []
+    expect(BitTwiddle::Gorilla.new(:integer).type).to eq :integer
+  end
+
+  it "rejects unknown series types" do
+    expect { BitTwiddle::Gorilla.new(:string) }.to raise_error(ArgumentError)
+  end
+
+  it "round-trips float series" do
+    rng = Random.new(31)
+    walk = 100.0
+    series = [
+      Array.new(2000) { walk += rng.rand(-1.0..1.0); walk.round(2) },
+      Array.new(2000) { rng.rand },
+      [0.0, -0.0, Float::INFINITY, -Float::INFINITY, Float::MAX, Float::MIN, 5e-324, 1.0, 1.0, 1.0],
+      [42.0] * 100,
+    ]
+    series.each do |values|
+      g = BitTwiddle::Gorilla.new(:float)
+      values.each { |v| g << v }
+      expect(g.size).to eq values.size
+      expect(g.to_a).to eq values
+      expect(g.to_buffer).to eq values.pack('d*')
+    end
+  end
+
+  it "round-trips NaN bit patterns" do
+    nans = ["\x00\x00\x00\x00\x00\x00\xF8\x7F", "\x01\x00\x00\x00\x00\x00\xF0\xFF"].map(&:b).join
+    g = BitTwiddle::Gorilla.new
+    g.append(nans)
+    expect(g.to_buffer).to eq nans
+  end
+
+  it "round-trips integer series, including extreme deltas" do
+    rng = Random.new(32)
+    t = 1_600_000_000
+    series = [
+      Array.new(2000) { t += 60 + [0, 0, 0, 1, -1, 100, -300, 3000].sample(random: rng) },
+      Array.new(2000) { rng.rand(-(1 << 63)...(1 << 63)) },
+      [-(1 << 63), (1 << 63) - 1, -(1 << 63), 0, 0, 0, (1 << 63) - 1],
+    ]
+    series.each do |values|
+      g = BitTwiddle::Gorilla.new(:integer)
+      g.append(values.pack('q*'))
+      expect(g.to_a).to eq values
+      expect(g.each.to_a).to eq values
+    end
+  end
+
+  it "compresses regular timestamps to about a bit per value" do
+    g = BitTwiddle::Gorilla.new(:integer)
+    g.append((0...10_000).map { |i| 1_600_000_000 + 60 * i }.pack('q*'))
+    expect(g.bytesize).to be < 10_000 / 8 + 20
+  end
+
+  it "converts Integers to Float in a float series" do
+    g = BitTwiddle::Gorilla.new
+    g << 1 << 2.5
+    expect(g.to_a).to eq [1.0, 2.5]
+  end
+
+  it "raises RangeError for integers which don't fit in 64 bits" do
+    expect { BitTwiddle::Gorilla.new(:integer) << (1 << 63) }.to raise_error(RangeError)
+  end
+
+  it "raises TypeError for non-Integers in an integer series" do
+    g = BitTwiddle::Gorilla.new(:integer)
+    expect { g << 1.9 }.to raise_error(TypeError)
+    expect { g << "1" }.to raise_error(TypeError)
+    expect(g.size).to eq 0
+  end
+
+  it "decodes block by block" do
+    values = Array.new(2500) { |i| Math.sin(i / 100.0) }
+    g = BitTwiddle::Gorilla.new
+    g.append(values.pack('d*'))
+    blocks = g.each_block(1000).to_a
+    expect(blocks.map(&:bytesize)).to eq [8000, 8000, 4000]
+    expect(blocks.join.unpack('d*')).to eq values
+    expect(g.each_block.to_a.join).to eq values.pack('d*')
+    expect { g.each_block(0) {} }.to raise_error(ArgumentError)
+  end
+
+  it "can be serialized, loaded, and appended to" do
+    [[:float, [1.5, 1.5, 2.25, -7.0]], [:integer, [10, 20, 30, 45, 45]]].each do |type, values|
+      g = BitTwiddle::Gorilla.new(type)
+      values.each { |v| g << v }
+      loaded = BitTwiddle::Gorilla.load(g.to_s)
+      expect(loaded.type).to eq type
+      expect(loaded.to_a).to eq values
+      loaded << values.first
+      g << values.first
+      expect(loaded.to_s).to eq g.to_s
+    end
+    expect(BitTwiddle::Gorilla.load(BitTwiddle::Gorilla.new.to_s).to_a).to eq []
+  end
+
+  it "rejects invalid serialized data" do
+    g = BitTwiddle::Gorilla.new
+    g.append([1.0, 2.0, 3.0].pack('d*'))
+    str = g.to_s
+    expect { BitTwiddle::Gorilla.load("X") }.to raise_error(ArgumentError)
+    expect { BitTwiddle::Gorilla.load(str[0..-2]) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::Gorilla.load(str + "\x00") }.to raise_error(ArgumentError)
+  end
+
+  it "can be copied" do
+    g = BitTwiddle::Gorilla.new
+    g << 1.0
+    copy = g.dup
+    copy << 2.0
+    expect(g.to_a).to eq [1.0]
+    expect(copy.to_a).to eq [1.0, 2.0]
+  end
+end
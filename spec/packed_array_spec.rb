@@ -0,0 +1,142 @@
+describe BitTwiddle::PackedArray do
+  it "starts out filled with zeroes" do
+    ary = BitTwiddle::PackedArray.new(7, 300)
+    expect(ary.size).to eq 300
+    expect(ary.bits).to eq 7
+    expect(ary.to_a).to eq [0] * 300
+  end
+
+  it "stores and retrieves values of every width from 1 to 64 bits" do
+    rng = Random.new(28)
+    1.upto(64) do |bits|
+      values = Array.new(1000) { rng.rand(1 << bits) }
+      ary = BitTwiddle::PackedArray.new(bits)
+      values.each { |v| ary << v }
+      expect(ary.size).to eq 1000
+      expect(ary.to_a).to eq values
+      # overwrite in random order, to check that neighbours are not disturbed
+      (0...1000).to_a.shuffle(random: rng).each do |i|
+        values[i] = rng.rand(1 << bits)
+        ary[i] = values[i]
+      end
+      values.each_with_index { |v, i| expect(ary[i]).to eq v }
+    end
+  end
+
+  it "supports negative indices" do
+    ary = BitTwiddle::PackedArray.new(4, 3)
+    ary[-1] = 9
+    expect(ary[2]).to eq 9
+    expect(ary[-1]).to eq 9
+    expect(ary[-4]).to be_nil
+    expect { ary[-4] = 1 }.to raise_error(IndexError)
+  end
+
+  it "returns nil for indices past the end" do
+    expect(BitTwiddle::PackedArray.new(4, 3)[3]).to be_nil
+  end
+
+  it "grows when assigning past the end" do
+    ary = BitTwiddle::PackedArray.new(10)
+    ary[500] = 1023
+    expect(ary.size).to eq 501
+    expect(ary[499]).to eq 0
+    expect(ary[500]).to eq 1023
+  end
+
+  it "raises a RangeError for values which don't fit" do
+    ary = BitTwiddle::PackedArray.new(5, 1)
+    expect { ary[0] = 32 }.to raise_error(RangeError)
+    expect { ary[0] = -1 }.to raise_error(RangeError)
+    expect { ary << (1 << 64) }.to raise_error(RangeError)
+  end
+
+  it "rejects widths outside 1-64 bits" do
+    expect { BitTwiddle::PackedArray.new(0) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::PackedArray.new(65) }.to raise_error(ArgumentError)
+  end
+
+  it "uses only the given number of bits per element" do
+    expect(BitTwiddle::PackedArray.new(5, 1 << 20).bytesize).to eq((5 << 20) / 8)
+  end
+
+  it "is Enumerable" do
+    ary = BitTwiddle::PackedArray.from_buffer([3, 1, 2].pack("L*"), 2)
+    expect(ary.each.to_a).to eq [3, 1, 2]
+    expect(ary.sort).to eq [1, 2, 3]
+    expect(ary.map { |x| x * 2 }).to eq [6, 2, 4]
+  end
+
+  it "can be duplicated" do
+    ary  = BitTwiddle::PackedArray.from_buffer([1, 2, 3].pack("L*"), 2)
+    copy = ary.dup
+    copy[0] = 0
+    expect(ary.to_a).to eq [1, 2, 3]
+    expect(copy.to_a).to eq [0, 2, 3]
+  end
+
+  it "can't be modified when frozen" do
+    ary = BitTwiddle::PackedArray.new(2, 1).freeze
+    expect { ary[0] = 1 }.to raise_error(FrozenError)
+    expect { ary << 1 }.to raise_error(FrozenError)
+  end
+
+  describe ".from_buffer and #to_buffer" do
+    it "convert to and from 32 and 64-bit buffers" do
+      rng = Random.new(29)
+      1.upto(64) do |bits|
+        [0, 1, 127, 128, 129, 1000].each do |n|
+          values = Array.new(n) { rng.rand(1 << bits) }
+          if bits <= 32
+            ary = BitTwiddle::PackedArray.from_buffer(values.pack("L*"), bits)
+            expect(ary.to_a).to eq values
+            expect(ary.to_buffer).to eq values.pack("L*")
+          end
+          ary = BitTwiddle::PackedArray.from_buffer(values.pack("Q*"), bits, 64)
+          expect(ary.to_a).to eq values
+          expect(ary.to_buffer(64)).to eq values.pack("Q*")
+        end
+      end
+    end
+
+    it "raise a RangeError if a value doesn't fit" do
+      expect { BitTwiddle::PackedArray.from_buffer([1, 2, 8].pack("L*"), 3) }.to raise_error(RangeError)
+      expect { BitTwiddle::PackedArray.from_buffer([1 << 40].pack("Q*"), 32, 64) }.to raise_error(RangeError)
+      expect { BitTwiddle::PackedArray.from_buffer(([1] * 200 + [16]).pack("L*"), 4) }.to raise_error(RangeError)
+    end
+
+    it "reject bad widths and lengths" do
+      expect { BitTwiddle::PackedArray.from_buffer("abc", 3) }.to raise_error(ArgumentError)
+      expect { BitTwiddle::PackedArray.from_buffer("abcd", 3, 16) }.to raise_error(ArgumentError)
+      expect { BitTwiddle::PackedArray.new(40, 1).to_buffer(32) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe "#sum" do
+    it "adds up all the elements" do
+      rng = Random.new(30)
+      [1, 7, 31, 32, 33, 64].each do |bits|
+        values = Array.new(777) { rng.rand(1 << bits) }
+        ary = BitTwiddle::PackedArray.from_buffer(values.pack("Q*"), bits, 64)
+        expect(ary.sum).to eq values.sum
+      end
+    end
+
+    it "accepts a block or initial value, like Enumerable#sum" do
+      ary = BitTwiddle::PackedArray.from_buffer([1, 2, 3].pack("L*"), 2)
+      expect(ary.sum(10)).to eq 16
+      expect(ary.sum { |x| x * x }).to eq 14
+    end
+  end
+
+  describe "#popcount" do
+    it "counts the 1 bits in all the elements" do
+      rng = Random.new(31)
+      [1, 5, 32, 40, 64].each do |bits|
+        values = Array.new(500) { rng.rand(1 << bits) }
+        ary = BitTwiddle::PackedArray.from_buffer(values.pack("Q*"), bits, 64)
+        expect(ary.popcount).to eq values.sum(&:popcount)
+      end
+    end
+  end
+end
@@ -0,0 +1,88 @@
+describe "BitTwiddle.compile" do
+  # reference implementation of each operation
+  def reference(op, arg, x, w)
+    mask = (1 << w) - 1
+    case op
+    when :xor          then x ^ (arg & mask)
+    when :and          then x & (arg & mask)
+    when :or           then x | (arg & mask)
+    when :add          then (x + arg) & mask
+    when :sub          then (x - arg) & mask
+    when :mul          then (x * arg) & mask
+    when :lshift       then (x << arg) & mask
+    when :rshift       then x >> arg
+    when :arith_rshift then (x[w - 1] == 1 ? x - (1 << w) : x) >> arg & mask
+    when :lrot         then r = arg % w; ((x << r) | (x >> (w - r))) & mask
+    when :rrot         then r = arg % w; ((x >> r) | (x << (w - r))) & mask
+    when :xor_lshift   then x ^ ((x << arg) & mask)
+    when :xor_rshift   then x ^ (x >> arg)
+    when :add_lshift   then (x + (x << arg)) & mask
+    when :not          then x ^ mask
+    when :neg          then -x & mask
+    when :bswap        then [x].pack({ 8 => 'C', 16 => 'S>', 32 => 'L>', 64 => 'Q>' }[w]).reverse.unpack1({ 8 => 'C', 16 => 'S>', 32 => 'L>', 64 => 'Q>' }[w])
+    when :bitreverse   then x.to_s(2).rjust(w, '0').reverse.to_i(2)
+    end
+  end
+
+  CONSTANT_OPS = [:xor, :and, :or, :add, :sub, :mul]
+  SHIFT_OPS    = [:lshift, :rshift, :arith_rshift, :lrot, :rrot, :xor_lshift, :xor_rshift, :add_lshift]
+  PLAIN_OPS    = [:not, :neg, :bswap, :bitreverse]
+
+  { 8 => 'C*', 16 => 'S*', 32 => 'L*', 64 => 'Q*' }.each do |w, fmt|
+    it "compiles random #{w}-bit pipelines which agree with Ruby arithmetic" do
+      rng = Random.new(37 + w)
+      30.times do
+        ops = Array.new(rng.rand(1..8)) do
+          case rng.rand(3)
+          when 0 then [CONSTANT_OPS.sample(random: rng), rng.rand(1 << w)]
+          when 1 then [SHIFT_OPS.sample(random: rng), rng.rand(w)]
+          else        PLAIN_OPS.sample(random: rng)
+          end
+        end
+        pipeline = BitTwiddle.compile(ops, w)
+        inputs   = Array.new(300) { rng.rand(1 << w) }
+        expected = inputs.map do |x|
+          ops.reduce(x) { |v, (op, arg)| reference(op, arg, v, w) }
+        end
+        expect(inputs.map { |x| pipeline.call(x) }).to eq expected
+        expect(pipeline.apply(inputs.pack(fmt)).unpack(fmt)).to eq expected
+      end
+    end
+  end
+
+  it "accepts negative constants and rotate distances" do
+    p = BitTwiddle.compile([[:add, -1], [:lrot, -4]], 16)
+    expect(p.call(0x1235)).to eq 0x4123
+    expect(p[0]).to eq 0xFFFF
+  end
+
+  it "applies a pipeline in place" do
+    p = BitTwiddle.compile([:bswap], 32)
+    buf = [1, 2].pack('L*')
+    expect(p.apply!(buf).equal?(buf)).to eq true
+    expect(buf.unpack('L*')).to eq [0x01000000, 0x02000000]
+  end
+
+  it "describes itself" do
+    ops = [[:xor_rshift, 33], [:mul, 0xff51afd7ed558ccd], :not]
+    p = BitTwiddle.compile(ops)
+    expect(p).to be_kind_of(BitTwiddle::Pipeline)
+    expect(p.width).to eq 64
+    expect(p.to_a).to eq ops
+    expect(BitTwiddle.compile([], 8).call(200)).to eq 200
+  end
+
+  it "rejects invalid operations and arguments" do
+    expect { BitTwiddle.compile([:frobnicate]) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.compile([:xor]) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.compile([[:not, 1]]) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.compile([[:lshift, 8]], 8) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.compile([[:xor, "1"]]) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.compile([[:lshift, 1.5]]) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.compile([[:xor, 256]], 8) }.to raise_error(RangeError)
+    expect { BitTwiddle.compile([[:add, -129]], 8) }.to raise_error(RangeError)
+    expect { BitTwiddle.compile([], 12) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.compile([], 8).call(256) }.to raise_error(RangeError)
+    expect { BitTwiddle.compile([], 32).apply("abc") }.to raise_error(ArgumentError)
+  end
+end
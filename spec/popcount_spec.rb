@@ -32,4 +32,20 @@ describe "#popcount" do
       expect { num.popcount }.to raise_error(RangeError)
     end
   end
-end
\ No newline at end of file
+end
+describe "String#popcount" do
+  it "counts the 1 bits in every byte" do
+    expect("".popcount).to eq 0
+    expect("abc".popcount).to eq 10
+    expect(("\xFF".b * 1000).popcount).to eq 8000
+  end
+
+  it "agrees with a per-byte count for Strings of many lengths" do
+    rng = Random.new(42)
+    [1, 7, 8, 15, 16, 31, 32, 255, 256, 257, 1000, 4099].each do |len|
+      str = Array.new(len) { rng.rand(256) }.pack("C*")
+      expect(str.popcount).to eq str.unpack("B*")[0].count("1")
+      expect(str[1..-1].popcount).to eq str[1..-1].unpack("B*")[0].count("1")
+    end
+  end
+end
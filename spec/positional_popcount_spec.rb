@@ -0,0 +1,31 @@
+describe "BitTwiddle.positional_popcount" do
+  it "counts the words with each bit set" do
+    expect(BitTwiddle.positional_popcount([1, 3, 0xF0].pack("C*"), 8)).to eq [2, 1, 0, 0, 1, 1, 1, 1]
+    expect(BitTwiddle.positional_popcount([0x8001, 0x8000].pack("S*"), 16)).to eq [1] + [0] * 14 + [2]
+    expect(BitTwiddle.positional_popcount("", 64)).to eq [0] * 64
+  end
+
+  { 8 => "C*", 16 => "S*", 32 => "L*", 64 => "Q*" }.each do |width, format|
+    it "matches a reference for #{width}-bit words" do
+      rng = Random.new(50 + width)
+      # lengths which end in each of the vector kernels and the byte loop
+      [1, 7, 33, 129, 1000, 20_000].each do |n|
+        words = Array.new(n) { rng.rand(2**width) & rng.rand(2**width) }
+        expected = (0...width).map { |j| words.count { |w| w[j] == 1 } }
+        expect(BitTwiddle.positional_popcount(words.pack(format), width)).to eq expected
+      end
+    end
+  end
+
+  it "doesn't overflow on long runs of set bits" do
+    counts = BitTwiddle.positional_popcount("\xFF".b * 300_007, 8)
+    expect(counts).to eq [300_007] * 8
+    counts = BitTwiddle.positional_popcount("\xFF".b * 2_000_000, 32)
+    expect(counts).to eq [500_000] * 32
+  end
+
+  it "rejects bad arguments" do
+    expect { BitTwiddle.positional_popcount("abc", 16) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.positional_popcount("abcd", 24) }.to raise_error(ArgumentError)
+  end
+end
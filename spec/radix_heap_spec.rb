@@ -0,0 +1,107 @@
+describe BitTwiddle::RadixHeap do
+  it "pops pairs in key order" do
+    heap = BitTwiddle::RadixHeap.new
+    heap.push(5, :five).push(1, :one).push(3)
+    expect(heap.size).to eq 3
+    expect(heap.min_key).to eq 1
+    expect(heap.pop_min).to eq [1, :one]
+    expect(heap.pop_min).to eq [3, nil]
+    expect(heap.pop_min).to eq [5, :five]
+    expect(heap.pop_min).to eq nil
+    expect(heap.empty?).to eq true
+    expect(heap.min_key).to eq nil
+  end
+
+  it "accepts pushes down to the last key popped" do
+    heap = BitTwiddle::RadixHeap.new
+    heap.push_all([10, 20])
+    heap.pop_min
+    expect(heap.last_key).to eq 10
+    heap.push(10, :again)
+    expect { heap.push(9) }.to raise_error(ArgumentError)
+    expect(heap.pop_min).to eq [10, :again]
+    expect(heap.min_key).to eq 20
+    heap.push(15)
+    expect(heap.pop_min).to eq [15, nil]
+  end
+
+  it "matches a sorted reference with interleaved pushes and pops" do
+    rng = Random.new(46)
+    heap = BitTwiddle::RadixHeap.new
+    ref = []
+    last = 0
+    3000.times do |i|
+      if rng.rand(3) > 0 || ref.empty?
+        key = last + rng.rand(2**rng.rand(64))
+        key = 2**64 - 1 if key >= 2**64
+        heap.push(key, i)
+        ref << [key, i]
+      else
+        key, value = heap.pop_min
+        min = ref.map(&:first).min
+        expect(key).to eq min
+        expect(ref.delete([key, value])).to eq [key, value]
+        last = key
+      end
+    end
+    expect(heap.size).to eq ref.size
+    popped = []
+    popped << heap.pop_min until heap.empty?
+    expect(popped.map(&:first)).to eq ref.map(&:first).sort
+  end
+
+  it "pushes keys and values in bulk" do
+    heap = BitTwiddle::RadixHeap.new
+    heap.push_all([30, 10, 20], %w(c a b))
+    expect(3.times.map { heap.pop_min }).to eq [[10, "a"], [20, "b"], [30, "c"]]
+    expect { heap.push_all([1, 2], [:x]) }.to raise_error(ArgumentError)
+  end
+
+  it "keeps values alive" do
+    heap = BitTwiddle::RadixHeap.new
+    heap.push_all((0...1000).to_a, (0...1000).map { |i| "value #{i}" })
+    GC.start
+    expect(heap.pop_min).to eq [0, "value 0"]
+  end
+
+  it "keeps values alive while a bucket is redistributed" do
+    # every key is in the same bucket, so the first pop_min moves all of them
+    heap = BitTwiddle::RadixHeap.new
+    2000.times { |i| heap.push(2**40 + i * 7919 % 2000, "value #{i * 7919 % 2000}") }
+    begin
+      GC.stress = true
+      popped = 3.times.map { heap.pop_min }
+    ensure
+      GC.stress = false
+    end
+    expect(popped).to eq [[2**40, "value 0"], [2**40 + 1, "value 1"], [2**40 + 2, "value 2"]]
+    expect(heap.size).to eq 1997
+  end
+
+  it "can't be changed when frozen" do
+    heap = BitTwiddle::RadixHeap.new.push(1).freeze
+    expect { heap.push(2) }.to raise_error(RuntimeError)
+    expect { heap.push_all([2]) }.to raise_error(RuntimeError)
+    expect { heap.pop_min }.to raise_error(RuntimeError)
+    expect { heap.clear }.to raise_error(RuntimeError)
+    expect(heap.min_key).to eq 1
+  end
+
+  it "can be copied and cleared" do
+    heap = BitTwiddle::RadixHeap.new.push(1).push(2)
+    heap.pop_min
+    copy = heap.dup
+    heap.clear
+    expect(heap.size).to eq 0
+    expect(heap.last_key).to eq 0
+    expect(copy.pop_min).to eq [2, nil]
+  end
+
+  it "checks keys" do
+    heap = BitTwiddle::RadixHeap.new
+    expect { heap.push(-1) }.to raise_error(RangeError)
+    expect { heap.push(2**64) }.to raise_error(RangeError)
+    heap.push(2**64 - 1)
+    expect(heap.pop_min).to eq [2**64 - 1, nil]
+  end
+end
@@ -0,0 +1,76 @@
+describe "BitTwiddle.radix_sort" do
+  def random_values(rng, n, bits)
+    Array.new(n) { rng.rand(1 << bits) }
+  end
+
+  it "sorts buffers of unsigned 32 and 64-bit keys" do
+    rng = Random.new(33)
+    [0, 1, 2, 100, 5000].each do |n|
+      [[32, 'L*'], [64, 'Q*']].each do |width, fmt|
+        [8, 20, width].each do |bits|
+          values = random_values(rng, n, bits)
+          expect(BitTwiddle.radix_sort(values.pack(fmt), width).unpack(fmt)).to eq values.sort
+        end
+      end
+    end
+  end
+
+  it "defaults to 64-bit keys" do
+    expect(BitTwiddle.radix_sort([3, 1 << 40, 2].pack('Q*')).unpack('Q*')).to eq [2, 3, 1 << 40]
+  end
+
+  it "sorts signed integers" do
+    rng = Random.new(34)
+    values = Array.new(3000) { rng.rand(-(1 << 63)...(1 << 63)) }
+    expect(BitTwiddle.radix_sort(values.pack('q*'), signed: true).unpack('q*')).to eq values.sort
+    values = Array.new(3000) { rng.rand(-1000..1000) }
+    expect(BitTwiddle.radix_sort(values.pack('l*'), 32, signed: true).unpack('l*')).to eq values.sort
+  end
+
+  it "sorts floats" do
+    rng = Random.new(35)
+    values = Array.new(3000) { (rng.rand - 0.5) * 10.0**rng.rand(-30..30) } + [0.0, -0.0, Float::INFINITY, -Float::INFINITY, Float::MAX]
+    sorted = BitTwiddle.radix_sort(values.pack('d*'), float: true).unpack('d*')
+    expect(sorted).to eq values.sort
+    expect(1 / sorted[sorted.index(0.0)]).to eq(-Float::INFINITY) # -0.0 comes first
+
+    values = Array.new(3000) { rng.rand(-100.0..100.0) }.pack('f*').unpack('f*')
+    expect(BitTwiddle.radix_sort(values.pack('f*'), 32, float: true).unpack('f*')).to eq values.sort
+  end
+
+  it "doesn't modify its argument, but radix_sort! sorts in place" do
+    buf = [3, 1, 2].pack('Q*')
+    BitTwiddle.radix_sort(buf)
+    expect(buf.unpack('Q*')).to eq [3, 1, 2]
+    expect(BitTwiddle.radix_sort!(buf).equal?(buf)).to eq true
+    expect(buf.unpack('Q*')).to eq [1, 2, 3]
+    expect { BitTwiddle.radix_sort!(buf.freeze) }.to raise_error(RuntimeError)
+  end
+
+  it "returns a stable index of the original positions" do
+    rng = Random.new(36)
+    values = random_values(rng, 4000, 6)
+    keys, index = BitTwiddle.radix_sort_with_index(values.pack('L*'), 32)
+    expect(keys.unpack('L*')).to eq values.sort
+    expect(index.unpack('L*')).to eq (0...values.size).sort_by { |i| [values[i], i] }
+  end
+
+  it "gives the same results with multiple threads" do
+    rng = Random.new(37)
+    values = random_values(rng, 10_000, 64)
+    [1, 2, 3, 4, 7].each do |threads|
+      expect(BitTwiddle.radix_sort(values.pack('Q*'), threads: threads).unpack('Q*')).to eq values.sort
+      keys, index = BitTwiddle.radix_sort_with_index(values.pack('Q*'), threads: threads)
+      expect(index.unpack('L*').map { |i| values[i] }).to eq values.sort
+    end
+    values = random_values(rng, 3, 32)
+    expect(BitTwiddle.radix_sort(values.pack('L*'), 32, threads: 8).unpack('L*')).to eq values.sort
+  end
+
+  it "rejects bad arguments" do
+    expect { BitTwiddle.radix_sort("abc", 32) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.radix_sort("abcd", 16) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.radix_sort("abcd", 32, signed: true, float: true) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.radix_sort("abcd", 32, threads: 0) }.to raise_error(ArgumentError)
+  end
+end
@@ -0,0 +1,173 @@
+describe BitTwiddle::HyperLogLog do
+  it "counts small sets exactly while sparse" do
+    hll = BitTwiddle::HyperLogLog.new
+    expect(hll.count).to eq 0
+    hll << "a" << "b" << "a"
+    expect(hll.count).to eq 2
+    hll.add_all((0...500).to_a)
+    expect(hll.sparse?).to eq true
+    expect(hll.count).to eq 502
+  end
+
+  it "estimates large cardinalities within a few standard errors" do
+    [10, 14].each do |p|
+      hll = BitTwiddle::HyperLogLog.new(p)
+      hll.add_all((0...200_000).map { |i| "key#{i}" })
+      expect(hll.sparse?).to eq false
+      error = 1.04 / Math.sqrt(2**p)
+      expect((hll.count - 200_000).abs).to be < 200_000 * error * 4
+    end
+  end
+
+  it "gives the same estimate however the keys were added" do
+    a = BitTwiddle::HyperLogLog.new(12).add_all((0...3000).to_a)
+    b = BitTwiddle::HyperLogLog.new(12).add_all((2000...60_000).to_a)
+    all = BitTwiddle::HyperLogLog.new(12).add_all((0...60_000).to_a)
+    expect((a | b).count).to eq all.count
+    expect((b | a).count).to eq all.count
+    expect((a | b).to_s).to eq all.to_s
+    sparse = BitTwiddle::HyperLogLog.new(12).add_all((0...100).to_a)
+    expect(sparse.dup.merge!(a).count).to eq a.count
+    expect(a.merge!(a).count).to eq a.count
+    expect { a | BitTwiddle::HyperLogLog.new(13) }.to raise_error(ArgumentError)
+  end
+
+  it "round trips through compact Strings" do
+    sparse = BitTwiddle::HyperLogLog.new.add_all((0...100).to_a)
+    dense = BitTwiddle::HyperLogLog.new(10).add_all((0...10_000).to_a)
+    expect(sparse.to_s.bytesize).to be < 400
+    expect(dense.to_s.bytesize).to eq 8 + 1024 * 6 / 8
+    [sparse, dense].each do |hll|
+      copy = BitTwiddle::HyperLogLog.load(hll.to_s)
+      expect(copy.to_s).to eq hll.to_s
+      expect(copy.count).to eq hll.count
+      expect(copy.precision).to eq hll.precision
+      expect(copy.sparse?).to eq hll.sparse?
+    end
+    expect { BitTwiddle::HyperLogLog.load(dense.to_s[0...-1]) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::HyperLogLog.load(sparse.to_s[0...-1]) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::HyperLogLog.load("BTHLL\x01\x03\x00") }.to raise_error(ArgumentError)
+  end
+
+  it "can be cleared and copied" do
+    hll = BitTwiddle::HyperLogLog.new(8).add_all((0...1000).to_a)
+    copy = hll.dup
+    hll.clear
+    expect(hll.count).to eq 0
+    expect(hll.sparse?).to eq true
+    expect(copy.count).to be > 900
+  end
+
+  it "checks its arguments" do
+    expect { BitTwiddle::HyperLogLog.new(3) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::HyperLogLog.new(19) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::HyperLogLog.new.add(1.5) }.to raise_error(TypeError)
+    expect { BitTwiddle::HyperLogLog.allocate.count }.to raise_error(RuntimeError)
+  end
+
+  it "can't be changed when frozen" do
+    hll = BitTwiddle::HyperLogLog.new
+    hll.add("x")
+    hll.freeze
+    expect { hll.add("y") }.to raise_error(RuntimeError)
+    expect { hll << "y" }.to raise_error(RuntimeError)
+    expect { hll.add_all(["y"]) }.to raise_error(RuntimeError)
+    expect { hll.merge!(BitTwiddle::HyperLogLog.new) }.to raise_error(RuntimeError)
+    expect { hll.merge!(hll) }.to raise_error(RuntimeError)
+    expect { hll.clear }.to raise_error(RuntimeError)
+    expect(hll.count).to eq 1
+    expect((hll | BitTwiddle::HyperLogLog.new).count).to eq 1
+  end
+
+  it "counts and serializes a frozen sketch without changing it" do
+    # 40 entries would make a precision 8 sketch switch to dense registers
+    [(0...40).to_a, (0...10).to_a * 3].each do |keys|
+      hll = BitTwiddle::HyperLogLog.new(8).add_all(keys).freeze
+      copy = hll.dup
+      expect(hll.count).to eq copy.count
+      expect(hll.to_s).to eq copy.to_s
+      expect(hll.sparse?).to eq true
+      expect(hll.to_s).to eq copy.to_s
+    end
+  end
+end
+
+describe BitTwiddle::CountMinSketch do
+  it "never underestimates" do
+    cms = BitTwiddle::CountMinSketch.new(200, 5)
+    truth = Hash.new(0)
+    rng = Random.new(44)
+    2000.times do
+      k = rng.rand(300)
+      n = rng.rand(1..3)
+      cms.add(k, n)
+      truth[k] += n
+    end
+    expect(cms.total).to eq truth.values.inject(:+)
+    counts = cms.count_all(truth.keys)
+    expect(counts.zip(truth.values).all? { |c, t| c >= t }).to eq true
+    expect(counts.zip(truth.values).count { |c, t| c - t > Math::E / 200 * cms.total }).to be < truth.size / 10
+  end
+
+  it "counts Strings and Integers" do
+    cms = BitTwiddle::CountMinSketch.new(1000)
+    expect(cms.depth).to eq 4
+    expect(cms.width).to eq 1000
+    cms << "x" << "x" << 7
+    cms.add_all(["x", 7, 7])
+    expect(cms["x"]).to eq 3
+    expect(cms.count(7)).to eq 3
+    expect(cms.count("y")).to eq 0
+  end
+
+  it "merges sketches of the same shape" do
+    a = BitTwiddle::CountMinSketch.new(100, 3).add("x", 2)
+    b = BitTwiddle::CountMinSketch.new(100, 3).add("x", 5).add("y")
+    expect(a.merge!(b).count("x")).to eq 7
+    expect(a.total).to eq 8
+    expect { a.merge!(BitTwiddle::CountMinSketch.new(100, 4)) }.to raise_error(ArgumentError)
+  end
+
+  it "round trips through a compact String" do
+    cms = BitTwiddle::CountMinSketch.new(1000, 4)
+    cms.add_all((0...100).to_a)
+    cms.add("big", 10**12)
+    str = cms.to_s
+    expect(str.bytesize).to be < 4100
+    copy = BitTwiddle::CountMinSketch.load(str)
+    expect(copy.to_s).to eq str
+    expect(copy["big"]).to eq 10**12
+    expect(copy.total).to eq cms.total
+    expect { BitTwiddle::CountMinSketch.load(str[0...-1]) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::CountMinSketch.load(str + "\x00") }.to raise_error(ArgumentError)
+  end
+
+  it "can be cleared and copied" do
+    cms = BitTwiddle::CountMinSketch.new(10).add("a")
+    copy = cms.dup
+    cms.clear
+    expect(cms["a"]).to eq 0
+    expect(cms.total).to eq 0
+    expect(copy["a"]).to eq 1
+  end
+
+  it "checks its arguments" do
+    expect { BitTwiddle::CountMinSketch.new(0) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::CountMinSketch.new(10, 33) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::CountMinSketch.new(10).add("a", -1) }.to raise_error(RangeError)
+    expect { BitTwiddle::CountMinSketch.allocate.total }.to raise_error(RuntimeError)
+  end
+
+  it "can't be changed when frozen" do
+    cms = BitTwiddle::CountMinSketch.new(100)
+    cms.add("x", 2)
+    cms.freeze
+    expect { cms.add("y") }.to raise_error(RuntimeError)
+    expect { cms << "y" }.to raise_error(RuntimeError)
+    expect { cms.add_all(["y"]) }.to raise_error(RuntimeError)
+    expect { cms.merge!(BitTwiddle::CountMinSketch.new(100)) }.to raise_error(RuntimeError)
+    expect { cms.clear }.to raise_error(RuntimeError)
+    expect(cms.count("x")).to eq 2
+    expect(cms.total).to eq 2
+  end
+end
@@ -0,0 +1,112 @@
+describe BitTwiddle::SlotAllocator do
+  it "hands out the lowest free slot" do
+    sa = BitTwiddle::SlotAllocator.new(10)
+    expect(3.times.map { sa.alloc }).to eq [0, 1, 2]
+    sa.free(1)
+    expect(sa.alloc).to eq 1
+    expect(sa.alloc).to eq 3
+    expect(sa.size).to eq 4
+    expect(sa.capacity).to eq 10
+  end
+
+  it "returns nil when full" do
+    sa = BitTwiddle::SlotAllocator.new(3)
+    3.times { sa.alloc }
+    expect(sa.full?).to eq true
+    expect(sa.alloc).to eq nil
+    expect(sa.alloc_near(1)).to eq nil
+  end
+
+  it "allocates near a hint, wrapping around" do
+    sa = BitTwiddle::SlotAllocator.new(200)
+    expect(sa.alloc_near(100)).to eq 100
+    expect(sa.alloc_near(100)).to eq 101
+    (102...200).each { |i| expect(sa.alloc_near(i)).to eq i }
+    expect(sa.alloc_near(150)).to eq 0
+    expect { sa.alloc_near(200) }.to raise_error(IndexError)
+  end
+
+  it "matches a simple model across several levels" do
+    rng = Random.new(45)
+    [1, 64, 65, 4096, 4097, 9000].each do |cap|
+      sa = BitTwiddle::SlotAllocator.new(cap)
+      used = []
+      (cap * 2).times do
+        if rng.rand(3) > 0
+          hint = rng.rand(cap)
+          got = sa.alloc_near(hint)
+          free = (0...cap).to_a - used
+          expect(got).to eq(free.find { |i| i >= hint } || free.first)
+          used << got if got
+        elsif !used.empty?
+          sa.free(used.delete_at(rng.rand(used.size)))
+        end
+      end
+      expect(sa.to_a).to eq used.sort
+      expect(sa.each.to_a).to eq used.sort
+      expect(sa.size).to eq used.size
+    end
+  end
+
+  it "finds free slots in a nearly full large pool" do
+    sa = BitTwiddle::SlotAllocator.new(300_000)
+    300_000.times { sa.alloc }
+    sa.free(123_456)
+    sa.free(7)
+    expect(sa.alloc_near(200_000)).to eq 7
+    expect(sa.alloc).to eq 123_456
+    expect(sa.full?).to eq true
+  end
+
+  it "checks slots" do
+    sa = BitTwiddle::SlotAllocator.new(100)
+    sa.alloc
+    expect(sa.allocated?(0)).to eq true
+    expect(sa.allocated?(1)).to eq false
+    expect { sa.free(1) }.to raise_error(ArgumentError)
+    expect { sa.free(100) }.to raise_error(IndexError)
+    expect { sa.allocated?(-1) }.to raise_error(IndexError)
+  end
+
+  it "grows, clears and copies" do
+    sa = BitTwiddle::SlotAllocator.new(70)
+    70.times { sa.alloc }
+    copy = sa.dup
+    sa.grow(5000)
+    expect(sa.alloc).to eq 70
+    expect(sa.size).to eq 71
+    expect(sa.to_a).to eq (0..70).to_a
+    expect { sa.grow(10) }.to raise_error(ArgumentError)
+    expect(copy.alloc).to eq nil
+    sa.clear
+    expect(sa.size).to eq 0
+    expect(sa.alloc).to eq 0
+  end
+
+  it "is Enumerable" do
+    sa = BitTwiddle::SlotAllocator.new(1000)
+    5.times { sa.alloc }
+    sa.free(2)
+    expect(sa.select(&:odd?)).to eq [1, 3]
+    expect(sa.each.size).to eq 4
+  end
+
+  it "checks its arguments" do
+    expect { BitTwiddle::SlotAllocator.new(0) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::SlotAllocator.new(2**41) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::SlotAllocator.allocate.alloc }.to raise_error(RuntimeError)
+  end
+
+  it "can't be changed when frozen" do
+    sa = BitTwiddle::SlotAllocator.new(100)
+    sa.alloc
+    sa.freeze
+    expect { sa.alloc }.to raise_error(RuntimeError)
+    expect { sa.alloc_near(50) }.to raise_error(RuntimeError)
+    expect { sa.free(0) }.to raise_error(RuntimeError)
+    expect { sa.grow(200) }.to raise_error(RuntimeError)
+    expect { sa.clear }.to raise_error(RuntimeError)
+    expect(sa.to_a).to eq [0]
+    expect(sa.capacity).to eq 100
+  end
+end
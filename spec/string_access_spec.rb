@@ -0,0 +1,77 @@
+describe "String#get_* and String#set_*" do
+  formats = {
+    'u8'    => ['C',  1], 'i8'    => ['c',  1],
+    'u16le' => ['S<', 2], 'u16be' => ['S>', 2], 'i16le' => ['s<', 2], 'i16be' => ['s>', 2],
+    'u32le' => ['L<', 4], 'u32be' => ['L>', 4], 'i32le' => ['l<', 4], 'i32be' => ['l>', 4],
+    'u64le' => ['Q<', 8], 'u64be' => ['Q>', 8], 'i64le' => ['q<', 8], 'i64be' => ['q>', 8],
+    'f32le' => ['e',  4], 'f32be' => ['g',  4], 'f64le' => ['E',  8], 'f64be' => ['G',  8]
+  }
+
+  formats.each do |type, (fmt, size)|
+    it "reads and writes #{type} values at any offset, like pack/unpack with #{fmt}" do
+      rng = Random.new(35)
+      str = Random.new(1).bytes(40)
+      20.times do
+        offset = rng.rand(40 - size + 1)
+        expect(str.send("get_#{type}", offset)).to eq str[offset, size].unpack(fmt)[0]
+        expect(str.send("get_#{type}", offset - 40)).to eq str[offset, size].unpack(fmt)[0]
+
+        value = [rng.bytes(size)].pack('a*').unpack(fmt)[0]
+        value = 0.0 if value.is_a?(Float) && value.nan?
+        expected = str.dup
+        expected[offset, size] = [value].pack(fmt)
+        expect(str.send("set_#{type}", offset, value)).to eq value
+        expect(str).to eq expected
+      end
+    end
+  end
+
+  it "returns the expected values for known bytes" do
+    str = "\x01\x02\x03\x04\x05\x06\x07\x08\xFF".b
+    expect(str.get_u16le(0)).to eq 0x0201
+    expect(str.get_u16be(0)).to eq 0x0102
+    expect(str.get_u32be(1)).to eq 0x02030405
+    expect(str.get_u64le(1)).to eq 0xFF08070605040302
+    expect(str.get_i64le(1)).to eq(-0x00F7F8F9FAFBFCFE)
+    expect(str.get_i8(-1)).to eq(-1)
+    expect(str.get_u8(-1)).to eq 255
+  end
+
+  it "raises IndexError for values which don't fit in the String" do
+    str = "abcd"
+    expect { str.get_u32le(1) }.to raise_error(IndexError)
+    expect { str.get_u16be(-1) }.to raise_error(IndexError)
+    expect { str.get_u8(-5) }.to raise_error(IndexError)
+    expect { str.set_u32le(4, 0) }.to raise_error(IndexError)
+    expect { "".get_u8(0) }.to raise_error(IndexError)
+  end
+
+  it "raises RangeError for values which don't fit in the type" do
+    str = "\0" * 8
+    expect { str.set_u8(0, 256) }.to raise_error(RangeError)
+    expect { str.set_u16le(0, -1) }.to raise_error(RangeError)
+    expect { str.set_i16le(0, 32768) }.to raise_error(RangeError)
+    expect { str.set_i32be(0, -(1 << 31) - 1) }.to raise_error(RangeError)
+    expect { str.set_u64le(0, 1 << 64) }.to raise_error(RangeError)
+    expect { str.set_i64le(0, 1 << 63) }.to raise_error(RangeError)
+    expect(str).to eq "\0" * 8
+  end
+
+  it "can't modify a frozen String" do
+    expect { "abcd".freeze.set_u16le(0, 1) }.to raise_error(RuntimeError)
+  end
+
+  it "is also available as BitTwiddle module functions" do
+    str = "\x01\x02\x03\x04\x05\x06\x07\x08".b
+    formats.each_key do |type|
+      expect(BitTwiddle.send("get_#{type}", str, 0)).to eq str.send("get_#{type}", 0)
+    end
+    copy = str.dup
+    expect(BitTwiddle.set_u16be(copy, -2, 0xBEEF)).to eq 0xBEEF
+    expect(copy).to eq "\x01\x02\x03\x04\x05\x06\xBE\xEF".b
+    expect(BitTwiddle.set_f64le(copy, 0, 1.5)).to eq 1.5
+    expect(BitTwiddle.get_f64le(copy, 0)).to eq 1.5
+    expect { BitTwiddle.get_u8(1, 0) }.to raise_error(TypeError)
+    expect { BitTwiddle.set_u8("a".freeze, 0, 1) }.to raise_error(RuntimeError)
+  end
+end
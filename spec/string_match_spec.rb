@@ -0,0 +1,152 @@
+describe "Bit-parallel string matching" do
+  def levenshtein(a, b)
+    a, b = a.bytes, b.bytes
+    row = (0..b.size).to_a
+    a.each_with_index do |x, i|
+      prev, row[0] = row[0], i + 1
+      b.each_with_index do |y, j|
+        cur = [row[j + 1] + 1, row[j] + 1, prev + (x == y ? 0 : 1)].min
+        prev, row[j + 1] = row[j + 1], cur
+      end
+    end
+    row[b.size]
+  end
+
+  # best edit distance between pattern and any substring of text ending at each offset
+  def approximate_ends(text, pattern, k)
+    p, t = pattern.bytes, text.bytes
+    col = (0..p.size).to_a
+    ends = []
+    t.each_with_index do |c, j|
+      prev, col[0] = col[0], 0
+      p.each_with_index do |x, i|
+        cur = [col[i + 1] + 1, col[i] + 1, prev + (x == c ? 0 : 1)].min
+        prev, col[i + 1] = col[i + 1], cur
+      end
+      ends << j + 1 if col[p.size] <= k
+    end
+    ends
+  end
+
+  def random_string(rng, len, alphabet = 'abcd')
+    Array.new(len) { alphabet[rng.rand(alphabet.size)] }.join
+  end
+
+  # similar Strings, so bounded distances are often in range
+  def mutate(rng, str, edits, alphabet = 'abcd')
+    str = str.dup
+    edits.times do
+      pos = rng.rand(str.size + 1)
+      case rng.rand(3)
+      when 0 then str.insert(pos, alphabet[rng.rand(alphabet.size)])
+      when 1 then str[pos, 1] = '' if pos < str.size
+      else        str[pos, 1] = alphabet[rng.rand(alphabet.size)] if pos < str.size
+      end
+    end
+    str
+  end
+
+  describe "BitTwiddle.myers_distance" do
+    it "computes Levenshtein distances" do
+      expect(BitTwiddle.myers_distance("kitten", "sitting")).to eq 3
+      expect(BitTwiddle.myers_distance("", "abc")).to eq 3
+      expect(BitTwiddle.myers_distance("abc", "")).to eq 3
+      expect(BitTwiddle.myers_distance("", "")).to eq 0
+      expect(BitTwiddle.myers_distance("flaw", "lawn")).to eq 2
+    end
+
+    it "agrees with a simple DP on random short and long Strings" do
+      rng = Random.new(38)
+      [1, 5, 63, 64, 65, 127, 128, 129, 300].each do |len|
+        10.times do
+          a = random_string(rng, len)
+          b = rng.rand(2) == 0 ? random_string(rng, rng.rand(len * 2) + 1) : mutate(rng, a, rng.rand(len / 2 + 2))
+          expect(BitTwiddle.myers_distance(a, b)).to eq levenshtein(a, b)
+          expect(BitTwiddle.myers_distance(b, a)).to eq levenshtein(a, b)
+        end
+      end
+    end
+
+    it "returns nil when the distance is more than max" do
+      rng = Random.new(138)
+      [10, 64, 70, 200].each do |len|
+        20.times do
+          a = random_string(rng, len)
+          b = mutate(rng, a, rng.rand(40))
+          d = levenshtein(a, b)
+          [0, 1, 3, 10, 31, 32, 50].each do |max|
+            expect(BitTwiddle.myers_distance(a, b, max)).to eq(d <= max ? d : nil)
+          end
+        end
+      end
+    end
+
+    it "treats multibyte characters as bytes" do
+      expect(BitTwiddle.myers_distance("café", "cafe")).to eq 2
+    end
+
+    it "rejects a negative max" do
+      expect { BitTwiddle.myers_distance("a", "b", -1) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe "BitTwiddle.myers_distances" do
+    it "compares one pattern with many candidates" do
+      expect(BitTwiddle.myers_distances("apple", ["apply", "maple", "banana"])).to eq [1, 2, 5]
+      expect(BitTwiddle.myers_distances("apple", ["apply", "maple", "banana"], 1)).to eq [1, nil, nil]
+      expect(BitTwiddle.myers_distances("apple", [])).to eq []
+    end
+
+    it "matches myers_distance for long patterns" do
+      rng = Random.new(238)
+      pattern = random_string(rng, 150)
+      candidates = Array.new(30) { mutate(rng, pattern, rng.rand(30)) } + ["", "abc"]
+      expect(BitTwiddle.myers_distances(pattern, candidates)).to eq(candidates.map { |c| levenshtein(pattern, c) })
+      expect(BitTwiddle.myers_distances(pattern, candidates, 12)).to eq(candidates.map { |c| d = levenshtein(pattern, c); d <= 12 ? d : nil })
+    end
+  end
+
+  describe "BitTwiddle.shift_or_search" do
+    it "finds all exact occurrences" do
+      expect(BitTwiddle.shift_or_search("abracadabra", "abra")).to eq [0, 7]
+      expect(BitTwiddle.shift_or_search("aaaa", "aa")).to eq [0, 1, 2]
+      expect(BitTwiddle.shift_or_search("abc", "abcd")).to eq []
+    end
+
+    it "agrees with a naive search" do
+      rng = Random.new(338)
+      text = random_string(rng, 5000, 'ab')
+      [1, 3, 8, 20, 64].each do |len|
+        pattern = text[rng.rand(text.size - len), len]
+        naive = (0..text.size - len).select { |i| text[i, len] == pattern }
+        expect(BitTwiddle.shift_or_search(text, pattern)).to eq naive
+      end
+    end
+
+    it "rejects empty and overlong patterns" do
+      expect { BitTwiddle.shift_or_search("abc", "") }.to raise_error(ArgumentError)
+      expect { BitTwiddle.shift_or_search("abc", "a" * 65) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe "BitTwiddle.bitap_search" do
+    it "finds approximate occurrences" do
+      expect(BitTwiddle.bitap_search("the quick brown fox", "quack", 1)).to eq [9]
+      expect(BitTwiddle.bitap_search("abcabd", "abc", 0)).to eq [3]
+    end
+
+    it "agrees with the DP for substring matching" do
+      rng = Random.new(438)
+      text = random_string(rng, 2000)
+      [[4, 1], [10, 2], [30, 5], [64, 3], [64, 10]].each do |len, k|
+        pattern = mutate(rng, text[rng.rand(text.size - len), len], k)[0, 64]
+        expect(BitTwiddle.bitap_search(text, pattern, k)).to eq approximate_ends(text, pattern, k)
+      end
+    end
+
+    it "rejects max_errors not less than the pattern length" do
+      expect { BitTwiddle.bitap_search("abc", "ab", 2) }.to raise_error(ArgumentError)
+      expect { BitTwiddle.bitap_search("abc", "ab", -1) }.to raise_error(ArgumentError)
+    end
+  end
+end
@@ -0,0 +1,75 @@
+describe "String bitwise operations" do
+  def random_bytes(rng, len)
+    Array.new(len) { rng.rand(256) }.pack("C*")
+  end
+
+  LENGTHS = [0, 1, 7, 8, 15, 16, 31, 32, 33, 63, 100, 1000]
+
+  { :xor! => :^, :and! => :&, :or! => :|, :andnot! => nil }.each do |method, op|
+    describe "String##{method}" do
+      it "combines the Strings byte by byte, in place" do
+        rng = Random.new(method.to_s.sum)
+        LENGTHS.each do |len|
+          a, b = random_bytes(rng, len), random_bytes(rng, len)
+          expected = a.bytes.zip(b.bytes).map { |x, y| op ? x.send(op, y) : x & ~y & 0xFF }.pack("C*")
+          copy = a.dup
+          expect(copy.send(method, b).equal?(copy)).to eq true
+          expect(copy).to eq expected
+          expect(b).to eq b.dup
+        end
+      end
+
+      it "works on a slice which doesn't start on a word boundary" do
+        a = ("\xAA".b * 50)[3, 40]
+        b = ("\x0F".b * 50)[1, 40]
+        a.send(method, b)
+        expect(a.bytesize).to eq 40
+      end
+
+      it "raises ArgumentError for Strings of different lengths" do
+        expect { "abc".dup.send(method, "ab") }.to raise_error(ArgumentError)
+      end
+
+      it "refuses to modify a frozen String" do
+        expect { "abc".freeze.send(method, "abc") }.to raise_error(RuntimeError)
+      end
+    end
+  end
+
+  describe "String#xor_key!" do
+    it "XORs with a repeating key" do
+      expect("Hello".b.xor_key!("\x37\xfa\x21\x3d".b)).to eq "\x7F\x9F\x4D\x51\x58".b
+      expect("abc".dup.xor_key!(" ")).to eq "ABC"
+    end
+
+    it "matches a per-byte XOR for keys of many lengths" do
+      rng = Random.new(142)
+      [1, 3, 4, 5, 16, 17, 32, 33, 100].each do |klen|
+        key = random_bytes(rng, klen)
+        LENGTHS.each do |len|
+          data = random_bytes(rng, len)
+          expected = data.bytes.each_with_index.map { |x, i| x ^ key.getbyte(i % klen) }.pack("C*")
+          expect(data.dup.xor_key!(key)).to eq expected
+        end
+      end
+    end
+
+    it "rejects an empty key" do
+      expect { "abc".dup.xor_key!("") }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe "BitTwiddle module functions" do
+    it "change their first argument in place" do
+      bitmap = "\x0F\xF0".b
+      expect(BitTwiddle.or!(bitmap, "\x30\x03".b).equal?(bitmap)).to eq true
+      expect(bitmap).to eq "\x3F\xF3".b
+      expect(BitTwiddle.and!(bitmap, "\x0F\x0F".b)).to eq "\x0F\x03".b
+      expect(BitTwiddle.andnot!(bitmap, "\x01\x01".b)).to eq "\x0E\x02".b
+      expect(BitTwiddle.xor!(bitmap, "\xFF\xFF".b)).to eq "\xF1\xFD".b
+      expect(BitTwiddle.xor_key!("abc".dup, " ")).to eq "ABC"
+      expect { BitTwiddle.xor!(1, "a") }.to raise_error(TypeError)
+      expect { BitTwiddle.xor!("ab", "a") }.to raise_error(ArgumentError)
+    end
+  end
+end
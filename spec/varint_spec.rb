@@ -0,0 +1,194 @@
+def leb128(n)
+  bytes = []
+  loop do
+    b = n & 0x7F
+    n >>= 7
+    break bytes << b if n == 0
+    bytes << (b | 0x80)
+  end
+  bytes.pack('C*')
+end
+
+describe "BitTwiddle.varint_encode" do
+  it "encodes unsigned integers as LEB128" do
+    expect(BitTwiddle.varint_encode([1, 300].pack('Q*'), 64).bytes).to eq [1, 172, 2]
+    expect(BitTwiddle.varint_encode([0, 127, 128].pack('L*'), 32).bytes).to eq [0, 127, 128, 1]
+    expect(BitTwiddle.varint_encode([(1 << 64) - 1].pack('Q*'), 64)).to eq leb128((1 << 64) - 1)
+    expect(BitTwiddle.varint_encode('', 64)).to eq ''
+  end
+
+  it "rejects widths other than 32 and 64" do
+    expect { BitTwiddle.varint_encode('', 16) }.to raise_error(ArgumentError)
+  end
+
+  it "rejects buffers which are not a whole number of elements" do
+    expect { BitTwiddle.varint_encode('abc', 32) }.to raise_error(ArgumentError)
+  end
+end
+
+describe "BitTwiddle.varint_decode" do
+  it "round-trips values of all sizes" do
+    rng = Random.new(29)
+    [32, 64].each do |width|
+      values = Array.new(5000) { rng.rand(1 << rng.rand(1..width)) }
+      # long runs of 1-byte values, for the vectorized path
+      values.concat(Array.new(100) { rng.rand(128) })
+      values.concat(Array.new(5) { rng.rand(1 << width) })
+      buffer = values.pack(width == 32 ? 'L*' : 'Q*')
+      encoded = BitTwiddle.varint_encode(buffer, width)
+      expect(encoded).to eq values.map { |v| leb128(v) }.join
+      expect(BitTwiddle.varint_decode(encoded, width)).to eq buffer
+    end
+  end
+
+  it "raises ArgumentError for a truncated varint" do
+    expect { BitTwiddle.varint_decode("\x01\x80".b, 64) }.to raise_error(ArgumentError)
+  end
+
+  it "raises ArgumentError for a varint which is too big for 64 bits" do
+    expect { BitTwiddle.varint_decode(("\xFF".b * 9) + "\x02".b, 64) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.varint_decode(("\x80".b * 10) + "\x00".b, 64) }.to raise_error(ArgumentError)
+  end
+
+  it "raises RangeError for a value which is too big for a 32-bit buffer" do
+    expect { BitTwiddle.varint_decode(leb128(1 << 32), 32) }.to raise_error(RangeError)
+  end
+end
+
+describe "BitTwiddle.svarint_encode" do
+  it "encodes signed integers as zigzag LEB128" do
+    expect(BitTwiddle.svarint_encode([-1, 1, -64].pack('q*'), 64).bytes).to eq [1, 2, 127]
+    expect(BitTwiddle.svarint_encode([-(1 << 31)].pack('l*'), 32)).to eq leb128(0xFFFFFFFF)
+  end
+
+  it "round-trips through svarint_decode" do
+    rng = Random.new(30)
+    [[32, 'l*'], [64, 'q*']].each do |width, fmt|
+      values = Array.new(3000) { rng.rand(1 << rng.rand(1..width-1)) * [1, -1].sample(random: rng) }
+      values << -(1 << (width - 1)) << (1 << (width - 1)) - 1
+      buffer = values.pack(fmt)
+      expect(BitTwiddle.svarint_decode(BitTwiddle.svarint_encode(buffer, width), width)).to eq buffer
+    end
+  end
+
+  it "raises RangeError when decoding a value which is too big for a 32-bit buffer" do
+    expect { BitTwiddle.svarint_decode(leb128(1 << 32), 32) }.to raise_error(RangeError)
+  end
+end
+
+describe "BitTwiddle.read_varint" do
+  it "returns the value and the offset of the following byte" do
+    expect(BitTwiddle.read_varint("\x01\xAC\x02".b)).to eq [1, 1]
+    expect(BitTwiddle.read_varint("\x01\xAC\x02".b, 1)).to eq [300, 3]
+    expect(BitTwiddle.read_varint(leb128((1 << 64) - 1) + "rest")).to eq [(1 << 64) - 1, 10]
+  end
+
+  it "raises IndexError for an offset outside the String" do
+    expect { BitTwiddle.read_varint("\x01".b, 1) }.to raise_error(IndexError)
+    expect { BitTwiddle.read_varint("\x01".b, -1) }.to raise_error(IndexError)
+  end
+
+  it "raises ArgumentError for a truncated varint" do
+    expect { BitTwiddle.read_varint("\x01\xAC".b, 1) }.to raise_error(ArgumentError)
+  end
+end
+
+describe "BitTwiddle.streamvbyte_encode" do
+  it "uses one control byte per 4 integers, and 1-4 data bytes per integer" do
+    expect(BitTwiddle.streamvbyte_encode([1, 300, 70000].pack('L*')).bytesize).to eq 7
+    expect(BitTwiddle.streamvbyte_encode([].pack('L*'))).to eq ''
+  end
+
+  it "round-trips through streamvbyte_decode" do
+    rng = Random.new(31)
+    [0, 1, 3, 4, 5, 16, 17, 1000, 1003].each do |n|
+      values = Array.new(n) { rng.rand(1 << (8 * rng.rand(1..4))) }
+      buffer = values.pack('L*')
+      encoded = BitTwiddle.streamvbyte_encode(buffer)
+      expect(BitTwiddle.streamvbyte_decode(encoded, n)).to eq buffer
+    end
+  end
+
+  it "raises ArgumentError when decoding data of the wrong length" do
+    encoded = BitTwiddle.streamvbyte_encode([1, 300, 70000].pack('L*'))
+    expect { BitTwiddle.streamvbyte_decode(encoded, 4) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.streamvbyte_decode(encoded + "\x00", 3) }.to raise_error(ArgumentError)
+    expect { BitTwiddle.streamvbyte_decode(encoded, -1) }.to raise_error(ArgumentError)
+  end
+end
+
+describe "BitTwiddle.zigzag_encode" do
+  it "maps small signed integers to small unsigned ones" do
+    expect(BitTwiddle.zigzag_encode([0, -1, 1, -2].pack('l*'), 32).unpack('L*')).to eq [0, 1, 2, 3]
+    expect(BitTwiddle.zigzag_encode([-(1 << 63)].pack('q*'), 64).unpack('Q*')).to eq [(1 << 64) - 1]
+  end
+
+  it "is inverted by zigzag_decode" do
+    values = [0, -1, 1, 12345, -12345, (1 << 63) - 1, -(1 << 63)]
+    buffer = values.pack('q*')
+    expect(BitTwiddle.zigzag_decode(BitTwiddle.zigzag_encode(buffer, 64), 64)).to eq buffer
+  end
+end
+
+describe "BitTwiddle.delta_encode" do
+  it "replaces each integer with its difference from the previous one" do
+    expect(BitTwiddle.delta_encode([10, 20, 30, 41].pack('Q*'), 64).unpack('Q*')).to eq [10, 10, 10, 11]
+    expect(BitTwiddle.delta_encode([10, 20, 30, 41].pack('Q*'), 64, 2).unpack('q*')).to eq [10, 0, 0, 1]
+    expect(BitTwiddle.delta_encode([5, 3].pack('L*'), 32).unpack('l*')).to eq [5, -2]
+  end
+
+  it "round-trips through delta_decode" do
+    rng = Random.new(32)
+    [[32, 'L*'], [64, 'Q*']].each do |width, fmt|
+      [0, 1, 3, 4, 7, 100].each do |n|
+        buffer = Array.new(n) { rng.rand(1 << width) }.pack(fmt)
+        [1, 2].each do |order|
+          encoded = BitTwiddle.delta_encode(buffer, width, order)
+          expect(BitTwiddle.delta_decode(encoded, width, order)).to eq buffer
+        end
+      end
+    end
+  end
+
+  it "rejects orders other than 1 and 2" do
+    expect { BitTwiddle.delta_encode('', 64, 3) }.to raise_error(ArgumentError)
+  end
+end
+
+describe "Integer#zigzag64" do
+  it "zigzag-encodes a signed 64-bit integer" do
+    expect(-3.zigzag64).to eq 5
+    expect(3.zigzag64).to eq 6
+    expect((-(1 << 63)).zigzag64).to eq (1 << 64) - 1
+    expect(BitTwiddle.zigzag64(-1)).to eq 1
+  end
+
+  it "raises RangeError for integers which don't fit in 64 bits" do
+    expect { (1 << 63).zigzag64 }.to raise_error(RangeError)
+  end
+end
+
+describe "Integer#unzigzag64" do
+  it "inverts Integer#zigzag64" do
+    [0, 1, -1, 1000, -(1 << 63), (1 << 63) - 1].each do |n|
+      expect(n.zigzag64.unzigzag64).to eq n
+    end
+    expect(BitTwiddle.unzigzag64(5)).to eq(-3)
+  end
+
+  it "raises RangeError for negative numbers" do
+    expect { -1.unzigzag64 }.to raise_error(RangeError)
+  end
+end
+
+describe "Integer#to_varint" do
+  it "encodes an integer as a LEB128 varint" do
+    expect(300.to_varint.bytes).to eq [172, 2]
+    expect(0.to_varint.bytes).to eq [0]
+    expect(BitTwiddle.to_varint((1 << 64) - 1)).to eq leb128((1 << 64) - 1)
+  end
+
+  it "raises RangeError for negative numbers" do
+    expect { -1.to_varint }.to raise_error(RangeError)
+  end
+end
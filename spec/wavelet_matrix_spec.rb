@@ -0,0 +1,85 @@
+describe BitTwiddle::WaveletMatrix do
+  it "answers queries over the bytes of a String" do
+    wm = BitTwiddle::WaveletMatrix.new("abracadabra")
+    expect(wm.size).to eq 11
+    expect(wm.bits).to eq 7
+    expect(wm[4]).to eq "c".ord
+    expect(wm.access(-1)).to eq "a".ord
+    expect(wm.rank("a".ord, 8)).to eq 4
+    expect(wm.rank("a".ord, 11)).to eq 5
+    expect(wm.rank("z".ord, 11)).to eq 0
+    expect(wm.select("a".ord, 2)).to eq 5
+    expect(wm.select("r".ord, 1)).to eq 9
+    expect(wm.select("r".ord, 2)).to eq nil
+    expect(wm.select(1000, 0)).to eq nil
+    expect(wm.quantile(0...4, 0)).to eq "a".ord
+    expect(wm.quantile(0...4, 3)).to eq "r".ord
+    expect(wm.quantile(0...4, 4)).to eq nil
+    expect(wm.range_freq(0..10, "b".ord.."r".ord)).to eq 6
+    expect(wm.range_freq(0..10, "b".ord..."r".ord)).to eq 4
+    expect(wm.range_freq(2..-1, 0..1000)).to eq 9
+  end
+
+  [[8, "C*"], [16, "S*"], [32, "L*"]].each do |width, format|
+    it "matches a reference on random #{width}-bit symbols" do
+      rng = Random.new(49 + width)
+      [1, 511, 512, 513, 5000].each do |n|
+        [4, 2**width].each do |sigma|
+          symbols = Array.new(n) { rng.rand(sigma) }
+          wm = BitTwiddle::WaveletMatrix.new(symbols.pack(format), width)
+          n.times { |i| expect(wm[i]).to eq symbols[i] } if n < 1000
+
+          (symbols.sample(3, random: rng) + [0, 2**width - 1]).uniq.each do |c|
+            positions = symbols.each_index.select { |i| symbols[i] == c }
+            [0, n / 3, n].each { |i| expect(wm.rank(c, i)).to eq symbols[0, i].count(c) }
+            positions.each_with_index { |pos, k| expect(wm.select(c, k)).to eq pos }
+            expect(wm.select(c, positions.size)).to eq nil
+          end
+
+          10.times do
+            start = rng.rand(n)
+            stop  = start + rng.rand(n - start)
+            sorted = symbols[start..stop].sort
+            k = rng.rand(sorted.size)
+            expect(wm.quantile(start..stop, k)).to eq sorted[k]
+            lo = rng.rand(2**width)
+            hi = lo + rng.rand(2**width)
+            expect(wm.range_freq(start..stop, lo...hi)).to eq sorted.count { |v| v >= lo && v < hi }
+            expect(wm.range_freq(start..stop, lo..2**64)).to eq sorted.count { |v| v >= lo }
+            expect(wm.range_freq(start..stop, -1..lo)).to eq sorted.count { |v| v <= lo }
+          end
+        end
+      end
+    end
+  end
+
+  it "handles an empty sequence" do
+    wm = BitTwiddle::WaveletMatrix.new("")
+    expect(wm.size).to eq 0
+    expect(wm.rank(0, 0)).to eq 0
+    expect(wm.select(0, 0)).to eq nil
+    expect(wm.quantile(0...0, 0)).to eq nil
+    expect(wm.range_freq(0...0, 0..255)).to eq 0
+  end
+
+  it "copies" do
+    wm = BitTwiddle::WaveletMatrix.new([7, 300, 7].pack("S*"), 16)
+    expect(wm.dup.select(7, 1)).to eq 2
+    other = BitTwiddle::WaveletMatrix.new([1].pack("S*"), 16)
+    expect { wm.send(:initialize_copy, other) }.to raise_error(RuntimeError)
+    expect { wm.freeze.send(:initialize_copy, other) }.to raise_error(RuntimeError)
+    expect(wm.size).to eq 3
+  end
+
+  it "rejects bad arguments" do
+    expect { BitTwiddle::WaveletMatrix.new("abc", 16) }.to raise_error(ArgumentError)
+    expect { BitTwiddle::WaveletMatrix.new("ab", 64) }.to raise_error(ArgumentError)
+    wm = BitTwiddle::WaveletMatrix.new("abc")
+    expect { wm[3] }.to raise_error(IndexError)
+    expect { wm.rank(97, 4) }.to raise_error(IndexError)
+    expect { wm.quantile(5..6, 0) }.to raise_error(RangeError)
+    expect { wm.range_freq(0..2, 5) }.to raise_error(TypeError)
+    expect { wm.send(:initialize, "") }.to raise_error(RuntimeError)
+    expect { BitTwiddle::WaveletMatrix.allocate.size }.to raise_error(RuntimeError)
+  end
+end